@@ -2,6 +2,7 @@ typedef unsigned int uint32_t;
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
 typedef unsigned int size_t;
+typedef unsigned long long uint64_t;
 
 int atoi(const char *str) {
     int num = 0;
@@ -25,45 +26,10 @@ int atoi(const char *str) {
     return num * sign;
 }
 
-int parse_condition(const char *condition, char *left, char *op, char *right);
-
 int is_space(char c) {
     return c == ' ' || c == '\t' || c == '\n' || c == '\r';
 }
 
-int parse_condition(const char *condition, char *left, char *op, char *right) {
-    const char *ptr = condition;
-    int i = 0;
-
-    // Parse left operand
-    while (*ptr && !is_space(*ptr) && i < 19) {
-        left[i++] = *ptr++;
-    }
-    left[i] = '\0';
-
-    // Skip whitespace
-    while (is_space(*ptr)) ptr++;
-
-    // Parse operator
-    i = 0;
-    while (*ptr && !is_space(*ptr) && i < 2) {
-        op[i++] = *ptr++;
-    }
-    op[i] = '\0';
-
-    // Skip whitespace
-    while (is_space(*ptr)) ptr++;
-
-    // Parse right operand
-    i = 0;
-    while (*ptr && !is_space(*ptr) && i < 19) {
-        right[i++] = *ptr++;
-    }
-    right[i] = '\0';
-
-    return (*left && *op && *right) ? 3 : 0;
-}
-
 typedef __builtin_va_list va_list;
 #define va_start(v, l) __builtin_va_start(v, l)
 #define va_end(v) __builtin_va_end(v)
@@ -101,6 +67,42 @@ const char *strstr(const char *haystack, const char *needle) {
     return NULL;  // Substring not found
 }
 
+// Shell commands are registered next to the code that runs them. Each
+// COMMAND record goes into the .commands section, which linker.ld gathers
+// between __commands_start and __commands_end (see Command registry).
+// Handlers get the words of the command line as argv, with argv[0] the name
+// of the command; the shell checks the argument count against the record.
+#define COMMAND_ANY_ARGS 255  // No upper limit on the argument count
+#define COMMAND_LINE_MAX 256  // Longest line the shell reads, terminator included
+
+typedef struct {
+    const char *name;
+    void (*run)(void);                          // Commands without arguments
+    void (*run_args)(int argc, char **argv);  // Everything else
+    uint8_t min_args;
+    uint8_t max_args;
+    const char *usage;
+    const char *help;
+} Command;
+
+#define COMMAND_RECORD(name, run, run_args, min_args, max_args, usage, help) \
+    static const Command command_##name                                      \
+        __attribute__((used, section(".commands"), aligned(4))) = {          \
+            #name, run, run_args, min_args, max_args, usage, help}
+#define COMMAND(name, run, help) COMMAND_RECORD(name, run, NULL, 0, 0, #name, help)
+#define COMMAND_ARGS(name, run, min_args, max_args, usage, help) \
+    COMMAND_RECORD(name, NULL, run, min_args, max_args, usage, help)
+
+// Join argv[first..argc) with single spaces into buf, truncated to fit
+void join_args(int argc, char **argv, int first, char *buf, uint32_t size) {
+    uint32_t len = 0;
+    for (int i = first; i < argc; i++) {
+        for (const char *p = i > first ? " " : ""; *p && len + 1 < size; p++) buf[len++] = *p;
+        for (const char *p = argv[i]; *p && len + 1 < size; p++) buf[len++] = *p;
+    }
+    buf[len] = '\0';
+}
+
 #define MEMORY_POOL_SIZE (1024 * 1024)  // 1 MB memory pool
 
 typedef struct block_meta {
@@ -123,6 +125,7 @@ block_meta *request_space(block_meta *last, size_t size);
 // Initialize the memory pool
 static char memory_pool[MEMORY_POOL_SIZE];
 static int memory_initialized = 0;
+static size_t heap_top = META_SIZE;  // The pool starts with the list head sentinel
 
 void init_memory() {
     if (!memory_initialized) {
@@ -155,6 +158,16 @@ void *malloc(size_t size) {
                 return NULL;
             }
         } else {  // Found free block
+            // Split off the tail if it is big enough to be useful on its own
+            if (block->size >= total_size + META_SIZE + sizeof(size_t)) {
+                block_meta *rest = (block_meta *)((char *)block + total_size);
+                rest->size = block->size - total_size;
+                rest->next = block->next;
+                rest->free = 1;
+                rest->magic = 0x87654321;
+                block->size = total_size;
+                block->next = rest;
+            }
             block->free = 0;
             block->magic = 0x12345678;
         }
@@ -179,13 +192,14 @@ void *find_free_block(block_meta **last, size_t size) {
 }
 
 block_meta *request_space(block_meta *last, size_t size) {
-    block_meta *block;
-    block = (block_meta *)((char *)global_base + MEMORY_POOL_SIZE - size);
-
-    if ((void *)block < (void *)global_base) {
+    if (heap_top + size > MEMORY_POOL_SIZE) {
         return NULL;  // No more memory
     }
 
+    // Carve the block from the top of the used part of the pool
+    block_meta *block = (block_meta *)(memory_pool + heap_top);
+    heap_top += size;
+
     if (last) {
         last->next = block;
     }
@@ -217,7 +231,7 @@ void free(void *ptr) {
     block_meta *current = global_base;
     while (current) {
         if (current->free && current->next && current->next->free) {
-            current->size += current->next->size + META_SIZE;
+            current->size += current->next->size;  // Sizes already include the metadata
             current->next = current->next->next;
         } else {
             current = current->next;
@@ -270,7 +284,21 @@ uint8_t make_color(enum vga_color fg, enum vga_color bg) {
     return fg | bg << 4;
 }
 
-void putchar(char c) {
+// Streams
+
+// Commands print to the output stream of the task running them and read from
+// its input stream. Both are the console unless the shell connected them to
+// a pipe or a file (see Pipelines).
+typedef struct Stream {
+    // Byte count, 0 at the end of the input, or -1 if the stream is broken
+    int (*read)(struct Stream *stream, void *buffer, uint32_t size);
+    int (*write)(struct Stream *stream, const void *data, uint32_t size);
+    void (*close)(struct Stream *stream);
+    struct Pipe *pipe;  // The pipe of a pipe end
+    int fd;             // The file of a redirection
+} Stream;
+
+void console_putchar(char c) {
     if (c == '\n') {
         cursor_x = 0;
         cursor_y++;
@@ -305,20 +333,100 @@ void putchar(char c) {
         }
         cursor_y = VGA_HEIGHT - 1;
     }
+}
+
+// The console has nothing to read; keyboard input goes through get_key
+int console_read(Stream *stream, void *buffer, uint32_t size) {
+    return 0;
+}
+
+void serial_write(const void *data, uint32_t size);
+
+int console_serial = 1;  // Cleared while COM1 carries something else, see fsexport
+
+// Console output is mirrored on COM1, in the batches it is written in
+int console_write(Stream *stream, const void *data, uint32_t size) {
+    if (console_serial) serial_write(data, size);
+    for (uint32_t i = 0; i < size; i++) {
+        console_putchar(((const char *)data)[i]);
+    }
     update_cursor();
+    return size;
+}
+
+Stream console = {console_read, console_write, NULL, NULL, -1};
+Stream *current_input = &console;
+Stream *current_output = &console;
+
+void putchar(char c) {
+    current_output->write(current_output, &c, 1);
+}
+
+void print_n(const char *str, uint32_t len) {
+    current_output->write(current_output, str, len);
 }
 
 void print(const char *str) {
-    while (*str) {
-        putchar(*str);
-        str++;
-    }
+    print_n(str, strlen(str));
+}
+
+void print_uint(uint32_t value) {
+    char buffer[10];
+    int i = 0;
+    do {
+        buffer[i++] = (value % 10) + '0';
+        value /= 10;
+    } while (value > 0);
+    while (i > 0) putchar(buffer[--i]);
+}
+
+// Right-aligned in a field of width characters
+void print_uint_padded(uint32_t value, int width) {
+    int digits = 1;
+    for (uint32_t v = value; v >= 10; v /= 10) digits++;
+    while (width-- > digits) putchar(' ');
+    print_uint(value);
+}
+
+// 64-bit quotient, in two 32-bit divisions as there is no libgcc to call
+uint64_t div64(uint64_t value, uint32_t divisor) {
+    uint32_t high = value >> 32;
+    uint32_t low;
+    uint32_t remainder;
+    __asm__("divl %4"
+            : "=a"(low), "=d"(remainder)
+            : "a"((uint32_t)value), "d"(high % divisor), "rm"(divisor));
+    return (uint64_t)(high / divisor) << 32 | low;
+}
+
+void print_uint64_padded(uint64_t value, int width) {
+    char buffer[20];
+    int i = 0;
+    do {
+        uint64_t quotient = div64(value, 10);
+        buffer[i++] = (value - quotient * 10) + '0';
+        value = quotient;
+    } while (value > 0);
+    while (width-- > i) putchar(' ');
+    while (i > 0) putchar(buffer[--i]);
+}
+
+void print_uint64(uint64_t value) {
+    print_uint64_padded(value, 0);
 }
 
 void print_colored(const char *str, uint8_t color) {
+    // Colors only exist on the screen
+    if (current_output != &console) {
+        print(str);
+        return;
+    }
+
     int current_x = cursor_x;
     int current_y = cursor_y;
 
+    // Mirrored on COM1 like the rest of the console, without the colors
+    if (console_serial) serial_write(str, strlen(str));
     while (*str) {
         if (*str == '\n') {
             cursor_x = 0;
@@ -352,6 +460,8 @@ void print_colored(const char *str, uint8_t color) {
     update_cursor();
 }
 
+// End of Streams
+
 int strcmp(const char *s1, const char *s2) {
     while (*s1 && (*s1 == *s2)) {
         s1++;
@@ -375,24 +485,43 @@ void memset(void *ptr, int value, uint32_t num) {
 }
 
 void *memcpy(void *dest, const void *src, uint32_t num) {
-    // Cast the destination and source pointers to byte pointers
-    uint8_t *d = (uint8_t *)dest;
-    const uint8_t *s = (const uint8_t *)src;
+    void *d = dest;
+    uint32_t words = num / 4;
+    uint32_t bytes = num % 4;
 
-    // Copy bytes from source to destination
-    while (num--) {
-        *d++ = *s++;  // Copy byte by byte
-    }
+    // Copy whole words first, then the remaining bytes. Copying forward keeps
+    // overlapping moves to a lower address safe.
+    __asm__ __volatile__("rep movsl" : "+D"(d), "+S"(src), "+c"(words) : : "memory");
+    __asm__ __volatile__("rep movsb" : "+D"(d), "+S"(src), "+c"(bytes) : : "memory");
 
     return dest;  // Return the destination pointer
 }
 
+// Custom memcmp implementation
+int memcmp(const void *s1, const void *s2, int n) {
+    const unsigned char *p1 = s1, *p2 = s2;
+    while (n--) {
+        if (*p1 != *p2) {
+            return *p1 - *p2;
+        }
+        p1++;
+        p2++;
+    }
+    return 0;
+}
+
+#define FILE_READONLY 0x1  // Content cannot be modified
+#define FILE_MAPPED 0x2    // Content lives outside the heap (e.g. in a boot module)
+
 typedef struct FileEntry {
     char filename[MAX_FILENAME];
     uint32_t size;
     uint32_t start_block;
     int is_directory;
     struct Directory *dir_ptr;  // Pointer to Directory if this is a directory
+    uint32_t flags;
+    struct FileData *data;  // Chunk index for heap-backed content
+    struct FatNode *fat;    // Location on disk for entries of FAT volumes
 } FileEntry;
 
 typedef struct Directory {
@@ -401,6 +530,11 @@ typedef struct Directory {
     uint32_t num_files;
     FileEntry files[MAX_FILES];
     struct Directory *parent;  // optional, if needed
+    uint32_t refcount;
+    uint32_t epoch;          // Snapshot epoch the directory was created or last saved in
+    uint32_t total_bytes;    // File bytes anywhere below this directory
+    uint32_t total_entries;  // Files and directories anywhere below this directory
+    struct FatNode *fat;     // Set for directories of FAT volumes
 } Directory;
 
 typedef struct {
@@ -412,6 +546,37 @@ typedef struct {
 
 FileSystem fs;
 uint8_t disk[BLOCK_SIZE * (DATA_BLOCKS + 1)];
+uint32_t fs_epoch = 1;  // Bumped by every snapshot
+uint32_t fs_removals = 0;  // Bumped whenever entries or directories may have gone
+
+// Block storage goes through the buffer cache
+struct BlockDevice;
+extern struct BlockDevice ramdisk;
+int bcache_read_bytes(struct BlockDevice *dev, uint32_t offset, void *buffer, uint32_t size);
+int bcache_write_bytes(struct BlockDevice *dev, uint32_t offset, const void *buffer,
+                       uint32_t size);
+
+// Directories and files of mounted FAT volumes stay on disk (see FAT)
+Directory *fat_load_dir(Directory *parent, FileEntry *entry);
+int fat_create(Directory *dir, FileEntry *entry);
+int fat_remove(Directory *dir, FileEntry *entry);
+int fat_exchange(FileEntry *a, FileEntry *b);
+void fat_release(Directory *dir);
+int fat_read(struct FatNode *node, uint32_t offset, void *buffer, uint32_t count);
+int fat_write(Directory *dir, FileEntry *entry, uint32_t offset, const void *buffer,
+              uint32_t count);
+void fat_truncate(FileEntry *entry);
+uint32_t fat_stored_bytes(FileEntry *entry);
+int fat_mount_image(const void *image, uint32_t size, const char *mountpoint);
+int fat_boot_sector_valid(const uint8_t *sector);
+
+// Exported trees come back as mapped files (see Filesystem image)
+int fs_import(const void *image, uint32_t size, const char *path);
+int fsimage_find(const void *module, uint32_t size);
+
+// Long walks of the tree let the other tasks run (see Tasks)
+void task_yield();
+int task_killed();
 
 // Filesystem
 
@@ -424,1898 +589,10161 @@ void init_fs() {
     fs.root.start_block = 1;  // Start after the metadata
     fs.root.num_files = 0;
     fs.root.parent = NULL;  // Root has no parent
+    fs.root.refcount = 1;
+    fs.root.epoch = fs_epoch;
     fs.current_dir = &fs.root;  // Set current directory to root
 }
 
-int create_file(const char *filename, const char *content) {
-    if (fs.current_dir->num_files >= MAX_FILES) {
-        print("Error: Directory is full\n");
-        return -1;  // Directory is full
+// Add to the subtree totals of dir and of every directory above it
+void dir_account(Directory *dir, int bytes, int entries) {
+    for (; dir != NULL; dir = dir->parent) {
+        dir->total_bytes += bytes;
+        dir->total_entries += entries;
     }
+}
 
-    // Check if a file with this name already exists
-    for (uint32_t i = 0; i < fs.current_dir->num_files; i++) {
-        if (strcmp(fs.current_dir->files[i].filename, filename) == 0) {
-            print("Error: File already exists with this name\n");
-            return -1;  // File already exists
-        }
+void entry_set_size(Directory *dir, FileEntry *entry, uint32_t size) {
+    dir_account(dir, size - entry->size, 0);
+    entry->size = size;
+}
+
+// The Directory of a directory entry, read from disk the first time on FAT
+// volumes. NULL if it cannot be loaded.
+Directory *entry_dir(Directory *parent, FileEntry *entry) {
+    if (entry->dir_ptr == NULL && entry->fat != NULL) {
+        entry->dir_ptr = fat_load_dir(parent, entry);
     }
+    return entry->dir_ptr;
+}
 
-    // Calculate the size of the content
-    size_t content_size = strlen(content) + 1;  // +1 for null terminator
+// Compression
+//
+// LZ77 in the style of LZ4. Each sequence is a token byte holding the literal
+// and match lengths (four bits each, 15 meaning more length bytes follow),
+// the literals, a 16-bit little-endian offset back to the match and any extra
+// match length. The last sequence has only literals. Matches are found in a
+// single pass through a hash of the next four bytes.
 
-    // Allocate memory for the file content
-    char *file_content = (char *)malloc(content_size);
-    if (file_content == NULL) {
-        print("Error: Failed to allocate memory for file content\n");
-        return -1;  // Memory allocation failed
-    }
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 10
 
-    // Copy the content to the allocated memory
-    strncpy(file_content, content, content_size);
+uint16_t lz_table[1 << LZ_HASH_BITS];  // Position + 1 of the last four bytes with each hash
 
-    // Create a new FileEntry for the file
-    FileEntry *new_entry = &fs.current_dir->files[fs.current_dir->num_files];
-    strncpy(new_entry->filename, filename, MAX_FILENAME);
-    new_entry->size = content_size;
-    new_entry->start_block = (uint32_t)file_content;  // Use the pointer as the "block" address
-    new_entry->is_directory = 0;
+// Worst-case compressed size of len bytes
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
 
-    fs.current_dir->num_files++;
+uint32_t lz_read32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
 
-    return 0;
+uint32_t lz_put_length(uint8_t *dst, uint32_t pos, uint32_t len) {
+    while (len >= 255) {
+        dst[pos++] = 255;
+        len -= 255;
+    }
+    dst[pos++] = len;
+    return pos;
 }
 
-int read_file(const char *filename, void *buffer, uint32_t size) {
-    int file_index = -1;
-    for (int i = 0; i < fs.num_files; i++) {
-        if (strcmp(fs.files[i].filename, filename) == 0) {
-            file_index = i;
-            break;
+uint32_t lz_put_sequence(uint8_t *dst, uint32_t pos, const uint8_t *literals, uint32_t lit_len,
+                         uint32_t offset, uint32_t match_len) {
+    uint32_t extra = match_len ? match_len - LZ_MIN_MATCH : 0;
+    dst[pos++] = (lit_len < 15 ? lit_len : 15) << 4 | (extra < 15 ? extra : 15);
+    if (lit_len >= 15) {
+        pos = lz_put_length(dst, pos, lit_len - 15);
+    }
+    memcpy(dst + pos, literals, lit_len);
+    pos += lit_len;
+    if (match_len) {
+        dst[pos++] = offset;
+        dst[pos++] = offset >> 8;
+        if (extra >= 15) {
+            pos = lz_put_length(dst, pos, extra - 15);
         }
     }
+    return pos;
+}
 
-    if (file_index == -1) {
-        return -1;  // File not found
-    }
+// Compress len bytes (at most 64 KB) into dst, which must hold LZ_BOUND(len)
+uint32_t lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst) {
+    memset(lz_table, 0, sizeof(lz_table));
+
+    uint32_t pos = 0;
+    uint32_t anchor = 0;  // Start of the pending literals
+    uint32_t i = 0;
+    while (i + LZ_MIN_MATCH <= len) {
+        uint32_t word = lz_read32(src + i);
+        uint32_t slot = (word * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t candidate = lz_table[slot];
+        lz_table[slot] = i + 1;
+        if (candidate == 0 || lz_read32(src + candidate - 1) != word) {
+            i++;
+            continue;
+        }
 
-    FileEntry *file = &fs.files[file_index];
-    if (size > file->size) {
-        size = file->size;
+        candidate--;
+        uint32_t match = LZ_MIN_MATCH;
+        while (i + match < len && src[candidate + match] == src[i + match]) {
+            match++;
+        }
+        pos = lz_put_sequence(dst, pos, src + anchor, i - anchor, i - candidate, match);
+        i += match;
+        anchor = i;
     }
-
-    memcpy(buffer, &disk[file->start_block * BLOCK_SIZE], size);
-    return size;
+    return lz_put_sequence(dst, pos, src + anchor, len - anchor, 0, 0);
 }
 
-void save_fs() {
-    memcpy(disk, &fs, sizeof(FileSystem));
+uint32_t lz_get_length(const uint8_t *src, uint32_t len, uint32_t *ip, uint32_t *value) {
+    uint8_t byte;
+    do {
+        if (*ip >= len) return 0;
+        byte = src[(*ip)++];
+        *value += byte;
+    } while (byte == 255);
+    return 1;
 }
 
-void load_fs() {
-    memcpy(&fs, disk, sizeof(FileSystem));
-}
+// Returns the decompressed size, or -1 if the input is malformed or too large
+int lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t max) {
+    uint32_t ip = 0;
+    uint32_t op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        uint32_t lit_len = token >> 4;
+        if (lit_len == 15 && !lz_get_length(src, len, &ip, &lit_len)) return -1;
+        if (lit_len > len - ip || lit_len > max - op) return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == len) {
+            break;  // Final literals
+        }
 
-// Function to remove a file
-int remove_file(const char *filename) {
-    // Search for the file in the current directory
-    for (int i = 0; i < fs.current_dir->num_files; i++) {
-        if (strcmp(fs.current_dir->files[i].filename, filename) == 0) {
-            // Free the memory associated with the file
-            free((void *)fs.current_dir->files[i].start_block);
-            
-            // Shift the remaining files in the directory
-            for (int j = i; j < fs.current_dir->num_files - 1; j++) {
-                fs.current_dir->files[j] = fs.current_dir->files[j + 1];
-            }
-            fs.current_dir->num_files--;
-            return 0; // Success
+        if (len - ip < 2) return -1;
+        uint32_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        uint32_t match = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15 && !lz_get_length(src, len, &ip, &match)) return -1;
+        if (offset == 0 || offset > op || match > max - op) return -1;
+
+        // Byte by byte, since the match may overlap what it produces
+        for (uint32_t k = 0; k < match; k++, op++) {
+            dst[op] = dst[op - offset];
         }
     }
-    print("Error: File not found.\n");
-    return -1; // File not found
+    return op;
 }
 
-// End of Filesystem
-
-// FS Commands
+// End of Compression
+
+// File data
+//
+// Heap-backed file content is split into fixed-size chunks referenced from a
+// per-file chunk index. Appends only touch the tail chunk, and a file never
+// needs a contiguous region larger than one chunk, so it can grow as long as
+// there is free memory anywhere in the pool. Chunks are reference counted and
+// copied before being written while shared (see Snapshots).
+//
+// Once a chunk is full, or its writer closes the file, it is sealed: it
+// becomes immutable and goes into a store addressed by a 64-bit hash of its
+// content. If the store already holds the same bytes, the chunk is replaced by
+// a reference to that copy, so identical chunks are kept once however many
+// files use them. New content is compressed if that saves at least an eighth
+// of a raw chunk. Compressed chunks are read through a small cache of
+// decompressed chunks. Writing to a sealed chunk unpacks it into a fresh raw
+// chunk first.
+
+#define FILE_CHUNK_SIZE 1024
+#define CHUNK_CACHE_SLOTS 8
+#define CHUNK_STORE_BUCKETS 256
+
+#define CHUNK_SEALED 0x1  // Immutable and entered in the chunk store
+#define CHUNK_COMPRESSED 0x2
+
+typedef struct FileChunk {
+    uint32_t refcount;
+    uint16_t flags;
+    uint16_t stored;         // Bytes held in data; FILE_CHUNK_SIZE unless compressed
+    uint16_t length;         // Bytes of content, once sealed
+    uint64_t hash;           // Of the content, once sealed
+    struct FileChunk *next;  // Next sealed chunk in the same store bucket
+    uint8_t data[];
+} FileChunk;
+
+typedef struct FileData {
+    uint32_t refcount;
+    uint32_t epoch;       // Snapshot epoch the index was created or last saved in
+    uint32_t num_chunks;  // Chunks allocated
+    uint32_t max_chunks;  // Capacity of the chunk index
+    FileChunk **chunks;
+} FileData;
 
-int touch(const char *filename) {
-    return create_file(filename, "");  // Pass for empty file
+typedef struct {
+    FileChunk *chunk;  // Compressed chunk whose content is held, NULL if free
+    uint32_t last_used;
+    uint8_t data[FILE_CHUNK_SIZE];
+} ChunkCacheSlot;
+
+ChunkCacheSlot chunk_cache[CHUNK_CACHE_SLOTS];
+uint32_t chunk_cache_clock = 0;
+uint8_t chunk_packed[LZ_BOUND(FILE_CHUNK_SIZE)];
+FileChunk *chunk_store[CHUNK_STORE_BUCKETS];
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+
+uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
 }
 
-void cat(const char *filename) {
-    // Find the file
-    FileEntry *file = NULL;
-    for (int i = 0; i < fs.current_dir->num_files; i++) {
-        if (strcmp(fs.current_dir->files[i].filename, filename) == 0) {
-            file = &fs.current_dir->files[i];
-            break;
-        }
+// 64-bit hash of len bytes, eight at a time (rounds and mixing as in xxHash64)
+uint64_t hash64(const uint8_t *p, uint32_t len) {
+    uint64_t h = HASH_PRIME3 + len;
+    uint32_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t k = lz_read32(p + i) | (uint64_t)lz_read32(p + i + 4) << 32;
+        k = rotl64(k * HASH_PRIME2, 31) * HASH_PRIME1;
+        h = rotl64(h ^ k, 27) * HASH_PRIME1 + HASH_PRIME2;
+    }
+    for (; i < len; i++) {
+        h = rotl64(h ^ (p[i] * HASH_PRIME3), 11) * HASH_PRIME1;
     }
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
 
-    if (file == NULL) {
-        print("Error: File not found\n");
-        return;
+int dir_prepare(Directory *dir);
+int file_data_prepare(FileData *data);
+
+FileChunk *chunk_alloc() {
+    FileChunk *chunk = (FileChunk *)malloc(sizeof(FileChunk) + FILE_CHUNK_SIZE);
+    if (chunk != NULL) {
+        chunk->refcount = 1;
+        chunk->flags = 0;
+        chunk->stored = FILE_CHUNK_SIZE;
     }
+    return chunk;
+}
 
-    // Check if it's a directory
-    if (file->is_directory) {
-        print("Error: Cannot cat a directory\n");
+void chunk_put(FileChunk *chunk) {
+    if (--chunk->refcount > 0) {
         return;
     }
-
-    // Print the contents of the file
-    char *content = (char *)file->start_block;
-    print(content);
-    print("\n");
+    if (chunk->flags & CHUNK_SEALED) {
+        FileChunk **link = &chunk_store[(uint32_t)chunk->hash % CHUNK_STORE_BUCKETS];
+        while (*link != chunk) {
+            link = &(*link)->next;
+        }
+        *link = chunk->next;
+    }
+    if (chunk->flags & CHUNK_COMPRESSED) {
+        for (int i = 0; i < CHUNK_CACHE_SLOTS; i++) {
+            if (chunk_cache[i].chunk == chunk) {
+                chunk_cache[i].chunk = NULL;
+                chunk_cache[i].last_used = 0;
+            }
+        }
+    }
+    free(chunk);
 }
 
-int mkdir(const char *dirname) {
-    if (fs.current_dir->num_files >= MAX_FILES) {
-        print("Error: Directory is full\n");
-        return -1;  // Directory is full
+// Content of chunk, decompressed through the cache if needed. The pointer
+// stays valid until other chunks push it out of the cache.
+const uint8_t *chunk_bytes(FileChunk *chunk) {
+    if (!(chunk->flags & CHUNK_COMPRESSED)) {
+        return chunk->data;
     }
 
-    // Check if a file or directory with this name already exists
-    for (uint32_t i = 0; i < fs.current_dir->num_files; i++) {
-        if (strcmp(fs.current_dir->files[i].filename, dirname) == 0) {
-            print("Error: File or directory already exists with this name\n");
-            return -1;  // File or directory already exists
+    ChunkCacheSlot *victim = &chunk_cache[0];
+    for (int i = 0; i < CHUNK_CACHE_SLOTS; i++) {
+        if (chunk_cache[i].chunk == chunk) {
+            chunk_cache[i].last_used = ++chunk_cache_clock;
+            return chunk_cache[i].data;
+        }
+        if (chunk_cache[i].last_used < victim->last_used) {
+            victim = &chunk_cache[i];
         }
     }
+    victim->chunk = chunk;
+    victim->last_used = ++chunk_cache_clock;
+    lz_decompress(chunk->data, chunk->stored, victim->data, FILE_CHUNK_SIZE);
+    return victim->data;
+}
 
-    // Create a new FileEntry for the directory
-    FileEntry *new_entry = &fs.current_dir->files[fs.current_dir->num_files];
-    strncpy(new_entry->filename, dirname, MAX_FILENAME);
-    new_entry->size = 0;  // Directories don't have a size in this simple implementation
-    new_entry->is_directory = 1;
-
-    // Create a new Directory structure
-    Directory *new_dir = (Directory *)malloc(sizeof(Directory));
-    if (new_dir == NULL) {
-        print("Error: Failed to allocate memory for new directory\n");
-        return -1;  // Memory allocation failed
+// Seal chunk index, whose first len bytes are content. It is swapped for the
+// stored chunk with the same content if there is one, otherwise it is stored
+// itself, compressed when that pays off.
+void file_chunk_seal(FileData *data, uint32_t index, uint32_t len) {
+    FileChunk *chunk = data->chunks[index];
+    if ((chunk->flags & CHUNK_SEALED) || chunk->refcount > 1) {
+        return;
     }
 
-    strncpy(new_dir->name, dirname, MAX_FILENAME);
-    new_dir->start_block = 0;
-    new_dir->num_files = 0;
-    new_dir->parent = fs.current_dir;  // Set the parent to the current directory
-
-    new_entry->dir_ptr = new_dir;
+    uint64_t hash = hash64(chunk->data, len);
+    FileChunk **bucket = &chunk_store[(uint32_t)hash % CHUNK_STORE_BUCKETS];
+    for (FileChunk *stored = *bucket; stored != NULL; stored = stored->next) {
+        if (stored->hash == hash && stored->length == len &&
+            memcmp(chunk_bytes(stored), chunk->data, len) == 0) {
+            stored->refcount++;
+            data->chunks[index] = stored;
+            chunk_put(chunk);
+            return;
+        }
+    }
 
-    fs.current_dir->num_files++;
+    uint32_t size = lz_compress(chunk->data, len, chunk_packed);
+    if (size <= FILE_CHUNK_SIZE - FILE_CHUNK_SIZE / 8) {
+        FileChunk *packed = (FileChunk *)malloc(sizeof(FileChunk) + size);
+        if (packed != NULL) {  // Otherwise store it raw
+            packed->refcount = 1;
+            packed->flags = CHUNK_COMPRESSED;
+            packed->stored = size;
+            memcpy(packed->data, chunk_packed, size);
+            data->chunks[index] = packed;
+            chunk_put(chunk);
+            chunk = packed;
+        }
+    }
+    chunk->flags |= CHUNK_SEALED;
+    chunk->length = len;
+    chunk->hash = hash;
+    chunk->next = *bucket;
+    *bucket = chunk;
+}
 
-    return 0;
+void file_data_put(FileData *data) {
+    if (--data->refcount == 0) {
+        for (uint32_t i = 0; i < data->num_chunks; i++) {
+            chunk_put(data->chunks[i]);
+        }
+        free(data->chunks);
+        free(data);
+    }
 }
 
-void ls() {
-    for (int i = 0; i < fs.current_dir->num_files; i++) {
-        print(fs.current_dir->files[i].filename);
-        print("\n");
+// Make chunk index writable in place, copying it first if it is shared or
+// sealed
+FileChunk *file_chunk_writable(FileData *data, uint32_t index) {
+    FileChunk *chunk = data->chunks[index];
+    if (chunk->refcount > 1 || (chunk->flags & CHUNK_SEALED)) {
+        FileChunk *copy = chunk_alloc();
+        if (copy == NULL) return NULL;
+        memcpy(copy->data, chunk_bytes(chunk), FILE_CHUNK_SIZE);
+        chunk_put(chunk);
+        data->chunks[index] = copy;
+        chunk = copy;
     }
+    return chunk;
 }
 
-int cd(const char *dirname) {
-    if (strcmp(dirname, "..") == 0) {
-        if (fs.current_dir->parent != NULL) {
-            fs.current_dir = fs.current_dir->parent;
-            return 0;
-        }
-        return -1;  // Already at root
+// Make sure chunks [0, count) exist, growing the index geometrically
+int file_data_reserve(FileEntry *entry, uint32_t count) {
+    FileData *data = entry->data;
+    if (data == NULL) {
+        data = (FileData *)malloc(sizeof(FileData));
+        if (data == NULL) return -1;
+        memset(data, 0, sizeof(FileData));
+        data->refcount = 1;
+        data->epoch = fs_epoch;
+        entry->data = data;
+    }
+    if (count <= data->num_chunks) {
+        return 0;
     }
+    if (file_data_prepare(data) != 0) return -1;
 
-    for (int i = 0; i < fs.current_dir->num_files; i++) {
-        if (strcmp(fs.current_dir->files[i].filename, dirname) == 0) {
-            if (fs.current_dir->files[i].is_directory) {
-                fs.current_dir = fs.current_dir->files[i].dir_ptr;  // Change to the new directory
-                return 0;
-            } else {
-                return -1;  // Not a directory
-            }
+    if (count > data->max_chunks) {
+        uint32_t max_chunks = data->max_chunks ? data->max_chunks : 4;
+        while (max_chunks < count) max_chunks *= 2;
+
+        FileChunk **chunks = (FileChunk **)malloc(max_chunks * sizeof(FileChunk *));
+        if (chunks == NULL) return -1;
+        if (data->chunks) {
+            memcpy(chunks, data->chunks, data->num_chunks * sizeof(FileChunk *));
+            free(data->chunks);
         }
+        data->chunks = chunks;
+        data->max_chunks = max_chunks;
     }
 
-    return -1;  // Directory not found
+    while (data->num_chunks < count) {
+        FileChunk *chunk = chunk_alloc();
+        if (chunk == NULL) return -1;
+        data->chunks[data->num_chunks++] = chunk;
+    }
+    return 0;
 }
 
-// End of FS Commands
-
-// Function prototypes
+// Release chunks that lie entirely past the end of the file
+void file_data_trim(FileEntry *entry) {
+    if (entry->fat != NULL) {
+        fat_truncate(entry);
+        return;
+    }
+    FileData *data = entry->data;
+    if (data == NULL) return;
 
-void print_colored(const char *str, unsigned char color);
+    uint32_t needed = (entry->size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+    if (data->num_chunks <= needed || file_data_prepare(data) != 0) {
+        return;
+    }
+    while (data->num_chunks > needed) {
+        chunk_put(data->chunks[--data->num_chunks]);
+    }
+    if (data->num_chunks == 0) {
+        file_data_put(data);
+        entry->data = NULL;
+    }
+}
 
-void update_cursor(void);
+// Seal chunks first..last of entry. A partial chunk at the end of the file is
+// left alone until the writer has finished with it.
+void file_data_seal(FileEntry *entry, uint32_t first, uint32_t last, int finished) {
+    FileData *data = entry->data;
+    if (data == NULL || file_data_prepare(data) != 0) {
+        return;
+    }
+    for (uint32_t i = first; i <= last && i < data->num_chunks; i++) {
+        uint32_t start = i * FILE_CHUNK_SIZE;
+        if (start >= entry->size || (entry->size - start < FILE_CHUNK_SIZE && !finished)) {
+            break;
+        }
+        uint32_t len = entry->size - start;
+        file_chunk_seal(data, i, len < FILE_CHUNK_SIZE ? len : FILE_CHUNK_SIZE);
+    }
+}
 
-uint16_t make_vga_entry(char c, unsigned char color);
+// Seal the partial chunk at the end of the file once its writer is done
+void file_data_finish(FileEntry *entry) {
+    if (entry->size > 0) {
+        uint32_t tail = (entry->size - 1) / FILE_CHUNK_SIZE;
+        file_data_seal(entry, tail, tail, 1);
+    }
+}
 
-void play_sound(unsigned int frequency);
+// Heap bytes taken by the content of entry
+uint32_t file_stored_bytes(FileEntry *entry) {
+    if (entry->flags & FILE_MAPPED) {
+        return entry->size;
+    }
+    if (entry->fat != NULL) {
+        return fat_stored_bytes(entry);
+    }
+    uint32_t total = 0;
+    for (uint32_t i = 0; entry->data && i < entry->data->num_chunks; i++) {
+        total += entry->data->chunks[i]->stored;
+    }
+    return total;
+}
 
-void stop_sound(void);
+int file_data_release(Directory *dir, FileEntry *entry) {
+    if (dir_prepare(dir) != 0) return -1;
+    entry_set_size(dir, entry, 0);
+    file_data_trim(entry);
+    return 0;
+}
 
-void sleep(unsigned int milliseconds);
+int file_read_at(FileEntry *entry, uint32_t offset, void *buffer, uint32_t count) {
+    if (offset >= entry->size) {
+        return 0;  // End of file
+    }
+    if (count > entry->size - offset) {
+        count = entry->size - offset;
+    }
 
-void play_silly_tune(void);
+    if (entry->flags & FILE_MAPPED) {
+        memcpy(buffer, (const char *)entry->start_block + offset, count);
+        return count;
+    }
+    if (entry->fat != NULL) {
+        return fat_read(entry->fat, offset, buffer, count);
+    }
 
-// IO functions
-void outb(uint16_t port, uint8_t val) {
-    asm volatile("outb %0, %1" : : "a"(val), "Nd"(port));
+    uint8_t *dst = (uint8_t *)buffer;
+    uint32_t remaining = count;
+    while (remaining > 0) {
+        uint32_t chunk_offset = offset % FILE_CHUNK_SIZE;
+        uint32_t n = FILE_CHUNK_SIZE - chunk_offset;
+        if (n > remaining) n = remaining;
+
+        memcpy(dst, chunk_bytes(entry->data->chunks[offset / FILE_CHUNK_SIZE]) + chunk_offset, n);
+        dst += n;
+        offset += n;
+        remaining -= n;
+    }
+    return count;
 }
 
-void outw(uint16_t port, uint16_t val) {
-    asm volatile("outw %0, %1" : : "a"(val), "Nd"(port));
+// Copy count bytes into the file at offset; bytes from pos to offset are zeroed
+int file_fill_range(FileData *data, uint32_t pos, const uint8_t *src, uint32_t count) {
+    while (count > 0) {
+        uint32_t chunk_offset = pos % FILE_CHUNK_SIZE;
+        uint32_t n = FILE_CHUNK_SIZE - chunk_offset;
+        if (n > count) n = count;
+
+        FileChunk *chunk = file_chunk_writable(data, pos / FILE_CHUNK_SIZE);
+        if (chunk == NULL) return -1;
+        if (src) {
+            memcpy(chunk->data + chunk_offset, src, n);
+            src += n;
+        } else {
+            memset(chunk->data + chunk_offset, 0, n);
+        }
+        pos += n;
+        count -= n;
+    }
+    return 0;
 }
 
-uint8_t inb(uint16_t port) {
-    uint8_t ret;
-    asm volatile("inb %1, %0" : "=a"(ret) : "Nd"(port));
-    return ret;
+// Copy the content of a writable mapped file into chunks before it changes
+int file_unmap(FileEntry *entry) {
+    const uint8_t *content = (const uint8_t *)entry->start_block;
+    uint32_t count = (entry->size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+    if (count > 0 && (file_data_reserve(entry, count) != 0 ||
+                      file_fill_range(entry->data, 0, content, entry->size) != 0)) {
+        if (entry->data != NULL) {
+            file_data_put(entry->data);
+            entry->data = NULL;
+        }
+        return -1;
+    }
+    entry->flags &= ~FILE_MAPPED;
+    entry->start_block = 0;
+    if (count > 0) {
+        file_data_seal(entry, 0, count - 1, 0);
+    }
+    return 0;
 }
 
-int strncmp(const char *s1, const char *s2, int n) {
-    while (n && *s1 && (*s1 == *s2)) {
-        ++s1;
-        ++s2;
-        --n;
+int file_write_at(Directory *dir, FileEntry *entry, uint32_t offset, const void *buffer,
+                  uint32_t count) {
+    if (entry->flags & FILE_READONLY) {
+        return -1;
+    }
+    if (entry->fat != NULL) {
+        return fat_write(dir, entry, offset, buffer, count);
+    }
+    if (dir_prepare(dir) != 0) {
+        return -1;  // Cannot preserve the snapshot
+    }
+    if ((entry->flags & FILE_MAPPED) && file_unmap(entry) != 0) {
+        return -1;  // Out of memory
     }
-    if (n == 0) return 0;
-    return *(unsigned char *)s1 - *(unsigned char *)s2;
-}
 
-void update_cursor() {
-    uint16_t pos = cursor_y * VGA_WIDTH + cursor_x;
+    uint32_t end = offset + count;
+    if (file_data_reserve(entry, (end + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE) != 0) {
+        file_data_trim(entry);
+        return -1;  // Out of memory
+    }
+    if (count == 0) {
+        return 0;
+    }
+    if (file_data_prepare(entry->data) != 0) {
+        return -1;
+    }
 
-    outb(0x3D4, 0x0F);
-    outb(0x3D5, (uint8_t)(pos & 0xFF));
-    outb(0x3D4, 0x0E);
-    outb(0x3D5, (uint8_t)((pos >> 8) & 0xFF));
+    // Zero any hole between the old end of file and the write offset
+    if (offset > entry->size && file_fill_range(entry->data, entry->size, NULL,
+                                                offset - entry->size) != 0) {
+        return -1;
+    }
+    if (file_fill_range(entry->data, offset, (const uint8_t *)buffer, count) != 0) {
+        return -1;
+    }
+
+    if (end > entry->size) {
+        entry_set_size(dir, entry, end);
+    }
+    file_data_seal(entry, offset / FILE_CHUNK_SIZE, (end - 1) / FILE_CHUNK_SIZE, 0);
+    return count;
 }
 
-#define LSHIFT 0x2A
-#define RSHIFT 0x36
-#define CAPS_LOCK 0x3A
+// End of File data
+
+// Directory walk
+//
+// Pre-order traversal of a subtree that follows parent links back up instead
+// of recursing, so it needs no stack however deep the tree is.
+
+typedef struct DirWalk {
+    Directory *root;
+    Directory *dir;      // Directory holding the entry last returned
+    uint32_t index;      // Next slot to visit in dir
+    Directory *descend;  // Subdirectory to enter on the next step
+    uint32_t depth;      // Of dir below the root
+    int load;            // Read FAT directories that are not loaded yet instead of skipping them
+} DirWalk;
+
+void dir_walk_begin(DirWalk *walk, Directory *root) {
+    walk->root = root;
+    walk->dir = root;
+    walk->index = 0;
+    walk->descend = NULL;
+    walk->depth = 0;
+    walk->load = 0;
+}
 
-char get_keyboard_char() {
-    static const char sc_ascii[] = {0,   27,  '1',  '2',  '3',  '4', '5', '6',  '7', '8', '9', '0',
-                                    '-', '=', '\b', '\t', 'q',  'w', 'e', 'r',  't', 'y', 'u', 'i',
-                                    'o', 'p', '[',  ']',  '\n', 0,   'a', 's',  'd', 'f', 'g', 'h',
-                                    'j', 'k', 'l',  ';',  '\'', '`', 0,   '\\', 'z', 'x', 'c', 'v',
-                                    'b', 'n', 'm',  ',',  '.',  '/', 0,   '*',  0,   ' '};
+// Return the next entry below the root, or NULL once the subtree is done
+FileEntry *dir_walk_next(DirWalk *walk) {
+    if (walk->descend != NULL) {
+        walk->dir = walk->descend;
+        walk->index = 0;
+        walk->descend = NULL;
+        walk->depth++;
+    }
 
-    static const char sc_ascii_shift[] = {
-        0,    27,  '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+',  '\b',
-        '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n', 0,
-        'A',  'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~', 0,   '|',  'Z',
-        'X',  'C', 'V', 'B', 'N', 'M', '<', '>', '?', 0,   '*', 0,   ' '};
+    while (walk->index >= walk->dir->num_files) {
+        if (walk->dir == walk->root) {
+            return NULL;
+        }
+        // Continue in the parent right after the entry of the finished directory
+        Directory *child = walk->dir;
+        walk->dir = child->parent;
+        walk->index = 0;
+        walk->depth--;
+        while (walk->index < walk->dir->num_files &&
+               walk->dir->files[walk->index].dir_ptr != child) {
+            walk->index++;
+        }
+        walk->index++;
+    }
 
-    static int shift = 0;
-    static int caps_lock = 0;
+    FileEntry *entry = &walk->dir->files[walk->index++];
+    if (entry->is_directory) {
+        walk->descend = walk->load ? entry_dir(walk->dir, entry) : entry->dir_ptr;
+    }
+    return entry;
+}
 
-    while (1) {
-        if (inb(0x64) & 0x1) {
-            uint8_t scancode = inb(0x60);
+#define WALK_YIELD_PERIOD 256  // Entries visited between yields
 
-            if (scancode == LSHIFT || scancode == RSHIFT) {
-                shift = 1;
-                continue;
-            } else if (scancode == (LSHIFT | 0x80) || scancode == (RSHIFT | 0x80)) {
-                shift = 0;
-                continue;
-            } else if (scancode == CAPS_LOCK) {
-                caps_lock = !caps_lock;
-                continue;
-            }
+// Let the other tasks run in the middle of a long walk. Nonzero if the walk
+// must stop: the task was killed, or something was removed meanwhile and the
+// entries it holds may be gone.
+int fs_yield() {
+    uint32_t removals = fs_removals;
+    task_yield();
+    if (task_killed()) {
+        return 1;
+    }
+    if (fs_removals != removals) {
+        print("Error: Files were removed during the walk\n");
+        return 1;
+    }
+    return 0;
+}
 
-            if (!(scancode & 0x80)) {
-                if (scancode < sizeof(sc_ascii)) {
-                    char c;
-                    if (shift) {
-                        c = sc_ascii_shift[scancode];
-                    } else {
-                        c = sc_ascii[scancode];
-                    }
+// Recount the subtree totals of every directory, after a rollback put back
+// directories without their ancestors
+void dir_totals_rebuild() {
+    fs.root.total_bytes = 0;
+    fs.root.total_entries = 0;
+
+    DirWalk walk;
+    dir_walk_begin(&walk, &fs.root);
+    FileEntry *entry;
+    while ((entry = dir_walk_next(&walk)) != NULL) {
+        if (entry->is_directory && entry->dir_ptr != NULL) {
+            // Pre-order: reached before anything below it is counted
+            entry->dir_ptr->total_bytes = 0;
+            entry->dir_ptr->total_entries = 0;
+        }
+        dir_account(walk.dir, entry->size, 1);
+    }
+}
 
-                    if (caps_lock && c >= 'a' && c <= 'z') {
-                        c -= 32;  // Convert to uppercase
-                    } else if (caps_lock && c >= 'A' && c <= 'Z') {
-                        c += 32;  // Convert to lowercase
-                    }
+// End of Directory walk
+
+// Tries
+//
+// Radix tries of names, for completion. An edge holds a run of characters:
+// every node either ends a name or has several children, and a chain of
+// single children is merged into one edge. Children are sorted by their first
+// character and each node counts the names below it, so finding the names
+// that start with a prefix takes time in the length of the prefix only.
+
+#define TRIE_MAX_NAME MAX_FILENAME  // Longest name plus one
+
+typedef struct TrieNode {
+    struct TrieNode *child;  // First child
+    struct TrieNode *sibling;
+    uint16_t count;    // Names ending at or below this node
+    uint8_t terminal;  // A name ends here
+    uint8_t length;    // Of the label
+    char label[];      // The characters on the edge from the parent
+} TrieNode;
+
+TrieNode *trie_node(const char *label, uint32_t length) {
+    TrieNode *node = (TrieNode *)malloc(sizeof(TrieNode) + length);
+    if (node != NULL) {
+        memset(node, 0, sizeof(TrieNode));
+        memcpy(node->label, label, length);
+        node->length = length;
+    }
+    return node;
+}
 
-                    if (c) {
-                        return c;
-                    }
-                }
-            }
+void trie_free(TrieNode *node) {
+    while (node != NULL) {
+        TrieNode *sibling = node->sibling;
+        trie_free(node->child);
+        free(node);
+        node = sibling;
+    }
+}
+
+// Link in the child list of node where the child starting with c is or goes
+TrieNode **trie_child(TrieNode *node, char c) {
+    TrieNode **link = &node->child;
+    while (*link != NULL && (uint8_t)(*link)->label[0] < (uint8_t)c) {
+        link = &(*link)->sibling;
+    }
+    return link;
+}
+
+// Returns -1 if the name is too long or memory ran out
+int trie_insert(TrieNode *root, const char *name) {
+    uint32_t length = strlen(name);
+    if (length >= TRIE_MAX_NAME) return -1;
+
+    // Follow the name as far as the trie has it
+    TrieNode *path[TRIE_MAX_NAME];
+    int depth = 0;
+    TrieNode *node = root;
+    uint32_t i = 0;
+    uint32_t k = 0;  // Characters of the label of node matched
+    while (i < length) {
+        if (k < node->length) {
+            if (node->label[k] != name[i]) break;
+            k++;
+            i++;
+            continue;
         }
+        TrieNode *next = *trie_child(node, name[i]);
+        if (next == NULL || next->label[0] != name[i]) break;
+        path[depth++] = next;
+        node = next;
+        k = 0;
+    }
 
-        // Small delay to prevent overwhelming the CPU
-        for (volatile int i = 0; i < 10000; i++) {
+    if (i == length && k == node->length) {
+        if (node->terminal) return 0;
+        node->terminal = 1;
+    } else {
+        // Split the edge where the name leaves it, and hang the rest of the
+        // name below
+        TrieNode *split = NULL;
+        TrieNode *leaf = NULL;
+        if (k < node->length && (split = trie_node(node->label + k, node->length - k)) == NULL) {
+            return -1;
+        }
+        if (i < length && (leaf = trie_node(name + i, length - i)) == NULL) {
+            free(split);
+            return -1;
+        }
+        if (split != NULL) {
+            split->child = node->child;
+            split->terminal = node->terminal;
+            split->count = node->count;
+            node->child = split;
+            node->terminal = leaf == NULL;
+            node->length = k;
+        }
+        if (leaf != NULL) {
+            TrieNode **link = trie_child(node, leaf->label[0]);
+            leaf->terminal = 1;
+            leaf->count = 1;
+            leaf->sibling = *link;
+            *link = leaf;
         }
     }
+
+    root->count++;
+    for (int d = 0; d < depth; d++) path[d]->count++;
+    return 0;
 }
 
-uint16_t make_vga_entry(char c, uint8_t color) {
-    return (uint16_t)c | (uint16_t)color << 8;
+void trie_remove(TrieNode *root, const char *name) {
+    TrieNode *path[TRIE_MAX_NAME];
+    TrieNode **links[TRIE_MAX_NAME];  // Where each node of path is linked from
+    int depth = 0;
+    TrieNode *node = root;
+    while (*name) {
+        TrieNode **link = trie_child(node, *name);
+        node = *link;
+        if (node == NULL || depth == TRIE_MAX_NAME || memcmp(node->label, name, node->length)) {
+            return;
+        }
+        links[depth] = link;
+        path[depth++] = node;
+        name += node->length;
+    }
+    if (!node->terminal) return;
+
+    node->terminal = 0;
+    root->count--;
+    for (int d = 0; d < depth; d++) path[d]->count--;
+
+    // Free the nodes left without names, then merge a node left with a
+    // single child and no name of its own into that child
+    int d = depth - 1;
+    while (d >= 0 && path[d]->count == 0) {
+        *links[d] = path[d]->sibling;
+        free(path[d]);
+        d--;
+    }
+    if (d < 0) return;
+    node = path[d];
+    TrieNode *child = node->child;
+    if (node->terminal || child == NULL || child->sibling != NULL) return;
+    TrieNode *merged = (TrieNode *)malloc(sizeof(TrieNode) + node->length + child->length);
+    if (merged == NULL) return;  // Still correct, only less compact
+    memcpy(merged->label, node->label, node->length);
+    memcpy(merged->label + node->length, child->label, child->length);
+    merged->length = node->length + child->length;
+    merged->child = child->child;
+    merged->sibling = node->sibling;
+    merged->count = child->count;
+    merged->terminal = child->terminal;
+    *links[d] = merged;
+    free(node);
+    free(child);
 }
 
-void clear_screen() {
-    for (int y = 0; y < VGA_HEIGHT; y++) {
-        for (int x = 0; x < VGA_WIDTH; x++) {
-            const int index = y * VGA_WIDTH + x;
-            vga_buffer[index] = make_vga_entry(' ', make_color(WHITE, BLACK));
+// Node holding the names that start with prefix, with *offset set to the
+// characters of its label the prefix covers. NULL if no name starts so.
+TrieNode *trie_prefix(TrieNode *root, const char *prefix, uint32_t *offset) {
+    TrieNode *node = root;
+    uint32_t k = 0;
+    for (; *prefix; prefix++, k++) {
+        if (k == node->length) {
+            node = *trie_child(node, *prefix);
+            k = 0;
+            if (node == NULL) return NULL;
         }
+        if (node->label[k] != *prefix) return NULL;
     }
-    cursor_x = 0;
-    cursor_y = 0;
-    update_cursor();
+    if (node->count == 0) return NULL;
+    *offset = k;
+    return node;
 }
 
-void cpuinfo();
-void time();
-void calc(const char *expression);
+// Number of names starting with prefix. What they all have after it goes
+// into extra.
+uint32_t trie_complete(TrieNode *root, const char *prefix, char *extra, uint32_t size) {
+    uint32_t offset;
+    uint32_t length = 0;
+    TrieNode *node = trie_prefix(root, prefix, &offset);
+    extra[0] = '\0';
+    if (node == NULL) return 0;
 
-void read_line(char *buffer, int max_length) {
-    int i = 0;
-    char c;
-    while (i < max_length - 1) {
-        c = get_keyboard_char();
-        if (c == '\n') {
-            buffer[i] = '\0';
-            putchar('\n');
-            return;
-        } else if (c == '\b' && i > 0) {
-            i--;
-            putchar('\b');
-        } else if (c >= 32 && c <= 126) {
-            buffer[i] = c;
-            putchar(c);
-            i++;
+    uint32_t count = node->count;
+    while (1) {
+        for (; offset < node->length && length < size - 1; offset++) {
+            extra[length++] = node->label[offset];
         }
+        if (node->terminal || node->child == NULL || node->child->sibling != NULL) break;
+        node = node->child;
+        offset = 0;
     }
-    buffer[i] = '\0';
+    extra[length] = '\0';
+    return count;
 }
 
-#ifndef UINT_TYPES
-#define UINT_TYPES
-typedef unsigned char uint8_t;
-typedef unsigned short uint16_t;
-typedef unsigned int uint32_t;
-typedef unsigned long long uint64_t;
-typedef char int8_t;
-typedef short int16_t;
-typedef int int32_t;
-typedef long long int64_t;
-#endif
+// Print the names below node, whose label starts after length characters of
+// name, in order
+void trie_print(TrieNode *node, char *name, uint32_t length) {
+    memcpy(name + length, node->label, node->length);
+    length += node->length;
+    if (node->terminal) {
+        print_n(name, length);
+        print("  ");
+    }
+    for (TrieNode *child = node->child; child != NULL; child = child->sibling) {
+        trie_print(child, name, length);
+    }
+}
 
-// ACPI-related definitions
-#define ACPI_RSDP_SIGNATURE "RSD PTR "
-#define ACPI_FADT_SIGNATURE "FACP"
-#define ACPI_DSDT_SIGNATURE "DSDT"
+// Print the names that start with prefix
+void trie_list(TrieNode *root, const char *prefix) {
+    uint32_t offset;
+    TrieNode *node = trie_prefix(root, prefix, &offset);
+    if (node == NULL) return;
+    char name[TRIE_MAX_NAME];
+    uint32_t length = strlen(prefix) - offset;
+    memcpy(name, prefix, length);
+    trie_print(node, name, length);
+    print("\n");
+}
 
-// PCI-related definitions
-#define PCI_CONFIG_ADDRESS 0xCF8
-#define PCI_CONFIG_DATA 0xCFC
+// End of Tries
 
-// Keyboard controller
-#define KBC_DATA_PORT 0x60
-#define KBC_STATUS_PORT 0x64
+// Name index
+//
+// Every entry name in the tree is indexed by its trigrams (three-byte
+// substrings). A substring query of three or more characters only visits the
+// records listed under its rarest trigram and confirms each with strstr.
+// add_entry and remove_file keep the index current; a rollback rebuilds it.
+// The names of each directory also go into a trie of their own, for completion.
 
-// CMOS
-#define CMOS_ADDRESS 0x70
-#define CMOS_DATA 0x71
+#define NAME_BUCKETS 256
+#define TRIGRAM_BUCKETS 256
 
-// Function prototypes
-void shutdown();
-void *find_acpi_table(const char *signature);
-void acpi_poweroff();
-void apm_poweroff();
-void pci_reset();
-void ps2_reset();
-void cmos_reset();
-void triple_fault();
-void outl(uint16_t port, uint32_t val);
+typedef struct NameRecord {
+    Directory *dir;  // NULL while the record is free
+    char name[MAX_FILENAME];
+    uint32_t next;  // Next record in the same name bucket or in the free list
+} NameRecord;
+
+typedef struct Trigram {
+    uint32_t key;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *records;  // Ids of the records whose name contains the trigram
+    struct Trigram *next;
+} Trigram;
+
+// Record ids start at 1 so that 0 can terminate lists
+NameRecord *name_records = NULL;
+uint32_t name_records_used = 1;
+uint32_t name_records_max = 0;
+uint32_t name_records_free = 0;
+uint32_t name_buckets[NAME_BUCKETS];
+Trigram *trigram_buckets[TRIGRAM_BUCKETS];
+int name_index_complete = 1;  // Cleared when an update ran out of memory
+
+typedef struct NameTrie {
+    Directory *dir;
+    TrieNode *root;
+    struct NameTrie *next;
+} NameTrie;
+
+NameTrie *name_tries[NAME_BUCKETS];
+
+NameTrie **name_trie_slot(Directory *dir) {
+    NameTrie **slot = &name_tries[((uint32_t)dir * 2654435761u) >> 24];
+    while (*slot != NULL && (*slot)->dir != dir) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
 
-void outl(uint16_t port, uint32_t val) {
-    asm volatile("outl %0, %1" : : "a"(val), "Nd"(port));
+// Trie of the names in dir, NULL while it has none
+TrieNode *name_trie(Directory *dir) {
+    NameTrie *trie = *name_trie_slot(dir);
+    return trie ? trie->root : NULL;
 }
 
-void io_wait() {
-    outb(0x80, 0);
+// A name missing after running out of memory is only missed by completion
+void name_trie_add(Directory *dir, const char *name) {
+    NameTrie **slot = name_trie_slot(dir);
+    NameTrie *trie = *slot;
+    if (trie == NULL) {
+        trie = (NameTrie *)malloc(sizeof(NameTrie));
+        TrieNode *root = trie_node("", 0);
+        if (trie == NULL || root == NULL) {
+            free(trie);
+            free(root);
+            return;
+        }
+        trie->dir = dir;
+        trie->root = root;
+        trie->next = NULL;
+        *slot = trie;
+    }
+    trie_insert(trie->root, name);
 }
 
-#define NULL 0
+void name_trie_remove(Directory *dir, const char *name) {
+    NameTrie **slot = name_trie_slot(dir);
+    NameTrie *trie = *slot;
+    if (trie == NULL) return;
+    trie_remove(trie->root, name);
+    if (trie->root->count == 0) {
+        *slot = trie->next;
+        trie_free(trie->root);
+        free(trie);
+    }
+}
 
-// Type definitions (since we can't use stdint.h)
-#ifndef UINT_TYPES
-#define UINT_TYPES
-typedef unsigned char uint8_t;
-typedef unsigned short uint16_t;
-typedef unsigned int uint32_t;
-#endif
+uint32_t name_hash(Directory *dir, const char *name) {
+    uint32_t hash = (uint32_t)dir;
+    while (*name) {
+        hash = hash * 31 + (uint8_t)*name++;
+    }
+    return hash % NAME_BUCKETS;
+}
 
-// ACPI-related definitions
-#define ACPI_RSDP_SIGNATURE "RSD PTR "
-#define ACPI_FADT_SIGNATURE "FACP"
-#define ACPI_DSDT_SIGNATURE "DSDT"
+uint32_t trigram_key(const char *s) {
+    return (uint8_t)s[0] << 16 | (uint8_t)s[1] << 8 | (uint8_t)s[2];
+}
 
-// PCI-related definitions
-#define PCI_CONFIG_ADDRESS 0xCF8
-#define PCI_CONFIG_DATA 0xCFC
+// Nonzero if the trigram at position i does not occur earlier in name
+int trigram_first(const char *name, uint32_t i) {
+    for (uint32_t j = 0; j < i; j++) {
+        if (memcmp(name + j, name + i, 3) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-// Keyboard controller
-#define KBC_DATA_PORT 0x60
-#define KBC_SATUS_PORT 0x64
+Trigram **trigram_slot(uint32_t key) {
+    Trigram **slot = &trigram_buckets[(key * 2654435761u) >> 24];
+    while (*slot != NULL && (*slot)->key != key) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
 
-// CMOS
-#define CMOS_ADDRESS 0x70
-#define CMOS_DATA 0x71
+int trigram_add(uint32_t key, uint32_t id) {
+    Trigram **slot = trigram_slot(key);
+    Trigram *trigram = *slot;
+    if (trigram == NULL) {
+        trigram = (Trigram *)malloc(sizeof(Trigram));
+        if (trigram == NULL) {
+            return -1;
+        }
+        memset(trigram, 0, sizeof(Trigram));
+        trigram->key = key;
+        *slot = trigram;
+    }
 
-// Custom memcmp implementation
-int memcmp(const void *s1, const void *s2, int n) {
-    const unsigned char *p1 = s1, *p2 = s2;
-    while (n--) {
-        if (*p1 != *p2) {
-            return *p1 - *p2;
+    if (trigram->count == trigram->capacity) {
+        uint32_t capacity = trigram->capacity ? trigram->capacity * 2 : 4;
+        uint32_t *records = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+        if (records == NULL) {
+            return -1;
         }
-        p1++;
-        p2++;
+        memcpy(records, trigram->records, trigram->count * sizeof(uint32_t));
+        free(trigram->records);
+        trigram->records = records;
+        trigram->capacity = capacity;
     }
+    trigram->records[trigram->count++] = id;
     return 0;
 }
 
-// Main shutdown function
-void shutdown() {
-    print("Initiating NeoNoir advanced shutdown sequence...\n");
+void trigram_remove(uint32_t key, uint32_t id) {
+    Trigram **slot = trigram_slot(key);
+    Trigram *trigram = *slot;
+    if (trigram == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < trigram->count; i++) {
+        if (trigram->records[i] == id) {
+            trigram->records[i] = trigram->records[--trigram->count];
+            break;
+        }
+    }
+    if (trigram->count == 0) {
+        *slot = trigram->next;
+        free(trigram->records);
+        free(trigram);
+    }
+}
 
-    // 1. Try ACPI shutdown
-    print("Attempting ACPI shutdown...\n");
-    acpi_poweroff();
-    io_wait();
+uint32_t name_record_alloc() {
+    if (name_records_free != 0) {
+        uint32_t id = name_records_free;
+        name_records_free = name_records[id].next;
+        return id;
+    }
+    if (name_records_used >= name_records_max) {
+        uint32_t max = name_records_max ? name_records_max * 2 : 64;
+        NameRecord *records = (NameRecord *)malloc(max * sizeof(NameRecord));
+        if (records == NULL) {
+            return 0;
+        }
+        memcpy(records, name_records, name_records_max * sizeof(NameRecord));
+        free(name_records);
+        name_records = records;
+        name_records_max = max;
+    }
+    return name_records_used++;
+}
 
-    // 2. Try APM shutdown
-    print("Attempting APM shutdown...\n");
-    outw(0xB004, 0x0 | (2 << 10));
-    io_wait();
+void name_index_add(Directory *dir, const char *name) {
+    name_trie_add(dir, name);
+    uint32_t id = name_record_alloc();
+    if (id == 0) {
+        name_index_complete = 0;
+        return;
+    }
 
-    // 3. Try PCI reset
-    print("Attempting PCI reset...\n");
-    outl(PCI_CONFIG_ADDRESS, 0x8000F840);
-    outb(PCI_CONFIG_DATA, 0x0E);
-    io_wait();
-
-    // 4. Try PS/2 keyboard controller reset
-    print("Attempting PS/2 keyboard controller reset...\n");
-    while (inb(KBC_STATUS_PORT) & 2);
-    outb(KBC_STATUS_PORT, 0xFE);
-    io_wait();
-
-    // 5. Try CMOS reset
-    print("Attempting CMOS reset...\n");
-    outb(CMOS_ADDRESS, 0xF);
-    outb(CMOS_DATA, 0x0A);
-    io_wait();
-
-    // 6. Try keyboard controller reset
-    print("Attempting keyboard controller reset...\n");
-    uint8_t good = 0x02;
-    while (good & 0x02) good = inb(KEYBOARD_STATUS);
-    outb(KEYBOARD_STATUS, 0xFE);
-    io_wait();
-
-    // 7. Try to exit QEMU (won't affect real hardware)
-    print("Attempting QEMU exit...\n");
-    outw(0x604, 0x2000);
-
-    // 8. Last resort: Triple fault
-    print("All shutdown attempts failed. Initiating triple fault...\n");
-    asm volatile(
-        "movl $0, %eax\n"
-        "movl %eax, (%eax)\n");
-
-    // If we're still here, nothing worked
-    print("System is still running. It is now safe to power off your computer.\n");
+    NameRecord *record = &name_records[id];
+    record->dir = dir;
+    strncpy(record->name, name, MAX_FILENAME - 1);
+    record->name[MAX_FILENAME - 1] = '\0';
+    uint32_t bucket = name_hash(dir, record->name);
+    record->next = name_buckets[bucket];
+    name_buckets[bucket] = id;
+
+    uint32_t len = strlen(record->name);
+    for (uint32_t i = 0; i + 3 <= len; i++) {
+        if (trigram_first(record->name, i) && trigram_add(trigram_key(record->name + i), id) != 0) {
+            name_index_complete = 0;
+        }
+    }
+}
 
-    // Disable interrupts and halt
-    asm volatile("cli");
-    while (1) {
-        asm volatile("hlt");
+void name_index_remove(Directory *dir, const char *name) {
+    name_trie_remove(dir, name);
+    uint32_t *link = &name_buckets[name_hash(dir, name)];
+    while (*link != 0) {
+        uint32_t id = *link;
+        NameRecord *record = &name_records[id];
+        if (record->dir == dir && strcmp(record->name, name) == 0) {
+            uint32_t len = strlen(record->name);
+            for (uint32_t i = 0; i + 3 <= len; i++) {
+                if (trigram_first(record->name, i)) {
+                    trigram_remove(trigram_key(record->name + i), id);
+                }
+            }
+            *link = record->next;
+            record->dir = NULL;
+            record->next = name_records_free;
+            name_records_free = id;
+            return;
+        }
+        link = &record->next;
     }
 }
 
-// ACPI power off helper function
-void acpi_poweroff() {
-    // Search for RSDP in BIOS memory
-    char *addr;
-    for (addr = (char *)0x000E0000; addr < (char *)0x00100000; addr += 16) {
-        if (memcmp(addr, ACPI_RSDP_SIGNATURE, 8) == 0) {
-            // Found RSDP, now try to shut down
-            uint32_t pm1a_cnt = 0x1000;     // Default port if we can't find real one
-            uint16_t slp_typa = (1 << 13);  // Default sleep type
+// Drop the names of everything below dir
+void name_index_remove_tree(Directory *dir) {
+    DirWalk walk;
+    dir_walk_begin(&walk, dir);
+    FileEntry *entry;
+    while ((entry = dir_walk_next(&walk)) != NULL) {
+        name_index_remove(walk.dir, entry->filename);
+    }
+}
 
-            outw(pm1a_cnt, slp_typa | (1 << 13));
-            io_wait();
-            return;
+void name_index_rebuild() {
+    for (uint32_t i = 0; i < TRIGRAM_BUCKETS; i++) {
+        while (trigram_buckets[i] != NULL) {
+            Trigram *trigram = trigram_buckets[i];
+            trigram_buckets[i] = trigram->next;
+            free(trigram->records);
+            free(trigram);
+        }
+    }
+    for (uint32_t i = 0; i < NAME_BUCKETS; i++) {
+        while (name_tries[i] != NULL) {
+            NameTrie *trie = name_tries[i];
+            name_tries[i] = trie->next;
+            trie_free(trie->root);
+            free(trie);
         }
     }
+    memset(name_buckets, 0, sizeof(name_buckets));
+    name_records_used = 1;
+    name_records_free = 0;
+    name_index_complete = 1;
+
+    DirWalk walk;
+    dir_walk_begin(&walk, &fs.root);
+    FileEntry *entry;
+    while ((entry = dir_walk_next(&walk)) != NULL) {
+        name_index_add(walk.dir, entry->filename);
+    }
 }
 
-// ACPI power off
-void *find_acpi_table(const char *signature) {
-    // Search for RSDP in BIOS memory
-    for (char *addr = (char *)0x000E0000; addr < (char *)0x00100000; addr += 16) {
-        if (memcmp(addr, ACPI_RSDP_SIGNATURE, 8) == 0) {
-            // Found RSDP, now find RSDT
-            uint32_t *rsdt = (uint32_t *)(*(uint32_t *)(addr + 16));
-            int entries = (*(uint32_t *)(addr + 4) - 36) / 4;
+// End of Name index
 
-            // Search RSDT for the requested table
-            for (int i = 0; i < entries; i++) {
-                void *table = (void *)rsdt[i + 9];
-                if (memcmp(table, signature, 4) == 0) {
-                    return table;
-                }
-            }
+FileEntry *find_entry(Directory *dir, const char *name) {
+    for (uint32_t i = 0; i < dir->num_files; i++) {
+        if (strcmp(dir->files[i].filename, name) == 0) {
+            return &dir->files[i];
         }
     }
     return NULL;
 }
 
-// APM power off
-void apm_poweroff() {
-    outw(0xB004, 0x0 | (2 << 10));
-    io_wait();
-}
+// Claim a zeroed slot for a new entry in dir; returns NULL if full or taken
+FileEntry *add_entry(Directory *dir, const char *name) {
+    if (dir->num_files >= MAX_FILES) {
+        print("Error: Directory is full\n");
+        return NULL;
+    }
+    if (find_entry(dir, name) != NULL) {
+        print("Error: File or directory already exists with this name\n");
+        return NULL;
+    }
+    if (dir_prepare(dir) != 0) {
+        print("Error: Out of memory for snapshot\n");
+        return NULL;
+    }
 
-// PCI reset
-void pci_reset() {
-    outl(PCI_CONFIG_ADDRESS, 0x8000F840);
-    outb(PCI_CONFIG_DATA, 0x0E);
-    io_wait();
+    FileEntry *entry = &dir->files[dir->num_files];
+    memset(entry, 0, sizeof(FileEntry));
+    strncpy(entry->filename, name, MAX_FILENAME - 1);
+    dir->num_files++;
+    dir_account(dir, 0, 1);
+    name_index_add(dir, entry->filename);
+    return entry;
 }
 
-// PS/2 keyboard controller reset
-void ps2_reset() {
-    while (inb(KBC_STATUS_PORT) & 2);
-    outb(KBC_STATUS_PORT, 0xFE);
-    io_wait();
+// Undo add_entry for the last entry of dir
+void dir_drop_last(Directory *dir) {
+    FileEntry *entry = &dir->files[dir->num_files - 1];
+    name_index_remove(dir, entry->filename);
+    dir->num_files--;
+    dir_account(dir, -(int)entry->size, -1);
 }
 
-// CMOS reset
-void cmos_reset() {
-    outb(CMOS_ADDRESS, 0xF);
-    outb(CMOS_DATA, 0x0A);
-    io_wait();
-}
+Directory *create_directory(Directory *parent, const char *dirname) {
+    if (parent->num_files >= MAX_FILES || find_entry(parent, dirname) != NULL) {
+        add_entry(parent, dirname);  // Reports the error
+        return NULL;
+    }
 
-// Triple fault (last resort)
-void triple_fault() {
-    asm volatile(
-        "movl $0, %eax\n"
-        "movl %eax, (%eax)\n");
+    Directory *new_dir = (Directory *)malloc(sizeof(Directory));
+    if (new_dir == NULL) {
+        print("Error: Failed to allocate memory for new directory\n");
+        return NULL;  // Memory allocation failed
+    }
+
+    strncpy(new_dir->name, dirname, MAX_FILENAME - 1);
+    new_dir->name[MAX_FILENAME - 1] = '\0';
+    new_dir->start_block = 0;
+    new_dir->num_files = 0;
+    new_dir->parent = parent;
+    new_dir->refcount = 1;
+    new_dir->epoch = fs_epoch;
+    new_dir->total_bytes = 0;
+    new_dir->total_entries = 0;
+    new_dir->fat = NULL;
+
+    FileEntry *new_entry = add_entry(parent, dirname);
+    if (new_entry == NULL) {
+        free(new_dir);
+        return NULL;
+    }
+    new_entry->size = 0;  // A directory's size is kept in its subtree totals
+    new_entry->is_directory = 1;
+    new_entry->dir_ptr = new_dir;
+    if (parent->fat != NULL && fat_create(parent, new_entry) != 0) {
+        dir_drop_last(parent);
+        free(new_dir);
+        return NULL;
+    }
+    return new_dir;
 }
 
-// Add these type definitions if not already present
-typedef unsigned int uint32_t;
-typedef int int32_t;
+// Add a file whose content stays where it already is in memory. It is
+// read-only unless the caller clears FILE_READONLY; the first write then
+// copies it into chunks.
+FileEntry *create_mapped_file(Directory *dir, const char *filename, const char *content,
+                              uint32_t size) {
+    FileEntry *entry = add_entry(dir, filename);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry_set_size(dir, entry, size);
+    entry->start_block = (uint32_t)content;
+    entry->flags = FILE_READONLY | FILE_MAPPED;
+    return entry;
+}
 
-// String parsing function for the calculator
-int parse_number(const char **str) {
-    int num = 0;
-    int sign = 1;
+int create_file(const char *filename, const char *content) {
+    if (fs.current_dir->num_files >= MAX_FILES) {
+        print("Error: Directory is full\n");
+        return -1;  // Directory is full
+    }
 
-    // Skip whitespace
-    while (**str == ' ') (*str)++;
+    // Check if a file with this name already exists
+    if (find_entry(fs.current_dir, filename) != NULL) {
+        print("Error: File already exists with this name\n");
+        return -1;  // File already exists
+    }
 
-    // Handle negative numbers
-    if (**str == '-') {
-        sign = -1;
-        (*str)++;
+    // Create a new FileEntry for the file
+    FileEntry *new_entry = add_entry(fs.current_dir, filename);
+    if (new_entry == NULL) {
+        return -1;
+    }
+    if (fs.current_dir->fat != NULL && fat_create(fs.current_dir, new_entry) != 0) {
+        dir_drop_last(fs.current_dir);
+        return -1;
     }
 
-    while (**str >= '0' && **str <= '9') {
-        num = num * 10 + (**str - '0');
-        (*str)++;
+    // Copy the content into the file's chunks
+    size_t content_size = strlen(content);
+    if (file_write_at(fs.current_dir, new_entry, 0, content, content_size) < 0) {
+        file_data_release(fs.current_dir, new_entry);
+        if (new_entry->fat != NULL) {
+            fat_remove(fs.current_dir, new_entry);
+            free(new_entry->fat);
+        }
+        dir_drop_last(fs.current_dir);
+        print("Error: Failed to allocate memory for file content\n");
+        return -1;  // Memory allocation failed
     }
+    file_data_finish(new_entry);
 
-    return num * sign;
+    return 0;
 }
 
-char parse_operator(const char **str) {
-    // Skip whitespace
-    while (**str == ' ') (*str)++;
+// File descriptors
+//
+// open/read/write/lseek/close work on byte offsets, so callers can stream a
+// file in fixed-size pieces instead of handling the whole content at once.
 
-    char op = **str;
-    if (op) (*str)++;
+#define MAX_OPEN_FILES 16
 
-    return op;
-}
+#define O_RDONLY 0x0
+#define O_WRONLY 0x1
+#define O_RDWR 0x2
+#define O_ACCMODE 0x3
+#define O_CREAT 0x40
+#define O_TRUNC 0x200
+#define O_APPEND 0x400
 
-#define MAX_DIGITS 10
-#define DECIMAL_PLACES 4
-#define FLOAT_MULTIPLIER 10000
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
 
 typedef struct {
-    int value;  // Stores the number as an integer, scaled by FLOAT_MULTIPLIER
-    int is_negative;
-} FloatNum;
+    int in_use;
+    int flags;
+    Directory *dir;  // Directory holding the entry
+    FileEntry *entry;
+    uint32_t offset;
+} OpenFile;
+
+OpenFile open_files[MAX_OPEN_FILES];
+
+// Resolve all but the last component of path. Returns the parent directory
+// and copies the last component into leaf (MAX_FILENAME bytes).
+Directory *lookup_parent(const char *path, char *leaf) {
+    Directory *dir = (*path == '/') ? &fs.root : fs.current_dir;
+    char component[MAX_FILENAME];
+
+    leaf[0] = '\0';
+    while (*path) {
+        int len = 0;
+        while (*path == '/') path++;
+        while (*path && *path != '/') {
+            if (len < MAX_FILENAME - 1) component[len++] = *path;
+            path++;
+        }
+        component[len] = '\0';
+        while (*path == '/') path++;
 
-// Function to parse a floating-point number from a string
-FloatNum parse_float(const char **str) {
-    FloatNum num = {0, 0};
-    int digits = 0;
-    int decimal_seen = 0;
-    int decimal_places = 0;
+        if (*path == '\0') {
+            strncpy(leaf, component, MAX_FILENAME);
+            return dir;
+        }
 
-    // Handle negative numbers
-    if (**str == '-') {
-        num.is_negative = 1;
-        (*str)++;
-    }
-
-    // Parse integer and fractional parts
-    while ((**str >= '0' && **str <= '9') || **str == '.') {
-        if (**str == '.') {
-            if (decimal_seen) break;  // Second decimal point, stop parsing
-            decimal_seen = 1;
-        } else if (digits < MAX_DIGITS) {
-            num.value = num.value * 10 + (**str - '0');
-            if (decimal_seen) {
-                decimal_places++;
-                if (decimal_places >= DECIMAL_PLACES) break;
-            }
-            digits++;
+        if (len == 0 || strcmp(component, ".") == 0) {
+            continue;
+        } else if (strcmp(component, "..") == 0) {
+            if (dir->parent) dir = dir->parent;
         } else {
-            break;
+            FileEntry *entry = find_entry(dir, component);
+            if (entry == NULL || !entry->is_directory) {
+                return NULL;
+            }
+            dir = entry_dir(dir, entry);
+            if (dir == NULL) {
+                return NULL;
+            }
         }
-        (*str)++;
+    }
+    return dir;
+}
+
+// Resolve path to a directory, with *entry set to NULL, or to a file entry
+// and the directory holding it. An empty path is the current directory.
+int resolve_path(const char *path, Directory **dir, FileEntry **entry) {
+    char leaf[MAX_FILENAME];
+    Directory *parent = lookup_parent(path, leaf);
+    *entry = NULL;
+    if (parent == NULL) {
+        return -1;
+    }
+    if (leaf[0] == '\0' || strcmp(leaf, ".") == 0) {
+        *dir = parent;
+        return 0;
+    }
+    if (strcmp(leaf, "..") == 0) {
+        *dir = parent->parent ? parent->parent : parent;
+        return 0;
     }
 
-    // Adjust the value based on decimal places
-    while (decimal_places < DECIMAL_PLACES) {
-        num.value *= 10;
-        decimal_places++;
+    FileEntry *found = find_entry(parent, leaf);
+    if (found == NULL) {
+        return -1;
+    }
+    if (found->is_directory) {
+        *dir = entry_dir(parent, found);
+        return *dir ? 0 : -1;
+    } else {
+        *dir = parent;
+        *entry = found;
     }
+    return 0;
+}
 
-    return num;
+OpenFile *get_open_file(int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !open_files[fd].in_use) {
+        return NULL;
+    }
+    return &open_files[fd];
 }
 
-// Function to add two floating-point numbers
-FloatNum add_float(FloatNum a, FloatNum b) {
-    FloatNum result;
-    if (a.is_negative == b.is_negative) {
-        result.value = a.value + b.value;
-        result.is_negative = a.is_negative;
-    } else {
-        if (a.value > b.value) {
-            result.value = a.value - b.value;
-            result.is_negative = a.is_negative;
-        } else {
-            result.value = b.value - a.value;
-            result.is_negative = b.is_negative;
+int open(const char *path, int flags) {
+    char leaf[MAX_FILENAME];
+    Directory *dir = lookup_parent(path, leaf);
+    if (dir == NULL || leaf[0] == '\0') {
+        return -1;  // Bad path
+    }
+
+    FileEntry *entry = find_entry(dir, leaf);
+    if (entry == NULL) {
+        if (!(flags & O_CREAT)) return -1;  // File not found
+        entry = add_entry(dir, leaf);
+        if (entry == NULL) return -1;
+        if (dir->fat != NULL && fat_create(dir, entry) != 0) {
+            dir_drop_last(dir);
+            return -1;
         }
     }
-    return result;
+    if (entry->is_directory) {
+        return -1;
+    }
+    if ((flags & O_ACCMODE) != O_RDONLY && (entry->flags & FILE_READONLY)) {
+        return -1;  // Read-only file
+    }
+
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        if (!open_files[fd].in_use) {
+            if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+                if (dir_prepare(dir) != 0) return -1;
+                entry_set_size(dir, entry, 0);  // Keep the chunks so rewrites can reuse them
+            }
+            open_files[fd].in_use = 1;
+            open_files[fd].flags = flags;
+            open_files[fd].dir = dir;
+            open_files[fd].entry = entry;
+            open_files[fd].offset = 0;
+            return fd;
+        }
+    }
+    return -1;  // Too many open files
 }
 
-// Function to subtract two floating-point numbers
-FloatNum subtract_float(FloatNum a, FloatNum b) {
-    b.is_negative = !b.is_negative;
-    return add_float(a, b);
+int close(int fd) {
+    OpenFile *file = get_open_file(fd);
+    if (file == NULL) {
+        return -1;
+    }
+    file->in_use = 0;
+
+    // Drop chunks left over from a truncating rewrite and pack the tail
+    if ((file->flags & O_ACCMODE) != O_RDONLY && !(file->entry->flags & FILE_MAPPED) &&
+        dir_prepare(file->dir) == 0) {
+        file_data_trim(file->entry);
+        file_data_finish(file->entry);
+    }
+    return 0;
 }
 
-// Function to multiply two floating-point numbers
-FloatNum multiply_float(FloatNum a, FloatNum b) {
-    FloatNum result;
-    result.is_negative = a.is_negative != b.is_negative;
+int read(int fd, void *buffer, uint32_t count) {
+    OpenFile *file = get_open_file(fd);
+    if (file == NULL || (file->flags & O_ACCMODE) == O_WRONLY) {
+        return -1;
+    }
+
+    int n = file_read_at(file->entry, file->offset, buffer, count);
+    if (n > 0) {
+        file->offset += n;
+    }
+    return n;
+}
 
-    // Use two 32-bit multiplications to avoid 64-bit arithmetic
-    int high1 = a.value / 1000;
-    int low1 = a.value % 1000;
-    int high2 = b.value / 1000;
-    int low2 = b.value % 1000;
+int write(int fd, const void *buffer, uint32_t count) {
+    OpenFile *file = get_open_file(fd);
+    if (file == NULL || (file->flags & O_ACCMODE) == O_RDONLY) {
+        return -1;
+    }
 
-    int mid = high1 * low2 + high2 * low1;
-    result.value = (high1 * high2 * FLOAT_MULTIPLIER) + (mid * 1000) + (low1 * low2 / 1000);
+    if (file->flags & O_APPEND) {
+        file->offset = file->entry->size;
+    }
 
-    return result;
+    int n = file_write_at(file->dir, file->entry, file->offset, buffer, count);
+    if (n > 0) {
+        file->offset += n;
+    }
+    return n;
 }
 
-// Function to divide two floating-point numbers
-FloatNum divide_float(FloatNum a, FloatNum b) {
-    FloatNum result;
-    if (b.value == 0) {
-        print("Error: Division by zero\n");
-        return (FloatNum){0, 0};
+int lseek(int fd, int offset, int whence) {
+    OpenFile *file = get_open_file(fd);
+    if (file == NULL) {
+        return -1;
     }
 
-    result.is_negative = a.is_negative != b.is_negative;
+    int base;
+    if (whence == SEEK_SET) {
+        base = 0;
+    } else if (whence == SEEK_CUR) {
+        base = file->offset;
+    } else if (whence == SEEK_END) {
+        base = file->entry->size;
+    } else {
+        return -1;
+    }
 
-    // Perform division
-    result.value = (a.value * FLOAT_MULTIPLIER) / b.value;
+    if (base + offset < 0) {
+        return -1;
+    }
+    file->offset = base + offset;
+    return file->offset;
+}
 
-    return result;
+int read_file(const char *filename, void *buffer, uint32_t size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;  // File not found
+    }
+    int n = read(fd, buffer, size);
+    close(fd);
+    return n;
 }
 
-// Function to print a floating-point number
-void print_float(FloatNum num) {
-    if (num.is_negative) {
-        putchar('-');
+int remove_entry(Directory *dir, const char *filename);
+
+// Give path the content of from, which must be in the same directory, and
+// remove from. path keeps its entry, so descriptors on it stay good, and it
+// is not touched until from already holds the whole new content.
+int replace_file(const char *from, const char *path) {
+    char from_leaf[MAX_FILENAME];
+    char leaf[MAX_FILENAME];
+    Directory *dir = lookup_parent(from, from_leaf);
+    if (dir == NULL || lookup_parent(path, leaf) != dir) {
+        return -1;
     }
+    int fd = open(path, O_WRONLY | O_CREAT);  // Creates it if it is missing
+    if (fd < 0) {
+        return -1;
+    }
+    close(fd);
 
-    int integer_part = num.value / FLOAT_MULTIPLIER;
-    int fractional_part = num.value % FLOAT_MULTIPLIER;
+    FileEntry *source = find_entry(dir, from_leaf);
+    FileEntry *target = find_entry(dir, leaf);
+    if (source == NULL || source->is_directory || source == target) {
+        return -1;
+    }
+    if (dir->fat == NULL && dir_prepare(dir) != 0) {
+        return -1;
+    }
 
-    // Print integer part
-    char buffer[MAX_DIGITS];
-    int i = 0;
-    do {
-        buffer[i++] = (integer_part % 10) + '0';
-        integer_part /= 10;
-    } while (integer_part > 0 && i < MAX_DIGITS);
-    while (i > 0) putchar(buffer[--i]);
+    // Swap the contents; the sizes stay in one directory, so its totals hold
+    FileEntry swap = *source;
+    source->size = target->size;
+    source->start_block = target->start_block;
+    source->data = target->data;
+    source->flags = (source->flags & ~FILE_MAPPED) | (target->flags & FILE_MAPPED);
+    target->size = swap.size;
+    target->start_block = swap.start_block;
+    target->data = swap.data;
+    target->flags = (target->flags & ~FILE_MAPPED) | (swap.flags & FILE_MAPPED);
+    if (dir->fat != NULL && fat_exchange(source, target) != 0) {
+        return -1;
+    }
+    return remove_entry(dir, from_leaf);
+}
 
-    // Only print fractional part if it's non-zero
-    if (fractional_part != 0) {
-        putchar('.');
-        // Remove trailing zeros
-        while (fractional_part % 10 == 0 && fractional_part != 0) {
-            fractional_part /= 10;
+// End of File descriptors
+
+// Snapshots
+//
+// Taking a snapshot only opens a new epoch, so it is O(1). The first time a
+// Directory or chunk index from an older epoch is about to change, a copy of
+// it is saved together with references to everything it points at; chunks are
+// copied only when written while shared. Rollback puts the saved copies back
+// into the original objects, dropping the snapshot releases them.
+
+#define SNAP_DIRECTORY 1
+#define SNAP_FILE_DATA 2
+
+typedef struct SnapshotImage {
+    int type;
+    void *object;  // Live Directory or FileData
+    void *copy;    // Its state when the snapshot was taken
+    struct SnapshotImage *next;
+} SnapshotImage;
+
+int snapshot_active = 0;
+SnapshotImage *snapshot_images = NULL;  // Newest first
+uint32_t snapshot_count = 0;
+uint32_t snapshot_bytes = 0;
+
+void dir_put(Directory *dir);
+
+// Take a reference on everything the entries of dir point at
+void dir_get_children(Directory *dir) {
+    for (uint32_t i = 0; i < dir->num_files; i++) {
+        if (dir->files[i].dir_ptr) {
+            dir->files[i].dir_ptr->refcount++;
+        } else if (dir->files[i].data) {
+            dir->files[i].data->refcount++;
         }
-        i = 0;
-        do {
-            buffer[i++] = (fractional_part % 10) + '0';
-            fractional_part /= 10;
-        } while (fractional_part > 0 && i < DECIMAL_PLACES);
-        while (i > 0) putchar(buffer[--i]);
     }
 }
 
-// Function to skip whitespace
-void skip_whitespace(const char **ptr) {
-    while (**ptr == ' ' || **ptr == '\t') {
-        (*ptr)++;
+void dir_put_children(Directory *dir) {
+    for (uint32_t i = 0; i < dir->num_files; i++) {
+        if (dir->files[i].dir_ptr) {
+            dir_put(dir->files[i].dir_ptr);
+        } else if (dir->files[i].data) {
+            file_data_put(dir->files[i].data);
+        }
     }
 }
 
-// Main calculator function
-void calc(const char *expression) {
-    const char *ptr = expression;
-    FloatNum a, b, result;
-    char op;
+void dir_put(Directory *dir) {
+    if (--dir->refcount > 0) {
+        return;
+    }
 
-    // Skip initial whitespace
-    skip_whitespace(&ptr);
+    // Descriptors on entries of a freed directory would dangle
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        if (open_files[fd].in_use && open_files[fd].dir == dir) {
+            open_files[fd].in_use = 0;
+        }
+    }
+    dir_put_children(dir);
+    if (dir->fat) {
+        fat_release(dir);
+    }
+    free(dir);
+    fs_removals++;
+}
 
-    // Parse first number
-    a = parse_float(&ptr);
+int snapshot_save(int type, void *object, void *copy) {
+    SnapshotImage *image = (SnapshotImage *)malloc(sizeof(SnapshotImage));
+    if (image == NULL) {
+        return -1;
+    }
+    image->type = type;
+    image->object = object;
+    image->copy = copy;
+    image->next = snapshot_images;
+    snapshot_images = image;
+    snapshot_count++;
+    return 0;
+}
 
-    // Parse operator
-    op = parse_operator(&ptr);
-    if (op == '\0') {
-        print("Error: Invalid operator\n");
-        return;
+// Called before dir is modified
+int dir_prepare(Directory *dir) {
+    if (!snapshot_active || dir->epoch == fs_epoch || dir->fat != NULL) {
+        return 0;  // FAT volumes are outside snapshots
     }
 
-    // Skip whitespace after operator
-    skip_whitespace(&ptr);
+    Directory *copy = (Directory *)malloc(sizeof(Directory));
+    if (copy == NULL) {
+        return -1;
+    }
+    memcpy(copy, dir, sizeof(Directory));
+    if (snapshot_save(SNAP_DIRECTORY, dir, copy) != 0) {
+        free(copy);
+        return -1;
+    }
+    dir_get_children(copy);
+    snapshot_bytes += sizeof(Directory);
+    dir->epoch = fs_epoch;
+    return 0;
+}
 
-    // Parse second number
-    b = parse_float(&ptr);
+// Called before the chunk list of data is modified or any of its chunks is written
+int file_data_prepare(FileData *data) {
+    if (!snapshot_active || data->epoch == fs_epoch) {
+        return 0;
+    }
 
-    // Perform calculation
-    switch (op) {
-        case '+':
-            result = add_float(a, b);
-            break;
-        case '-':
-            result = subtract_float(a, b);
-            break;
-        case '*':
-            result = multiply_float(a, b);
-            break;
-        case '/':
-            if (b.value == 0) {
-                print("Error: Division by zero\n");
-                return;
-            }
-            result = divide_float(a, b);
-            break;
-        default:
-            print("Error: Invalid operator. Supported operators: +, -, *, /\n");
-            return;
+    FileData *copy = (FileData *)malloc(sizeof(FileData));
+    FileChunk **chunks = (FileChunk **)malloc(data->num_chunks * sizeof(FileChunk *) + 1);
+    if (copy == NULL || chunks == NULL || snapshot_save(SNAP_FILE_DATA, data, copy) != 0) {
+        free(copy);
+        free(chunks);
+        return -1;
     }
 
-    // Print the calculation
-    print_float(a);
-    putchar(' ');
-    putchar(op);
-    putchar(' ');
-    print_float(b);
-    print(" = ");
-    print_float(result);
-    print("\n");
+    memcpy(chunks, data->chunks, data->num_chunks * sizeof(FileChunk *));
+    for (uint32_t i = 0; i < data->num_chunks; i++) {
+        chunks[i]->refcount++;  // Shared chunks are copied on write
+    }
+    memcpy(copy, data, sizeof(FileData));
+    copy->chunks = chunks;
+    copy->max_chunks = data->num_chunks;
+    snapshot_bytes += sizeof(FileData) + data->num_chunks * sizeof(FileChunk *);
+    data->epoch = fs_epoch;
+    return 0;
 }
 
-void search_files(const char *filename) {
-    int found = 0;
-
-    // Helper function to recursively search files
-    void search_in_directory(Directory *dir) {
-        for (int i = 0; i < dir->num_files; i++) {
-            if (strstr(dir->files[i].filename, filename) != NULL) {
-                print(dir->files[i].filename);
-                print("\n");
-                found = 1;
-            }
+// Release everything held by the saved images
+void snapshot_drop() {
+    while (snapshot_images) {
+        SnapshotImage *image = snapshot_images;
+        snapshot_images = image->next;
 
-            // If the file is a directory, search recursively
-            if (dir->files[i].is_directory) {
-                search_in_directory(dir->files[i].dir_ptr);
+        if (image->type == SNAP_DIRECTORY) {
+            dir_put_children((Directory *)image->copy);
+        } else {
+            FileData *copy = (FileData *)image->copy;
+            for (uint32_t i = 0; i < copy->num_chunks; i++) {
+                chunk_put(copy->chunks[i]);
             }
+            free(copy->chunks);
         }
+        free(image->copy);
+        free(image);
     }
+    snapshot_active = 0;
+    snapshot_count = 0;
+    snapshot_bytes = 0;
+}
 
-    // Start searching in the current directory
-    search_in_directory(fs.current_dir);
+void snapshot_take() {
+    snapshot_drop();
+    fs_epoch++;
+    snapshot_active = 1;
+}
 
-    if (!found) {
-        print("No files found matching the search term.\n");
+// Restore every saved object, newest change first. Objects created since the
+// snapshot lose their last reference and are freed along the way.
+int snapshot_rollback() {
+    if (!snapshot_active) {
+        return -1;
     }
-}
 
-void play_sound(unsigned int frequency);
-void stop_sound(void);
-void sleep(unsigned int milliseconds);
-void play_silly_tune(void);
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+        open_files[fd].in_use = 0;
+    }
 
-void play_sound(unsigned int frequency) {
-    unsigned int div;
-    unsigned char tmp;
+    fs_removals++;  // Entries created since the snapshot go away
+    int restored = 0;
+    while (snapshot_images) {
+        SnapshotImage *image = snapshot_images;
+        snapshot_images = image->next;
+
+        if (image->type == SNAP_DIRECTORY) {
+            Directory *dir = (Directory *)image->object;
+            uint32_t refcount = dir->refcount;
+            dir_put_children(dir);
+            memcpy(dir, image->copy, sizeof(Directory));
+            dir->refcount = refcount;
+        } else {
+            FileData *data = (FileData *)image->object;
+            FileData *copy = (FileData *)image->copy;
+            for (uint32_t i = 0; i < data->num_chunks; i++) {
+                chunk_put(data->chunks[i]);
+            }
+            free(data->chunks);
+            data->num_chunks = copy->num_chunks;
+            data->max_chunks = copy->max_chunks;
+            data->chunks = copy->chunks;
+        }
+        free(image->copy);
+        free(image);
+        restored++;
+    }
 
-    // Set the PIT to the desired frequency
-    div = 1193180 / frequency;
-    outb(0x43, 0xb6);
-    outb(0x42, (unsigned char)(div));
-    outb(0x42, (unsigned char)(div >> 8));
+    snapshot_active = 0;
+    snapshot_count = 0;
+    snapshot_bytes = 0;
+    fs_epoch++;
+    fs.current_dir = &fs.root;  // The old working directory may be gone
+    name_index_rebuild();
+    dir_totals_rebuild();
+    return restored;
+}
 
-    // And play the sound using the PC speaker
-    tmp = inb(0x61);
-    if (tmp != (tmp | 3)) {
-        outb(0x61, tmp | 3);
+void snapshot(int argc, char **argv) {
+    const char *args = argc > 1 ? argv[1] : "";
+    if (strcmp(args, "drop") == 0) {
+        snapshot_drop();
+        print("Snapshot dropped.\n");
+    } else if (strcmp(args, "status") == 0) {
+        if (!snapshot_active) {
+            print("No snapshot.\n");
+            return;
+        }
+        print("Snapshot active: ");
+        print_uint(snapshot_count);
+        print(" modified blocks saved (");
+        print_uint(snapshot_bytes);
+        print(" bytes of metadata)\n");
+    } else if (*args == '\0') {
+        snapshot_take();
+        print("Snapshot taken.\n");
+    } else {
+        print("Usage: snapshot [drop|status]\n");
     }
 }
+COMMAND_ARGS(snapshot, snapshot, 0, 1, "snapshot [drop|status]", "Checkpoint the files");
 
-void stop_sound(void) {
-    unsigned char tmp = inb(0x61) & 0xFC;
-    outb(0x61, tmp);
+void rollback() {
+    int restored = snapshot_rollback();
+    if (restored < 0) {
+        print("Error: No snapshot to roll back to\n");
+        return;
+    }
+    print("Rolled back ");
+    print_uint(restored);
+    print(" modified blocks.\n");
 }
+COMMAND(rollback, rollback, "Restore the checkpoint");
 
-void sleep(unsigned int milliseconds) {
-    for (unsigned int i = 0; i < milliseconds * 10000; i++) {
-        __asm__ __volatile__("nop");
+// End of Snapshots
+
+// Function to remove a file from a directory
+int remove_entry(Directory *dir, const char *filename) {
+    for (int i = 0; i < dir->num_files; i++) {
+        if (strcmp(dir->files[i].filename, filename) == 0) {
+            if (dir_prepare(dir) != 0) {
+                print("Error: Out of memory for snapshot\n");
+                return -1;
+            }
+
+            // Release the file's content or the directory's subtree
+            FileEntry *entry = &dir->files[i];
+            if (entry->fat && fat_remove(dir, entry) != 0) {
+                return -1;
+            }
+            name_index_remove(dir, entry->filename);
+            if (entry->is_directory && entry->dir_ptr) {
+                dir_account(dir, -(int)entry->dir_ptr->total_bytes,
+                            -(int)entry->dir_ptr->total_entries - 1);
+                name_index_remove_tree(entry->dir_ptr);
+                dir_put(entry->dir_ptr);
+            } else {
+                dir_account(dir, -(int)entry->size, -1);
+                if (entry->data) {
+                    file_data_put(entry->data);
+                }
+            }
+            free(entry->fat);
+            
+            // Shift the remaining files in the directory
+            for (int j = i; j < dir->num_files - 1; j++) {
+                dir->files[j] = dir->files[j + 1];
+            }
+
+            // Close descriptors on the removed file and follow the shifted entries
+            FileEntry *removed = &dir->files[i];
+            FileEntry *last = &dir->files[dir->num_files - 1];
+            for (int fd = 0; fd < MAX_OPEN_FILES; fd++) {
+                if (!open_files[fd].in_use) continue;
+                if (open_files[fd].entry == removed) {
+                    open_files[fd].in_use = 0;
+                } else if (open_files[fd].entry > removed && open_files[fd].entry <= last) {
+                    open_files[fd].entry--;
+                }
+            }
+            dir->num_files--;
+            fs_removals++;
+            return 0; // Success
+        }
     }
+    print("Error: File not found.\n");
+    return -1; // File not found
 }
 
-void play_silly_tune(void) {
-    // Define some basic frequencies
-    const unsigned int C4 = 262;
-    const unsigned int D4 = 294;
-    const unsigned int E4 = 330;
-    const unsigned int F4 = 349;
-    const unsigned int G4 = 392;
-    const unsigned int A4 = 440;
-    const unsigned int B4 = 494;
-    const unsigned int C5 = 523;
+int remove_file(const char *filename) {
+    return remove_entry(fs.current_dir, filename);
+}
 
-    print_colored("Playing a silly tune...\n", make_color(LIGHT_CYAN, BLACK));
+void rm_command(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) remove_file(argv[i]);
+}
+COMMAND_ARGS(rm, rm_command, 1, COMMAND_ANY_ARGS, "rm [name]", "Remove file or dir");
 
-    const unsigned int notes[] = {E4, D4, C4, D4, E4, E4, E4, D4, D4, D4, E4, G4, G4, E4, D4, C4,
-                                  D4, E4, E4, E4, E4, D4, D4, E4, D4, C4,
+// End of Filesystem
 
-                                  // New section
-                                  C4, C4, D4, E4, E4, D4, C4, C4, D4, E4, E4, D4, C4, C4, D4, E4,
+// FS Commands
 
-                                  // Another variation
-                                  G4, G4, A4, B4, B4, A4, G4, G4, A4, B4, B4, A4, G4, G4, A4, B4,
+int touch(const char *filename) {
+    return create_file(filename, "");  // Pass for empty file
+}
 
-                                  // Final section
-                                  E4, D4, C4, D4, E4, E4, E4, D4, D4, D4, E4, G4, G4, E4, D4, C4,
-                                  D4, E4, E4, E4, E4, D4, D4, E4, D4, C4};
+void touch_command(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) touch(argv[i]);
+}
+COMMAND_ARGS(touch, touch_command, 1, COMMAND_ANY_ARGS, "touch [filename]", "Create a file");
 
-    const unsigned int durations[] = {
-        200, 200, 200, 200, 200, 200, 400, 200, 200, 400, 200, 200, 400, 200, 200, 200, 200, 200,
-        200, 400, 200, 200, 200, 200, 200, 400,
+#define CAT_CHUNK_SIZE 256
 
-        // New section durations
-        200, 200, 200, 200, 200, 200, 400, 200, 200, 200, 200, 200, 200, 400, 200,
+void cat(const char *filename) {
+    // Find the file
+    char leaf[MAX_FILENAME];
+    Directory *dir = lookup_parent(filename, leaf);
+    FileEntry *file = dir ? find_entry(dir, leaf) : NULL;
 
-        // Another variation durations
-        200, 200, 200, 200, 200, 200, 400, 200, 200, 200, 200, 200, 200, 400, 200,
+    if (file == NULL) {
+        print("Error: File not found\n");
+        return;
+    }
 
-        // Final section durations
-        200, 200, 200, 200, 200, 200, 400, 200, 200, 400, 200, 200, 400, 200, 200, 200, 200, 200,
-        200, 400, 200, 200, 200, 200, 200, 400};
+    // Check if it's a directory
+    if (file->is_directory) {
+        print("Error: Cannot cat a directory\n");
+        return;
+    }
 
-    for (int i = 0; i < sizeof(notes) / sizeof(notes[0]); i++) {
-        play_sound(notes[i]);
-        sleep(durations[i]);
-        stop_sound();
-        sleep(50);  // Small pause between notes
+    // Stream the contents of the file to the console
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        print("Error: Cannot open file\n");
+        return;
     }
 
-    print_colored("Song finished!\n", make_color(LIGHT_GREEN, BLACK));
+    char chunk[CAT_CHUNK_SIZE];
+    int n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+        print_n(chunk, n);
+    }
+    close(fd);
+    if (current_output == &console) print("\n");  // Back to the start of a line for the prompt
 }
 
-// Modified cpuinfo function
-// Function to emulate CPUID instruction
-static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx,
-                         uint32_t *ecx, uint32_t *edx) {
-    __asm__ __volatile__("cpuid"
-                         : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
-                         : "a"(leaf), "c"(subleaf));
+// Without a file, copy the input of the task, such as a pipe, to its output
+void cat_command(int argc, char **argv) {
+    if (argc == 1) {
+        if (current_input == &console) {
+            print("Usage: cat [filename]\n");
+            return;
+        }
+        char chunk[CAT_CHUNK_SIZE];
+        int n;
+        while ((n = current_input->read(current_input, chunk, sizeof(chunk))) > 0) {
+            print_n(chunk, n);
+        }
+        return;
+    }
+    for (int i = 1; i < argc; i++) cat(argv[i]);
 }
+COMMAND_ARGS(cat, cat_command, 0, COMMAND_ANY_ARGS, "cat [filename]", "Show a file");
 
-// Function prototypes for the adventure game
-void adventure_north(void);
-void adventure_south(void);
-void adventure_east(void);
-void adventure_west(void);
-void textadventure(void);
-
-void textadventure() {
-    clear_screen();
-    print_colored("Welcome to the Text Adventure Game!\n", make_color(LIGHT_CYAN, BLACK));
-    print_colored("You find yourself in a dark forest. You can go:\n",
-                  make_color(LIGHT_GREEN, BLACK));
-    print_colored("1. North\n", make_color(WHITE, BLACK));
-    print_colored("2. South\n", make_color(WHITE, BLACK));
-    print_colored("3. East\n", make_color(WHITE, BLACK));
-    print_colored("4. West\n", make_color(WHITE, BLACK));
-    print_colored("Type your choice (1-4): ", make_color(LIGHT_GREY, BLACK));
+int mkdir(const char *dirname) {
+    return create_directory(fs.current_dir, dirname) ? 0 : -1;
+}
 
-    char choice[2];
-    read_line(choice, sizeof(choice));
+void mkdir_command(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) mkdir(argv[i]);
+}
+COMMAND_ARGS(mkdir, mkdir_command, 1, COMMAND_ANY_ARGS, "mkdir [name]", "Create a directory");
 
-    if (strcmp(choice, "1") == 0) {
-        adventure_north();
-    } else if (strcmp(choice, "2") == 0) {
-        adventure_south();
-    } else if (strcmp(choice, "3") == 0) {
-        adventure_east();
-    } else if (strcmp(choice, "4") == 0) {
-        adventure_west();
-    } else {
-        print_colored("Invalid choice. Game over.\n", make_color(RED, BLACK));
+void ls() {
+    for (int i = 0; i < fs.current_dir->num_files; i++) {
+        print(fs.current_dir->files[i].filename);
+        print("\n");
     }
 }
 
-void adventure_north() {
-    clear_screen();
-    print_colored("You go north and find a mysterious treasure chest!\n",
-                  make_color(LIGHT_BROWN, BLACK));
-    print_colored("The chest is covered in ancient runes and seems to glow...\n",
-                  make_color(LIGHT_BLUE, BLACK));
-    print_colored("Do you want to open it? (y/n): ", make_color(WHITE, BLACK));
+// List with the logical size of each file and the bytes it actually takes
+void ls_long() {
+    uint32_t total_size = 0;
+    uint32_t total_stored = 0;
 
-    char choice[2];
-    read_line(choice, sizeof(choice));
+    print("     size    stored  name\n");
+    for (int i = 0; i < fs.current_dir->num_files; i++) {
+        FileEntry *entry = &fs.current_dir->files[i];
+        if (entry->is_directory) {
+            if (entry->dir_ptr) {
+                print_uint_padded(entry->dir_ptr->total_bytes, 9);
+            } else {
+                print("        ?");  // FAT directory not read yet
+            }
+            print("         -  ");
+            print(entry->filename);
+            print("/\n");
+            continue;
+        }
+        uint32_t stored = file_stored_bytes(entry);
+        print_uint_padded(entry->size, 9);
+        print_uint_padded(stored, 10);
+        print("  ");
+        print(entry->filename);
+        print("\n");
+        total_size += entry->size;
+        total_stored += stored;
+    }
+    print("total ");
+    print_uint(total_size);
+    print(" bytes in ");
+    print_uint(total_stored);
+    print(" stored\n");
+}
 
-    if (strcmp(choice, "y") == 0) {
-        print_colored("\nYou carefully open the chest...\n", make_color(LIGHT_GREY, BLACK));
-        print_colored("*FLASH* A burst of light blinds you momentarily!\n",
-                      make_color(WHITE, BLACK));
-        print_colored("You found a magical sword and 100 gold coins!\n",
-                      make_color(LIGHT_GREEN, BLACK));
+void ls_command(int argc, char **argv) {
+    if (argc == 1) {
+        ls();
+    } else if (strcmp(argv[1], "-l") == 0) {
+        ls_long();
     } else {
-        print_colored("You decide to play it safe and leave the chest alone.\n",
-                      make_color(LIGHT_RED, BLACK));
-        print_colored("Perhaps some mysteries are better left unsolved...\n",
-                      make_color(MAGENTA, BLACK));
+        print("Usage: ls [-l]\n");
     }
-    print_colored("\nPress any key to continue...\n", make_color(WHITE, BLACK));
-    get_keyboard_char();
 }
+COMMAND_ARGS(ls, ls_command, 0, 1, "ls [-l]", "List files and dirs");
+
+// Space used below a directory, read from its totals
+void du(const char *path) {
+    Directory *dir;
+    FileEntry *entry;
+    if (resolve_path(path, &dir, &entry) != 0) {
+        print("Error: File not found.\n");
+        return;
+    }
 
-void adventure_south() {
-    clear_screen();
-    print_colored("You venture south into darker woods...\n", make_color(DARK_GREY, BLACK));
-    print_colored("Suddenly, a massive dragon appears before you!\n", make_color(RED, BLACK));
-    print_colored("Its scales shimmer with an otherworldly glow...\n",
-                  make_color(LIGHT_RED, BLACK));
-    print_colored("Do you want to fight it? (y/n): ", make_color(WHITE, BLACK));
-
-    char choice[2];
-    read_line(choice, sizeof(choice));
-
-    if (strcmp(choice, "y") == 0) {
-        print_colored("\nYou draw your weapon and charge forward!\n",
-                      make_color(LIGHT_BROWN, BLACK));
-        print_colored("After an epic battle, you emerge victorious!\n", make_color(GREEN, BLACK));
-        print_colored("The dragon transforms into a friendly spirit...\n",
-                      make_color(LIGHT_CYAN, BLACK));
-    } else {
-        print_colored("You wisely choose to retreat...\n", make_color(LIGHT_BLUE, BLACK));
-        print_colored("The dragon nods respectfully at your decision.\n", make_color(CYAN, BLACK));
+    if (entry != NULL) {
+        print_uint(entry->size);
+        print(" bytes\n");
+        return;
     }
-    print_colored("\nPress any key to continue...\n", make_color(WHITE, BLACK));
-    get_keyboard_char();
+    print_uint(dir->total_bytes);
+    print(" bytes in ");
+    print_uint(dir->total_entries);
+    print(" entries\n");
 }
 
-void adventure_east() {
-    clear_screen();
-    print_colored("You travel east and discover a mystical village!\n",
-                  make_color(LIGHT_GREEN, BLACK));
-    print_colored("An old sage approaches you with ancient wisdom...\n", make_color(CYAN, BLACK));
-    print_colored("Do you want to hear their counsel? (y/n): ", make_color(WHITE, BLACK));
+void du_command(int argc, char **argv) {
+    du(argc > 1 ? argv[1] : "");
+}
+COMMAND_ARGS(du, du_command, 0, 1, "du [path]", "Disk usage of a dir");
+
+// Print the subtree below a directory, one entry per line
+void tree(const char *path) {
+    Directory *dir;
+    FileEntry *entry;
+    if (resolve_path(path, &dir, &entry) != 0 || entry != NULL) {
+        print("Error: Directory not found.\n");
+        return;
+    }
 
-    char choice[2];
-    read_line(choice, sizeof(choice));
+    uint32_t dirs = 0;
+    uint32_t files = 0;
+    print(dir->name);
+    print("\n");
 
-    if (strcmp(choice, "y") == 0) {
-        print_colored("\nThe sage reveals secrets of great power...\n", make_color(MAGENTA, BLACK));
-        print_colored("You learn about a legendary artifact!\n", make_color(LIGHT_BROWN, BLACK));
-        print_colored("This knowledge will serve you well...\n", make_color(LIGHT_CYAN, BLACK));
-    } else {
-        print_colored("You politely decline the sage's offer.\n", make_color(LIGHT_GREY, BLACK));
-        print_colored("Sometimes ignorance is bliss...\n", make_color(DARK_GREY, BLACK));
+    DirWalk walk;
+    dir_walk_begin(&walk, dir);
+    walk.load = 1;
+    uint32_t steps = 0;
+    while ((entry = dir_walk_next(&walk)) != NULL) {
+        if (++steps % WALK_YIELD_PERIOD == 0 && fs_yield()) {
+            return;
+        }
+        for (uint32_t i = 0; i <= walk.depth; i++) {
+            print("  ");
+        }
+        print(entry->filename);
+        if (entry->is_directory) {
+            print("/");
+            dirs++;
+        } else {
+            files++;
+        }
+        print("\n");
     }
-    print_colored("\nPress any key to continue...\n", make_color(WHITE, BLACK));
-    get_keyboard_char();
+
+    print_uint(dirs);
+    print(" directories, ");
+    print_uint(files);
+    print(" files, ");
+    print_uint(dir->total_bytes);
+    print(" bytes\n");
 }
 
-void adventure_west() {
-    clear_screen();
-    print_colored("You head west into a mysterious fog...\n", make_color(LIGHT_BLUE, BLACK));
-    print_colored("The mists swirl around you creating strange shapes...\n",
-                  make_color(CYAN, BLACK));
-    print_colored("You hear whispers from the beyond...\n", make_color(MAGENTA, BLACK));
-    print_colored("As the fog clears, you find your way back...\n", make_color(GREEN, BLACK));
-    print_colored("But you're not quite the same as before...\n", make_color(LIGHT_MAGENTA, BLACK));
-    print_colored("\nPress any key to continue...\n", make_color(WHITE, BLACK));
-    get_keyboard_char();
+void tree_command(int argc, char **argv) {
+    tree(argc > 1 ? argv[1] : "");
 }
+COMMAND_ARGS(tree, tree_command, 0, 1, "tree [path]", "Show the directory tree");
 
-void cpuinfo() {
-    char vendor[13];
-    uint32_t eax, ebx, ecx, edx;
+// num / den with two decimals
+void print_ratio(uint32_t num, uint32_t den) {
+    if (den == 0) {
+        print("-");
+        return;
+    }
+    uint32_t hundredths = (num % den) * 100 / den;
+    print_uint(num / den);
+    print(hundredths < 10 ? ".0" : ".");
+    print_uint(hundredths);
+    print("x");
+}
 
-    // Get vendor string
-    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+// Report how much the chunk store saves
+void dfstat() {
+    uint32_t refs = 0, unsealed = 0, referenced = 0;
+    DirWalk walk;
+    dir_walk_begin(&walk, &fs.root);
+    FileEntry *entry;
+    while ((entry = dir_walk_next(&walk)) != NULL) {
+        if (entry->is_directory || entry->data == NULL) {
+            continue;
+        }
+        for (uint32_t i = 0; i < entry->data->num_chunks; i++) {
+            FileChunk *chunk = entry->data->chunks[i];
+            if (chunk->flags & CHUNK_SEALED) {
+                refs++;
+                referenced += chunk->length;
+            } else {
+                unsealed++;
+            }
+        }
+    }
+
+    uint32_t chunks = 0, compressed = 0, unique = 0, stored = 0;
+    for (int i = 0; i < CHUNK_STORE_BUCKETS; i++) {
+        for (FileChunk *chunk = chunk_store[i]; chunk != NULL; chunk = chunk->next) {
+            chunks++;
+            unique += chunk->length;
+            stored += chunk->stored;
+            if (chunk->flags & CHUNK_COMPRESSED) compressed++;
+        }
+    }
+
+    print("Chunk references: ");
+    print_uint(refs);
+    print(" (");
+    print_uint(unsealed);
+    print(" still open for writing)\n");
+    print("Stored chunks:    ");
+    print_uint(chunks);
+    print(" (");
+    print_uint(compressed);
+    print(" compressed)\n");
+    print("Referenced bytes: ");
+    print_uint(referenced);
+    print("\nUnique bytes:     ");
+    print_uint(unique);
+    print("\nStored bytes:     ");
+    print_uint(stored);
+    print("\nDedup ratio:      ");
+    print_ratio(referenced, unique);
+    print(", ");
+    print_ratio(referenced, stored);
+    print(" with compression\n");
+}
+COMMAND(dfstat, dfstat, "Deduplication stats");
+
+int cd(const char *dirname) {
+    if (strcmp(dirname, "..") == 0) {
+        if (fs.current_dir->parent != NULL) {
+            fs.current_dir = fs.current_dir->parent;
+            return 0;
+        }
+        return -1;  // Already at root
+    }
+
+    for (int i = 0; i < fs.current_dir->num_files; i++) {
+        if (strcmp(fs.current_dir->files[i].filename, dirname) == 0) {
+            if (fs.current_dir->files[i].is_directory) {
+                Directory *dir = entry_dir(fs.current_dir, &fs.current_dir->files[i]);
+                if (dir == NULL) {
+                    return -1;
+                }
+                fs.current_dir = dir;  // Change to the new directory
+                return 0;
+            } else {
+                return -1;  // Not a directory
+            }
+        }
+    }
+
+    return -1;  // Directory not found
+}
+
+void cd_command(int argc, char **argv) {
+    cd(argv[1]);
+}
+COMMAND_ARGS(cd, cd_command, 1, 1, "cd [dir]", "Change directory");
+
+// End of FS Commands
+
+// Initrd
+//
+// Boot modules passed by GRUB are mounted read-only as directory trees. File
+// entries point straight into module memory; only Directory metadata is
+// allocated. Both ustar and cpio (newc) archives are understood. Modules
+// holding a FAT disk image are mounted read-write through a memory disk
+// instead (see FAT).
+
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+#define MULTIBOOT_INFO_CMDLINE 0x4
+#define MULTIBOOT_INFO_MODS 0x8
+
+typedef struct {
+    uint32_t mod_start;
+    uint32_t mod_end;
+    uint32_t string;  // Module command line, e.g. "/boot/initrd.tar initrd"
+    uint32_t reserved;
+} MultibootModule;
+
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower;
+    uint32_t mem_upper;
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count;
+    uint32_t mods_addr;
+} MultibootInfo;
+
+#define TAR_BLOCK_SIZE 512
+#define CPIO_HEADER_SIZE 110
+
+uint32_t parse_octal(const char *str, int len) {
+    uint32_t value = 0;
+    for (int i = 0; i < len && str[i]; i++) {
+        if (str[i] < '0' || str[i] > '7') {
+            if (str[i] == ' ') continue;
+            break;
+        }
+        value = value * 8 + (str[i] - '0');
+    }
+    return value;
+}
+
+uint32_t parse_hex(const char *str, int len) {
+    uint32_t value = 0;
+    for (int i = 0; i < len; i++) {
+        char c = str[i];
+        if (c >= '0' && c <= '9') {
+            value = value * 16 + (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            value = value * 16 + (c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            value = value * 16 + (c - 'A' + 10);
+        } else {
+            break;
+        }
+    }
+    return value;
+}
+
+// Add an archive member below root. Missing parent directories are created.
+int initrd_add(Directory *root, const char *path, int is_directory, const char *data,
+               uint32_t size) {
+    Directory *dir = root;
+    char component[MAX_FILENAME];
+
+    while (*path) {
+        // Split off the next path component
+        int len = 0;
+        while (*path == '/') path++;
+        while (*path && *path != '/') {
+            if (len < MAX_FILENAME - 1) component[len++] = *path;
+            path++;
+        }
+        component[len] = '\0';
+        while (*path == '/') path++;
+
+        if (len == 0 || strcmp(component, ".") == 0) {
+            continue;
+        }
+
+        FileEntry *entry = find_entry(dir, component);
+        if (*path == '\0' && !is_directory) {
+            if (entry != NULL) return -1;  // Duplicate member
+            return create_mapped_file(dir, component, data, size) ? 0 : -1;
+        }
+
+        if (entry == NULL) {
+            dir = create_directory(dir, component);
+            if (dir == NULL) return -1;
+        } else if (entry->is_directory) {
+            dir = entry->dir_ptr;
+        } else {
+            return -1;  // A file is in the way
+        }
+    }
+    return 0;
+}
+
+int initrd_mount_tar(Directory *root, const char *archive, uint32_t size) {
+    uint32_t offset = 0;
+    int count = 0;
+    char path[256];
+
+    while (offset + TAR_BLOCK_SIZE <= size) {
+        const char *header = archive + offset;
+        if (header[0] == '\0') break;  // End-of-archive marker
+
+        uint32_t file_size = parse_octal(header + 124, 12);
+        char type = header[156];
+
+        // ustar splits long names into prefix (offset 345) and name (offset 0)
+        int len = 0;
+        if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+            for (int i = 0; i < 155 && header[345 + i] && len < 254; i++) {
+                path[len++] = header[345 + i];
+            }
+            path[len++] = '/';
+        }
+        for (int i = 0; i < 100 && header[i] && len < 255; i++) {
+            path[len++] = header[i];
+        }
+        path[len] = '\0';
+
+        const char *data = header + TAR_BLOCK_SIZE;
+        if (offset + TAR_BLOCK_SIZE + file_size > size) break;  // Truncated archive
+
+        if (type == '0' || type == '\0') {
+            if (initrd_add(root, path, 0, data, file_size) == 0) count++;
+        } else if (type == '5') {
+            initrd_add(root, path, 1, NULL, 0);
+        }
+
+        offset += TAR_BLOCK_SIZE + (file_size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+    }
+    return count;
+}
+
+int initrd_mount_cpio(Directory *root, const char *archive, uint32_t size) {
+    uint32_t offset = 0;
+    int count = 0;
+
+    while (offset + CPIO_HEADER_SIZE <= size && memcmp(archive + offset, "070701", 6) == 0) {
+        const char *header = archive + offset;
+        uint32_t mode = parse_hex(header + 14, 8);
+        uint32_t file_size = parse_hex(header + 54, 8);
+        uint32_t name_size = parse_hex(header + 94, 8);
+        const char *name = header + CPIO_HEADER_SIZE;
+
+        uint32_t data_offset = (offset + CPIO_HEADER_SIZE + name_size + 3) & ~3;
+        if (data_offset + file_size > size || name[name_size - 1] != '\0') break;
+        if (strcmp(name, "TRAILER!!!") == 0) break;
+
+        if ((mode & 0170000) == 0100000) {
+            if (initrd_add(root, name, 0, archive + data_offset, file_size) == 0) count++;
+        } else if ((mode & 0170000) == 0040000) {
+            initrd_add(root, name, 1, NULL, 0);
+        }
+
+        offset = (data_offset + file_size + 3) & ~3;
+    }
+    return count;
+}
+
+int mount_initrd(const char *archive, uint32_t size, const char *mountpoint) {
+    Directory *root = create_directory(&fs.root, mountpoint);
+    if (root == NULL) {
+        return -1;
+    }
+
+    int count;
+    if (size >= 6 && memcmp(archive, "070701", 6) == 0) {
+        count = initrd_mount_cpio(root, archive, size);
+    } else {
+        count = initrd_mount_tar(root, archive, size);
+    }
+
+    print("Mounted initrd at /");
+    print(mountpoint);
+    print(" (");
+    print_uint(count);
+    print(" files)\n");
+    return count;
+}
+
+void mount_modules(MultibootInfo *mbi) {
+    MultibootModule *modules = (MultibootModule *)mbi->mods_addr;
+
+    for (uint32_t i = 0; i < mbi->mods_count; i++) {
+        // The mount point is the word after the module path, "initrd" by default
+        char mountpoint[MAX_FILENAME];
+        const char *args = (const char *)modules[i].string;
+        int named = 0;
+        strncpy(mountpoint, "initrd", MAX_FILENAME);
+        if (args) {
+            while (*args && *args != ' ') args++;
+            while (*args == ' ') args++;
+            int len = 0;
+            while (args[len] && args[len] != ' ' && len < MAX_FILENAME - 1) {
+                mountpoint[len] = args[len];
+                len++;
+            }
+            if (len > 0) mountpoint[len] = '\0';
+            named = len > 0;
+        }
+
+        // A module may also be a FAT disk image, or an exported tree that is
+        // restored into the root unless a mount point is given
+        const uint8_t *image = (const uint8_t *)modules[i].mod_start;
+        uint32_t size = modules[i].mod_end - modules[i].mod_start;
+        int image_offset = fsimage_find(image, size);
+        if (image_offset >= 0) {
+            fs_import(image + image_offset, size - image_offset, named ? mountpoint : "");
+        } else if (size >= BLOCK_SIZE && fat_boot_sector_valid(image)) {
+            fat_mount_image(image, size, mountpoint);
+        } else {
+            mount_initrd((const char *)image, size, mountpoint);
+        }
+    }
+}
+
+// End of Initrd
+
+// Function prototypes
+
+void print_colored(const char *str, unsigned char color);
+
+void update_cursor(void);
+
+uint16_t make_vga_entry(char c, unsigned char color);
+
+void play_sound(unsigned int frequency);
+
+void stop_sound(void);
+
+void sleep(unsigned int milliseconds);
+
+void play_silly_tune(void);
+
+void task_yield();
+
+int task_killed();
+
+int task_has_keyboard();
+
+void key_wait();
+
+// IO functions
+void outb(uint16_t port, uint8_t val) {
+    asm volatile("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+void outw(uint16_t port, uint16_t val) {
+    asm volatile("outw %0, %1" : : "a"(val), "Nd"(port));
+}
+
+uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    asm volatile("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+int strncmp(const char *s1, const char *s2, int n) {
+    while (n && *s1 && (*s1 == *s2)) {
+        ++s1;
+        ++s2;
+        --n;
+    }
+    if (n == 0) return 0;
+    return *(unsigned char *)s1 - *(unsigned char *)s2;
+}
+
+void update_cursor() {
+    uint16_t pos = cursor_y * VGA_WIDTH + cursor_x;
+
+    outb(0x3D4, 0x0F);
+    outb(0x3D5, (uint8_t)(pos & 0xFF));
+    outb(0x3D4, 0x0E);
+    outb(0x3D5, (uint8_t)((pos >> 8) & 0xFF));
+}
+
+#define LSHIFT 0x2A
+#define RSHIFT 0x36
+#define CAPS_LOCK 0x3A
+#define SCANCODE_EXTENDED 0xE0
+
+// Keys without a character, returned by get_key above the byte range
+#define KEY_UP 0x100
+#define KEY_DOWN 0x101
+#define KEY_LEFT 0x102
+#define KEY_RIGHT 0x103
+#define KEY_HOME 0x104
+#define KEY_END 0x105
+#define KEY_PAGE_UP 0x106
+#define KEY_PAGE_DOWN 0x107
+#define KEY_DELETE 0x108
+
+// Next key press: a character, or a KEY_ code for the cursor keys. Background
+// jobs wait here until they are brought to the foreground, and a killed task
+// gets Esc.
+int get_key() {
+    static const char sc_ascii[] = {0,   27,  '1',  '2',  '3',  '4', '5', '6',  '7', '8', '9', '0',
+                                    '-', '=', '\b', '\t', 'q',  'w', 'e', 'r',  't', 'y', 'u', 'i',
+                                    'o', 'p', '[',  ']',  '\n', 0,   'a', 's',  'd', 'f', 'g', 'h',
+                                    'j', 'k', 'l',  ';',  '\'', '`', 0,   '\\', 'z', 'x', 'c', 'v',
+                                    'b', 'n', 'm',  ',',  '.',  '/', 0,   '*',  0,   ' '};
+
+    static const char sc_ascii_shift[] = {
+        0,    27,  '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+',  '\b',
+        '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n', 0,
+        'A',  'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~', 0,   '|',  'Z',
+        'X',  'C', 'V', 'B', 'N', 'M', '<', '>', '?', 0,   '*', 0,   ' '};
+
+    // Cursor keys from scancode 0x47 on, also sent by the keypad
+    static const uint16_t sc_keys[] = {KEY_HOME, KEY_UP,   KEY_PAGE_UP,   0,
+                                       KEY_LEFT, 0,        KEY_RIGHT,     0,
+                                       KEY_END,  KEY_DOWN, KEY_PAGE_DOWN, 0,
+                                       KEY_DELETE};
+
+    static int shift = 0;
+    static int caps_lock = 0;
+    static int extended = 0;
+
+    while (1) {
+        if (task_killed()) {
+            task_yield();  // Callers may loop on keys, so let the others run
+            return 27;
+        }
+        if (task_has_keyboard() && (inb(0x64) & 0x1)) {
+            uint8_t scancode = inb(0x60);
+
+            if (scancode == SCANCODE_EXTENDED) {
+                extended = 1;
+                continue;
+            }
+            int was_extended = extended;
+            extended = 0;
+            if (was_extended && (scancode & 0x7F) == LSHIFT) {
+                continue;  // Fake shift sent around the cursor keys
+            }
+
+            if (scancode == LSHIFT || scancode == RSHIFT) {
+                shift = 1;
+                continue;
+            } else if (scancode == (LSHIFT | 0x80) || scancode == (RSHIFT | 0x80)) {
+                shift = 0;
+                continue;
+            } else if (scancode == CAPS_LOCK) {
+                caps_lock = !caps_lock;
+                continue;
+            }
+
+            if (!(scancode & 0x80)) {
+                if (scancode >= 0x47 && scancode < 0x47 + sizeof(sc_keys) / sizeof(sc_keys[0]) &&
+                    sc_keys[scancode - 0x47]) {
+                    return sc_keys[scancode - 0x47];
+                }
+                if (scancode < sizeof(sc_ascii)) {
+                    char c;
+                    if (shift) {
+                        c = sc_ascii_shift[scancode];
+                    } else {
+                        c = sc_ascii[scancode];
+                    }
+
+                    if (caps_lock && c >= 'a' && c <= 'z') {
+                        c -= 32;  // Convert to uppercase
+                    } else if (caps_lock && c >= 'A' && c <= 'Z') {
+                        c += 32;  // Convert to lowercase
+                    }
+
+                    if (c) {
+                        return (uint8_t)c;
+                    }
+                }
+            }
+        }
+
+        key_wait();
+    }
+}
+
+int key_pending() {
+    return inb(0x64) & 0x1;
+}
+
+char get_keyboard_char() {
+    int key;
+    while ((key = get_key()) > 0xFF) {
+    }
+    return (char)key;
+}
+
+uint16_t make_vga_entry(char c, uint8_t color) {
+    return (uint16_t)c | (uint16_t)color << 8;
+}
+
+void clear_screen() {
+    for (int y = 0; y < VGA_HEIGHT; y++) {
+        for (int x = 0; x < VGA_WIDTH; x++) {
+            const int index = y * VGA_WIDTH + x;
+            vga_buffer[index] = make_vga_entry(' ', make_color(WHITE, BLACK));
+        }
+    }
+    cursor_x = 0;
+    cursor_y = 0;
+    update_cursor();
+}
+COMMAND(clear, clear_screen, "Clear the screen");
+
+void cpuinfo();
+void time();
+void calc(const char *expression);
+void print_padded(const char *str, int width);
+
+// Read a line into buffer, echoing it. Tab calls complete, if given, with the
+// line so far; it echoes what it adds and returns the new length.
+void edit_line(char *buffer, int max_length,
+               int (*complete)(char *line, int length, int max_length)) {
+    int i = 0;
+    char c;
+    while (i < max_length - 1) {
+        c = get_keyboard_char();
+        if (c == '\n' || task_killed()) {
+            buffer[i] = '\0';
+            putchar('\n');
+            return;
+        } else if (c == '\b' && i > 0) {
+            i--;
+            putchar('\b');
+        } else if (c == '\t' && complete != NULL) {
+            buffer[i] = '\0';
+            i = complete(buffer, i, max_length);
+        } else if (c >= 32 && c <= 126) {
+            buffer[i] = c;
+            putchar(c);
+            i++;
+        }
+    }
+    buffer[i] = '\0';
+}
+
+void read_line(char *buffer, int max_length) {
+    edit_line(buffer, max_length, NULL);
+}
+
+#ifndef UINT_TYPES
+#define UINT_TYPES
+typedef unsigned char uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int uint32_t;
+typedef unsigned long long uint64_t;
+typedef char int8_t;
+typedef short int16_t;
+typedef int int32_t;
+typedef long long int64_t;
+#endif
+
+// ACPI-related definitions
+#define ACPI_RSDP_SIGNATURE "RSD PTR "
+#define ACPI_FADT_SIGNATURE "FACP"
+#define ACPI_DSDT_SIGNATURE "DSDT"
+
+// PCI-related definitions
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+// Keyboard controller
+#define KBC_DATA_PORT 0x60
+#define KBC_STATUS_PORT 0x64
+
+// CMOS
+#define CMOS_ADDRESS 0x70
+#define CMOS_DATA 0x71
+
+// Function prototypes
+void shutdown();
+void *find_acpi_table(const char *signature);
+void acpi_poweroff();
+void apm_poweroff();
+void pci_reset();
+void ps2_reset();
+void cmos_reset();
+void triple_fault();
+void outl(uint16_t port, uint32_t val);
+
+void outl(uint16_t port, uint32_t val) {
+    asm volatile("outl %0, %1" : : "a"(val), "Nd"(port));
+}
+
+void io_wait() {
+    outb(0x80, 0);
+}
+
+// Interrupts
+//
+// Only the IRQs of drivers that ask for them are unmasked; the keyboard and
+// the timer are still polled. The PICs are moved past the CPU exceptions, so
+// IRQ n arrives at vector IRQ_BASE + n.
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+#define PIC_EOI 0x20
+#define IRQ_BASE 0x20
+#define IRQ_SPURIOUS 7
+#define IDT_ENTRIES (IRQ_BASE + 16)
+#define CODE_SELECTOR 0x08
+#define DATA_SELECTOR 0x10
+
+typedef struct {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t flags;
+    uint16_t offset_high;
+} __attribute__((packed)) IdtEntry;
+
+typedef struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed)) DescriptorTable;
+
+// Flat code and data segments; the GDT the boot loader left is not ours to keep
+uint64_t gdt[3] = {0, 0x00CF9A000000FFFFULL, 0x00CF92000000FFFFULL};
+IdtEntry idt[IDT_ENTRIES];
+
+// A spurious IRQ 7 must not be acknowledged
+void irq_spurious_entry();
+asm(".pushsection .text\n"
+    ".global irq_spurious_entry\n"
+    "irq_spurious_entry:\n"
+    "    iret\n"
+    ".popsection\n");
+
+void irq_set_handler(int irq, void (*entry)()) {
+    IdtEntry *gate = &idt[IRQ_BASE + irq];
+    gate->offset_low = (uint32_t)entry & 0xFFFF;
+    gate->selector = CODE_SELECTOR;
+    gate->zero = 0;
+    gate->flags = 0x8E;  // Present 32-bit interrupt gate
+    gate->offset_high = (uint32_t)entry >> 16;
+}
+
+void irq_unmask(int irq) {
+    outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+}
+
+void irq_end() {
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+// Disable interrupts, returning the flags for irq_restore
+uint32_t irq_save() {
+    uint32_t flags;
+    asm volatile("pushf\n"
+                 "pop %0\n"
+                 "cli"
+                 : "=r"(flags)
+                 :
+                 : "memory");
+    return flags;
+}
+
+void irq_restore(uint32_t flags) {
+    asm volatile("push %0\n"
+                 "popf"
+                 :
+                 : "r"(flags)
+                 : "memory", "cc");
+}
+
+void interrupts_init() {
+    DescriptorTable gdtr = {sizeof(gdt) - 1, (uint32_t)gdt};
+    asm volatile("lgdt %0\n"
+                 "ljmp %1, $1f\n"
+                 "1:\n"
+                 "mov %2, %%ax\n"
+                 "mov %%ax, %%ds\n"
+                 "mov %%ax, %%es\n"
+                 "mov %%ax, %%fs\n"
+                 "mov %%ax, %%gs\n"
+                 "mov %%ax, %%ss"
+                 :
+                 : "m"(gdtr), "i"(CODE_SELECTOR), "i"(DATA_SELECTOR)
+                 : "eax", "memory");
+
+    // Initialize both PICs with every line masked
+    outb(PIC1_COMMAND, 0x11);
+    outb(PIC2_COMMAND, 0x11);
+    outb(PIC1_DATA, IRQ_BASE);
+    outb(PIC2_DATA, IRQ_BASE + 8);
+    outb(PIC1_DATA, 0x04);  // The slave is on IRQ 2
+    outb(PIC2_DATA, 0x02);
+    outb(PIC1_DATA, 0x01);  // 8086 mode
+    outb(PIC2_DATA, 0x01);
+    outb(PIC1_DATA, 0xFF);
+    outb(PIC2_DATA, 0xFF);
+
+    irq_set_handler(IRQ_SPURIOUS, irq_spurious_entry);
+    DescriptorTable idtr = {sizeof(idt) - 1, (uint32_t)idt};
+    asm volatile("lidt %0\n"
+                 "sti"
+                 :
+                 : "m"(idtr)
+                 : "memory");
+}
+
+// End of Interrupts
+
+// Serial port
+//
+// COM1 is a 16550 run from its interrupt: output is queued in a ring and
+// the UART's FIFO is refilled whenever it empties, and received bytes are
+// queued until read. Writers only wait when the output ring is full. Where
+// no interrupt arrives, the same work is done when the rings are used.
+#define COM1 0x3F8
+#define IRQ_COM1 4
+#define SERIAL_IIR_NONE 0x01
+#define SERIAL_LSR_DATA_READY 0x01
+#define SERIAL_LSR_THR_EMPTY 0x20
+#define SERIAL_LSR_IDLE 0x40
+#define SERIAL_FIFO_SIZE 16
+#define SERIAL_RING_SIZE 16384  // Power of two
+#define SERIAL_RING_MASK (SERIAL_RING_SIZE - 1)
+
+// Rings indexed by free-running counters: bytes go in at head, out at tail
+typedef struct {
+    uint8_t data[SERIAL_RING_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} SerialRing;
+
+SerialRing serial_tx;
+SerialRing serial_rx;
+
+// Refill the transmit FIFO once it is empty. Runs with interrupts off.
+void serial_tx_fill() {
+    if (!(inb(COM1 + 5) & SERIAL_LSR_THR_EMPTY)) return;
+    for (int i = 0; i < SERIAL_FIFO_SIZE && serial_tx.tail != serial_tx.head; i++) {
+        outb(COM1, serial_tx.data[serial_tx.tail++ & SERIAL_RING_MASK]);
+    }
+}
+
+// Queue the received bytes, dropping those that do not fit. Runs with
+// interrupts off.
+void serial_rx_drain() {
+    while (inb(COM1 + 5) & SERIAL_LSR_DATA_READY) {
+        uint8_t c = inb(COM1);
+        if (serial_rx.head - serial_rx.tail < SERIAL_RING_SIZE) {
+            serial_rx.data[serial_rx.head++ & SERIAL_RING_MASK] = c;
+        }
+    }
+}
+
+void serial_irq() {
+    while (!(inb(COM1 + 2) & SERIAL_IIR_NONE)) {
+        serial_rx_drain();
+        serial_tx_fill();
+    }
+    irq_end();
+}
+
+void serial_irq_entry();
+asm(".pushsection .text\n"
+    ".global serial_irq_entry\n"
+    "serial_irq_entry:\n"
+    "    pusha\n"
+    "    cld\n"
+    "    call serial_irq\n"
+    "    popa\n"
+    "    iret\n"
+    ".popsection\n");
+
+// 115200 baud, 8 data bits, no parity, one stop bit, FIFOs on
+void serial_init() {
+    outb(COM1 + 1, 0x00);  // No interrupts
+    outb(COM1 + 3, 0x80);  // Divisor latch access
+    outb(COM1 + 0, 0x01);  // Divisor 1, low byte
+    outb(COM1 + 1, 0x00);  // High byte
+    outb(COM1 + 3, 0x03);  // 8N1
+    outb(COM1 + 2, 0xC7);  // Enable and clear the FIFOs, interrupt at 14 bytes
+    outb(COM1 + 4, 0x0B);  // DTR, RTS and OUT2, which passes the IRQ on
+    irq_set_handler(IRQ_COM1, serial_irq_entry);
+    irq_unmask(IRQ_COM1);
+    outb(COM1 + 1, 0x03);  // Interrupt on received data and on an empty FIFO
+}
+
+void serial_write(const void *data, uint32_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint32_t flags = irq_save();
+    for (uint32_t i = 0; i < size; i++) {
+        while (serial_tx.head - serial_tx.tail == SERIAL_RING_SIZE) serial_tx_fill();
+        serial_tx.data[serial_tx.head++ & SERIAL_RING_MASK] = bytes[i];
+    }
+    serial_tx_fill();
+    irq_restore(flags);
+}
+
+// Wait until everything written has left the UART
+void serial_flush() {
+    while (serial_tx.tail != serial_tx.head) {
+        uint32_t flags = irq_save();
+        serial_tx_fill();
+        irq_restore(flags);
+    }
+    while (!(inb(COM1 + 5) & SERIAL_LSR_IDLE)) {
+    }
+}
+
+// Next received byte, or -1 if none is waiting
+int serial_read_byte() {
+    uint32_t flags = irq_save();
+    serial_rx_drain();
+    int c = -1;
+    if (serial_rx.tail != serial_rx.head) c = serial_rx.data[serial_rx.tail++ & SERIAL_RING_MASK];
+    irq_restore(flags);
+    return c;
+}
+
+// End of Serial port
+
+// Block devices
+
+typedef struct BlockDevice {
+    const char *name;
+    uint32_t num_blocks;
+    int (*read)(struct BlockDevice *dev, uint32_t block, uint32_t count, void *buffer);
+    int (*write)(struct BlockDevice *dev, uint32_t block, uint32_t count, const void *buffer);
+    int (*flush)(struct BlockDevice *dev);
+    uint32_t last_block;  // Last block requested, for sequential access detection
+    uint32_t seq_run;     // Number of consecutive sequential requests
+    uint8_t *base;        // Memory holding the blocks of a memory disk
+} BlockDevice;
+
+void insw(uint16_t port, void *buffer, uint32_t count) {
+    asm volatile("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+void outsw(uint16_t port, const void *buffer, uint32_t count) {
+    asm volatile("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port));
+}
+
+// RAM disk backed by the static disk array
+int ramdisk_read(BlockDevice *dev, uint32_t block, uint32_t count, void *buffer) {
+    if (block + count > dev->num_blocks) return -1;
+    memcpy(buffer, &disk[block * BLOCK_SIZE], count * BLOCK_SIZE);
+    return 0;
+}
+
+int ramdisk_write(BlockDevice *dev, uint32_t block, uint32_t count, const void *buffer) {
+    if (block + count > dev->num_blocks) return -1;
+    memcpy(&disk[block * BLOCK_SIZE], buffer, count * BLOCK_SIZE);
+    return 0;
+}
+
+BlockDevice ramdisk = {"ram0", DATA_BLOCKS + 1, ramdisk_read, ramdisk_write, NULL, 0, 0, NULL};
+
+// Memory disks over disk images loaded as boot modules
+#define MAX_MEMDISKS 4
+
+int memdisk_read(BlockDevice *dev, uint32_t block, uint32_t count, void *buffer) {
+    if (block + count > dev->num_blocks) return -1;
+    memcpy(buffer, dev->base + block * BLOCK_SIZE, count * BLOCK_SIZE);
+    return 0;
+}
+
+int memdisk_write(BlockDevice *dev, uint32_t block, uint32_t count, const void *buffer) {
+    if (block + count > dev->num_blocks) return -1;
+    memcpy(dev->base + block * BLOCK_SIZE, buffer, count * BLOCK_SIZE);
+    return 0;
+}
+
+BlockDevice memdisks[MAX_MEMDISKS] = {
+    {"md0", 0, memdisk_read, memdisk_write, NULL, 0, 0, NULL},
+    {"md1", 0, memdisk_read, memdisk_write, NULL, 0, 0, NULL},
+    {"md2", 0, memdisk_read, memdisk_write, NULL, 0, 0, NULL},
+    {"md3", 0, memdisk_read, memdisk_write, NULL, 0, 0, NULL},
+};
+
+// Claim a memory disk for size bytes at image; NULL if none is left
+BlockDevice *memdisk_attach(const void *image, uint32_t size) {
+    for (int i = 0; i < MAX_MEMDISKS; i++) {
+        if (memdisks[i].num_blocks == 0) {
+            memdisks[i].base = (uint8_t *)image;
+            memdisks[i].num_blocks = size / BLOCK_SIZE;
+            return &memdisks[i];
+        }
+    }
+    return NULL;
+}
+
+// ATA PIO driver for the primary master drive
+#define ATA_DATA 0x1F0
+#define ATA_ERROR 0x1F1
+#define ATA_SECTOR_COUNT 0x1F2
+#define ATA_LBA_LOW 0x1F3
+#define ATA_LBA_MID 0x1F4
+#define ATA_LBA_HIGH 0x1F5
+#define ATA_DRIVE 0x1F6
+#define ATA_COMMAND 0x1F7
+#define ATA_STATUS 0x1F7
+
+#define ATA_SR_ERR 0x01
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_DF 0x20
+#define ATA_SR_BSY 0x80
+
+#define ATA_CMD_READ_SECTORS 0x20
+#define ATA_CMD_WRITE_SECTORS 0x30
+#define ATA_CMD_CACHE_FLUSH 0xE7
+#define ATA_CMD_IDENTIFY 0xEC
+
+#define ATA_MAX_TRANSFER 128  // Sectors per command
+
+int ata_wait(int need_drq) {
+    for (int i = 0; i < 1000000; i++) {
+        uint8_t status = inb(ATA_STATUS);
+        if (status & ATA_SR_BSY) continue;
+        if (status & (ATA_SR_ERR | ATA_SR_DF)) return -1;
+        if (!need_drq || (status & ATA_SR_DRQ)) return 0;
+    }
+    return -1;  // Timed out
+}
+
+void ata_select(uint32_t lba, uint32_t count) {
+    outb(ATA_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(ATA_SECTOR_COUNT, (uint8_t)count);
+    outb(ATA_LBA_LOW, (uint8_t)lba);
+    outb(ATA_LBA_MID, (uint8_t)(lba >> 8));
+    outb(ATA_LBA_HIGH, (uint8_t)(lba >> 16));
+}
+
+int ata_read(BlockDevice *dev, uint32_t block, uint32_t count, void *buffer) {
+    uint8_t *ptr = (uint8_t *)buffer;
+    if (block + count > dev->num_blocks) return -1;
+
+    while (count > 0) {
+        uint32_t n = count > ATA_MAX_TRANSFER ? ATA_MAX_TRANSFER : count;
+        if (ata_wait(0) != 0) return -1;
+        ata_select(block, n);
+        outb(ATA_COMMAND, ATA_CMD_READ_SECTORS);
+        for (uint32_t i = 0; i < n; i++) {
+            if (ata_wait(1) != 0) return -1;
+            insw(ATA_DATA, ptr, BLOCK_SIZE / 2);
+            ptr += BLOCK_SIZE;
+        }
+        block += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int ata_write(BlockDevice *dev, uint32_t block, uint32_t count, const void *buffer) {
+    const uint8_t *ptr = (const uint8_t *)buffer;
+    if (block + count > dev->num_blocks) return -1;
+
+    while (count > 0) {
+        uint32_t n = count > ATA_MAX_TRANSFER ? ATA_MAX_TRANSFER : count;
+        if (ata_wait(0) != 0) return -1;
+        ata_select(block, n);
+        outb(ATA_COMMAND, ATA_CMD_WRITE_SECTORS);
+        for (uint32_t i = 0; i < n; i++) {
+            if (ata_wait(1) != 0) return -1;
+            outsw(ATA_DATA, ptr, BLOCK_SIZE / 2);
+            ptr += BLOCK_SIZE;
+        }
+        block += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int ata_flush(BlockDevice *dev) {
+    if (ata_wait(0) != 0) return -1;
+    outb(ATA_DRIVE, 0xE0);
+    outb(ATA_COMMAND, ATA_CMD_CACHE_FLUSH);
+    return ata_wait(0);
+}
+
+BlockDevice ata_disk = {"hda", 0, ata_read, ata_write, ata_flush, 0, 0, NULL};
+
+// Probe the primary master with IDENTIFY; returns 0 if an ATA disk is present
+int ata_init() {
+    uint16_t identify[256];
+
+    if (inb(ATA_STATUS) == 0xFF) return -1;  // Floating bus, no controller
+
+    outb(ATA_DRIVE, 0xA0);
+    io_wait();
+    outb(ATA_SECTOR_COUNT, 0);
+    outb(ATA_LBA_LOW, 0);
+    outb(ATA_LBA_MID, 0);
+    outb(ATA_LBA_HIGH, 0);
+    outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+
+    if (inb(ATA_STATUS) == 0) return -1;  // No drive
+
+    for (int i = 0; i < 1000000 && (inb(ATA_STATUS) & ATA_SR_BSY); i++) {
+    }
+    if (inb(ATA_LBA_MID) != 0 || inb(ATA_LBA_HIGH) != 0) return -1;  // ATAPI or SATA
+    if (ata_wait(1) != 0) return -1;
+
+    insw(ATA_DATA, identify, 256);
+    ata_disk.num_blocks = identify[60] | ((uint32_t)identify[61] << 16);
+    return ata_disk.num_blocks ? 0 : -1;
+}
+
+// End of Block devices
+
+// Buffer cache
+//
+// Sits between the filesystem and block devices. Buffers are looked up by
+// (device, block) through a hash table and kept on an LRU list; eviction
+// takes the least recently used unpinned buffer. Writes are write-back:
+// dirty buffers reach the device on eviction, on `sync`, and periodically
+// from bcache_tick(). Sequential misses trigger a multi-block read-ahead.
+
+#define BCACHE_BUFFERS 64
+#define BCACHE_HASH_SIZE 128
+#define BCACHE_READAHEAD 8         // Max blocks fetched by one read-ahead
+#define BCACHE_FLUSH_INTERVAL 16  // Ticks (shell commands) between periodic flushes
+
+#define BUF_VALID 1
+#define BUF_DIRTY 2
+
+typedef struct Buffer {
+    BlockDevice *dev;
+    uint32_t block;
+    int flags;
+    int refcount;
+    struct Buffer *hash_next;
+    struct Buffer *lru_prev;
+    struct Buffer *lru_next;
+    uint8_t data[BLOCK_SIZE];
+} Buffer;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t readahead;
+    uint32_t writebacks;
+} BufferCacheStats;
+
+Buffer bcache_buffers[BCACHE_BUFFERS];
+Buffer *bcache_hash[BCACHE_HASH_SIZE];
+Buffer *bcache_lru_head = NULL;  // Most recently used
+Buffer *bcache_lru_tail = NULL;  // Least recently used
+BufferCacheStats bcache_stats;
+uint32_t bcache_dirty = 0;
+uint32_t bcache_ticks = 0;
+uint8_t bcache_staging[BCACHE_READAHEAD * BLOCK_SIZE];
+
+uint32_t bcache_hash_index(BlockDevice *dev, uint32_t block) {
+    return (((uint32_t)dev >> 4) ^ (block * 2654435761u)) % BCACHE_HASH_SIZE;
+}
+
+void bcache_lru_unlink(Buffer *buf) {
+    if (buf->lru_prev) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else {
+        bcache_lru_head = buf->lru_next;
+    }
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        bcache_lru_tail = buf->lru_prev;
+    }
+    buf->lru_prev = buf->lru_next = NULL;
+}
+
+void bcache_lru_push_front(Buffer *buf) {
+    buf->lru_prev = NULL;
+    buf->lru_next = bcache_lru_head;
+    if (bcache_lru_head) {
+        bcache_lru_head->lru_prev = buf;
+    } else {
+        bcache_lru_tail = buf;
+    }
+    bcache_lru_head = buf;
+}
+
+void bcache_hash_remove(Buffer *buf) {
+    Buffer **link = &bcache_hash[bcache_hash_index(buf->dev, buf->block)];
+    while (*link) {
+        if (*link == buf) {
+            *link = buf->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    buf->hash_next = NULL;
+}
+
+void bcache_hash_insert(Buffer *buf) {
+    uint32_t index = bcache_hash_index(buf->dev, buf->block);
+    buf->hash_next = bcache_hash[index];
+    bcache_hash[index] = buf;
+}
+
+void bcache_init() {
+    memset(bcache_buffers, 0, sizeof(bcache_buffers));
+    memset(bcache_hash, 0, sizeof(bcache_hash));
+    memset(&bcache_stats, 0, sizeof(bcache_stats));
+    bcache_lru_head = bcache_lru_tail = NULL;
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        bcache_lru_push_front(&bcache_buffers[i]);
+    }
+    bcache_dirty = 0;
+    bcache_ticks = 0;
+}
+
+Buffer *bcache_lookup(BlockDevice *dev, uint32_t block) {
+    Buffer *buf = bcache_hash[bcache_hash_index(dev, block)];
+    while (buf) {
+        if (buf->dev == dev && buf->block == block && (buf->flags & BUF_VALID)) {
+            return buf;
+        }
+        buf = buf->hash_next;
+    }
+    return NULL;
+}
+
+int bcache_writeback(Buffer *buf) {
+    if (!(buf->flags & BUF_DIRTY)) return 0;
+    if (buf->dev->write(buf->dev, buf->block, 1, buf->data) != 0) return -1;
+    buf->flags &= ~BUF_DIRTY;
+    bcache_dirty--;
+    bcache_stats.writebacks++;
+    return 0;
+}
+
+// Take the least recently used unpinned buffer, writing it back if dirty
+Buffer *bcache_evict() {
+    for (Buffer *buf = bcache_lru_tail; buf; buf = buf->lru_prev) {
+        if (buf->refcount > 0) continue;
+        if (bcache_writeback(buf) != 0) continue;
+        if (buf->flags & BUF_VALID) {
+            bcache_hash_remove(buf);
+        }
+        buf->flags = 0;
+        buf->dev = NULL;
+        return buf;
+    }
+    return NULL;  // Everything is pinned
+}
+
+// Load blocks [block, block + count) into fresh buffers with one device transfer.
+// The first buffer is returned pinned; the rest are read-ahead.
+Buffer *bcache_fill(BlockDevice *dev, uint32_t block, uint32_t count) {
+    if (dev->read(dev, block, count, bcache_staging) != 0) return NULL;
+
+    Buffer *first = NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        Buffer *buf = bcache_evict();
+        if (!buf) break;
+        buf->dev = dev;
+        buf->block = block + i;
+        buf->flags = BUF_VALID;
+        memcpy(buf->data, &bcache_staging[i * BLOCK_SIZE], BLOCK_SIZE);
+        bcache_hash_insert(buf);
+        bcache_lru_unlink(buf);
+        bcache_lru_push_front(buf);
+        if (i == 0) {
+            buf->refcount = 1;  // Pin so read-ahead cannot evict it
+            first = buf;
+        } else {
+            bcache_stats.readahead++;
+        }
+    }
+    return first;
+}
+
+// Get a pinned buffer holding the given block; release it with brelse()
+Buffer *bread(BlockDevice *dev, uint32_t block) {
+    if (block >= dev->num_blocks) return NULL;
+
+    // Sequential access detection
+    if (block == dev->last_block + 1) {
+        dev->seq_run++;
+    } else if (block != dev->last_block) {
+        dev->seq_run = 0;
+    }
+    dev->last_block = block;
+
+    Buffer *buf = bcache_lookup(dev, block);
+    if (buf) {
+        bcache_stats.hits++;
+        buf->refcount++;
+        bcache_lru_unlink(buf);
+        bcache_lru_push_front(buf);
+        return buf;
+    }
+    bcache_stats.misses++;
+
+    // On a sequential stream, read ahead up to the next cached block
+    uint32_t count = 1;
+    if (dev->seq_run > 0) {
+        while (count < BCACHE_READAHEAD && block + count < dev->num_blocks &&
+               !bcache_lookup(dev, block + count)) {
+            count++;
+        }
+    }
+    return bcache_fill(dev, block, count);
+}
+
+void brelse(Buffer *buf) {
+    if (buf && buf->refcount > 0) {
+        buf->refcount--;
+    }
+}
+
+void bdirty(Buffer *buf) {
+    if (!(buf->flags & BUF_DIRTY)) {
+        buf->flags |= BUF_DIRTY;
+        bcache_dirty++;
+    }
+}
+
+// Copy size bytes at offset within one block, which must not be crossed
+int bcache_read_block(BlockDevice *dev, uint32_t block, uint32_t offset, void *buffer,
+                      uint32_t size) {
+    Buffer *buf = bread(dev, block);
+    if (!buf) return -1;
+    memcpy(buffer, &buf->data[offset], size);
+    brelse(buf);
+    return 0;
+}
+
+int bcache_write_block(BlockDevice *dev, uint32_t block, uint32_t offset, const void *buffer,
+                       uint32_t size) {
+    Buffer *buf;
+    if (size == BLOCK_SIZE && !bcache_lookup(dev, block)) {
+        // Whole-block overwrite: no need to read the old contents
+        if (block >= dev->num_blocks) return -1;
+        buf = bcache_evict();
+        if (!buf) return -1;
+        buf->dev = dev;
+        buf->block = block;
+        buf->flags = BUF_VALID;
+        buf->refcount = 1;
+        bcache_hash_insert(buf);
+        bcache_lru_unlink(buf);
+        bcache_lru_push_front(buf);
+    } else {
+        buf = bread(dev, block);
+        if (!buf) return -1;
+    }
+    memcpy(&buf->data[offset], buffer, size);
+    bdirty(buf);
+    brelse(buf);
+    return 0;
+}
+
+// Byte-granular helpers on top of the block helpers
+int bcache_read_bytes(BlockDevice *dev, uint32_t offset, void *buffer, uint32_t size) {
+    uint8_t *dst = (uint8_t *)buffer;
+    while (size > 0) {
+        uint32_t block_offset = offset % BLOCK_SIZE;
+        uint32_t n = BLOCK_SIZE - block_offset;
+        if (n > size) n = size;
+
+        if (bcache_read_block(dev, offset / BLOCK_SIZE, block_offset, dst, n) != 0) return -1;
+        dst += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int bcache_write_bytes(BlockDevice *dev, uint32_t offset, const void *buffer, uint32_t size) {
+    const uint8_t *src = (const uint8_t *)buffer;
+    while (size > 0) {
+        uint32_t block_offset = offset % BLOCK_SIZE;
+        uint32_t n = BLOCK_SIZE - block_offset;
+        if (n > size) n = size;
+
+        if (bcache_write_block(dev, offset / BLOCK_SIZE, block_offset, src, n) != 0) return -1;
+        src += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Write back every dirty buffer, coalescing runs of consecutive blocks
+int bcache_sync() {
+    Buffer *dirty[BCACHE_BUFFERS];
+    int count = 0;
+    int errors = 0;
+
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        if (bcache_buffers[i].flags & BUF_DIRTY) {
+            dirty[count++] = &bcache_buffers[i];
+        }
+    }
+
+    // Insertion sort by (device, block)
+    for (int i = 1; i < count; i++) {
+        Buffer *buf = dirty[i];
+        int j = i - 1;
+        while (j >= 0 && (dirty[j]->dev > buf->dev ||
+                          (dirty[j]->dev == buf->dev && dirty[j]->block > buf->block))) {
+            dirty[j + 1] = dirty[j];
+            j--;
+        }
+        dirty[j + 1] = buf;
+    }
+
+    int i = 0;
+    while (i < count) {
+        int run = 1;
+        while (i + run < count && run < BCACHE_READAHEAD && dirty[i + run]->dev == dirty[i]->dev &&
+               dirty[i + run]->block == dirty[i]->block + run) {
+            run++;
+        }
+        for (int j = 0; j < run; j++) {
+            memcpy(&bcache_staging[j * BLOCK_SIZE], dirty[i + j]->data, BLOCK_SIZE);
+        }
+        if (dirty[i]->dev->write(dirty[i]->dev, dirty[i]->block, run, bcache_staging) == 0) {
+            for (int j = 0; j < run; j++) {
+                dirty[i + j]->flags &= ~BUF_DIRTY;
+                bcache_dirty--;
+                bcache_stats.writebacks++;
+            }
+        } else {
+            errors++;
+        }
+        i += run;
+    }
+
+    if (ata_disk.num_blocks && ata_disk.flush) {
+        ata_disk.flush(&ata_disk);
+    }
+    return errors ? -1 : 0;
+}
+
+// Forget every block of dev, dirty or not, before the device goes away and its
+// slot is reused for another one
+void bcache_invalidate(BlockDevice *dev) {
+    for (int i = 0; i < BCACHE_BUFFERS; i++) {
+        Buffer *buf = &bcache_buffers[i];
+        if (buf->dev != dev || !(buf->flags & BUF_VALID)) continue;
+        if (buf->flags & BUF_DIRTY) bcache_dirty--;
+        bcache_hash_remove(buf);
+        buf->flags = 0;
+        buf->dev = NULL;
+    }
+}
+
+// Periodic write-back, called once per shell command
+void bcache_tick() {
+    bcache_ticks++;
+    if (bcache_dirty > 0 &&
+        (bcache_ticks % BCACHE_FLUSH_INTERVAL == 0 || bcache_dirty > BCACHE_BUFFERS / 2)) {
+        bcache_sync();
+    }
+}
+
+void bcstat() {
+    uint32_t lookups = bcache_stats.hits + bcache_stats.misses;
+
+    print_colored("Buffer cache:\n", make_color(LIGHT_CYAN, BLACK));
+    print("  Buffers:    ");
+    print_uint(BCACHE_BUFFERS);
+    print(" x ");
+    print_uint(BLOCK_SIZE);
+    print(" bytes\n  Hits:       ");
+    print_uint(bcache_stats.hits);
+    print("\n  Misses:     ");
+    print_uint(bcache_stats.misses);
+    print("\n  Hit rate:   ");
+    print_uint(lookups ? bcache_stats.hits * 100 / lookups : 0);
+    print("%\n  Read-ahead: ");
+    print_uint(bcache_stats.readahead);
+    print(" blocks\n  Writebacks: ");
+    print_uint(bcache_stats.writebacks);
+    print("\n  Dirty:      ");
+    print_uint(bcache_dirty);
+    print("\n");
+
+    print("Devices: ");
+    print(ramdisk.name);
+    print(" (");
+    print_uint(ramdisk.num_blocks);
+    print(" blocks)");
+    if (ata_disk.num_blocks) {
+        print(", ");
+        print(ata_disk.name);
+        print(" (");
+        print_uint(ata_disk.num_blocks);
+        print(" blocks)");
+    }
+    for (int i = 0; i < MAX_MEMDISKS; i++) {
+        if (memdisks[i].num_blocks) {
+            print(", ");
+            print(memdisks[i].name);
+            print(" (");
+            print_uint(memdisks[i].num_blocks);
+            print(" blocks)");
+        }
+    }
+    print("\n");
+}
+COMMAND(bcstat, bcstat, "Buffer cache statistics");
+
+void sync() {
+    if (bcache_sync() == 0) {
+        print("Buffers flushed.\n");
+    } else {
+        print("Error: Failed to write back some buffers\n");
+    }
+}
+COMMAND(sync, sync, "Flush disk buffers");
+
+// End of Buffer cache
+
+// FAT
+//
+// FAT12, FAT16 and FAT32 volumes are mounted into the directory tree. A
+// directory is read from disk the first time it is entered and is kept as an
+// ordinary Directory, so ls, cd, cat and the rest work unchanged across the
+// mount point. File content stays on disk. FAT sectors are held in a small
+// cache of their own, and every file remembers a few runs of consecutive
+// clusters so that sequential access rarely follows the chain. Reads of
+// whole sectors bypass the buffer cache and fetch as many consecutive
+// clusters as possible per device request. Mounted volumes are not covered
+// by snapshots.
+
+#define FAT_MAX_VOLUMES 4
+#define FAT_CACHE_SECTORS 16
+#define FAT_RUNS 6
+#define FAT_EOC 0x0FFFFFFF      // End of chain, as fat_get reports it for every FAT type
+#define FAT_UNKNOWN 0xFFFFFFFF  // Chain length not counted yet
+
+#define FAT_DELETED 0xE5
+#define FAT_ATTR_READONLY 0x01
+#define FAT_ATTR_VOLUME 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define FAT_ATTR_LFN 0x0F  // Long name slot
+#define FAT_NT_LOWER_BASE 0x08
+#define FAT_NT_LOWER_EXT 0x10
+#define FAT_LFN_LAST 0x40      // In the order byte of the first slot of a long name
+#define FAT_LFN_CHECKSUM 13    // Offset of the short name checksum in a long name slot
+#define FAT_LFN_CHARS 13       // UCS-2 characters per long name slot
+#define FAT_LFN_MAX_SLOTS 20
+
+typedef struct __attribute__((packed)) {
+    uint8_t name[11];  // 8.3, space padded
+    uint8_t attr;
+    uint8_t nt_flags;  // Case of the base name and extension
+    uint8_t create_tenths;
+    uint16_t create_time;
+    uint16_t create_date;
+    uint16_t access_date;
+    uint16_t cluster_high;  // FAT32 only
+    uint16_t write_time;
+    uint16_t write_date;
+    uint16_t cluster_low;
+    uint32_t size;
+} FatDirent;
+
+typedef struct {
+    uint32_t index;    // Position of the first cluster in the chain
+    uint32_t cluster;  // Where it is on disk
+    uint32_t length;   // Consecutive clusters from there
+} FatRun;
+
+typedef struct FatNode {
+    struct FatVolume *vol;
+    uint32_t first_cluster;  // 0 for empty files and the FAT12/16 root
+    uint32_t chain_length;   // Clusters in the chain, or FAT_UNKNOWN
+    uint32_t dirent_sector;  // Of the short entry; 0 for the root, which has none
+    uint32_t dirent_offset;
+    uint32_t dirent_index;  // Slot of the short entry in the parent directory
+    uint32_t lfn_slots;     // Long name slots right before it
+    uint32_t num_runs;
+    FatRun runs[FAT_RUNS];  // Consecutive pieces of the chain, in chain order
+} FatNode;
+
+typedef struct {
+    uint32_t sector;     // Index into the first FAT
+    uint32_t last_used;  // 0 while the slot is empty
+    uint8_t data[BLOCK_SIZE];
+} FatCacheSlot;
+
+typedef struct FatVolume {
+    BlockDevice *dev;
+    int type;  // 12, 16 or 32
+    uint32_t sectors_per_cluster;
+    uint32_t cluster_bytes;
+    uint32_t fat_start;  // Device sector of the first FAT
+    uint32_t fat_sectors;
+    uint32_t num_fats;
+    uint32_t root_start;  // Device sector of the FAT12/16 root directory
+    uint32_t root_entries;
+    uint32_t data_start;  // Device sector of cluster 2
+    uint32_t num_clusters;
+    uint32_t next_free;      // Where the search for a free cluster resumes
+    uint32_t fsinfo_sector;  // FAT32 free space hints, 0 if absent
+    Directory *mount;
+    FatNode root;
+    FatCacheSlot cache[FAT_CACHE_SECTORS];
+    uint32_t cache_clock;
+} FatVolume;
+
+FatVolume *fat_volumes[FAT_MAX_VOLUMES];
+uint8_t fat_zero[BLOCK_SIZE];
+
+// Offsets of the characters in a long name slot
+const uint8_t fat_lfn_offsets[FAT_LFN_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+void print_relative_path(Directory *dir, Directory *root, const char *leaf);
+char *strchr(const char *str, int c);
+
+uint32_t fat_u16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+uint32_t fat_u32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+uint32_t fat_cluster_sector(FatVolume *vol, uint32_t cluster) {
+    return vol->data_start + (cluster - 2) * vol->sectors_per_cluster;
+}
+
+// Nonzero if sector looks like the boot sector of a FAT volume
+int fat_boot_sector_valid(const uint8_t *sector) {
+    uint32_t per_cluster = sector[13];
+    return sector[510] == 0x55 && sector[511] == 0xAA && fat_u16(sector + 11) == BLOCK_SIZE &&
+           per_cluster != 0 && (per_cluster & (per_cluster - 1)) == 0 &&
+           fat_u16(sector + 14) != 0 && sector[16] != 0 &&
+           (fat_u16(sector + 22) != 0 || fat_u32(sector + 36) != 0);
+}
+
+// Fill in the layout of vol from the boot sector at start; -1 if it is not FAT
+int fat_parse_boot(FatVolume *vol, const uint8_t *boot, uint32_t start) {
+    if (!fat_boot_sector_valid(boot)) {
+        return -1;
+    }
+
+    uint32_t reserved = fat_u16(boot + 14);
+    uint32_t total = fat_u16(boot + 19) ? fat_u16(boot + 19) : fat_u32(boot + 32);
+    vol->sectors_per_cluster = boot[13];
+    vol->cluster_bytes = vol->sectors_per_cluster * BLOCK_SIZE;
+    vol->num_fats = boot[16];
+    vol->root_entries = fat_u16(boot + 17);
+    vol->fat_sectors = fat_u16(boot + 22) ? fat_u16(boot + 22) : fat_u32(boot + 36);
+
+    uint32_t root_sectors = (vol->root_entries * sizeof(FatDirent) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t meta = reserved + vol->num_fats * vol->fat_sectors + root_sectors;
+    if (total <= meta || start + total > vol->dev->num_blocks) {
+        return -1;
+    }
+    vol->num_clusters = (total - meta) / vol->sectors_per_cluster;
+    vol->type = vol->num_clusters < 4085 ? 12 : vol->num_clusters < 65525 ? 16 : 32;
+
+    // The FAT must have an entry for every cluster
+    uint32_t fat_bytes = vol->type == 12 ? (vol->num_clusters + 2) * 3 / 2 + 1
+                                         : (vol->num_clusters + 2) * (vol->type / 8);
+    if (fat_bytes > vol->fat_sectors * BLOCK_SIZE || (vol->type == 32) != (root_sectors == 0)) {
+        return -1;
+    }
+
+    vol->fat_start = start + reserved;
+    vol->root_start = vol->fat_start + vol->num_fats * vol->fat_sectors;
+    vol->data_start = vol->root_start + root_sectors;
+    vol->next_free = 2;
+    vol->root.vol = vol;
+    vol->root.chain_length = FAT_UNKNOWN;
+    if (vol->type == 32) {
+        vol->root.first_cluster = fat_u32(boot + 44);
+        uint32_t fsinfo = fat_u16(boot + 48);
+        if (fsinfo != 0 && fsinfo < reserved) {
+            vol->fsinfo_sector = start + fsinfo;
+        }
+    }
+    return 0;
+}
+
+// Byte at offset within the first FAT, read through the FAT cache
+uint8_t *fat_byte(FatVolume *vol, uint32_t offset) {
+    uint32_t sector = offset / BLOCK_SIZE;
+    FatCacheSlot *victim = &vol->cache[0];
+    for (int i = 0; i < FAT_CACHE_SECTORS; i++) {
+        FatCacheSlot *slot = &vol->cache[i];
+        if (slot->last_used != 0 && slot->sector == sector) {
+            slot->last_used = ++vol->cache_clock;
+            return &slot->data[offset % BLOCK_SIZE];
+        }
+        if (slot->last_used < victim->last_used) {
+            victim = slot;
+        }
+    }
+
+    victim->last_used = 0;
+    if (bcache_read_block(vol->dev, vol->fat_start + sector, 0, victim->data, BLOCK_SIZE) != 0) {
+        return NULL;
+    }
+    victim->sector = sector;
+    victim->last_used = ++vol->cache_clock;
+    return &victim->data[offset % BLOCK_SIZE];
+}
+
+uint32_t fat_offset(FatVolume *vol, uint32_t cluster) {
+    return vol->type == 12 ? cluster + cluster / 2 : cluster * (vol->type / 8);
+}
+
+// FAT entry for cluster, with every kind of end-of-chain reported as FAT_EOC
+uint32_t fat_get(FatVolume *vol, uint32_t cluster) {
+    uint32_t offset = fat_offset(vol, cluster);
+    uint8_t *p = fat_byte(vol, offset);
+    if (p == NULL) {
+        return FAT_EOC;
+    }
+
+    uint32_t value;
+    if (vol->type == 32) {
+        value = fat_u32(p) & 0x0FFFFFFF;
+        return value >= 0x0FFFFFF8 ? FAT_EOC : value;
+    }
+    if (vol->type == 16) {
+        value = fat_u16(p);
+        return value >= 0xFFF8 ? FAT_EOC : value;
+    }
+
+    // FAT12 entries take a byte and a half and may straddle two sectors
+    value = *p;
+    p = fat_byte(vol, offset + 1);
+    if (p == NULL) {
+        return FAT_EOC;
+    }
+    value |= *p << 8;
+    value = cluster & 1 ? value >> 4 : value & 0xFFF;
+    return value >= 0xFF8 ? FAT_EOC : value;
+}
+
+// Set the FAT entry for cluster in the cache and in every copy of the FAT
+int fat_set(FatVolume *vol, uint32_t cluster, uint32_t value) {
+    uint32_t offset = fat_offset(vol, cluster);
+    uint32_t size = vol->type == 32 ? 4 : 2;
+    uint8_t bytes[4] = {0, 0, 0, 0};
+    for (uint32_t i = 0; i < size; i++) {
+        uint8_t *p = fat_byte(vol, offset + i);
+        if (p == NULL) return -1;
+        bytes[i] = *p;
+    }
+
+    uint32_t old = fat_u32(bytes);
+    uint32_t entry;
+    if (vol->type == 12) {
+        entry = cluster & 1 ? (old & 0x000F) | (value & 0xFFF) << 4
+                            : (old & 0xF000) | (value & 0xFFF);
+    } else if (vol->type == 16) {
+        entry = value & 0xFFFF;
+    } else {
+        entry = (old & 0xF0000000) | (value & 0x0FFFFFFF);  // The top bits are reserved
+    }
+
+    for (uint32_t i = 0; i < size; i++) {
+        bytes[i] = entry >> (8 * i);
+        *fat_byte(vol, offset + i) = bytes[i];  // Still cached from the loop above
+    }
+    for (uint32_t i = 0; i < size;) {
+        uint32_t sector_offset = (offset + i) % BLOCK_SIZE;
+        uint32_t n = BLOCK_SIZE - sector_offset;
+        if (n > size - i) n = size - i;
+        for (uint32_t copy = 0; copy < vol->num_fats; copy++) {
+            uint32_t sector = vol->fat_start + copy * vol->fat_sectors + (offset + i) / BLOCK_SIZE;
+            if (bcache_write_block(vol->dev, sector, sector_offset, bytes + i, n) != 0) return -1;
+        }
+        i += n;
+    }
+    return 0;
+}
+
+// Cluster after cluster in its chain, or 0 at the end
+uint32_t fat_next(FatVolume *vol, uint32_t cluster) {
+    uint32_t next = fat_get(vol, cluster);
+    return next >= 2 && next < vol->num_clusters + 2 ? next : 0;
+}
+
+// The FAT32 free cluster count and hint go stale once clusters change hands
+void fat_fsinfo_invalidate(FatVolume *vol) {
+    if (vol->fsinfo_sector != 0) {
+        uint8_t unknown[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        bcache_write_block(vol->dev, vol->fsinfo_sector, 488, unknown, sizeof(unknown));
+        vol->fsinfo_sector = 0;
+    }
+}
+
+// Take a free cluster and mark it as the end of a chain; 0 if the volume is full
+uint32_t fat_alloc(FatVolume *vol) {
+    for (uint32_t i = 0; i < vol->num_clusters; i++) {
+        uint32_t cluster = vol->next_free++;
+        if (vol->next_free >= vol->num_clusters + 2) {
+            vol->next_free = 2;
+        }
+        if (fat_get(vol, cluster) == 0) {
+            fat_fsinfo_invalidate(vol);
+            return fat_set(vol, cluster, FAT_EOC) == 0 ? cluster : 0;
+        }
+    }
+    return 0;
+}
+
+void fat_free_chain(FatVolume *vol, uint32_t cluster) {
+    if (cluster != 0) {
+        fat_fsinfo_invalidate(vol);
+    }
+    for (uint32_t n = 0; cluster != 0 && n < vol->num_clusters; n++) {
+        uint32_t next = fat_next(vol, cluster);
+        if (fat_set(vol, cluster, 0) != 0) return;
+        cluster = next;
+    }
+}
+
+// Disk cluster at position index of the chain of node, or 0 past its end.
+// *contiguous is set to how many clusters from there follow each other on
+// disk, looking at most count clusters ahead.
+uint32_t fat_map(FatNode *node, uint32_t index, uint32_t count, uint32_t *contiguous) {
+    FatVolume *vol = node->vol;
+    if (node->num_runs > 0 && index < node->runs[0].index) {
+        node->num_runs = 0;  // Before the runs held; start over from the head
+    }
+    if (node->num_runs == 0) {
+        if (node->first_cluster == 0) {
+            return 0;
+        }
+        node->runs[0].index = 0;
+        node->runs[0].cluster = node->first_cluster;
+        node->runs[0].length = 1;
+        node->num_runs = 1;
+    }
+
+    // Follow the chain from the end of the last run up to the last cluster wanted
+    uint32_t target = index + count - 1;
+    FatRun *run = &node->runs[node->num_runs - 1];
+    while (run->index + run->length <= target) {
+        uint32_t last = run->cluster + run->length - 1;
+        uint32_t next = fat_next(vol, last);
+        if (next == 0) {
+            break;  // End of the chain
+        }
+        if (next == last + 1) {
+            run->length++;
+            continue;
+        }
+
+        uint32_t next_index = run->index + run->length;
+        if (node->num_runs == FAT_RUNS) {
+            if (node->runs[0].index + node->runs[0].length > index) {
+                break;  // The oldest run holds index; keep it
+            }
+            for (int i = 1; i < FAT_RUNS; i++) {
+                node->runs[i - 1] = node->runs[i];
+            }
+            node->num_runs--;
+        }
+        run = &node->runs[node->num_runs++];
+        run->index = next_index;
+        run->cluster = next;
+        run->length = 1;
+    }
+
+    for (int i = node->num_runs - 1; i >= 0; i--) {
+        run = &node->runs[i];
+        if (index >= run->index) {
+            if (index >= run->index + run->length) {
+                return 0;
+            }
+            uint32_t avail = run->index + run->length - index;
+            *contiguous = avail < count ? avail : count;
+            return run->cluster + (index - run->index);
+        }
+    }
+    return 0;
+}
+
+uint32_t fat_chain_length(FatNode *node) {
+    if (node->chain_length == FAT_UNKNOWN) {
+        uint32_t length = 0;
+        for (uint32_t cluster = node->first_cluster; cluster != 0 &&
+             length <= node->vol->num_clusters; cluster = fat_next(node->vol, cluster)) {
+            length++;
+        }
+        node->chain_length = length;
+    }
+    return node->chain_length;
+}
+
+// Grow the chain of node to count clusters
+int fat_extend(FatNode *node, uint32_t count) {
+    FatVolume *vol = node->vol;
+    uint32_t have = fat_chain_length(node);
+    uint32_t contiguous;
+    uint32_t last = have ? fat_map(node, have - 1, 1, &contiguous) : 0;
+    while (have < count) {
+        uint32_t cluster = fat_alloc(vol);
+        if (cluster == 0) {
+            return -1;  // Volume full
+        }
+        if (last != 0) {
+            if (fat_set(vol, last, cluster) != 0) return -1;
+        } else {
+            node->first_cluster = cluster;
+        }
+
+        // Keep the runs current when they reach the end of the chain
+        FatRun *run = node->num_runs ? &node->runs[node->num_runs - 1] : NULL;
+        if (run != NULL && run->index + run->length == have) {
+            if (run->cluster + run->length == cluster) {
+                run->length++;
+            } else if (node->num_runs < FAT_RUNS) {
+                run++;
+                run->index = have;
+                run->cluster = cluster;
+                run->length = 1;
+                node->num_runs++;
+            }
+        }
+        last = cluster;
+        node->chain_length = ++have;
+    }
+    return 0;
+}
+
+int fat_zero_cluster(FatVolume *vol, uint32_t cluster) {
+    uint32_t sector = fat_cluster_sector(vol, cluster);
+    for (uint32_t i = 0; i < vol->sectors_per_cluster; i++) {
+        if (bcache_write_block(vol->dev, sector + i, 0, fat_zero, BLOCK_SIZE) != 0) return -1;
+    }
+    return 0;
+}
+
+// Device sector holding slot index of directory dir, or 0 past its end
+uint32_t fat_slot_sector(FatNode *dir, uint32_t index) {
+    FatVolume *vol = dir->vol;
+    uint32_t offset = index * sizeof(FatDirent);
+    if (dir->first_cluster == 0) {  // Fixed-size FAT12/16 root
+        return index < vol->root_entries ? vol->root_start + offset / BLOCK_SIZE : 0;
+    }
+    uint32_t contiguous;
+    uint32_t cluster = fat_map(dir, offset / vol->cluster_bytes, 1, &contiguous);
+    if (cluster == 0) {
+        return 0;
+    }
+    return fat_cluster_sector(vol, cluster) + offset % vol->cluster_bytes / BLOCK_SIZE;
+}
+
+int fat_read_slot(FatNode *dir, uint32_t index, FatDirent *dirent) {
+    uint32_t sector = fat_slot_sector(dir, index);
+    if (sector == 0) {
+        return -1;
+    }
+    return bcache_read_block(dir->vol->dev, sector, index * sizeof(FatDirent) % BLOCK_SIZE, dirent,
+                             sizeof(FatDirent));
+}
+
+int fat_write_slot(FatNode *dir, uint32_t index, const FatDirent *dirent) {
+    uint32_t sector = fat_slot_sector(dir, index);
+    if (sector == 0) {
+        return -1;
+    }
+    return bcache_write_block(dir->vol->dev, sector, index * sizeof(FatDirent) % BLOCK_SIZE,
+                              dirent, sizeof(FatDirent));
+}
+
+// Store the first cluster and size of node in its short entry
+int fat_write_dirent(FatNode *node, uint32_t size) {
+    if (node->dirent_sector == 0) {
+        return 0;
+    }
+    FatDirent dirent;
+    BlockDevice *dev = node->vol->dev;
+    if (bcache_read_block(dev, node->dirent_sector, node->dirent_offset, &dirent,
+                          sizeof(dirent)) != 0) {
+        return -1;
+    }
+    dirent.cluster_high = node->vol->type == 32 ? node->first_cluster >> 16 : 0;
+    dirent.cluster_low = node->first_cluster;
+    dirent.size = (dirent.attr & FAT_ATTR_DIRECTORY) ? 0 : size;
+    return bcache_write_block(dev, node->dirent_sector, node->dirent_offset, &dirent,
+                              sizeof(dirent));
+}
+
+uint8_t fat_lfn_checksum(const uint8_t *name) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+    }
+    return sum;
+}
+
+// Printable name of a short entry, lowercased as its NT flags ask
+void fat_short_to_name(const FatDirent *dirent, char *out) {
+    int len = 0;
+    for (int i = 0; i < 11; i++) {
+        char c = dirent->name[i];
+        if (i == 0 && (uint8_t)c == 0x05) {
+            c = (char)FAT_DELETED;  // A name that really starts with 0xE5
+        }
+        if (c == ' ') {
+            if (i < 8) i = 7;  // Skip the padding of the base name
+            continue;
+        }
+        if (i == 8) {
+            out[len++] = '.';
+        }
+        uint8_t lower = i < 8 ? FAT_NT_LOWER_BASE : FAT_NT_LOWER_EXT;
+        if ((dirent->nt_flags & lower) && c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        out[len++] = c;
+    }
+    out[len] = '\0';
+}
+
+int fat_name_char(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') ||
+           (c != '\0' && strchr("!#$%&'()-@^_`{}~", c) != NULL);
+}
+
+char fat_upper(char c) {
+    return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+// FAT names are compared without regard to case
+int fat_name_equal(const char *a, const char *b) {
+    while (*a && fat_upper(*a) == fat_upper(*b)) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+// Build the 8.3 form of name and its NT case flags. Returns -1 if the name
+// does not fit and needs a long name.
+int fat_short_name(const char *name, uint8_t *out, uint8_t *nt_flags) {
+    const char *dot = NULL;
+    for (const char *p = name; *p; p++) {
+        if (*p == '.') dot = p;
+    }
+    uint32_t base_len = dot ? (uint32_t)(dot - name) : strlen(name);
+    uint32_t ext_len = dot ? strlen(dot + 1) : 0;
+    if (base_len == 0 || base_len > 8 || ext_len > 3 || (dot && ext_len == 0)) {
+        return -1;
+    }
+
+    int lower[2] = {0, 0};
+    int upper[2] = {0, 0};
+    memset(out, ' ', 11);
+    for (uint32_t i = 0; i < base_len + ext_len; i++) {
+        int part = i >= base_len;
+        char c = part ? dot[1 + i - base_len] : name[i];
+        if (!fat_name_char(c)) {
+            return -1;
+        }
+        lower[part] |= c >= 'a' && c <= 'z';
+        upper[part] |= c >= 'A' && c <= 'Z';
+        out[part ? 8 + i - base_len : i] = fat_upper(c);
+    }
+    if ((lower[0] && upper[0]) || (lower[1] && upper[1])) {
+        return -1;  // Mixed case needs a long name
+    }
+    if (out[0] == FAT_DELETED) {
+        out[0] = 0x05;
+    }
+    *nt_flags = (lower[0] ? FAT_NT_LOWER_BASE : 0) | (lower[1] ? FAT_NT_LOWER_EXT : 0);
+    return 0;
+}
+
+int fat_short_taken(FatNode *dir, const uint8_t *name) {
+    FatDirent dirent;
+    for (uint32_t i = 0; fat_read_slot(dir, i, &dirent) == 0 && dirent.name[0] != 0; i++) {
+        if (dirent.name[0] != FAT_DELETED && dirent.attr != FAT_ATTR_LFN &&
+            memcmp(dirent.name, name, 11) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Pick an unused BASE~N.EXT short name to go with a long name
+int fat_alias(FatNode *dir, const char *name, uint8_t *out) {
+    const char *dot = NULL;
+    for (const char *p = name + 1; *p; p++) {
+        if (*p == '.') dot = p;
+    }
+    char base[6];
+    char ext[3];
+    uint32_t base_len = 0;
+    uint32_t ext_len = 0;
+    for (const char *p = name; *p && p != dot && base_len < sizeof(base); p++) {
+        if (fat_name_char(*p)) base[base_len++] = fat_upper(*p);
+    }
+    for (const char *p = dot ? dot + 1 : ""; *p && ext_len < sizeof(ext); p++) {
+        if (fat_name_char(*p)) ext[ext_len++] = fat_upper(*p);
+    }
+    if (base_len == 0) {
+        base[base_len++] = '_';
+    }
+
+    for (uint32_t n = 1; n < 10000; n++) {
+        char digits[5];
+        uint32_t len = 0;
+        for (uint32_t v = n; v > 0; v /= 10) {
+            digits[len++] = '0' + v % 10;
+        }
+        uint32_t keep = base_len + 1 + len > 8 ? 7 - len : base_len;
+
+        memset(out, ' ', 11);
+        memcpy(out, base, keep);
+        out[keep] = '~';
+        for (uint32_t i = 0; i < len; i++) {
+            out[keep + 1 + i] = digits[len - 1 - i];
+        }
+        memcpy(out + 8, ext, ext_len);
+        if (!fat_short_taken(dir, out)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Slot seq (counting from 1) of the long name for name
+void fat_lfn_fill(FatDirent *slot, const char *name, uint32_t seq, uint8_t checksum, int last) {
+    uint8_t *raw = (uint8_t *)slot;
+    uint32_t len = strlen(name);
+    memset(raw, 0, sizeof(FatDirent));
+    raw[0] = seq | (last ? FAT_LFN_LAST : 0);
+    slot->attr = FAT_ATTR_LFN;
+    raw[FAT_LFN_CHECKSUM] = checksum;
+    for (uint32_t i = 0; i < FAT_LFN_CHARS; i++) {
+        uint32_t pos = (seq - 1) * FAT_LFN_CHARS + i;
+        uint32_t c = pos < len ? (uint8_t)name[pos] : pos == len ? 0 : 0xFFFF;
+        raw[fat_lfn_offsets[i]] = c;
+        raw[fat_lfn_offsets[i] + 1] = c >> 8;
+    }
+}
+
+// Index of count consecutive free slots in dir, growing it if needed; -1 if full
+int fat_find_slots(FatNode *dir, uint32_t count) {
+    FatVolume *vol = dir->vol;
+    FatDirent dirent;
+    uint32_t run = 0;
+    uint32_t index = 0;
+    for (; fat_read_slot(dir, index, &dirent) == 0; index++) {
+        if (dirent.name[0] == 0 || dirent.name[0] == FAT_DELETED) {
+            if (++run == count) return index + 1 - count;
+        } else {
+            run = 0;
+        }
+    }
+    if (dir->first_cluster == 0) {
+        return -1;  // The FAT12/16 root cannot grow
+    }
+
+    uint32_t have = fat_chain_length(dir);
+    uint32_t bytes = (count - run) * sizeof(FatDirent);
+    uint32_t more = (bytes + vol->cluster_bytes - 1) / vol->cluster_bytes;
+    if (fat_extend(dir, have + more) != 0) {
+        return -1;
+    }
+    for (uint32_t i = have; i < have + more; i++) {
+        uint32_t contiguous;
+        if (fat_zero_cluster(vol, fat_map(dir, i, 1, &contiguous)) != 0) return -1;
+    }
+    return index - run;
+}
+
+// Give a new directory its first cluster with the . and .. entries
+int fat_init_dir(FatNode *node, FatNode *parent) {
+    FatVolume *vol = node->vol;
+    if (fat_extend(node, 1) != 0 || fat_zero_cluster(vol, node->first_cluster) != 0) {
+        return -1;
+    }
+
+    FatDirent dot;
+    memset(&dot, 0, sizeof(dot));
+    memset(dot.name, ' ', sizeof(dot.name));
+    dot.name[0] = '.';
+    dot.attr = FAT_ATTR_DIRECTORY;
+    dot.cluster_high = vol->type == 32 ? node->first_cluster >> 16 : 0;
+    dot.cluster_low = node->first_cluster;
+    if (fat_write_slot(node, 0, &dot) != 0) {
+        return -1;
+    }
+
+    // .. of a directory in the root says cluster 0, even on FAT32
+    uint32_t up = parent->dirent_sector ? parent->first_cluster : 0;
+    dot.name[1] = '.';
+    dot.cluster_high = vol->type == 32 ? up >> 16 : 0;
+    dot.cluster_low = up;
+    return fat_write_slot(node, 1, &dot);
+}
+
+// Read the entries of a FAT directory into dir
+void fat_read_dir(Directory *dir) {
+    FatNode *node = dir->fat;
+    FatVolume *vol = node->vol;
+    FatDirent dirent;
+    char long_name[FAT_LFN_MAX_SLOTS * FAT_LFN_CHARS + 1];
+    char short_name[13];
+    uint32_t lfn_slots = 0;   // Slots of the long name collected so far
+    uint32_t lfn_expect = 0;  // Sequence number of the next slot
+    uint8_t lfn_checksum = 0;
+    uint32_t skipped = 0;
+
+    for (uint32_t index = 0; fat_read_slot(node, index, &dirent) == 0 && dirent.name[0] != 0;
+         index++) {
+        uint8_t *raw = (uint8_t *)&dirent;
+        if (dirent.name[0] == FAT_DELETED) {
+            lfn_slots = 0;
+            continue;
+        }
+
+        // Long names come in slots before their short entry, last part first
+        if (dirent.attr == FAT_ATTR_LFN) {
+            uint32_t seq = raw[0] & 0x1F;
+            if (raw[0] & FAT_LFN_LAST) {
+                lfn_slots = 0;
+                lfn_expect = seq;
+                lfn_checksum = raw[FAT_LFN_CHECKSUM];
+                if (seq <= FAT_LFN_MAX_SLOTS) {
+                    long_name[seq * FAT_LFN_CHARS] = '\0';
+                }
+            }
+            if (seq == 0 || seq != lfn_expect || seq > FAT_LFN_MAX_SLOTS ||
+                raw[FAT_LFN_CHECKSUM] != lfn_checksum) {
+                lfn_slots = 0;
+                lfn_expect = 0;
+                continue;
+            }
+            for (uint32_t i = 0; i < FAT_LFN_CHARS; i++) {
+                uint32_t c = fat_u16(raw + fat_lfn_offsets[i]);
+                long_name[(seq - 1) * FAT_LFN_CHARS + i] = c == 0xFFFF ? '\0' : c > 0x7F ? '?' : c;
+            }
+            lfn_expect--;
+            lfn_slots++;
+            continue;
+        }
+
+        uint32_t slots = lfn_expect == 0 ? lfn_slots : 0;  // Only a complete long name counts
+        lfn_slots = 0;
+        lfn_expect = 0;
+        if (dirent.attr & FAT_ATTR_VOLUME) {
+            continue;
+        }
+        const char *name = long_name;
+        if (slots == 0 || lfn_checksum != fat_lfn_checksum(dirent.name)) {
+            fat_short_to_name(&dirent, short_name);
+            name = short_name;
+            slots = 0;
+        }
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        uint32_t cluster = dirent.cluster_low | (vol->type == 32 ? dirent.cluster_high << 16 : 0);
+        int is_directory = (dirent.attr & FAT_ATTR_DIRECTORY) != 0;
+        FatNode *child = NULL;
+        if (strlen(name) < MAX_FILENAME && dir->num_files < MAX_FILES &&
+            find_entry(dir, name) == NULL && (cluster != 0 || !is_directory)) {
+            child = (FatNode *)malloc(sizeof(FatNode));
+        }
+        if (child == NULL) {
+            skipped++;  // Cannot be represented, or out of memory
+            continue;
+        }
+
+        memset(child, 0, sizeof(FatNode));
+        child->vol = vol;
+        child->first_cluster = cluster;
+        child->chain_length = FAT_UNKNOWN;
+        child->dirent_sector = fat_slot_sector(node, index);
+        child->dirent_offset = index * sizeof(FatDirent) % BLOCK_SIZE;
+        child->dirent_index = index;
+        child->lfn_slots = slots;
+
+        FileEntry *entry = add_entry(dir, name);
+        if (entry == NULL) {
+            free(child);
+            continue;
+        }
+        entry->fat = child;
+        entry->is_directory = is_directory;
+        if (!is_directory) {
+            entry_set_size(dir, entry, dirent.size);
+        }
+        if (dirent.attr & FAT_ATTR_READONLY) {
+            entry->flags |= FILE_READONLY;
+        }
+    }
+
+    if (skipped > 0) {
+        print("Warning: ");
+        print_uint(skipped);
+        print(" entries of ");
+        print(dir->name);
+        print(" skipped (name too long, duplicate or directory full)\n");
+    }
+}
+
+Directory *fat_load_dir(Directory *parent, FileEntry *entry) {
+    Directory *dir = (Directory *)malloc(sizeof(Directory));
+    if (dir == NULL) {
+        print("Error: Out of memory for directory\n");
+        return NULL;
+    }
+    memset(dir, 0, sizeof(Directory));
+    strncpy(dir->name, entry->filename, MAX_FILENAME - 1);
+    dir->parent = parent;
+    dir->refcount = 1;
+    dir->epoch = fs_epoch;
+    dir->fat = entry->fat;
+    fat_read_dir(dir);
+    return dir;
+}
+
+// Write the directory entry for a new entry of dir, which add_entry has made
+int fat_create(Directory *dir, FileEntry *entry) {
+    FatNode *parent = dir->fat;
+    FatVolume *vol = parent->vol;
+    for (uint32_t i = 0; i < dir->num_files; i++) {
+        if (&dir->files[i] != entry && fat_name_equal(dir->files[i].filename, entry->filename)) {
+            print("Error: File or directory already exists with this name\n");
+            return -1;
+        }
+    }
+
+    FatDirent dirent;
+    memset(&dirent, 0, sizeof(dirent));
+    uint32_t slots = 0;
+    if (fat_short_name(entry->filename, dirent.name, &dirent.nt_flags) != 0) {
+        slots = (strlen(entry->filename) + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS;
+        if (fat_alias(parent, entry->filename, dirent.name) != 0) {
+            print("Error: No short name left for this name\n");
+            return -1;
+        }
+    } else if (fat_short_taken(parent, dirent.name)) {
+        print("Error: File or directory already exists with this name\n");
+        return -1;  // An entry that could not be listed has the name
+    }
+
+    int index = fat_find_slots(parent, slots + 1);
+    FatNode *node = index >= 0 ? (FatNode *)malloc(sizeof(FatNode)) : NULL;
+    if (node == NULL) {
+        print(index < 0 ? "Error: Directory is full\n" : "Error: Out of memory\n");
+        return -1;
+    }
+    memset(node, 0, sizeof(FatNode));
+    node->vol = vol;
+
+    dirent.attr = entry->is_directory ? FAT_ATTR_DIRECTORY : FAT_ATTR_ARCHIVE;
+    if (entry->is_directory && fat_init_dir(node, parent) != 0) {
+        fat_free_chain(vol, node->first_cluster);
+        free(node);
+        print("Error: Volume is full\n");
+        return -1;
+    }
+    dirent.cluster_high = vol->type == 32 ? node->first_cluster >> 16 : 0;
+    dirent.cluster_low = node->first_cluster;
+
+    FatDirent lfn;
+    uint8_t checksum = fat_lfn_checksum(dirent.name);
+    int failed = 0;
+    for (uint32_t i = 0; i < slots; i++) {
+        fat_lfn_fill(&lfn, entry->filename, slots - i, checksum, i == 0);
+        failed |= fat_write_slot(parent, index + i, &lfn);
+    }
+    failed |= fat_write_slot(parent, index + slots, &dirent);
+    if (failed) {
+        fat_free_chain(vol, node->first_cluster);
+        free(node);
+        print("Error: Cannot write the directory entry\n");
+        return -1;
+    }
+
+    node->dirent_sector = fat_slot_sector(parent, index + slots);
+    node->dirent_offset = (index + slots) * sizeof(FatDirent) % BLOCK_SIZE;
+    node->dirent_index = index + slots;
+    node->lfn_slots = slots;
+    entry->fat = node;
+    if (entry->is_directory) {
+        entry->dir_ptr->fat = node;
+    }
+    return 0;
+}
+
+int fat_dir_empty(FatNode *node) {
+    FatDirent dirent;
+    for (uint32_t i = 0; fat_read_slot(node, i, &dirent) == 0 && dirent.name[0] != 0; i++) {
+        if (dirent.name[0] == FAT_DELETED || dirent.attr == FAT_ATTR_LFN ||
+            (dirent.attr & FAT_ATTR_VOLUME) || dirent.name[0] == '.') {
+            continue;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// Delete the directory entry of entry and free its clusters
+int fat_remove(Directory *dir, FileEntry *entry) {
+    FatNode *node = entry->fat;
+    if (entry->is_directory && !fat_dir_empty(node)) {
+        print("Error: Directory is not empty\n");
+        return -1;
+    }
+
+    FatDirent dirent;
+    for (uint32_t i = node->dirent_index - node->lfn_slots; i <= node->dirent_index; i++) {
+        if (fat_read_slot(dir->fat, i, &dirent) != 0) {
+            return -1;
+        }
+        dirent.name[0] = FAT_DELETED;
+        if (fat_write_slot(dir->fat, i, &dirent) != 0) {
+            return -1;
+        }
+    }
+    fat_free_chain(node->vol, node->first_cluster);
+    node->first_cluster = 0;
+    node->chain_length = 0;
+    node->num_runs = 0;
+    return 0;
+}
+
+// Swap the clusters of two files of one directory, whose sizes were already
+// swapped, and store both in their directory entries
+int fat_exchange(FileEntry *a, FileEntry *b) {
+    FatNode *x = a->fat;
+    FatNode *y = b->fat;
+    uint32_t first_cluster = x->first_cluster;
+    uint32_t chain_length = x->chain_length;
+    x->first_cluster = y->first_cluster;
+    x->chain_length = y->chain_length;
+    y->first_cluster = first_cluster;
+    y->chain_length = chain_length;
+    x->num_runs = 0;  // The cached runs are of the other chain now
+    y->num_runs = 0;
+    if (fat_write_dirent(x, a->size) != 0) {
+        return -1;
+    }
+    return fat_write_dirent(y, b->size);
+}
+
+// Free what a FAT directory holds when its Directory goes away
+void fat_release(Directory *dir) {
+    for (uint32_t i = 0; i < dir->num_files; i++) {
+        free(dir->files[i].fat);
+    }
+
+    // Dropping the mount point unmounts the volume
+    FatVolume *vol = dir->fat->vol;
+    if (dir->fat == &vol->root) {
+        bcache_sync();
+        for (int i = 0; i < FAT_MAX_VOLUMES; i++) {
+            if (fat_volumes[i] == vol) fat_volumes[i] = NULL;
+        }
+        if (vol->dev->base != NULL) {
+            bcache_invalidate(vol->dev);
+            vol->dev->num_blocks = 0;  // Release the memory disk
+        }
+        free(vol);
+    }
+}
+
+// Read through the buffer cache for partial sectors. Whole sectors go straight
+// to the device, as many consecutive clusters at a time as the chain allows.
+int fat_read(FatNode *node, uint32_t offset, void *buffer, uint32_t count) {
+    FatVolume *vol = node->vol;
+    uint8_t *dst = (uint8_t *)buffer;
+    uint32_t done = 0;
+    while (done < count) {
+        uint32_t in_cluster = offset % vol->cluster_bytes;
+        uint32_t wanted = (in_cluster + count - done + vol->cluster_bytes - 1) / vol->cluster_bytes;
+        uint32_t contiguous;
+        uint32_t cluster = fat_map(node, offset / vol->cluster_bytes, wanted, &contiguous);
+        if (cluster == 0) {
+            break;  // The chain is shorter than the file
+        }
+
+        uint32_t sector = fat_cluster_sector(vol, cluster) + in_cluster / BLOCK_SIZE;
+        uint32_t sector_offset = in_cluster % BLOCK_SIZE;
+        uint32_t n = contiguous * vol->cluster_bytes - in_cluster;
+        if (n > count - done) n = count - done;
+
+        if (sector_offset == 0 && n >= BLOCK_SIZE) {
+            uint32_t sectors = n / BLOCK_SIZE;
+            if (vol->dev->read(vol->dev, sector, sectors, dst + done) != 0) return -1;
+            // Buffers not yet written back are newer than the disk
+            for (uint32_t i = 0; i < sectors; i++) {
+                Buffer *buf = bcache_lookup(vol->dev, sector + i);
+                if (buf != NULL) memcpy(dst + done + i * BLOCK_SIZE, buf->data, BLOCK_SIZE);
+            }
+            n = sectors * BLOCK_SIZE;
+        } else {
+            if (n > BLOCK_SIZE - sector_offset) n = BLOCK_SIZE - sector_offset;
+            if (bcache_read_block(vol->dev, sector, sector_offset, dst + done, n) != 0) return -1;
+        }
+        done += n;
+        offset += n;
+    }
+    return done;
+}
+
+// Copy count bytes into the clusters of node at pos, or zeros if src is NULL
+int fat_fill(FatNode *node, uint32_t pos, const uint8_t *src, uint32_t count) {
+    FatVolume *vol = node->vol;
+    while (count > 0) {
+        uint32_t contiguous;
+        uint32_t cluster = fat_map(node, pos / vol->cluster_bytes, 1, &contiguous);
+        if (cluster == 0) {
+            return -1;
+        }
+        uint32_t in_cluster = pos % vol->cluster_bytes;
+        uint32_t sector_offset = in_cluster % BLOCK_SIZE;
+        uint32_t n = BLOCK_SIZE - sector_offset;
+        if (n > count) n = count;
+
+        uint32_t sector = fat_cluster_sector(vol, cluster) + in_cluster / BLOCK_SIZE;
+        if (bcache_write_block(vol->dev, sector, sector_offset, src ? src : fat_zero, n) != 0) {
+            return -1;
+        }
+        if (src) src += n;
+        pos += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int fat_write(Directory *dir, FileEntry *entry, uint32_t offset, const void *buffer,
+              uint32_t count) {
+    FatNode *node = entry->fat;
+    FatVolume *vol = node->vol;
+    uint32_t end = offset + count;
+    if (count == 0) {
+        return 0;
+    }
+    if (fat_extend(node, (end + vol->cluster_bytes - 1) / vol->cluster_bytes) != 0) {
+        return -1;  // Volume full
+    }
+
+    // Zero any hole between the old end of file and the write offset
+    if (offset > entry->size && fat_fill(node, entry->size, NULL, offset - entry->size) != 0) {
+        return -1;
+    }
+    if (fat_fill(node, offset, (const uint8_t *)buffer, count) != 0) {
+        return -1;
+    }
+    if (end > entry->size) {
+        entry_set_size(dir, entry, end);
+    }
+    return fat_write_dirent(node, entry->size) == 0 ? (int)count : -1;
+}
+
+// Free the clusters past the end of the file and record its size
+void fat_truncate(FileEntry *entry) {
+    FatNode *node = entry->fat;
+    FatVolume *vol = node->vol;
+    uint32_t keep = (entry->size + vol->cluster_bytes - 1) / vol->cluster_bytes;
+    if (fat_chain_length(node) > keep) {
+        uint32_t rest = node->first_cluster;
+        if (keep == 0) {
+            node->first_cluster = 0;
+        } else {
+            uint32_t contiguous;
+            uint32_t last = fat_map(node, keep - 1, 1, &contiguous);
+            rest = fat_next(vol, last);
+            fat_set(vol, last, FAT_EOC);
+        }
+        fat_free_chain(vol, rest);
+        node->chain_length = keep;
+        node->num_runs = 0;
+    }
+    fat_write_dirent(node, entry->size);
+}
+
+uint32_t fat_stored_bytes(FileEntry *entry) {
+    uint32_t cluster_bytes = entry->fat->vol->cluster_bytes;
+    return (entry->size + cluster_bytes - 1) / cluster_bytes * cluster_bytes;
+}
+
+// Mount the FAT volume at sector start of dev on path
+int fat_mount(BlockDevice *dev, uint32_t start, const char *path) {
+    int slot = -1;
+    for (int i = FAT_MAX_VOLUMES - 1; i >= 0; i--) {
+        if (fat_volumes[i] == NULL) {
+            slot = i;
+        } else if (fat_volumes[i]->dev == dev) {
+            print("Error: Device is already mounted\n");
+            return -1;
+        }
+    }
+    if (slot < 0) {
+        print("Error: Too many mounted volumes\n");
+        return -1;
+    }
+
+    char leaf[MAX_FILENAME];
+    Directory *parent = lookup_parent(path, leaf);
+    if (parent == NULL || leaf[0] == '\0') {
+        print("Error: Bad mount point\n");
+        return -1;
+    }
+    if (parent->fat != NULL) {
+        print("Error: Cannot mount inside a FAT volume\n");
+        return -1;
+    }
+
+    FatVolume *vol = (FatVolume *)malloc(sizeof(FatVolume));
+    if (vol == NULL) {
+        print("Error: Out of memory for volume\n");
+        return -1;
+    }
+    memset(vol, 0, sizeof(FatVolume));
+    vol->dev = dev;
+    uint8_t boot[BLOCK_SIZE];
+    if (bcache_read_block(dev, start, 0, boot, BLOCK_SIZE) != 0 ||
+        fat_parse_boot(vol, boot, start) != 0) {
+        free(vol);
+        print("Error: No FAT filesystem found\n");
+        return -1;
+    }
+
+    Directory *root = create_directory(parent, leaf);
+    if (root == NULL) {
+        free(vol);
+        return -1;
+    }
+    root->fat = &vol->root;
+    vol->mount = root;
+    fat_volumes[slot] = vol;
+    fat_read_dir(root);
+
+    print("Mounted FAT");
+    print_uint(vol->type);
+    print(" volume from ");
+    print(dev->name);
+    print(" at ");
+    print(path);
+    print(" (");
+    print_uint(root->num_files);
+    print(" entries)\n");
+    return 0;
+}
+
+// Mount a disk image held in memory, such as a boot module
+int fat_mount_image(const void *image, uint32_t size, const char *mountpoint) {
+    BlockDevice *dev = memdisk_attach(image, size);
+    if (dev == NULL) {
+        print("Error: No memory disk left\n");
+        return -1;
+    }
+    if (fat_mount(dev, 0, mountpoint) != 0) {
+        bcache_invalidate(dev);
+        dev->num_blocks = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// First sector of the FAT volume on dev: the first FAT partition of an MBR,
+// or the whole device
+uint32_t fat_find_volume(BlockDevice *dev) {
+    uint8_t mbr[BLOCK_SIZE];
+    if (bcache_read_block(dev, 0, 0, mbr, BLOCK_SIZE) != 0 || fat_boot_sector_valid(mbr) ||
+        mbr[510] != 0x55 || mbr[511] != 0xAA) {
+        return 0;
+    }
+    for (int i = 0; i < 4; i++) {
+        const uint8_t *part = mbr + 446 + i * 16;
+        uint8_t type = part[4];
+        if (type == 0x01 || type == 0x04 || type == 0x06 || type == 0x0B || type == 0x0C ||
+            type == 0x0E) {
+            return fat_u32(part + 8);
+        }
+    }
+    return 0;
+}
+
+// mount lists the mounted volumes; mount <device> <path> mounts one
+void mount(int argc, char **argv) {
+    if (argc == 1) {
+        for (int i = 0; i < FAT_MAX_VOLUMES; i++) {
+            FatVolume *vol = fat_volumes[i];
+            if (vol == NULL) continue;
+            print(vol->dev->name);
+            print(" on /");
+            print_relative_path(vol->mount->parent, &fs.root, vol->mount->name);
+            print(" type FAT");
+            print_uint(vol->type);
+            print(", ");
+            print_uint(vol->num_clusters);
+            print(" clusters of ");
+            print_uint(vol->cluster_bytes);
+            print(" bytes\n");
+        }
+        return;
+    }
+
+    if (argc != 3) {
+        print("Usage: mount [device path]\n");
+        return;
+    }
+    if (strcmp(argv[1], ata_disk.name) != 0 || ata_disk.num_blocks == 0) {
+        print("Error: Unknown device\n");
+        return;
+    }
+    fat_mount(&ata_disk, fat_find_volume(&ata_disk), argv[2]);
+}
+COMMAND_ARGS(mount, mount, 0, 2, "mount [hda path]", "List or mount FAT volumes");
+
+// End of FAT
+
+// Filesystem image
+//
+// A pointer-free copy of a subtree that can leave the machine and come back.
+// The image is a header, a string table of names, a directory table, an entry
+// table and the file data, then a checksum of everything after the header.
+// Directories are numbered breadth first, so the entries of each one are
+// contiguous and every directory comes after its parent. Importing checks the
+// offsets once and then maps the files in place: their content stays in the
+// image until a file is first written.
+
+#define FSIMAGE_MAGIC 0x5346524E  // "NRFS"
+#define FSIMAGE_VERSION 1
+#define FSIMAGE_DIRECTORY 0x1
+#define FSIMAGE_READONLY 0x2
+#define FSIMAGE_NO_PARENT 0xFFFFFFFF
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t image_size;  // Including the trailing checksum
+    uint32_t num_dirs;
+    uint32_t num_entries;
+    uint32_t strings_offset;
+    uint32_t strings_size;
+    uint32_t dirs_offset;
+    uint32_t entries_offset;
+    uint32_t data_offset;
+    uint32_t data_size;
+} FsImageHeader;
+
+typedef struct {
+    uint32_t parent;  // Directory index, FSIMAGE_NO_PARENT for the root
+    uint32_t first_entry;
+    uint32_t num_entries;
+} FsImageDir;
+
+typedef struct {
+    uint32_t name;    // Offset in the string table
+    uint32_t flags;
+    uint32_t size;    // File bytes
+    uint32_t target;  // Offset in the data section, or directory index
+} FsImageEntry;
+
+uint32_t fsimage_checksum(uint32_t hash, const void *data, uint32_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (uint32_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Entries that go into an image; FAT volumes are left out, their files are on
+// disk already
+int fsimage_includes(FileEntry *entry) {
+    return !entry->is_directory || (entry->dir_ptr != NULL && entry->dir_ptr->fat == NULL);
+}
+
+// Entries of dir that go into an image, or only its directories
+uint32_t fsimage_count(Directory *dir, int dirs_only) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < dir->num_files; i++) {
+        FileEntry *entry = &dir->files[i];
+        if (fsimage_includes(entry) && (entry->is_directory || !dirs_only)) count++;
+    }
+    return count;
+}
+
+int fsimage_fits(uint32_t offset, uint32_t size, uint32_t limit) {
+    return offset <= limit && size <= limit - offset;
+}
+
+uint32_t fsimage_align(uint32_t size) {
+    return (size + 3) & ~3u;
+}
+
+// Writes the image to COM1, keeping the checksum of what went out
+typedef struct {
+    uint32_t checksum;
+    uint32_t written;
+} FsImageWriter;
+
+void fsimage_emit(FsImageWriter *writer, const void *data, uint32_t size) {
+    writer->checksum = fsimage_checksum(writer->checksum, data, size);
+    writer->written += size;
+    serial_write(data, size);
+}
+
+void fsimage_pad(FsImageWriter *writer) {
+    static const uint8_t zeros[4] = {0, 0, 0, 0};
+    fsimage_emit(writer, zeros, fsimage_align(writer->written) - writer->written);
+}
+
+// fsexport [path] streams the image of a subtree over the serial port. The
+// layout is worked out first, so each section is written straight from the
+// tree without building the image in memory. The console is not mirrored
+// until the image is out, so a capture of COM1 holds it in one piece after
+// the text printed before it, which fsimage_find skips.
+void fsexport(const char *path) {
+    Directory *root;
+    FileEntry *found;
+    if (resolve_path(path, &root, &found) != 0 || found != NULL || root->fat != NULL) {
+        print("Error: Directory not found.\n");
+        return;
+    }
+
+    // Breadth-first directory order; a directory has at most one entry per
+    // node below it
+    Directory **dirs = (Directory **)malloc((root->total_entries + 1) * sizeof(Directory *));
+    if (dirs == NULL) {
+        print("Error: Out of memory\n");
+        return;
+    }
+    FsImageHeader header;
+    memset(&header, 0, sizeof(header));
+    dirs[0] = root;
+    header.num_dirs = 1;
+    for (uint32_t i = 0; i < header.num_dirs; i++) {
+        for (uint32_t j = 0; j < dirs[i]->num_files; j++) {
+            FileEntry *entry = &dirs[i]->files[j];
+            if (!fsimage_includes(entry)) continue;
+            if (entry->is_directory) {
+                dirs[header.num_dirs++] = entry->dir_ptr;
+            } else {
+                header.data_size += fsimage_align(entry->size);
+            }
+            header.num_entries++;
+            header.strings_size += strlen(entry->filename) + 1;
+        }
+    }
+    header.magic = FSIMAGE_MAGIC;
+    header.version = FSIMAGE_VERSION;
+    header.strings_size = fsimage_align(header.strings_size);
+    header.strings_offset = sizeof(FsImageHeader);
+    header.dirs_offset = header.strings_offset + header.strings_size;
+    header.entries_offset = header.dirs_offset + header.num_dirs * sizeof(FsImageDir);
+    header.data_offset = header.entries_offset + header.num_entries * sizeof(FsImageEntry);
+    header.image_size = header.data_offset + header.data_size + sizeof(uint32_t);
+
+    // Nothing else may go out on COM1 in the middle of the image
+    console_serial = 0;
+    FsImageWriter writer = {2166136261u, 0};
+    serial_write(&header, sizeof(header));
+    writer.written = sizeof(header);
+
+    for (uint32_t i = 0; i < header.num_dirs; i++) {
+        for (uint32_t j = 0; j < dirs[i]->num_files; j++) {
+            FileEntry *entry = &dirs[i]->files[j];
+            if (fsimage_includes(entry)) {
+                fsimage_emit(&writer, entry->filename, strlen(entry->filename) + 1);
+            }
+        }
+    }
+    fsimage_pad(&writer);
+
+    // Directory i > 0 is a child of the first directory whose children reach
+    // past it
+    uint32_t parent = 0;
+    uint32_t children_end = 1 + fsimage_count(root, 1);
+    uint32_t next_entry = 0;
+    for (uint32_t i = 0; i < header.num_dirs; i++) {
+        while (i > 0 && i >= children_end) {
+            children_end += fsimage_count(dirs[++parent], 1);
+        }
+        FsImageDir record = {i > 0 ? parent : FSIMAGE_NO_PARENT, next_entry,
+                             fsimage_count(dirs[i], 0)};
+        next_entry += record.num_entries;
+        fsimage_emit(&writer, &record, sizeof(record));
+    }
+
+    uint32_t name = 0;
+    uint32_t data = 0;
+    uint32_t next_dir = 1;
+    uint32_t files = 0;
+    for (uint32_t i = 0; i < header.num_dirs; i++) {
+        for (uint32_t j = 0; j < dirs[i]->num_files; j++) {
+            FileEntry *entry = &dirs[i]->files[j];
+            if (!fsimage_includes(entry)) continue;
+            FsImageEntry record = {name, 0, 0, 0};
+            if (entry->is_directory) {
+                record.flags = FSIMAGE_DIRECTORY;
+                record.target = next_dir++;
+            } else {
+                record.flags = (entry->flags & FILE_READONLY) ? FSIMAGE_READONLY : 0;
+                record.size = entry->size;
+                record.target = data;
+                data += fsimage_align(entry->size);
+                files++;
+            }
+            name += strlen(entry->filename) + 1;
+            fsimage_emit(&writer, &record, sizeof(record));
+        }
+    }
+
+    uint8_t chunk[BLOCK_SIZE];
+    for (uint32_t i = 0; i < header.num_dirs; i++) {
+        for (uint32_t j = 0; j < dirs[i]->num_files; j++) {
+            FileEntry *entry = &dirs[i]->files[j];
+            if (entry->is_directory) continue;
+            int n;
+            for (uint32_t offset = 0; (n = file_read_at(entry, offset, chunk, sizeof(chunk))) > 0;
+                 offset += n) {
+                fsimage_emit(&writer, chunk, n);
+            }
+            fsimage_pad(&writer);
+        }
+    }
+    serial_write(&writer.checksum, sizeof(writer.checksum));
+    serial_flush();
+    console_serial = 1;
+    free(dirs);
+
+    print("Exported ");
+    print_uint(files);
+    print(" files in ");
+    print_uint(header.num_dirs);
+    print(" directories to COM1 (");
+    print_uint(header.image_size);
+    print(" bytes)\n");
+}
+
+void fsexport_command(int argc, char **argv) {
+    fsexport(argc > 1 ? argv[1] : "");
+}
+COMMAND_ARGS(fsexport, fsexport_command, 0, 1, "fsexport [path]",
+             "Send a filesystem image over COM1");
+
+// Offset of the image in a module, or -1 if it holds none. A capture of COM1
+// has the console text printed before fsexport in front of the image, which
+// is skipped; binary data before the magic means it is something else.
+int fsimage_find(const void *module, uint32_t size) {
+    const uint8_t *bytes = (const uint8_t *)module;
+    for (uint32_t offset = 0; offset + sizeof(FsImageHeader) <= size; offset++) {
+        uint32_t magic;
+        memcpy(&magic, bytes + offset, sizeof(magic));
+        if (magic == FSIMAGE_MAGIC) {
+            return offset;
+        }
+        uint8_t c = bytes[offset];
+        if (c < ' ' && c != '\n' && c != '\r' && c != '\t' && c != '\b' && c != 0x1B) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Check that every offset and index in an image stays inside it and that the
+// directories form a tree; returns the header, or NULL if the image is damaged
+const FsImageHeader *fsimage_check(const uint8_t *image, uint32_t size) {
+    const FsImageHeader *header = (const FsImageHeader *)image;
+    if (size < sizeof(FsImageHeader) + sizeof(uint32_t) || header->magic != FSIMAGE_MAGIC ||
+        header->version != FSIMAGE_VERSION || header->image_size > size ||
+        header->image_size < sizeof(FsImageHeader) + sizeof(uint32_t)) {
+        return NULL;
+    }
+    uint32_t limit = header->image_size - sizeof(uint32_t);
+    if (header->num_dirs == 0 || header->num_dirs > limit / sizeof(FsImageDir) ||
+        header->num_entries > limit / sizeof(FsImageEntry) ||
+        !fsimage_fits(header->strings_offset, header->strings_size, limit) ||
+        !fsimage_fits(header->dirs_offset, header->num_dirs * sizeof(FsImageDir), limit) ||
+        !fsimage_fits(header->entries_offset, header->num_entries * sizeof(FsImageEntry),
+                      limit) ||
+        !fsimage_fits(header->data_offset, header->data_size, limit) ||
+        (header->dirs_offset | header->entries_offset) % sizeof(uint32_t) != 0) {
+        return NULL;
+    }
+    uint32_t checksum;
+    memcpy(&checksum, image + limit, sizeof(checksum));
+    if (fsimage_checksum(2166136261u, image + sizeof(FsImageHeader),
+                         limit - sizeof(FsImageHeader)) != checksum) {
+        return NULL;
+    }
+
+    const char *strings = (const char *)image + header->strings_offset;
+    const FsImageDir *dirs = (const FsImageDir *)(image + header->dirs_offset);
+    const FsImageEntry *entries = (const FsImageEntry *)(image + header->entries_offset);
+    if (dirs[0].parent != FSIMAGE_NO_PARENT) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < header->num_dirs; i++) {
+        if (!fsimage_fits(dirs[i].first_entry, dirs[i].num_entries, header->num_entries)) {
+            return NULL;
+        }
+        for (uint32_t j = 0; j < dirs[i].num_entries; j++) {
+            const FsImageEntry *entry = &entries[dirs[i].first_entry + j];
+            uint32_t len = 0;
+            while (entry->name + len < header->strings_size && strings[entry->name + len]) {
+                len++;
+            }
+            if (entry->name + len >= header->strings_size) {
+                return NULL;  // Name runs off the string table
+            }
+            // Pointing only forward at a directory that names this one as its
+            // parent rules out cycles
+            if ((entry->flags & FSIMAGE_DIRECTORY)
+                    ? entry->target <= i || entry->target >= header->num_dirs ||
+                          dirs[entry->target].parent != i
+                    : !fsimage_fits(entry->target, entry->size, header->data_size)) {
+                return NULL;
+            }
+        }
+    }
+    return header;
+}
+
+// Add the tree in an image below path, or into the root if path is empty.
+// Directories that already exist are merged; files that do are skipped.
+int fs_import(const void *image, uint32_t size, const char *path) {
+    const FsImageHeader *header = fsimage_check((const uint8_t *)image, size);
+    if (header == NULL) {
+        print("Error: Damaged filesystem image\n");
+        return -1;
+    }
+    Directory *root = &fs.root;
+    if (*path) {
+        FileEntry *existing = find_entry(root, path);
+        root = existing == NULL ? create_directory(root, path)
+               : existing->is_directory ? entry_dir(root, existing) : NULL;
+        if (root == NULL || root->fat != NULL) {
+            print("Error: Cannot import into /");
+            print(path);
+            print("\n");
+            return -1;
+        }
+    }
+
+    Directory **dirs = (Directory **)malloc(header->num_dirs * sizeof(Directory *));
+    if (dirs == NULL) {
+        print("Error: Out of memory\n");
+        return -1;
+    }
+    memset(dirs, 0, header->num_dirs * sizeof(Directory *));
+    dirs[0] = root;
+
+    const uint8_t *base = (const uint8_t *)image;
+    const char *strings = (const char *)base + header->strings_offset;
+    const FsImageDir *records = (const FsImageDir *)(base + header->dirs_offset);
+    const FsImageEntry *entries = (const FsImageEntry *)(base + header->entries_offset);
+    const char *data = (const char *)base + header->data_offset;
+    uint32_t files = 0;
+    uint32_t skipped = 0;
+    for (uint32_t i = 0; i < header->num_dirs; i++) {
+        Directory *dir = dirs[i];
+        if (dir == NULL) {
+            continue;  // Could not be created; its subtree is skipped
+        }
+        for (uint32_t j = 0; j < records[i].num_entries; j++) {
+            const FsImageEntry *record = &entries[records[i].first_entry + j];
+            const char *name = strings + record->name;
+            FileEntry *existing = find_entry(dir, name);
+            int is_directory = (record->flags & FSIMAGE_DIRECTORY) != 0;
+            if (name[0] == '\0' || strlen(name) >= MAX_FILENAME || strchr(name, '/') ||
+                (existing && (!is_directory || !existing->is_directory))) {
+                skipped++;  // Bad name, or a file of that name is already there
+                continue;
+            }
+            if (is_directory) {
+                Directory *child =
+                    existing ? entry_dir(dir, existing) : create_directory(dir, name);
+                if (child != NULL && child->fat != NULL) {
+                    child = NULL;  // Files cannot be mapped onto a FAT volume
+                }
+                skipped += child == NULL;
+                dirs[record->target] = child;
+                continue;
+            }
+            FileEntry *entry = create_mapped_file(dir, name, data + record->target, record->size);
+            if (entry == NULL) {
+                skipped++;
+                continue;
+            }
+            if (!(record->flags & FSIMAGE_READONLY)) {
+                entry->flags &= ~FILE_READONLY;
+            }
+            files++;
+        }
+    }
+    free(dirs);
+
+    print("Imported ");
+    print_uint(files);
+    print(" files into /");
+    print(path);
+    if (skipped > 0) {
+        print(" (");
+        print_uint(skipped);
+        print(" skipped)");
+    }
+    print("\n");
+    return files;
+}
+
+// End of Filesystem image
+
+#define NULL 0
+
+// Type definitions (since we can't use stdint.h)
+#ifndef UINT_TYPES
+#define UINT_TYPES
+typedef unsigned char uint8_t;
+typedef unsigned short uint16_t;
+typedef unsigned int uint32_t;
+#endif
+
+// ACPI-related definitions
+#define ACPI_RSDP_SIGNATURE "RSD PTR "
+#define ACPI_FADT_SIGNATURE "FACP"
+#define ACPI_DSDT_SIGNATURE "DSDT"
+
+// PCI-related definitions
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+// Keyboard controller
+#define KBC_DATA_PORT 0x60
+#define KBC_SATUS_PORT 0x64
+
+// CMOS
+#define CMOS_ADDRESS 0x70
+#define CMOS_DATA 0x71
+
+// Main shutdown function
+void shutdown() {
+    print("Initiating NeoNoir advanced shutdown sequence...\n");
+
+    // 1. Try ACPI shutdown
+    print("Attempting ACPI shutdown...\n");
+    acpi_poweroff();
+    io_wait();
+
+    // 2. Try APM shutdown
+    print("Attempting APM shutdown...\n");
+    outw(0xB004, 0x0 | (2 << 10));
+    io_wait();
+
+    // 3. Try PCI reset
+    print("Attempting PCI reset...\n");
+    outl(PCI_CONFIG_ADDRESS, 0x8000F840);
+    outb(PCI_CONFIG_DATA, 0x0E);
+    io_wait();
+
+    // 4. Try PS/2 keyboard controller reset
+    print("Attempting PS/2 keyboard controller reset...\n");
+    while (inb(KBC_STATUS_PORT) & 2);
+    outb(KBC_STATUS_PORT, 0xFE);
+    io_wait();
+
+    // 5. Try CMOS reset
+    print("Attempting CMOS reset...\n");
+    outb(CMOS_ADDRESS, 0xF);
+    outb(CMOS_DATA, 0x0A);
+    io_wait();
+
+    // 6. Try keyboard controller reset
+    print("Attempting keyboard controller reset...\n");
+    uint8_t good = 0x02;
+    while (good & 0x02) good = inb(KEYBOARD_STATUS);
+    outb(KEYBOARD_STATUS, 0xFE);
+    io_wait();
+
+    // 7. Try to exit QEMU (won't affect real hardware)
+    print("Attempting QEMU exit...\n");
+    outw(0x604, 0x2000);
+
+    // 8. Last resort: Triple fault
+    print("All shutdown attempts failed. Initiating triple fault...\n");
+    asm volatile(
+        "movl $0, %eax\n"
+        "movl %eax, (%eax)\n");
+
+    // If we're still here, nothing worked
+    print("System is still running. It is now safe to power off your computer.\n");
+
+    // Disable interrupts and halt
+    asm volatile("cli");
+    while (1) {
+        asm volatile("hlt");
+    }
+}
+COMMAND(shutdown, shutdown, "Power off the system");
+
+// ACPI power off helper function
+void acpi_poweroff() {
+    // Search for RSDP in BIOS memory
+    char *addr;
+    for (addr = (char *)0x000E0000; addr < (char *)0x00100000; addr += 16) {
+        if (memcmp(addr, ACPI_RSDP_SIGNATURE, 8) == 0) {
+            // Found RSDP, now try to shut down
+            uint32_t pm1a_cnt = 0x1000;     // Default port if we can't find real one
+            uint16_t slp_typa = (1 << 13);  // Default sleep type
+
+            outw(pm1a_cnt, slp_typa | (1 << 13));
+            io_wait();
+            return;
+        }
+    }
+}
+
+// ACPI power off
+void *find_acpi_table(const char *signature) {
+    // Search for RSDP in BIOS memory
+    for (char *addr = (char *)0x000E0000; addr < (char *)0x00100000; addr += 16) {
+        if (memcmp(addr, ACPI_RSDP_SIGNATURE, 8) == 0) {
+            // Found RSDP, now find RSDT
+            uint32_t *rsdt = (uint32_t *)(*(uint32_t *)(addr + 16));
+            int entries = (*(uint32_t *)(addr + 4) - 36) / 4;
+
+            // Search RSDT for the requested table
+            for (int i = 0; i < entries; i++) {
+                void *table = (void *)rsdt[i + 9];
+                if (memcmp(table, signature, 4) == 0) {
+                    return table;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// APM power off
+void apm_poweroff() {
+    outw(0xB004, 0x0 | (2 << 10));
+    io_wait();
+}
+
+// PCI reset
+void pci_reset() {
+    outl(PCI_CONFIG_ADDRESS, 0x8000F840);
+    outb(PCI_CONFIG_DATA, 0x0E);
+    io_wait();
+}
+
+// PS/2 keyboard controller reset
+void ps2_reset() {
+    while (inb(KBC_STATUS_PORT) & 2);
+    outb(KBC_STATUS_PORT, 0xFE);
+    io_wait();
+}
+
+// CMOS reset
+void cmos_reset() {
+    outb(CMOS_ADDRESS, 0xF);
+    outb(CMOS_DATA, 0x0A);
+    io_wait();
+}
+
+// Triple fault (last resort)
+void triple_fault() {
+    asm volatile(
+        "movl $0, %eax\n"
+        "movl %eax, (%eax)\n");
+}
+
+// Add these type definitions if not already present
+typedef unsigned int uint32_t;
+typedef int int32_t;
+
+// Calculator
+//
+// calc compiles an expression into a program in reverse Polish notation with
+// the shunting-yard algorithm, then runs the program on a stack. Numbers are
+// fixed point: 64-bit counts of millionths. Products and quotients are formed
+// in 128 bits before they are scaled back, so nothing overflows on the way.
+// Expressions have + - * / % and ^ (whole powers, binding tightest and to the
+// right), unary minus, parentheses and variables. "calc NAME = EXPR" sets a
+// variable and ans holds the last result. expr runs one compiled program over
+// a range of values of a variable.
+
+#define CALC_SCALE 1000000
+#define CALC_DECIMALS 6
+#define CALC_MAX_INTEGER 9223372036854ULL  // Largest integer part that fits
+#define CALC_INT64_MAX 0x7FFFFFFFFFFFFFFFULL
+#define CALC_MAX_STEPS 128
+#define CALC_STACK_SIZE 32  // Values on the stack, and operators waiting
+#define CALC_MAX_VARS 32
+#define CALC_NAME_MAX 16
+
+// Opcodes. CALC_OPEN only marks a parenthesis on the operator stack.
+#define CALC_PUSH 0
+#define CALC_LOAD 1
+#define CALC_NEG 2
+#define CALC_ADD 3
+#define CALC_SUB 4
+#define CALC_MUL 5
+#define CALC_DIV 6
+#define CALC_MOD 7
+#define CALC_POW 8
+#define CALC_OPEN 9
+
+typedef struct {
+    uint8_t op;
+    uint8_t slot;   // Variable of CALC_LOAD
+    int64_t value;  // Number of CALC_PUSH
+} CalcStep;
+
+typedef struct {
+    CalcStep steps[CALC_MAX_STEPS];
+    int count;
+    int depth;  // Values the steps so far leave on the stack
+} CalcProgram;
+
+typedef struct {
+    char name[CALC_NAME_MAX];
+    int64_t value;
+} CalcVar;
+
+CalcVar calc_vars[CALC_MAX_VARS];
+int calc_var_count = 0;
+
+int calc_name_char(char c, int first) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+           (!first && c >= '0' && c <= '9');
+}
+
+// Slot of the variable named by the len characters at name; -1 if there is
+// none and create is not set, or after printing an error
+int calc_var_slot(const char *name, int len, int create) {
+    for (int i = 0; i < calc_var_count; i++) {
+        if (strncmp(calc_vars[i].name, name, len) == 0 && calc_vars[i].name[len] == '\0') {
+            return i;
+        }
+    }
+    if (!create) return -1;
+    if (len >= CALC_NAME_MAX) {
+        print("Error: Variable name too long\n");
+        return -1;
+    }
+    if (calc_var_count == CALC_MAX_VARS) {
+        print("Error: Too many variables\n");
+        return -1;
+    }
+    CalcVar *var = &calc_vars[calc_var_count];
+    memcpy(var->name, name, len);
+    var->name[len] = '\0';
+    var->value = 0;
+    return calc_var_count++;
+}
+
+// 128-bit product of a and b, from 32-bit halves
+void mul128(uint64_t a, uint64_t b, uint64_t *high, uint64_t *low) {
+    uint64_t ll = (uint64_t)(uint32_t)a * (uint32_t)b;
+    uint64_t lh = (uint64_t)(uint32_t)a * (uint32_t)(b >> 32);
+    uint64_t hl = (uint64_t)(uint32_t)(a >> 32) * (uint32_t)b;
+    uint64_t hh = (uint64_t)(uint32_t)(a >> 32) * (uint32_t)(b >> 32);
+    uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+    *low = mid << 32 | (uint32_t)ll;
+    *high = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+}
+
+// Quotient of high:low by divisor, which fits in 64 bits as high < divisor,
+// by shifting and subtracting
+uint64_t div128(uint64_t high, uint64_t low, uint64_t divisor, uint64_t *remainder) {
+    if (high == 0 && divisor <= 0xFFFFFFFF) {
+        uint64_t quotient = div64(low, divisor);
+        *remainder = low - quotient * divisor;
+        return quotient;
+    }
+    uint64_t quotient = 0;
+    for (int i = 63; i >= 0; i--) {
+        uint64_t carry = high >> 63;
+        high = high << 1 | (low >> i & 1);
+        quotient <<= 1;
+        if (carry || high >= divisor) {
+            high -= divisor;
+            quotient |= 1;
+        }
+    }
+    *remainder = high;
+    return quotient;
+}
+
+uint64_t calc_magnitude(int64_t value) {
+    return value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+}
+
+// The value of magnitude and sign; -1 if it does not fit
+int calc_signed(uint64_t magnitude, int negative, int64_t *result) {
+    if (magnitude > CALC_INT64_MAX + negative) {
+        print("Error: Overflow\n");
+        return -1;
+    }
+    *result = negative ? (int64_t)(0 - magnitude) : (int64_t)magnitude;
+    return 0;
+}
+
+// (a * b + round) / divisor, rounded to nearest if round is half the divisor
+int calc_muldiv(uint64_t a, uint64_t b, uint64_t divisor, int negative, int64_t *result) {
+    uint64_t high;
+    uint64_t low;
+    uint64_t remainder;
+    mul128(a, b, &high, &low);
+    low += divisor / 2;
+    if (low < divisor / 2) high++;
+    if (high >= divisor) {
+        print("Error: Overflow\n");
+        return -1;
+    }
+    return calc_signed(div128(high, low, divisor, &remainder), negative, result);
+}
+
+int calc_mul(int64_t a, int64_t b, int64_t *result) {
+    return calc_muldiv(calc_magnitude(a), calc_magnitude(b), CALC_SCALE, (a < 0) != (b < 0),
+                       result);
+}
+
+int calc_div(int64_t a, int64_t b, int64_t *result) {
+    if (b == 0) {
+        print("Error: Division by zero\n");
+        return -1;
+    }
+    return calc_muldiv(calc_magnitude(a), CALC_SCALE, calc_magnitude(b), (a < 0) != (b < 0),
+                       result);
+}
+
+int calc_pow(int64_t base, int64_t exponent, int64_t *result) {
+    uint64_t remainder;
+    uint64_t n = div128(0, calc_magnitude(exponent), CALC_SCALE, &remainder);
+    if (remainder != 0) {
+        print("Error: Powers must be whole numbers\n");
+        return -1;
+    }
+
+    // Square and multiply. A square that overflows is only taken when the
+    // power would overflow too.
+    int64_t power = CALC_SCALE;
+    while (n != 0) {
+        if ((n & 1) && calc_mul(power, base, &power) != 0) return -1;
+        n >>= 1;
+        if (n != 0 && calc_mul(base, base, &base) != 0) return -1;
+    }
+    if (exponent < 0) return calc_div(CALC_SCALE, power, result);
+    *result = power;
+    return 0;
+}
+
+int calc_apply(uint8_t op, int64_t a, int64_t b, int64_t *result) {
+    uint64_t remainder;
+    int64_t sum;
+    switch (op) {
+        case CALC_ADD:
+        case CALC_SUB:
+            sum = (int64_t)((uint64_t)a + (op == CALC_ADD ? (uint64_t)b : 0 - (uint64_t)b));
+            if (op == CALC_ADD ? ((a ^ sum) & (b ^ sum)) < 0 : ((a ^ b) & (a ^ sum)) < 0) {
+                print("Error: Overflow\n");
+                return -1;
+            }
+            *result = sum;
+            return 0;
+        case CALC_MUL:
+            return calc_mul(a, b, result);
+        case CALC_DIV:
+            return calc_div(a, b, result);
+        case CALC_MOD:
+            if (b == 0) {
+                print("Error: Division by zero\n");
+                return -1;
+            }
+            div128(0, calc_magnitude(a), calc_magnitude(b), &remainder);
+            return calc_signed(remainder, a < 0, result);
+        default:
+            return calc_pow(a, b, result);
+    }
+}
+
+// Operators that bind tighter go first
+int calc_precedence(uint8_t op) {
+    return op == CALC_POW ? 4 : op == CALC_NEG ? 3 : op >= CALC_MUL ? 2 : 1;
+}
+
+int calc_emit(CalcProgram *program, uint8_t op, uint8_t slot, int64_t value) {
+    program->depth += op <= CALC_LOAD ? 1 : op == CALC_NEG ? 0 : -1;
+    if (program->count == CALC_MAX_STEPS || program->depth > CALC_STACK_SIZE) {
+        print("Error: Expression too long\n");
+        return -1;
+    }
+    CalcStep *step = &program->steps[program->count++];
+    step->op = op;
+    step->slot = slot;
+    step->value = value;
+    return 0;
+}
+
+// A decimal number at *p, in fixed point; digits past the sixth decimal are
+// dropped. -1 if it does not fit.
+int calc_number(const char **p, int64_t *value) {
+    uint64_t integer = 0;
+    uint32_t fraction = 0;
+    uint32_t scale = CALC_SCALE;
+    int overflow = 0;
+    for (; **p >= '0' && **p <= '9'; (*p)++) {
+        integer = integer * 10 + (**p - '0');
+        if (integer > CALC_MAX_INTEGER) overflow = 1;
+    }
+    if (**p == '.') {
+        for ((*p)++; **p >= '0' && **p <= '9'; (*p)++) {
+            scale /= 10;
+            fraction += (**p - '0') * scale;
+        }
+    }
+    uint64_t fixed = integer * CALC_SCALE + fraction;
+    if (overflow || fixed > CALC_INT64_MAX) {
+        print("Error: Number too large\n");
+        return -1;
+    }
+    *value = fixed;
+    return 0;
+}
+
+// Compile expr into program. Returns 0, or -1 after printing an error.
+int calc_compile(const char *expr, CalcProgram *program) {
+    uint8_t ops[CALC_STACK_SIZE];  // Operators waiting for their right operand
+    int op_count = 0;
+    int operand = 1;  // An operand comes next, rather than an operator
+    const char *p = expr;
+    program->count = 0;
+    program->depth = 0;
+    while (1) {
+        while (*p == ' ' || *p == '\t') p++;
+        char c = *p;
+        uint8_t op;
+        if (operand) {
+            if ((c >= '0' && c <= '9') || c == '.') {
+                int64_t value;
+                if (calc_number(&p, &value) != 0) return -1;
+                if (calc_emit(program, CALC_PUSH, 0, value) != 0) return -1;
+                operand = 0;
+                continue;
+            }
+            if (calc_name_char(c, 1)) {
+                const char *name = p;
+                while (calc_name_char(*p, 0)) p++;
+                int slot = calc_var_slot(name, p - name, 0);
+                if (slot < 0) {
+                    print("Error: Unknown variable ");
+                    print_n(name, p - name);
+                    print("\n");
+                    return -1;
+                }
+                if (calc_emit(program, CALC_LOAD, slot, 0) != 0) return -1;
+                operand = 0;
+                continue;
+            }
+            if (c == '+') {
+                p++;
+                continue;
+            }
+            if (c != '(' && c != '-') {
+                print(c ? "Error: Expected a number\n" : "Error: Incomplete expression\n");
+                return -1;
+            }
+            op = c == '(' ? CALC_OPEN : CALC_NEG;  // Prefix operators wait for everything
+        } else if (c == '\0' || c == ')') {
+            while (op_count > 0 && ops[op_count - 1] != CALC_OPEN) {
+                if (calc_emit(program, ops[--op_count], 0, 0) != 0) return -1;
+            }
+            if (c == '\0') break;
+            if (op_count == 0) {
+                print("Error: Unmatched )\n");
+                return -1;
+            }
+            op_count--;
+            p++;
+            continue;
+        } else {
+            const char *binary = "+-*/%^";
+            const char *found = c ? strchr(binary, c) : NULL;
+            if (found == NULL) {
+                print("Error: Unexpected ");
+                putchar(c);
+                print("\n");
+                return -1;
+            }
+            op = CALC_ADD + (found - binary);
+            while (op_count > 0 && ops[op_count - 1] != CALC_OPEN &&
+                   (calc_precedence(ops[op_count - 1]) > calc_precedence(op) ||
+                    (calc_precedence(ops[op_count - 1]) == calc_precedence(op) &&
+                     op != CALC_POW))) {
+                if (calc_emit(program, ops[--op_count], 0, 0) != 0) return -1;
+            }
+            operand = 1;
+        }
+        if (op_count == CALC_STACK_SIZE) {
+            print("Error: Expression too long\n");
+            return -1;
+        }
+        ops[op_count++] = op;
+        p++;
+    }
+    if (op_count > 0) {
+        print("Error: Missing )\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Run a compiled program. Returns 0, or -1 after printing an error.
+int calc_run(const CalcProgram *program, int64_t *result) {
+    int64_t stack[CALC_STACK_SIZE];
+    int sp = 0;
+    for (int i = 0; i < program->count; i++) {
+        const CalcStep *step = &program->steps[i];
+        switch (step->op) {
+            case CALC_PUSH:
+                stack[sp++] = step->value;
+                break;
+            case CALC_LOAD:
+                stack[sp++] = calc_vars[step->slot].value;
+                break;
+            case CALC_NEG:
+                if (calc_signed(calc_magnitude(stack[sp - 1]), stack[sp - 1] > 0,
+                                &stack[sp - 1]) != 0) {
+                    return -1;
+                }
+                break;
+            default:
+                sp--;
+                if (calc_apply(step->op, stack[sp - 1], stack[sp], &stack[sp - 1]) != 0) {
+                    return -1;
+                }
+        }
+    }
+    *result = stack[0];
+    return 0;
+}
+
+// Compile and run expr. Programs live on the heap, since scripts running
+// calc in a task have little stack.
+int calc_eval(const char *expr, int64_t *result) {
+    CalcProgram *program = (CalcProgram *)malloc(sizeof(CalcProgram));
+    if (program == NULL) {
+        print("Error: Out of memory\n");
+        return -1;
+    }
+    int status = calc_compile(expr, program);
+    if (status == 0) status = calc_run(program, result);
+    free(program);
+    return status;
+}
+
+// value in decimal into buf, which holds at least 28 bytes
+void calc_format(int64_t value, char *buf) {
+    uint64_t magnitude = calc_magnitude(value);
+    uint64_t integer = div64(magnitude, CALC_SCALE);
+    uint32_t fraction = magnitude - integer * CALC_SCALE;
+    char digits[20];
+    int n = 0;
+    do {
+        uint64_t quotient = div64(integer, 10);
+        digits[n++] = '0' + (integer - quotient * 10);
+        integer = quotient;
+    } while (integer != 0);
+
+    int len = 0;
+    if (value < 0) buf[len++] = '-';
+    while (n > 0) buf[len++] = digits[--n];
+    if (fraction != 0) {
+        buf[len++] = '.';
+        for (int i = 0, scale = CALC_SCALE / 10; i < CALC_DECIMALS && fraction != 0; i++) {
+            buf[len++] = '0' + fraction / scale;
+            fraction %= scale;
+            scale /= 10;
+        }
+    }
+    buf[len] = '\0';
+}
+
+void calc_print(int64_t value) {
+    char buf[28];
+    calc_format(value, buf);
+    print(buf);
+}
+
+void calc(const char *expression) {
+    // NAME = EXPR sets a variable
+    const char *p = expression;
+    while (*p == ' ' || *p == '\t') p++;
+    const char *name = p;
+    while (calc_name_char(*p, p == name)) p++;
+    int name_len = p - name;
+    while (*p == ' ' || *p == '\t') p++;
+    if (name_len == 0 || *p != '=') {
+        name = "ans";
+        name_len = 3;
+        p = expression;
+    } else {
+        p++;
+    }
+
+    int64_t value;
+    if (calc_eval(p, &value) != 0) return;
+    int slot = calc_var_slot(name, name_len, 1);
+    if (slot < 0) return;
+    calc_vars[slot].value = value;
+    if (p != expression) {
+        print_n(name, name_len);
+        print(" = ");
+    }
+    calc_print(value);
+    print("\n");
+}
+
+// The expression may be one word or several, as in calc 2 + 3
+void calc_command(int argc, char **argv) {
+    char expression[COMMAND_LINE_MAX];
+    join_args(argc, argv, 1, expression, sizeof(expression));
+    calc(expression);
+}
+COMMAND_ARGS(calc, calc_command, 1, COMMAND_ANY_ARGS, "calc [expr]", "Calculator");
+
+// Tabulate an expression for a variable going from one value to another
+void expr_command(int argc, char **argv) {
+    const char *name = argv[1];
+    int name_len = strlen(name);
+    for (int i = 0; i < name_len; i++) {
+        if (!calc_name_char(name[i], i == 0)) {
+            print("Error: Invalid variable name\n");
+            return;
+        }
+    }
+    int64_t from;
+    int64_t to;
+    int64_t step;
+    if (calc_eval(argv[2], &from) != 0 || calc_eval(argv[3], &to) != 0 ||
+        calc_eval(argv[4], &step) != 0) {
+        return;
+    }
+    if (step == 0) {
+        print("Error: The step must not be 0\n");
+        return;
+    }
+    int slot = calc_var_slot(name, name_len, 1);
+    if (slot < 0) return;
+
+    char expression[COMMAND_LINE_MAX];
+    CalcProgram *program = (CalcProgram *)malloc(sizeof(CalcProgram));
+    if (program == NULL) {
+        print("Error: Out of memory\n");
+        return;
+    }
+    join_args(argc, argv, 5, expression, sizeof(expression));
+    if (calc_compile(expression, program) != 0) {
+        free(program);
+        return;
+    }
+
+    int64_t x = from;
+    while ((step > 0 ? x <= to : x >= to) && !task_killed()) {
+        char buf[28];
+        int64_t value;
+        calc_vars[slot].value = x;
+        if (calc_run(program, &value) != 0) break;
+        calc_format(x, buf);
+        print_padded(buf, 16);
+        calc_print(value);
+        print("\n");
+        if (step > 0 ? x > to - step : x < to - step) break;  // The next would pass to
+        x += step;
+    }
+    free(program);
+}
+COMMAND_ARGS(expr, expr_command, 5, COMMAND_ANY_ARGS, "expr [var] [from] [to] [step] [expr]",
+             "Tabulate an expression");
+
+// End of Calculator
+
+// Nonzero if dir is ancestor itself or lies below it
+int dir_within(Directory *dir, Directory *ancestor) {
+    for (; dir != NULL; dir = dir->parent) {
+        if (dir == ancestor) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void search_files(const char *filename) {
+    int found = 0;
+    uint32_t len = strlen(filename);
+
+    if (len >= 3 && name_index_complete) {
+        // Candidates are the names holding the query's rarest trigram
+        Trigram *rarest = NULL;
+        for (uint32_t i = 0; i + 3 <= len; i++) {
+            Trigram *trigram = *trigram_slot(trigram_key(filename + i));
+            if (trigram == NULL) {
+                rarest = NULL;
+                break;
+            }
+            if (rarest == NULL || trigram->count < rarest->count) {
+                rarest = trigram;
+            }
+        }
+
+        for (uint32_t i = 0; rarest != NULL && i < rarest->count; i++) {
+            NameRecord *record = &name_records[rarest->records[i]];
+            if (strstr(record->name, filename) != NULL &&
+                dir_within(record->dir, fs.current_dir)) {
+                print(record->name);
+                print("\n");
+                found = 1;
+            }
+        }
+    } else {
+        // Short queries match too many trigrams to be worth it; scan the tree
+        DirWalk walk;
+        dir_walk_begin(&walk, fs.current_dir);
+        FileEntry *entry;
+        uint32_t steps = 0;
+        while ((entry = dir_walk_next(&walk)) != NULL) {
+            if (++steps % WALK_YIELD_PERIOD == 0 && fs_yield()) {
+                return;
+            }
+            if (strstr(entry->filename, filename) != NULL) {
+                print(entry->filename);
+                print("\n");
+                found = 1;
+            }
+        }
+    }
+
+    if (!found) {
+        print("No files found matching the search term.\n");
+    }
+}
+
+void search_command(int argc, char **argv) {
+    search_files(argv[1]);
+}
+COMMAND_ARGS(search, search_command, 1, 1, "search [filename]", "Search files");
+
+void play_sound(unsigned int frequency);
+void stop_sound(void);
+void sleep(unsigned int milliseconds);
+void play_silly_tune(void);
+
+void play_sound(unsigned int frequency) {
+    unsigned int div;
+    unsigned char tmp;
+
+    // Set the PIT to the desired frequency
+    div = 1193180 / frequency;
+    outb(0x43, 0xb6);
+    outb(0x42, (unsigned char)(div));
+    outb(0x42, (unsigned char)(div >> 8));
+
+    // And play the sound using the PC speaker
+    tmp = inb(0x61);
+    if (tmp != (tmp | 3)) {
+        outb(0x61, tmp | 3);
+    }
+}
+
+void stop_sound(void) {
+    unsigned char tmp = inb(0x61) & 0xFC;
+    outb(0x61, tmp);
+}
+
+// Other tasks run in between, so background jobs go on while one sleeps
+void sleep(unsigned int milliseconds) {
+    for (unsigned int ms = 0; ms < milliseconds && !task_killed(); ms++) {
+        for (unsigned int i = 0; i < 10000; i++) {
+            __asm__ __volatile__("nop");
+        }
+        task_yield();
+    }
+}
+
+void play_silly_tune(void) {
+    // Define some basic frequencies
+    const unsigned int C4 = 262;
+    const unsigned int D4 = 294;
+    const unsigned int E4 = 330;
+    const unsigned int F4 = 349;
+    const unsigned int G4 = 392;
+    const unsigned int A4 = 440;
+    const unsigned int B4 = 494;
+    const unsigned int C5 = 523;
+
+    print_colored("Playing a silly tune...\n", make_color(LIGHT_CYAN, BLACK));
+
+    const unsigned int notes[] = {E4, D4, C4, D4, E4, E4, E4, D4, D4, D4, E4, G4, G4, E4, D4, C4,
+                                  D4, E4, E4, E4, E4, D4, D4, E4, D4, C4,
+
+                                  // New section
+                                  C4, C4, D4, E4, E4, D4, C4, C4, D4, E4, E4, D4, C4, C4, D4, E4,
+
+                                  // Another variation
+                                  G4, G4, A4, B4, B4, A4, G4, G4, A4, B4, B4, A4, G4, G4, A4, B4,
+
+                                  // Final section
+                                  E4, D4, C4, D4, E4, E4, E4, D4, D4, D4, E4, G4, G4, E4, D4, C4,
+                                  D4, E4, E4, E4, E4, D4, D4, E4, D4, C4};
+
+    const unsigned int durations[] = {
+        200, 200, 200, 200, 200, 200, 400, 200, 200, 400, 200, 200, 400, 200, 200, 200, 200, 200,
+        200, 400, 200, 200, 200, 200, 200, 400,
+
+        // New section durations
+        200, 200, 200, 200, 200, 200, 400, 200, 200, 200, 200, 200, 200, 400, 200,
+
+        // Another variation durations
+        200, 200, 200, 200, 200, 200, 400, 200, 200, 200, 200, 200, 200, 400, 200,
+
+        // Final section durations
+        200, 200, 200, 200, 200, 200, 400, 200, 200, 400, 200, 200, 400, 200, 200, 200, 200, 200,
+        200, 400, 200, 200, 200, 200, 200, 400};
+
+    for (int i = 0; i < sizeof(notes) / sizeof(notes[0]); i++) {
+        play_sound(notes[i]);
+        sleep(durations[i]);
+        stop_sound();
+        sleep(50);  // Small pause between notes
+    }
+
+    print_colored("Song finished!\n", make_color(LIGHT_GREEN, BLACK));
+}
+COMMAND(play, play_silly_tune, "Play a silly tune");
+
+// Modified cpuinfo function
+// Function to emulate CPUID instruction
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx,
+                         uint32_t *ecx, uint32_t *edx) {
+    __asm__ __volatile__("cpuid"
+                         : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                         : "a"(leaf), "c"(subleaf));
+}
+
+// Function prototypes for the adventure game
+void adventure_north(void);
+void adventure_south(void);
+void adventure_east(void);
+void adventure_west(void);
+void textadventure(void);
+
+void textadventure() {
+    clear_screen();
+    print_colored("Welcome to the Text Adventure Game!\n", make_color(LIGHT_CYAN, BLACK));
+    print_colored("You find yourself in a dark forest. You can go:\n",
+                  make_color(LIGHT_GREEN, BLACK));
+    print_colored("1. North\n", make_color(WHITE, BLACK));
+    print_colored("2. South\n", make_color(WHITE, BLACK));
+    print_colored("3. East\n", make_color(WHITE, BLACK));
+    print_colored("4. West\n", make_color(WHITE, BLACK));
+    print_colored("Type your choice (1-4): ", make_color(LIGHT_GREY, BLACK));
+
+    char choice[2];
+    read_line(choice, sizeof(choice));
+
+    if (strcmp(choice, "1") == 0) {
+        adventure_north();
+    } else if (strcmp(choice, "2") == 0) {
+        adventure_south();
+    } else if (strcmp(choice, "3") == 0) {
+        adventure_east();
+    } else if (strcmp(choice, "4") == 0) {
+        adventure_west();
+    } else {
+        print_colored("Invalid choice. Game over.\n", make_color(RED, BLACK));
+    }
+}
+COMMAND(textgame, textadventure, "Start a game");
+
+void adventure_north() {
+    clear_screen();
+    print_colored("You go north and find a mysterious treasure chest!\n",
+                  make_color(LIGHT_BROWN, BLACK));
+    print_colored("The chest is covered in ancient runes and seems to glow...\n",
+                  make_color(LIGHT_BLUE, BLACK));
+    print_colored("Do you want to open it? (y/n): ", make_color(WHITE, BLACK));
+
+    char choice[2];
+    read_line(choice, sizeof(choice));
+
+    if (strcmp(choice, "y") == 0) {
+        print_colored("\nYou carefully open the chest...\n", make_color(LIGHT_GREY, BLACK));
+        print_colored("*FLASH* A burst of light blinds you momentarily!\n",
+                      make_color(WHITE, BLACK));
+        print_colored("You found a magical sword and 100 gold coins!\n",
+                      make_color(LIGHT_GREEN, BLACK));
+    } else {
+        print_colored("You decide to play it safe and leave the chest alone.\n",
+                      make_color(LIGHT_RED, BLACK));
+        print_colored("Perhaps some mysteries are better left unsolved...\n",
+                      make_color(MAGENTA, BLACK));
+    }
+    print_colored("\nPress any key to continue...\n", make_color(WHITE, BLACK));
+    get_keyboard_char();
+}
+
+void adventure_south() {
+    clear_screen();
+    print_colored("You venture south into darker woods...\n", make_color(DARK_GREY, BLACK));
+    print_colored("Suddenly, a massive dragon appears before you!\n", make_color(RED, BLACK));
+    print_colored("Its scales shimmer with an otherworldly glow...\n",
+                  make_color(LIGHT_RED, BLACK));
+    print_colored("Do you want to fight it? (y/n): ", make_color(WHITE, BLACK));
+
+    char choice[2];
+    read_line(choice, sizeof(choice));
+
+    if (strcmp(choice, "y") == 0) {
+        print_colored("\nYou draw your weapon and charge forward!\n",
+                      make_color(LIGHT_BROWN, BLACK));
+        print_colored("After an epic battle, you emerge victorious!\n", make_color(GREEN, BLACK));
+        print_colored("The dragon transforms into a friendly spirit...\n",
+                      make_color(LIGHT_CYAN, BLACK));
+    } else {
+        print_colored("You wisely choose to retreat...\n", make_color(LIGHT_BLUE, BLACK));
+        print_colored("The dragon nods respectfully at your decision.\n", make_color(CYAN, BLACK));
+    }
+    print_colored("\nPress any key to continue...\n", make_color(WHITE, BLACK));
+    get_keyboard_char();
+}
+
+void adventure_east() {
+    clear_screen();
+    print_colored("You travel east and discover a mystical village!\n",
+                  make_color(LIGHT_GREEN, BLACK));
+    print_colored("An old sage approaches you with ancient wisdom...\n", make_color(CYAN, BLACK));
+    print_colored("Do you want to hear their counsel? (y/n): ", make_color(WHITE, BLACK));
+
+    char choice[2];
+    read_line(choice, sizeof(choice));
+
+    if (strcmp(choice, "y") == 0) {
+        print_colored("\nThe sage reveals secrets of great power...\n", make_color(MAGENTA, BLACK));
+        print_colored("You learn about a legendary artifact!\n", make_color(LIGHT_BROWN, BLACK));
+        print_colored("This knowledge will serve you well...\n", make_color(LIGHT_CYAN, BLACK));
+    } else {
+        print_colored("You politely decline the sage's offer.\n", make_color(LIGHT_GREY, BLACK));
+        print_colored("Sometimes ignorance is bliss...\n", make_color(DARK_GREY, BLACK));
+    }
+    print_colored("\nPress any key to continue...\n", make_color(WHITE, BLACK));
+    get_keyboard_char();
+}
+
+void adventure_west() {
+    clear_screen();
+    print_colored("You head west into a mysterious fog...\n", make_color(LIGHT_BLUE, BLACK));
+    print_colored("The mists swirl around you creating strange shapes...\n",
+                  make_color(CYAN, BLACK));
+    print_colored("You hear whispers from the beyond...\n", make_color(MAGENTA, BLACK));
+    print_colored("As the fog clears, you find your way back...\n", make_color(GREEN, BLACK));
+    print_colored("But you're not quite the same as before...\n", make_color(LIGHT_MAGENTA, BLACK));
+    print_colored("\nPress any key to continue...\n", make_color(WHITE, BLACK));
+    get_keyboard_char();
+}
+
+void cpuinfo() {
+    char vendor[13];
+    uint32_t eax, ebx, ecx, edx;
+
+    // Get vendor string
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+
+    *(uint32_t *)(&vendor[0]) = ebx;
+    *(uint32_t *)(&vendor[4]) = edx;
+    *(uint32_t *)(&vendor[8]) = ecx;
+    vendor[12] = '\0';
+
+    print("CPU Vendor: ");
+    print(vendor);
+    print("\n");
+
+    // Get CPU features
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+    print("CPU Features:\n");
+    if (edx & (1 << 0)) print("- FPU\n");
+    if (edx & (1 << 4)) print("- TSC\n");
+    if (edx & (1 << 5)) print("- MSR\n");
+    if (edx & (1 << 23)) print("- MMX\n");
+    if (edx & (1 << 25)) print("- SSE\n");
+    if (edx & (1 << 26)) print("- SSE2\n");
+    if (ecx & (1 << 0)) print("- SSE3\n");
+}
+COMMAND(cpuinfo, cpuinfo, "Display CPU info");
+
+// Content search
+//
+// grep reads each file through a window of whole lines. Literal patterns are
+// located with SSE2, testing sixteen positions at once against the pattern's
+// first and last byte and confirming the survivors byte by byte; without SSE2
+// a Boyer-Moore-Horspool scan does the same job. Patterns using regex
+// operators (. [] * + ? ^ $) are compiled into a DFA whose states are built
+// on demand from the set of pattern positions still alive.
+
+#define GREP_WINDOW 8192
+#define GREP_MAX_PATTERN 64
+
+#define GREP_IGNORE_CASE 0x1
+#define GREP_COUNT 0x2
+#define GREP_RECURSIVE 0x4
+#define GREP_NAMES 0x8  // Prefix matches with the file path
+
+#define RE_MAX_ATOMS 31  // Positions 0..31 fit a 32-bit set, the last one accepts
+#define RE_MAX_STATES 64
+#define RE_DEAD 0
+#define RE_START 1
+
+typedef struct {
+    uint8_t quant;    // 1, '*', '+' or '?'
+    uint32_t set[8];  // Bitmap of the bytes the atom matches
+} ReAtom;
+
+// Each grep has a search of its own, so that pipeline stages can search at
+// the same time
+typedef struct {
+    uint8_t vectors[4][16] __attribute__((aligned(16)));  // First and last byte, both cases
+    uint8_t window[GREP_WINDOW];                           // Text being searched
+    int flags;
+    int is_regex;
+    int stopped;  // Killed, or the files went away under it
+
+    // Literal pattern, lowercased when ignoring case
+    uint8_t literal[GREP_MAX_PATTERN];
+    uint32_t length;
+    uint32_t skip[256];  // Horspool shift per byte
+
+    // Regex pattern
+    ReAtom atoms[RE_MAX_ATOMS];
+    uint32_t num_atoms;
+    int anchor_start;
+    int anchor_end;
+    uint32_t dfa_sets[RE_MAX_STATES];  // Live positions of each DFA state
+    int16_t dfa_next[RE_MAX_STATES][256];
+    uint32_t dfa_states;
+
+    // File being searched
+    Directory *root;
+    Directory *dir;
+    const char *name;
+    uint32_t matches;
+} GrepSearch;
+
+char *strchr(const char *str, int c);
+
+int sse2_enabled = 0;
+uint8_t grep_newlines[16] __attribute__((aligned(16)));
+
+// Turn on SSE for the kernel if the CPU has SSE2
+void sse_init() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 26))) {
+        return;
+    }
+
+    uint32_t cr0, cr4;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    cr0 = (cr0 & ~(1 << 2)) | (1 << 1);  // No FPU emulation, monitor coprocessor
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(cr0));
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= (1 << 9) | (1 << 10);  // OSFXSR, OSXMMEXCPT
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4));
+    sse2_enabled = 1;
+}
+
+uint8_t fold_case(uint8_t c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+uint32_t popcount(uint32_t x) {
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    return (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+// Bit i set if p[i] matches the first byte and q[i] the last byte of the literal
+static inline uint32_t sse2_pair_mask(GrepSearch *g, const uint8_t *p, const uint8_t *q) {
+    uint32_t mask;
+    __asm__ __volatile__(
+        "movdqu (%1), %%xmm0\n\t"
+        "movdqa %%xmm0, %%xmm1\n\t"
+        "pcmpeqb 0(%3), %%xmm0\n\t"
+        "pcmpeqb 16(%3), %%xmm1\n\t"
+        "por %%xmm1, %%xmm0\n\t"
+        "movdqu (%2), %%xmm2\n\t"
+        "movdqa %%xmm2, %%xmm3\n\t"
+        "pcmpeqb 32(%3), %%xmm2\n\t"
+        "pcmpeqb 48(%3), %%xmm3\n\t"
+        "por %%xmm3, %%xmm2\n\t"
+        "pand %%xmm2, %%xmm0\n\t"
+        "pmovmskb %%xmm0, %0"
+        : "=r"(mask)
+        : "r"(p), "r"(q), "r"(g->vectors)
+        : "memory");
+    return mask;
+}
+
+// Bit i set if p[i] is a newline
+static inline uint32_t sse2_newline_mask(const uint8_t *p) {
+    uint32_t mask;
+    __asm__ __volatile__(
+        "movdqu (%1), %%xmm0\n\t"
+        "pcmpeqb (%2), %%xmm0\n\t"
+        "pmovmskb %%xmm0, %0"
+        : "=r"(mask)
+        : "r"(p), "r"(grep_newlines)
+        : "memory");
+    return mask;
+}
+
+uint32_t count_newlines(const uint8_t *buf, uint32_t from, uint32_t to) {
+    uint32_t count = 0;
+    if (sse2_enabled) {
+        for (; from + 16 <= to; from += 16) {
+            count += popcount(sse2_newline_mask(buf + from));
+        }
+    }
+    for (; from < to; from++) {
+        count += buf[from] == '\n';
+    }
+    return count;
+}
+
+int literal_equal(GrepSearch *g, const uint8_t *p) {
+    if (!(g->flags & GREP_IGNORE_CASE)) {
+        return memcmp(p, g->literal, g->length) == 0;
+    }
+    for (uint32_t i = 0; i < g->length; i++) {
+        if (fold_case(p[i]) != g->literal[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Offset of the first occurrence of the literal in buf[start, len), or -1
+int literal_find(GrepSearch *g, const uint8_t *buf, uint32_t start, uint32_t len) {
+    uint32_t last = g->length - 1;
+    uint32_t i = start;
+
+    if (sse2_enabled) {
+        for (; i + last + 16 <= len; i += 16) {
+            uint32_t mask = sse2_pair_mask(g, buf + i, buf + i + last);
+            while (mask) {
+                uint32_t bit = __builtin_ctz(mask);
+                if (literal_equal(g, buf + i + bit)) {
+                    return i + bit;
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+
+    while (i + last < len) {
+        if (literal_equal(g, buf + i)) {
+            return i;
+        }
+        i += g->skip[buf[i + last]];
+    }
+    return -1;
+}
+
+void literal_compile(GrepSearch *g, const char *pattern) {
+    int fold = g->flags & GREP_IGNORE_CASE;
+    g->length = strlen(pattern);
+    for (uint32_t i = 0; i < g->length; i++) {
+        g->literal[i] = fold ? fold_case(pattern[i]) : (uint8_t)pattern[i];
+    }
+
+    for (uint32_t c = 0; c < 256; c++) {
+        g->skip[c] = g->length;
+    }
+    for (uint32_t i = 0; i + 1 < g->length; i++) {
+        uint8_t c = g->literal[i];
+        g->skip[c] = g->length - 1 - i;
+        if (fold && c >= 'a' && c <= 'z') {
+            g->skip[c - ('a' - 'A')] = g->length - 1 - i;
+        }
+    }
+
+    uint8_t first = g->literal[0];
+    uint8_t last = g->literal[g->length - 1];
+    for (int i = 0; i < 16; i++) {
+        g->vectors[0][i] = first;
+        g->vectors[1][i] = (fold && first >= 'a' && first <= 'z') ? first - ('a' - 'A') : first;
+        g->vectors[2][i] = last;
+        g->vectors[3][i] = (fold && last >= 'a' && last <= 'z') ? last - ('a' - 'A') : last;
+        grep_newlines[i] = '\n';
+    }
+}
+
+void re_set(ReAtom *atom, uint8_t c) {
+    atom->set[c >> 5] |= 1u << (c & 31);
+}
+
+int re_has(ReAtom *atom, uint8_t c) {
+    return (atom->set[c >> 5] >> (c & 31)) & 1;
+}
+
+int re_compile(GrepSearch *g, const char *p) {
+    g->num_atoms = 0;
+    g->anchor_start = 0;
+    g->anchor_end = 0;
+    if (*p == '^') {
+        g->anchor_start = 1;
+        p++;
+    }
+
+    while (*p) {
+        if (*p == '$' && p[1] == '\0') {
+            g->anchor_end = 1;
+            break;
+        }
+        if (g->num_atoms >= RE_MAX_ATOMS || *p == '*' || *p == '+' || *p == '?') {
+            return -1;  // Too long, or nothing to repeat
+        }
+
+        ReAtom *atom = &g->atoms[g->num_atoms++];
+        memset(atom, 0, sizeof(ReAtom));
+        atom->quant = 1;
+        if (*p == '.') {
+            memset(atom->set, 0xFF, sizeof(atom->set));
+            p++;
+        } else if (*p == '[') {
+            p++;
+            int negate = (*p == '^');
+            if (negate) p++;
+            const char *first = p;
+            while (*p && (*p != ']' || p == first)) {
+                uint8_t lo = (uint8_t)*p++;
+                uint8_t hi = lo;
+                if (*p == '-' && p[1] && p[1] != ']') {
+                    hi = (uint8_t)p[1];
+                    p += 2;
+                }
+                for (uint32_t c = lo; c <= hi; c++) {
+                    re_set(atom, c);
+                }
+            }
+            if (*p != ']') {
+                return -1;  // Unterminated class
+            }
+            p++;
+            if (negate) {
+                for (int i = 0; i < 8; i++) atom->set[i] = ~atom->set[i];
+            }
+        } else {
+            if (*p == '\\' && p[1]) p++;
+            re_set(atom, (uint8_t)*p++);
+        }
+
+        if (g->flags & GREP_IGNORE_CASE) {
+            for (uint8_t c = 'a'; c <= 'z'; c++) {
+                if (re_has(atom, c) || re_has(atom, c - ('a' - 'A'))) {
+                    re_set(atom, c);
+                    re_set(atom, c - ('a' - 'A'));
+                }
+            }
+        }
+        if (*p == '*' || *p == '+' || *p == '?') {
+            atom->quant = *p++;
+        }
+    }
+    return 0;
+}
+
+// Add the positions reachable by skipping optional atoms
+uint32_t re_closure(GrepSearch *g, uint32_t set) {
+    for (uint32_t i = 0; i < g->num_atoms; i++) {
+        if ((set & (1u << i)) && (g->atoms[i].quant == '*' || g->atoms[i].quant == '?')) {
+            set |= 1u << (i + 1);
+        }
+    }
+    return set;
+}
+
+void dfa_reset(GrepSearch *g) {
+    memset(g->dfa_next, 0xFF, sizeof(g->dfa_next));
+    memset(g->dfa_next[RE_DEAD], 0, sizeof(g->dfa_next[RE_DEAD]));
+    g->dfa_sets[RE_DEAD] = 0;
+    g->dfa_sets[RE_START] = re_closure(g, 1);
+    g->dfa_states = 2;
+}
+
+// Compute and cache the transition of state on byte c
+int dfa_build(GrepSearch *g, int state, uint8_t c) {
+    uint32_t set = g->dfa_sets[state];
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < g->num_atoms; i++) {
+        if ((set & (1u << i)) && re_has(&g->atoms[i], c)) {
+            if (g->atoms[i].quant == '*' || g->atoms[i].quant == '+') {
+                next |= 1u << i;
+            }
+            next |= 1u << (i + 1);
+        }
+    }
+    next = re_closure(g, next);
+    if (!g->anchor_start) {
+        next |= g->dfa_sets[RE_START];  // A match may begin at every byte
+    }
+
+    int target = -1;
+    for (uint32_t s = 0; s < g->dfa_states; s++) {
+        if (g->dfa_sets[s] == next) {
+            target = s;
+            break;
+        }
+    }
+    if (target < 0) {
+        if (g->dfa_states == RE_MAX_STATES) {
+            dfa_reset(g);  // Start over rather than grow without bound
+            state = -1;
+        }
+        target = g->dfa_states++;
+        g->dfa_sets[target] = next;
+    }
+    if (state >= 0) {
+        g->dfa_next[state][c] = target;
+    }
+    return target;
+}
+
+// Print the path of leaf in dir relative to root
+void print_relative_path(Directory *dir, Directory *root, const char *leaf) {
+    char path[256];
+    uint32_t pos = sizeof(path) - 1;
+    path[pos] = '\0';
+    const char *name = leaf;
+    while (1) {
+        uint32_t len = strlen(name);
+        if (len + 1 > pos) {
+            break;  // Too deep; keep the tail
+        }
+        pos -= len;
+        memcpy(path + pos, name, len);
+        if (dir == root || dir == NULL) {
+            break;
+        }
+        path[--pos] = '/';
+        name = dir->name;
+        dir = dir->parent;
+    }
+    print(path + pos);
+}
+
+void grep_report(GrepSearch *g, uint32_t line, const uint8_t *text, uint32_t len) {
+    g->matches++;
+    if (g->flags & GREP_COUNT) {
+        return;
+    }
+    if (g->flags & GREP_NAMES) {
+        print_relative_path(g->dir, g->root, g->name);
+        print(":");
+    }
+    print_uint(line);
+    print(":");
+    print_n((const char *)text, len);
+    print("\n");
+}
+
+// Search the lines in buf[0, len); *line counts the newlines seen so far
+void grep_lines(GrepSearch *g, const uint8_t *buf, uint32_t len, uint32_t *line) {
+    uint32_t pos = 0;
+
+    if (!g->is_regex) {
+        uint32_t counted = 0;
+        while (pos < len) {
+            int at = literal_find(g, buf, pos, len);
+            if (at < 0) {
+                break;
+            }
+            uint32_t start = at;
+            while (start > pos && buf[start - 1] != '\n') start--;
+            uint32_t end = at + g->length;
+            while (end < len && buf[end] != '\n') end++;
+
+            *line += count_newlines(buf, counted, start);
+            counted = start;
+            grep_report(g, *line + 1, buf + start, end - start);
+            pos = end + 1;
+        }
+        *line += count_newlines(buf, counted, len);
+        return;
+    }
+
+    uint32_t accept = 1u << g->num_atoms;
+    while (pos < len) {
+        int state = RE_START;
+        int matched = !g->anchor_end && (g->dfa_sets[state] & accept);
+        uint32_t end = pos;
+        while (!matched && state != RE_DEAD && end < len && buf[end] != '\n') {
+            uint8_t c = buf[end++];
+            int next = g->dfa_next[state][c];
+            state = (next >= 0) ? next : dfa_build(g, state, c);
+            matched = !g->anchor_end && (g->dfa_sets[state] & accept);
+        }
+        if (g->anchor_end && (end == len || buf[end] == '\n')) {
+            matched = (g->dfa_sets[state] & accept) != 0;
+        }
+        while (end < len && buf[end] != '\n') end++;
+
+        if (matched) {
+            grep_report(g, *line + 1, buf + pos, end - pos);
+        }
+        if (end < len) {
+            (*line)++;
+        }
+        pos = end + 1;
+    }
+}
+
+// Search a file, or the input of the task if entry is NULL
+void grep_file(GrepSearch *g, Directory *dir, FileEntry *entry) {
+    g->dir = dir;
+    g->name = entry ? entry->filename : NULL;
+    g->matches = 0;
+
+    uint32_t line = 0;
+    uint32_t offset = 0;
+    uint32_t carry = 0;  // Bytes of an unfinished line kept from the last window
+    int more = 1;
+    while (more) {
+        int n = entry ? file_read_at(entry, offset, g->window + carry, GREP_WINDOW - carry)
+                      : current_input->read(current_input, g->window + carry, GREP_WINDOW - carry);
+        if (n < 0) n = 0;
+        offset += n;
+        more = n > 0 && (entry == NULL || offset < entry->size);
+        uint32_t len = carry + n;
+
+        // Hold back a trailing partial line unless the window has no line break at all
+        uint32_t end = len;
+        if (more) {
+            while (end > 0 && g->window[end - 1] != '\n') end--;
+            if (end == 0) end = len;
+        }
+        grep_lines(g, g->window, end, &line);
+        carry = len - end;
+        memcpy(g->window, g->window + end, carry);  // Forward copy, safe to overlap
+
+        // Input from a pipe yields on its own
+        if (more && entry != NULL && fs_yield()) {
+            g->stopped = 1;
+            return;
+        }
+    }
+
+    if ((g->flags & GREP_COUNT) && (g->matches > 0 || !(g->flags & GREP_NAMES))) {
+        if (g->flags & GREP_NAMES) {
+            print_relative_path(g->dir, g->root, g->name);
+            print(":");
+        }
+        print_uint(g->matches);
+        print("\n");
+    }
+}
+
+// Compile the pattern into g; -1 after printing an error
+int grep_compile(GrepSearch *g, const char *pattern) {
+    if (strlen(pattern) > GREP_MAX_PATTERN - 1) {
+        print("Error: Pattern too long\n");
+        return -1;
+    }
+
+    g->is_regex = 0;
+    for (const char *p = pattern; *p; p++) {
+        if (strchr(".[]*+?^$\\", *p) != NULL) {
+            g->is_regex = 1;
+        }
+    }
+    if (g->is_regex) {
+        if (re_compile(g, pattern) != 0) {
+            print("Error: Invalid pattern\n");
+            return -1;
+        }
+        dfa_reset(g);
+    } else {
+        literal_compile(g, pattern);
+    }
+    return 0;
+}
+
+// Search path, or the input of the task if it has one and path is empty;
+// returns the number of matches
+uint32_t grep_search(GrepSearch *g, const char *path) {
+    g->stopped = 0;
+    if (path[0] == '\0' && current_input != &console) {
+        grep_file(g, NULL, NULL);
+        return g->matches;
+    }
+
+    // A single file or a directory to scan
+    Directory *dir;
+    FileEntry *target;
+    if (resolve_path(path, &dir, &target) != 0) {
+        print("Error: File not found.\n");
+        return 0;
+    }
+
+    uint32_t total = 0;
+    g->root = dir;
+    if (target != NULL) {
+        grep_file(g, dir, target);
+        return g->matches;
+    }
+    g->flags |= GREP_NAMES;
+    if (g->flags & GREP_RECURSIVE) {
+        DirWalk walk;
+        dir_walk_begin(&walk, dir);
+        walk.load = 1;
+        FileEntry *entry;
+        uint32_t steps = 0;
+        while (!g->stopped && (entry = dir_walk_next(&walk)) != NULL) {
+            if (++steps % WALK_YIELD_PERIOD == 0 && fs_yield()) {
+                g->stopped = 1;
+            } else if (!entry->is_directory) {
+                grep_file(g, walk.dir, entry);
+                total += g->matches;
+            }
+        }
+    } else {
+        for (uint32_t i = 0; i < dir->num_files && !g->stopped; i++) {
+            if (!dir->files[i].is_directory) {
+                grep_file(g, dir, &dir->files[i]);
+                total += g->matches;
+            }
+        }
+    }
+    return total;
+}
+
+// grep [-r] [-i] [-c] pattern [path]
+void grep(int argc, char **argv) {
+    int flags = 0;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1]; arg++) {
+        for (const char *flag = argv[arg] + 1; *flag; flag++) {
+            if (*flag == 'r') {
+                flags |= GREP_RECURSIVE;
+            } else if (*flag == 'i') {
+                flags |= GREP_IGNORE_CASE;
+            } else if (*flag == 'c') {
+                flags |= GREP_COUNT;
+            } else {
+                print("Usage: grep [-r] [-i] [-c] pattern [path]\n");
+                return;
+            }
+        }
+    }
+
+    // A pattern and at most one path are left
+    if (argc - arg < 1 || argc - arg > 2 || argv[arg][0] == '\0') {
+        print("Usage: grep [-r] [-i] [-c] pattern [path]\n");
+        return;
+    }
+
+    // The SSE2 vectors at the start of the search need 16-byte alignment
+    void *memory = malloc(sizeof(GrepSearch) + 15);
+    if (memory == NULL) {
+        print("Error: Out of memory\n");
+        return;
+    }
+    GrepSearch *g = (GrepSearch *)(((uint32_t)memory + 15) & ~15u);
+    g->flags = flags;
+    if (grep_compile(g, argv[arg]) == 0) {
+        uint32_t total = grep_search(g, arg + 1 < argc ? argv[arg + 1] : "");
+        if (total == 0 && !g->stopped && !(g->flags & GREP_COUNT)) {
+            print("No matches found.\n");
+        }
+    }
+    free(memory);
+}
+COMMAND_ARGS(grep, grep, 1, COMMAND_ANY_ARGS, "grep [-r] [-i] [-c] pattern [path]",
+             "Search file contents");
+
+// End of Content search
+
+// Modified time function
+void time() {
+    uint8_t second, minute, hour;
+
+    // Disable NMI
+    outb(0x70, 0x80);
+
+    // Read CMOS registers
+    outb(0x70, 0x00);
+    second = inb(0x71);
+    outb(0x70, 0x02);
+    minute = inb(0x71);
+    outb(0x70, 0x04);
+    hour = inb(0x71);
+
+    // Re-enable NMI
+    outb(0x70, 0x00);
+
+    // Convert BCD to binary
+    second = ((second & 0xF0) >> 4) * 10 + (second & 0x0F);
+    minute = ((minute & 0xF0) >> 4) * 10 + (minute & 0x0F);
+    hour = ((hour & 0xF0) >> 4) * 10 + (hour & 0x0F);
+
+    // Print time
+    print("Current time: ");
+    if (hour < 10) putchar('0');
+    char buffer[3];
+    int i = 0;
+
+    // Convert hour
+    do {
+        buffer[i++] = (hour % 10) + '0';
+        hour /= 10;
+    } while (hour > 0);
+    while (i > 0) putchar(buffer[--i]);
+
+    print(":");
+
+    // Convert minute
+    if (minute < 10) putchar('0');
+    i = 0;
+    do {
+        buffer[i++] = (minute % 10) + '0';
+        minute /= 10;
+    } while (minute > 0);
+    while (i > 0) putchar(buffer[--i]);
+
+    print(":");
+
+    // Convert second
+    if (second < 10) putchar('0');
+    i = 0;
+    do {
+        buffer[i++] = (second % 10) + '0';
+        second /= 10;
+    } while (second > 0);
+    while (i > 0) putchar(buffer[--i]);
+
+    print("\n");
+}
+COMMAND_RECORD(time, time, NULL, 0, 0, "time [command]", "Clock, or time a command");
+
+void reboot() {
+    print("Rebooting NeoNoir...\n");
+    print("Please wait while the system restarts...\n");
+
+    // Wait for keyboard buffer to empty
+    uint8_t temp;
+    do {
+        temp = inb(KEYBOARD_STATUS);
+        if (temp & 1) {
+            inb(KEYBOARD_PORT);
+        }
+    } while (temp & 2);
+
+    // Send reset command
+    outb(KEYBOARD_STATUS, 0xFE);
+
+    // If that didn't work, try alternative method
+    while (1) {
+        asm volatile("hlt");
+    }
+}
+COMMAND(reboot, reboot, "Restart the system");
+
+void echo(const char *str) {
+    print(str);
+    print("\n");
+}
+
+void echo_command(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (i > 1) print(" ");
+        print(argv[i]);
+    }
+    print("\n");
+}
+COMMAND_ARGS(echo, echo_command, 0, COMMAND_ANY_ARGS, "echo [text]", "Display the text");
+
+void print_system_info() {
+    print("NeoNoir v1.0\n");
+    print("Architecture: x86, 32 Bit\n");
+    print("Memory: 640KB Base Memory\n");
+    print("Display: VGA Text Mode 80x26\n");
+}
+COMMAND(uname, print_system_info, "Display system info");
+
+void whoami() {
+    print("root\n");
+}
+COMMAND(whoami, whoami, "Display current user");
+
+void hostname() {
+    print("NeoNoir\n");
+}
+COMMAND(hostname, hostname, "Display system hostname");
+
+#define SNAKE_MAX_LENGTH 100
+#define BOARD_WIDTH 20
+#define BOARD_HEIGHT 20
+
+struct Point {
+    int x;
+    int y;
+};
+
+struct Snake {
+    struct Point body[SNAKE_MAX_LENGTH];
+    int length;
+    enum { UP, DOWN, LEFT, RIGHT } direction;
+};
+
+struct Game {
+    struct Snake snake;
+    struct Point food;
+    int score;
+    int game_over;
+};
+
+void init_game(struct Game *game) {
+    // Initialize snake in the middle
+    game->snake.body[0].x = BOARD_WIDTH / 2;
+    game->snake.body[0].y = BOARD_HEIGHT / 2;
+    game->snake.length = 1;
+    game->snake.direction = RIGHT;
+    game->score = 0;
+    game->game_over = 0;
+
+    // Place initial food
+    game->food.x = rand_range(0, BOARD_WIDTH - 1);
+    game->food.y = rand_range(0, BOARD_HEIGHT - 1);
+}
+
+void draw_board(struct Game *game) {
+    clear_screen();
+
+    // Draw border
+    for (int i = 0; i < BOARD_WIDTH + 2; i++) {
+        print_colored("#", make_color(LIGHT_BLUE, BLACK));
+    }
+    print("\n");
+
+    // Draw game area
+    for (int y = 0; y < BOARD_HEIGHT; y++) {
+        print_colored("#", make_color(LIGHT_BLUE, BLACK));
+
+        for (int x = 0; x < BOARD_WIDTH; x++) {
+            int is_snake = 0;
+            for (int i = 0; i < game->snake.length; i++) {
+                if (game->snake.body[i].x == x && game->snake.body[i].y == y) {
+                    print_colored("O", make_color(LIGHT_GREEN, BLACK));
+                    is_snake = 1;
+                    break;
+                }
+            }
+
+            if (!is_snake) {
+                if (game->food.x == x && game->food.y == y) {
+                    print_colored("*", make_color(LIGHT_RED, BLACK));
+                } else {
+                    print(" ");
+                }
+            }
+        }
+
+        print_colored("#\n", make_color(LIGHT_BLUE, BLACK));
+    }
+
+    // Draw border
+    for (int i = 0; i < BOARD_WIDTH + 2; i++) {
+        print_colored("#", make_color(LIGHT_BLUE, BLACK));
+    }
+    print("\n");
+
+    // Draw score
+    print("Score: ");
+    char score_str[10];
+    int i = 0;
+    int temp = game->score;
+    do {
+        score_str[i++] = (temp % 10) + '0';
+        temp /= 10;
+    } while (temp > 0);
+    while (i > 0) putchar(score_str[--i]);
+    print("\n");
+}
+
+void update_snake(struct Game *game) {
+    // Save current head position
+    struct Point new_head = game->snake.body[0];
+
+    // Update head position based on direction
+    switch (game->snake.direction) {
+        case UP:
+            new_head.y--;
+            break;
+        case DOWN:
+            new_head.y++;
+            break;
+        case LEFT:
+            new_head.x--;
+            break;
+        case RIGHT:
+            new_head.x++;
+            break;
+    }
+
+    // Check for collisions with walls
+    if (new_head.x < 0 || new_head.x >= BOARD_WIDTH || new_head.y < 0 ||
+        new_head.y >= BOARD_HEIGHT) {
+        game->game_over = 1;
+        return;
+    }
+
+    // Check for collisions with self
+    for (int i = 0; i < game->snake.length; i++) {
+        if (new_head.x == game->snake.body[i].x && new_head.y == game->snake.body[i].y) {
+            game->game_over = 1;
+            return;
+        }
+    }
+
+    // Move body
+    for (int i = game->snake.length - 1; i > 0; i--) {
+        game->snake.body[i] = game->snake.body[i - 1];
+    }
+    game->snake.body[0] = new_head;
+
+    // Check for food
+    if (new_head.x == game->food.x && new_head.y == game->food.y) {
+        game->score += 10;
+        game->snake.length++;
+
+        // Place new food
+        game->food.x = rand_range(0, BOARD_WIDTH - 1);
+        game->food.y = rand_range(0, BOARD_HEIGHT - 1);
+    }
+}
+
+void snake_game() {
+    struct Game game;
+    init_game(&game);
+
+    print_colored("Snake Game! Use WASD to move, Q to quit\n", make_color(LIGHT_CYAN, BLACK));
+    print("Press any key to start...\n");
+    get_keyboard_char();
+
+    while (!game.game_over) {
+        draw_board(&game);
+
+        // Handle input
+        char input = get_keyboard_char();
+        switch (input) {
+            case 'w':
+                if (game.snake.direction != DOWN) game.snake.direction = UP;
+                break;
+            case 's':
+                if (game.snake.direction != UP) game.snake.direction = DOWN;
+                break;
+            case 'a':
+                if (game.snake.direction != RIGHT) game.snake.direction = LEFT;
+                break;
+            case 'd':
+                if (game.snake.direction != LEFT) game.snake.direction = RIGHT;
+                break;
+            case 'q':
+                return;
+        }
+
+        update_snake(&game);
+
+        // Add a small delay
+        for (volatile int i = 0; i < 1000000; i++) {
+        }
+    }
+
+    print_colored("\nGame Over!\n", make_color(LIGHT_RED, BLACK));
+    print_colored("Final Score: ", make_color(LIGHT_GREEN, BLACK));
+    char score_str[10];
+    int i = 0;
+    int temp = game.score;
+    do {
+        score_str[i++] = (temp % 10) + '0';
+        temp /= 10;
+    } while (temp > 0);
+    while (i > 0) putchar(score_str[--i]);
+    print("\n");
+    print("Press any key to continue...\n");
+    get_keyboard_char();
+    clear_screen();
+}
+COMMAND(snake, snake_game, "Play the snake game");
+
+static uint32_t next = 1;  // Seed for the random number generator
+
+// Simple pseudo-random number generator
+static uint32_t z1 = 12345, z2 = 67890, z3 = 11111, z4 = 22222;
+
+// Xorshift algorithm combined with Linear Congruential Generator
+uint32_t rand() {
+    // Get some system entropy from timer and other sources
+    uint8_t timer_low = inb(0x40);        // Timer counter low byte
+    uint8_t timer_high = inb(0x40);       // Timer counter high byte
+    uint8_t keyboard_status = inb(0x64);  // Keyboard controller status
+    uint32_t timer_value = (timer_high << 8) | timer_low;
+
+    // Xorshift algorithm
+    z1 ^= (z1 << 11);
+    z1 ^= (z1 >> 8);
+    z2 ^= (z2 << 13);
+    z2 ^= (z2 >> 17);
+    z3 ^= (z3 << 9);
+    z3 ^= (z3 >> 7);
+    z4 = z4 ^ (z4 << 15);
+
+    // Combine multiple sources of randomness
+    uint32_t result = (z1 ^ z2 ^ z3 ^ z4) + timer_value + keyboard_status;
+
+    // Linear congruential generator
+    next = next * 1664525 + 1013904223;
+
+    // Mix everything together
+    result ^= next;
+    result ^= (result << 13);
+    result ^= (result >> 17);
+    result ^= (result << 5);
+
+    return result;
+}
+
+void srand(uint32_t seed) {
+    // Initialize all state variables with different transformations of the seed
+    next = seed;
+    z1 = seed ^ 0x12345678;
+    z2 = seed ^ 0x87654321;
+    z3 = seed ^ 0xFEDCBA98;
+    z4 = seed ^ 0x11223344;
+
+    // Additional mixing
+    for (int i = 0; i < 10; i++) {
+        rand();  // Discard first few values to improve distribution
+    }
+}
+
+// Helper function to get random number in a specific range
+uint32_t rand_range(uint32_t min, uint32_t max) {
+    uint32_t range = max - min + 1;
+    return min + (rand() % range);
+}
+
+void fortune() {
+    const char *fortunes[] = {"The best way to predict the future is to invent it.",
+                              "Stay hungry, stay foolish.",
+                              "The only way to do great work is to love what you do.",
+                              "Innovation distinguishes between a leader and a follower.",
+                              "The journey of a thousand miles begins with one step.",
+                              "Life is 10% what happens to us and 90% how we react to it.",
+                              "Your time is limited, don't waste it living someone else's life.",
+                              "You only live once, but if you do it right, once is enough."};
+    int fortune_count = sizeof(fortunes) / sizeof(fortunes[0]);
+    int random_index = rand() % fortune_count;  // Get a random index
+
+    print_colored("Your fortune: \n", make_color(LIGHT_CYAN, BLACK));
+    print_colored(fortunes[random_index], make_color(LIGHT_GREEN, BLACK));  // Display the fortune
+    print("\n");
+    print("\n");
+}
+COMMAND(fortune, fortune, "Display a fortune");
+
+// Function prototypes for the adventure game
+void adventure_north(void);
+void adventure_south(void);
+void adventure_east(void);
+void adventure_west(void);
+void textadventure(void);
+
+void print_banner() {
+    print(" /$$   /$$                     /$$   /$$           /$$          \n");
+    print("| $$$ | $$                    | $$$ | $$          |__/          \n");
+    print("| $$$$| $$  /$$$$$$   /$$$$$$ | $$$$| $$  /$$$$$$  /$$  /$$$$$$ \n");
+    print("| $$ $$ $$ /$$__  $$ /$$__  $$| $$ $$ $$ /$$__  $$| $$ /$$__  $$\n");
+    print("| $$  $$$$| $$$$$$$$| $$  \ $$| $$  $$$$| $$  \ $$| $$| $$  \__/\n");
+    print("| $$\  $$$| $$_____/| $$  | $$| $$\  $$$| $$  | $$| $$| $$      \n");
+    print("| $$ \  $$|  $$$$$$$|  $$$$$$/| $$ \  $$|  $$$$$$/| $$| $$      \n");
+    print("|__/  \__/ \_______/ \______/ |__/  \__/ \______/ |__/|__/      \n");
+    print_colored("\nWelcome to NeoNoir!\n", make_color(LIGHT_CYAN, BLACK));
+}
+COMMAND(banner, print_banner, "Display NeoNoir banner");
+
+// Text buffer
+//
+// Piece table behind noirtext. The text is a sequence of pieces, each a run of
+// bytes in the source file or in the append-only add buffer, kept in a treap
+// ordered by position. Every node caches the bytes and newlines of its
+// subtree, so finding an offset or the start of a line takes O(log n) steps,
+// and edits split and merge the treap instead of moving text.
+//
+// The source is not read when it is opened. It is cut into pieces from the
+// front as far as lookups need, or while the editor waits for keys, and its
+// bytes are only fetched to count newlines and to show or save them. A mapped
+// file is read where it lies, a heap file through its chunks, which are held
+// so that saving over the file leaves them alone, and a FAT file through a
+// few cached pages.
+
+#define TEXT_PIECE_MAX 4096  // Source bytes indexed per piece
+#define TEXT_ADD_BLOCK_SIZE 4096
+#define TEXT_PAGE_SIZE 1024
+#define TEXT_PAGES 8
+
+typedef struct TextPiece {
+    const char *text;  // In the add buffer, or NULL for bytes of the source
+    uint32_t offset;   // Start in the source
+    uint32_t length;
+    uint32_t newlines;
+    uint32_t priority;
+    uint32_t total_length;  // Of the subtree rooted here
+    uint32_t total_newlines;
+    struct TextPiece *left;
+    struct TextPiece *right;
+} TextPiece;
+
+typedef struct TextAddBlock {
+    struct TextAddBlock *next;
+    uint32_t used;
+    char data[TEXT_ADD_BLOCK_SIZE];
+} TextAddBlock;
+
+typedef struct {
+    uint32_t page;  // Page number plus one, 0 if free
+    uint32_t last_used;
+    char data[TEXT_PAGE_SIZE];
+} TextPage;
+
+typedef struct {
+    TextPiece *root;
+    TextAddBlock *add;  // Newest block first
+    uint32_t seed;      // For treap priorities
+
+    // Where the source lives: exactly one is set unless it is empty
+    const char *memory;     // Content of a mapped file
+    FileChunk **chunks;     // Chunks of a heap file, one reference each
+    struct FatNode *fat;    // File on a FAT volume
+    TextPage *pages;        // Cached pages of the FAT file
+    uint32_t page_clock;
+    uint32_t size;          // Bytes in the source
+    uint32_t indexed;       // Leading source bytes already in the treap
+    int missing_newline;    // The source does not end with one; it is added
+    int broken;             // Indexing ran out of memory, the text is incomplete
+    int read_failed;        // A page of the FAT file came back as '?' since last cleared
+} TextBuffer;
+
+void text_init(TextBuffer *buf) {
+    memset(buf, 0, sizeof(TextBuffer));
+    buf->seed = 2463534242u;
+}
+
+// Source bytes at offset, at least one and as many as lie together in memory.
+// The pointer is good until the next call.
+const char *text_source(TextBuffer *buf, uint32_t offset, uint32_t *count) {
+    if (buf->memory) {
+        *count = buf->size - offset;
+        return buf->memory + offset;
+    }
+    if (buf->chunks) {
+        uint32_t start = offset % FILE_CHUNK_SIZE;
+        *count = FILE_CHUNK_SIZE - start;
+        if (*count > buf->size - offset) *count = buf->size - offset;
+        return (const char *)chunk_bytes(buf->chunks[offset / FILE_CHUNK_SIZE]) + start;
+    }
+
+    uint32_t page = offset / TEXT_PAGE_SIZE;
+    TextPage *slot = &buf->pages[0];
+    for (int i = 0; i < TEXT_PAGES; i++) {
+        if (buf->pages[i].page == page + 1) {
+            slot = &buf->pages[i];
+            break;
+        }
+        if (buf->pages[i].last_used < slot->last_used) {
+            slot = &buf->pages[i];
+        }
+    }
+    uint32_t start = page * TEXT_PAGE_SIZE;
+    uint32_t length = buf->size - start < TEXT_PAGE_SIZE ? buf->size - start : TEXT_PAGE_SIZE;
+    if (slot->page != page + 1) {
+        if (fat_read(buf->fat, start, slot->data, length) != (int)length) {
+            memset(slot->data, '?', length);  // Shown, but never cached or saved
+            slot->page = 0;
+            buf->read_failed = 1;
+        } else {
+            slot->page = page + 1;
+        }
+    }
+    slot->last_used = ++buf->page_clock;
+    *count = start + length - offset;
+    return slot->data + offset - start;
+}
+
+// Bytes of node from start on, as many as lie together in memory
+const char *text_piece_bytes(TextBuffer *buf, TextPiece *node, uint32_t start,
+                             uint32_t *count) {
+    if (node->text) {
+        *count = node->length - start;
+        return node->text + start;
+    }
+    const char *bytes = text_source(buf, node->offset + start, count);
+    if (*count > node->length - start) *count = node->length - start;
+    return bytes;
+}
+
+uint32_t text_count_newlines(const char *text, uint32_t length) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        count += text[i] == '\n';
+    }
+    return count;
+}
+
+void text_update(TextPiece *node) {
+    node->total_length = node->length;
+    node->total_newlines = node->newlines;
+    if (node->left) {
+        node->total_length += node->left->total_length;
+        node->total_newlines += node->left->total_newlines;
+    }
+    if (node->right) {
+        node->total_length += node->right->total_length;
+        node->total_newlines += node->right->total_newlines;
+    }
+}
+
+TextPiece *text_new_piece(TextBuffer *buf) {
+    TextPiece *node = (TextPiece *)malloc(sizeof(TextPiece));
+    if (node == NULL) return NULL;
+    memset(node, 0, sizeof(TextPiece));
+    buf->seed ^= buf->seed << 13;
+    buf->seed ^= buf->seed >> 17;
+    buf->seed ^= buf->seed << 5;
+    node->priority = buf->seed;
+    return node;
+}
+
+// Point node at length bytes of the add buffer, or of the source at offset
+// when text is NULL
+void text_set_piece(TextBuffer *buf, TextPiece *node, const char *text, uint32_t offset,
+                    uint32_t length) {
+    node->text = text;
+    node->offset = offset;
+    node->length = length;
+    node->newlines = 0;
+    for (uint32_t start = 0, count; start < length; start += count) {
+        const char *bytes = text_piece_bytes(buf, node, start, &count);
+        node->newlines += text_count_newlines(bytes, count);
+    }
+    text_update(node);
+}
+
+void text_free_pieces(TextPiece *node) {
+    if (node == NULL) return;
+    text_free_pieces(node->left);
+    text_free_pieces(node->right);
+    free(node);
+}
+
+TextPiece *text_merge(TextPiece *left, TextPiece *right) {
+    if (left == NULL) return right;
+    if (right == NULL) return left;
+    if (left->priority > right->priority) {
+        left->right = text_merge(left->right, right);
+        text_update(left);
+        return left;
+    }
+    right->left = text_merge(left, right->left);
+    text_update(right);
+    return right;
+}
+
+// Split node into the first pos bytes and the rest. Cutting through a piece
+// takes *spare for its tail, so the caller allocates before anything changes.
+void text_split(TextBuffer *buf, TextPiece *node, uint32_t pos, TextPiece **spare,
+                TextPiece **left, TextPiece **right) {
+    if (node == NULL) {
+        *left = NULL;
+        *right = NULL;
+        return;
+    }
+    uint32_t left_length = node->left ? node->left->total_length : 0;
+    if (pos <= left_length) {
+        text_split(buf, node->left, pos, spare, left, &node->left);
+        *right = node;
+    } else if (pos >= left_length + node->length) {
+        text_split(buf, node->right, pos - left_length - node->length, spare, &node->right,
+                   right);
+        *left = node;
+    } else {
+        // The tail keeps the priority so it can stand in for node on the right
+        uint32_t cut = pos - left_length;
+        TextPiece *tail = *spare;
+        *spare = NULL;
+        tail->priority = node->priority;
+        tail->left = NULL;
+        tail->right = node->right;
+        text_set_piece(buf, tail, node->text ? node->text + cut : NULL, node->offset + cut,
+                       node->length - cut);
+        node->length = cut;
+        node->newlines -= tail->newlines;
+        node->right = NULL;
+        *left = node;
+        *right = tail;
+    }
+    text_update(node);
+}
+
+// Cut the next piece of the source into the treap; returns 0 once there is
+// nothing left to index
+int text_index_step(TextBuffer *buf) {
+    if (buf->indexed >= buf->size || buf->broken) {
+        return 0;
+    }
+    uint32_t length = buf->size - buf->indexed;
+    if (length > TEXT_PIECE_MAX) length = TEXT_PIECE_MAX;
+
+    // Lines always end with a newline, as they did when the file was saved
+    int add_newline = buf->indexed + length == buf->size && buf->missing_newline;
+    TextPiece *node = text_new_piece(buf);
+    TextPiece *newline = add_newline ? text_new_piece(buf) : NULL;
+    if (node == NULL || (add_newline && newline == NULL)) {
+        free(node);
+        buf->broken = 1;
+        return 0;
+    }
+    text_set_piece(buf, node, NULL, buf->indexed, length);
+    buf->root = text_merge(buf->root, node);
+    buf->indexed += length;
+    if (newline != NULL) {
+        text_set_piece(buf, newline, "\n", 0, 1);
+        buf->root = text_merge(buf->root, newline);
+    }
+    return 1;
+}
+
+// Index the source until the treap holds length bytes and the given number
+// of newlines, or all of it
+void text_index_to(TextBuffer *buf, uint32_t length, uint32_t newlines) {
+    while ((!buf->root || buf->root->total_length < length ||
+            buf->root->total_newlines < newlines) &&
+           text_index_step(buf)) {
+    }
+}
+
+// Length of the whole text, indexed or not
+uint32_t text_length(TextBuffer *buf) {
+    uint32_t length = buf->root ? buf->root->total_length : 0;
+    if (buf->indexed < buf->size && !buf->broken) {
+        length += buf->size - buf->indexed + buf->missing_newline;
+    }
+    return length;
+}
+
+// Lines found so far; *complete is set once the whole source is indexed
+uint32_t text_lines_known(TextBuffer *buf, int *complete) {
+    *complete = buf->indexed >= buf->size || buf->broken;
+    return buf->root ? buf->root->total_newlines : 0;
+}
+
+// Grow the piece ending at pos when text directly follows it in the add
+// buffer, which is what consecutive typing produces
+int text_extend(TextPiece *node, uint32_t pos, const char *text, uint32_t length) {
+    if (node == NULL) return 0;
+    uint32_t left_length = node->left ? node->left->total_length : 0;
+    int extended = 0;
+    if (pos <= left_length) {
+        extended = text_extend(node->left, pos, text, length);
+    } else if (pos > left_length + node->length) {
+        extended = text_extend(node->right, pos - left_length - node->length, text, length);
+    } else if (pos == left_length + node->length && node->text &&
+               node->text + node->length == text) {
+        node->length += length;
+        node->newlines += text_count_newlines(text, length);
+        extended = 1;
+    }
+    if (extended) text_update(node);
+    return extended;
+}
+
+// Copy up to length bytes of text to the end of the add buffer; returns
+// where they went and sets *copied, or NULL when out of memory
+const char *text_add(TextBuffer *buf, const char *text, uint32_t length, uint32_t *copied) {
+    TextAddBlock *block = buf->add;
+    if (block == NULL || block->used == TEXT_ADD_BLOCK_SIZE) {
+        block = (TextAddBlock *)malloc(sizeof(TextAddBlock));
+        if (block == NULL) return NULL;
+        block->next = buf->add;
+        block->used = 0;
+        buf->add = block;
+    }
+    uint32_t n = TEXT_ADD_BLOCK_SIZE - block->used;
+    if (n > length) n = length;
+    char *dst = block->data + block->used;
+    memcpy(dst, text, n);
+    block->used += n;
+    *copied = n;
+    return dst;
+}
+
+int text_insert(TextBuffer *buf, uint32_t pos, const char *text, uint32_t length) {
+    if (pos > text_length(buf)) pos = text_length(buf);
+    text_index_to(buf, pos, 0);
+    while (length > 0) {
+        TextPiece *node = text_new_piece(buf);
+        TextPiece *spare = text_new_piece(buf);
+        uint32_t n;
+        const char *added = node && spare ? text_add(buf, text, length, &n) : NULL;
+        if (added == NULL) {
+            free(node);
+            free(spare);
+            return -1;  // Out of memory
+        }
+
+        if (text_extend(buf->root, pos, added, n)) {
+            free(node);
+        } else {
+            TextPiece *left;
+            TextPiece *right;
+            text_split(buf, buf->root, pos, &spare, &left, &right);
+            text_set_piece(buf, node, added, 0, n);
+            buf->root = text_merge(text_merge(left, node), right);
+        }
+        free(spare);
+        pos += n;
+        text += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int text_delete(TextBuffer *buf, uint32_t pos, uint32_t length) {
+    if (pos >= text_length(buf) || length == 0) return 0;
+    if (length > text_length(buf) - pos) length = text_length(buf) - pos;
+    text_index_to(buf, pos + length, 0);
+
+    TextPiece *spare1 = text_new_piece(buf);
+    TextPiece *spare2 = text_new_piece(buf);
+    if (spare1 == NULL || spare2 == NULL) {
+        free(spare1);
+        free(spare2);
+        return -1;
+    }
+    TextPiece *left;
+    TextPiece *middle;
+    TextPiece *right;
+    text_split(buf, buf->root, pos, &spare1, &left, &right);
+    text_split(buf, right, length, &spare2, &middle, &right);
+    buf->root = text_merge(left, right);
+    text_free_pieces(middle);  // Their bytes stay behind in the buffers
+    free(spare1);
+    free(spare2);
+    return 0;
+}
+
+// Offset of the first byte of line (from 0), or the text length past the end
+uint32_t text_line_offset(TextBuffer *buf, uint32_t line) {
+    if (line == 0) return 0;
+    text_index_to(buf, 0, line);
+    TextPiece *node = buf->root;
+    uint32_t offset = 0;
+    while (node != NULL) {
+        uint32_t left_newlines = node->left ? node->left->total_newlines : 0;
+        if (line <= left_newlines) {
+            node = node->left;
+            continue;
+        }
+        line -= left_newlines;
+        offset += node->left ? node->left->total_length : 0;
+        if (line <= node->newlines) {
+            // The line starts after the line-th newline of this piece
+            for (uint32_t start = 0, count;; start += count) {
+                const char *bytes = text_piece_bytes(buf, node, start, &count);
+                for (uint32_t i = 0; i < count; i++) {
+                    if (bytes[i] == '\n' && --line == 0) return offset + start + i + 1;
+                }
+            }
+        }
+        line -= node->newlines;
+        offset += node->length;
+        node = node->right;
+    }
+    return text_length(buf);
+}
+
+// Piece holding the byte at pos, which must be inside the text; *start is
+// set to its place in the piece
+TextPiece *text_piece_at(TextBuffer *buf, uint32_t pos, uint32_t *start) {
+    TextPiece *node = buf->root;
+    while (1) {
+        uint32_t left_length = node->left ? node->left->total_length : 0;
+        if (pos < left_length) {
+            node = node->left;
+        } else if (pos >= left_length + node->length) {
+            pos -= left_length + node->length;
+            node = node->right;
+        } else {
+            *start = pos - left_length;
+            return node;
+        }
+    }
+}
+
+// Copy up to count bytes starting at pos; returns how many were copied
+uint32_t text_read(TextBuffer *buf, uint32_t pos, char *dst, uint32_t count) {
+    text_index_to(buf, pos + count, 0);
+    uint32_t copied = 0;
+    while (copied < count && buf->root && pos < buf->root->total_length) {
+        uint32_t start;
+        TextPiece *node = text_piece_at(buf, pos, &start);
+        uint32_t n;
+        const char *bytes = text_piece_bytes(buf, node, start, &n);
+        if (n > count - copied) n = count - copied;
+        memcpy(dst + copied, bytes, n);
+        copied += n;
+        pos += n;
+    }
+    return copied;
+}
+
+// Call fn on the whole text in order, a run of bytes at a time, until it
+// returns nonzero. Each run is found from the root rather than by recursion,
+// since nothing bounds the height of the treap. Returns -1 without passing on
+// the placeholder if the source cannot be read.
+int text_each(TextBuffer *buf, int (*fn)(const char *text, uint32_t length, void *ctx),
+              void *ctx) {
+    text_index_to(buf, text_length(buf), 0);
+    if (buf->broken) return -1;
+    buf->read_failed = 0;
+
+    // Cached source bytes are copied out first, since fn may write a file
+    // and push them out of the cache
+    char run[TEXT_PAGE_SIZE];
+    uint32_t length = buf->root ? buf->root->total_length : 0;
+    int result = 0;
+    for (uint32_t pos = 0, count; result == 0 && pos < length; pos += count) {
+        uint32_t start;
+        TextPiece *node = text_piece_at(buf, pos, &start);
+        const char *bytes = text_piece_bytes(buf, node, start, &count);
+        if (buf->read_failed) return -1;
+        if (node->text == NULL && buf->memory == NULL) {
+            if (count > sizeof(run)) count = sizeof(run);
+            memcpy(run, bytes, count);
+            bytes = run;
+        }
+        result = fn(bytes, count, ctx);
+    }
+    return result;
+}
+
+// Start on the content of entry without reading it; -1 if out of memory
+int text_open(TextBuffer *buf, FileEntry *entry) {
+    buf->size = entry->size;
+    if (buf->size == 0) {
+        return 0;
+    }
+    if (entry->flags & FILE_MAPPED) {
+        buf->memory = (const char *)entry->start_block;
+    } else if (entry->fat != NULL) {
+        buf->pages = (TextPage *)malloc(TEXT_PAGES * sizeof(TextPage));
+        if (buf->pages == NULL) return -1;
+        memset(buf->pages, 0, TEXT_PAGES * sizeof(TextPage));
+        buf->fat = entry->fat;
+    } else {
+        uint32_t count = (buf->size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE;
+        buf->chunks = (FileChunk **)malloc(count * sizeof(FileChunk *));
+        if (buf->chunks == NULL) return -1;
+        for (uint32_t i = 0; i < count; i++) {
+            buf->chunks[i] = entry->data->chunks[i];
+            buf->chunks[i]->refcount++;  // Writes to the file now copy it
+        }
+    }
+
+    uint32_t count;
+    buf->missing_newline = *text_source(buf, buf->size - 1, &count) != '\n';
+    return 0;
+}
+
+void text_free(TextBuffer *buf) {
+    text_free_pieces(buf->root);
+    while (buf->add) {
+        TextAddBlock *next = buf->add->next;
+        free(buf->add);
+        buf->add = next;
+    }
+    if (buf->chunks) {
+        for (uint32_t i = 0; i < (buf->size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE; i++) {
+            chunk_put(buf->chunks[i]);
+        }
+        free(buf->chunks);
+    }
+    free(buf->pages);
+    text_init(buf);
+}
+
+// End of Text buffer
+
+#define MAX_LINE_LENGTH 80
+
+// Screen editor
+//
+// noirtext shows a window of the text below a status row. Each key press
+// renders the rows of the window into a frame and writes to video memory only
+// the rows that differ from the last frame, so the work per key depends on
+// the window size and not on the length of the file.
+
+#define EDITOR_ROWS (VGA_HEIGHT - 1)  // Text rows below the status row
+#define EDITOR_TAB_WIDTH 4
+
+typedef struct {
+    TextBuffer text;
+    const char *filename;
+    int readonly;
+    int modified;
+    uint32_t line;                          // Cursor line
+    uint32_t column;                        // Cursor byte within the line
+    uint32_t top;                           // First line in the window
+    uint32_t left;                          // First column in the window
+    const char *message;                    // Shown in the status row until the next key
+    uint16_t frame[VGA_HEIGHT][VGA_WIDTH];  // What video memory holds
+} Editor;
+
+// Whether line exists; an empty buffer still has the line the cursor is on
+int editor_has_line(Editor *ed, uint32_t line) {
+    return line == 0 || text_line_offset(&ed->text, line) < text_length(&ed->text);
+}
+
+// line, or the last line if there are fewer
+uint32_t editor_clamp_line(Editor *ed, uint32_t line) {
+    if (editor_has_line(ed, line)) return line;
+    int complete;
+    uint32_t lines = text_lines_known(&ed->text, &complete);  // Indexed up to the end
+    return lines ? lines - 1 : 0;
+}
+
+uint32_t editor_line_length(Editor *ed, uint32_t line) {
+    uint32_t start = text_line_offset(&ed->text, line);
+    uint32_t end = text_line_offset(&ed->text, line + 1);
+    return end > start ? end - start - 1 : 0;  // Without the newline
+}
+
+uint32_t editor_offset(Editor *ed) {
+    return text_line_offset(&ed->text, ed->line) + ed->column;
+}
+
+// Write row into the frame and to the screen if it changed
+void editor_put_row(Editor *ed, int row, const uint16_t *cells) {
+    if (memcmp(ed->frame[row], cells, sizeof(ed->frame[row])) != 0) {
+        memcpy(ed->frame[row], cells, sizeof(ed->frame[row]));
+        memcpy(vga_buffer + row * VGA_WIDTH, cells, sizeof(ed->frame[row]));
+    }
+}
+
+void editor_append(char *status, int *len, const char *str) {
+    while (*str && *len < VGA_WIDTH) status[(*len)++] = *str++;
+}
+
+void editor_append_uint(char *status, int *len, uint32_t value) {
+    char digits[10];
+    int count = 0;
+    do {
+        digits[count++] = (value % 10) + '0';
+        value /= 10;
+    } while (value > 0);
+    while (count > 0 && *len < VGA_WIDTH) status[(*len)++] = digits[--count];
+}
+
+// The status row shows the file and cursor, or prompt while a command is typed
+void editor_status(Editor *ed, const char *prompt) {
+    char status[VGA_WIDTH];
+    int len = 0;
+    if (prompt) {
+        editor_append(status, &len, prompt);
+    } else {
+        editor_append(status, &len, " NoirText - ");
+        editor_append(status, &len, ed->filename ? ed->filename : "[No Name]");
+        editor_append(status, &len, ed->modified ? " [+]  Ln " : "  Ln ");
+        editor_append_uint(status, &len, ed->line + 1);
+        editor_append(status, &len, "/");
+        int complete;
+        uint32_t lines = text_lines_known(&ed->text, &complete);
+        editor_append_uint(status, &len, lines ? lines : 1);
+        editor_append(status, &len, complete ? "" : "+");
+        editor_append(status, &len, "  ");
+        editor_append(status, &len, ed->message ? ed->message
+                                                : "ESC: w save, q quit, N go to line, d delete");
+    }
+
+    uint16_t cells[VGA_WIDTH];
+    uint8_t color = make_color(BLACK, LIGHT_CYAN);
+    for (int x = 0; x < VGA_WIDTH; x++) {
+        cells[x] = make_vga_entry(x < len ? status[x] : ' ', color);
+    }
+    editor_put_row(ed, 0, cells);
+}
+
+void editor_render(Editor *ed, const char *prompt) {
+    // Keep the cursor inside the window
+    if (ed->line < ed->top) ed->top = ed->line;
+    if (ed->line >= ed->top + EDITOR_ROWS) ed->top = ed->line - EDITOR_ROWS + 1;
+    if (ed->column < ed->left) ed->left = ed->column;
+    if (ed->column >= ed->left + VGA_WIDTH) ed->left = ed->column - VGA_WIDTH + 1;
+
+    uint8_t color = make_color(WHITE, BLACK);
+    uint8_t filler = make_color(DARK_GREY, BLACK);
+    uint32_t length = text_length(&ed->text);
+    uint32_t start = text_line_offset(&ed->text, ed->top);
+    for (int row = 0; row < EDITOR_ROWS; row++) {
+        uint16_t cells[VGA_WIDTH];
+        char bytes[VGA_WIDTH];
+        uint32_t line = ed->top + row;
+        uint32_t end = text_line_offset(&ed->text, line + 1);
+        uint32_t count = 0;
+        int exists = start < length;
+        if (exists && end - 1 - start > ed->left) {
+            count = end - 1 - start - ed->left;
+            if (count > VGA_WIDTH) count = VGA_WIDTH;
+            text_read(&ed->text, start + ed->left, bytes, count);
+        }
+        for (uint32_t x = 0; x < VGA_WIDTH; x++) {
+            if (x < count) {
+                char c = bytes[x];
+                cells[x] = make_vga_entry(c >= 32 && c <= 126 ? c : '?', color);
+            } else {
+                cells[x] = make_vga_entry(x == 0 && !exists && line > 0 ? '~' : ' ', filler);
+            }
+        }
+        editor_put_row(ed, row + 1, cells);
+        start = end;
+    }
+    editor_status(ed, prompt);  // After the rows, which may have indexed more lines
+
+    cursor_x = prompt ? strlen(prompt) : (int)(ed->column - ed->left);
+    cursor_y = prompt ? 0 : (int)(ed->line - ed->top) + 1;
+    update_cursor();
+}
+
+int editor_insert(Editor *ed, const char *bytes, uint32_t length) {
+    if (ed->readonly) {
+        ed->message = "File is read-only";
+        return -1;
+    }
+    // Text always ends with a newline, so the first line brings one along
+    if (text_length(&ed->text) == 0 && text_insert(&ed->text, 0, "\n", 1) != 0) {
+        ed->message = "Out of memory!";
+        return -1;
+    }
+    if (text_insert(&ed->text, editor_offset(ed), bytes, length) != 0) {
+        ed->message = "Out of memory!";
+        return -1;
+    }
+    ed->modified = 1;
+    return 0;
+}
+
+int editor_delete(Editor *ed, uint32_t offset, uint32_t length) {
+    if (ed->readonly) {
+        ed->message = "File is read-only";
+        return -1;
+    }
+    if (text_delete(&ed->text, offset, length) != 0) {
+        ed->message = "Out of memory!";
+        return -1;
+    }
+    ed->modified = 1;
+    return 0;
+}
+
+int editor_write_piece(const char *text, uint32_t length, void *ctx) {
+    return write(*(int *)ctx, text, length) < 0;
+}
+
+// Start editing the file named by the editor, if it exists; -1 if out of memory
+int editor_open(Editor *ed) {
+    char leaf[MAX_FILENAME];
+    Directory *dir = ed->filename ? lookup_parent(ed->filename, leaf) : NULL;
+    FileEntry *file = dir ? find_entry(dir, leaf) : NULL;
+    ed->readonly = file && (file->flags & FILE_READONLY);
+    ed->modified = 0;
+    if (file == NULL || file->is_directory) {
+        return 0;
+    }
+    return text_open(&ed->text, file);
+}
+
+// Write the whole text to path; returns 0, or the message for the failure
+const char *editor_write(Editor *ed, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0) {
+        return "Error: Cannot open file for writing";
+    }
+    int saved = text_each(&ed->text, editor_write_piece, &fd) == 0;
+    close(fd);
+    if (ed->text.read_failed) {
+        return "Error: Cannot read the file, nothing was saved";
+    }
+    return saved ? NULL : "Error: Failed to allocate memory for file content";
+}
+
+void editor_save(Editor *ed) {
+    if (ed->filename == NULL) {
+        ed->message = "No filename specified.";
+        return;
+    }
+    if (ed->readonly) {
+        ed->message = "Error: File is read-only";
+        return;
+    }
+    if (ed->text.broken) {
+        ed->message = "Error: Out of memory while reading the file";
+        return;
+    }
+
+    // The text goes to a temporary file beside the old one first, so that
+    // running out of memory halfway leaves the old file as it was. The old
+    // content, which the text may still be reading, moves to the temporary
+    // file and goes away with it.
+    char temp[CAT_CHUNK_SIZE];
+    const char *leaf = ed->filename;
+    for (const char *p = ed->filename; *p; p++) {
+        if (*p == '/') leaf = p + 1;
+    }
+    uint32_t prefix = leaf - ed->filename;
+    if (prefix + MAX_FILENAME >= sizeof(temp)) {
+        ed->message = "Error: Path is too long";
+        return;
+    }
+    memcpy(temp, ed->filename, prefix);
+    temp[prefix] = '~';
+    strncpy(temp + prefix + 1, leaf, MAX_FILENAME - 2);
+    temp[prefix + MAX_FILENAME - 1] = '\0';
+
+    ed->message = editor_write(ed, temp);
+    if (ed->message == NULL && replace_file(temp, ed->filename) != 0) {
+        ed->message = "Error: Saving failed, the text is in the ~ file";
+        return;
+    }
+    char temp_leaf[MAX_FILENAME];
+    Directory *dir = lookup_parent(temp, temp_leaf);
+    if (dir != NULL && find_entry(dir, temp_leaf) != NULL) {
+        remove_entry(dir, temp_leaf);
+    }
+    if (ed->message != NULL) {
+        return;
+    }
+
+    // Start over from the saved file, which lets go of the old content, the
+    // pieces and the add buffer
+    text_free(&ed->text);
+    if (editor_open(ed) != 0) {
+        ed->message = "Error: Out of memory";
+        return;
+    }
+    ed->line = editor_clamp_line(ed, ed->line);
+    uint32_t length = editor_line_length(ed, ed->line);
+    if (ed->column > length) ed->column = length;
+    ed->message = "File saved.";
+}
+
+// Read a command on the status row; returns 0 if it was cancelled with ESC
+int editor_prompt(Editor *ed, char *buffer, int max_length) {
+    char prompt[VGA_WIDTH + 1];
+    int len = 0;
+    prompt[0] = ':';
+    while (1) {
+        memcpy(prompt + 1, buffer, len);
+        prompt[len + 1] = '\0';
+        buffer[len] = '\0';
+        editor_render(ed, prompt);
+
+        int key = get_key();
+        if (key == '\n') return 1;
+        if (key == 27) return 0;
+        if (key == '\b' && len > 0) {
+            len--;
+        } else if (key >= 32 && key <= 126 && len < max_length - 1 && len < VGA_WIDTH - 2) {
+            buffer[len++] = (char)key;
+        }
+    }
+}
+
+// Run an ESC command; returns 0 to leave the editor
+int editor_command(Editor *ed) {
+    char command[MAX_LINE_LENGTH];
+    if (!editor_prompt(ed, command, sizeof(command))) {
+        return 1;
+    }
+    if (strcmp(command, "w") == 0) {
+        editor_save(ed);
+    } else if (strcmp(command, "q") == 0) {
+        return 0;
+    } else if (strcmp(command, "wq") == 0) {
+        editor_save(ed);
+        return ed->modified;
+    } else if (strcmp(command, "d") == 0) {
+        uint32_t start = text_line_offset(&ed->text, ed->line);
+        editor_delete(ed, start, text_line_offset(&ed->text, ed->line + 1) - start);
+        ed->line = editor_clamp_line(ed, ed->line);
+        ed->column = 0;
+    } else if (command[0] >= '0' && command[0] <= '9') {
+        uint32_t line = atoi(command);
+        ed->line = line == 0 ? 0 : line - 1;
+        ed->line = editor_clamp_line(ed, ed->line);
+        ed->column = 0;
+    } else if (command[0] != '\0') {
+        ed->message = "Unknown command";
+    }
+    return 1;
+}
+
+// Apply one key; returns 0 to leave the editor
+int editor_key(Editor *ed, int key) {
+    uint32_t length = editor_line_length(ed, ed->line);
+    switch (key) {
+        case KEY_UP:
+            if (ed->line > 0) ed->line--;
+            break;
+        case KEY_DOWN:
+            if (editor_has_line(ed, ed->line + 1)) ed->line++;
+            break;
+        case KEY_PAGE_UP:
+            ed->line = ed->line > EDITOR_ROWS ? ed->line - EDITOR_ROWS : 0;
+            break;
+        case KEY_PAGE_DOWN:
+            ed->line = editor_clamp_line(ed, ed->line + EDITOR_ROWS);
+            break;
+        case KEY_LEFT:
+            if (ed->column > 0) {
+                ed->column--;
+            } else if (ed->line > 0) {
+                ed->line--;
+                ed->column = editor_line_length(ed, ed->line);
+            }
+            return 1;
+        case KEY_RIGHT:
+            if (ed->column < length) {
+                ed->column++;
+            } else if (editor_has_line(ed, ed->line + 1)) {
+                ed->line++;
+                ed->column = 0;
+            }
+            return 1;
+        case KEY_HOME:
+            ed->column = 0;
+            return 1;
+        case KEY_END:
+            ed->column = length;
+            return 1;
+        case KEY_DELETE:
+            // Joins the next line at the end of this one
+            if (ed->column < length || editor_has_line(ed, ed->line + 1)) {
+                editor_delete(ed, editor_offset(ed), 1);
+            }
+            return 1;
+        case '\b':
+            if (ed->column > 0) {
+                if (editor_delete(ed, editor_offset(ed) - 1, 1) == 0) ed->column--;
+            } else if (ed->line > 0) {
+                uint32_t previous = editor_line_length(ed, ed->line - 1);
+                if (editor_delete(ed, editor_offset(ed) - 1, 1) == 0) {
+                    ed->line--;
+                    ed->column = previous;
+                }
+            }
+            return 1;
+        case '\n':
+            if (editor_insert(ed, "\n", 1) == 0) {
+                ed->line++;
+                ed->column = 0;
+            }
+            return 1;
+        case '\t':
+            if (editor_insert(ed, "    ", EDITOR_TAB_WIDTH - ed->column % EDITOR_TAB_WIDTH) == 0) {
+                ed->column += EDITOR_TAB_WIDTH - ed->column % EDITOR_TAB_WIDTH;
+            }
+            return 1;
+        case 27:
+            return editor_command(ed);
+        default:
+            if (key >= 32 && key <= 126) {
+                char c = (char)key;
+                if (editor_insert(ed, &c, 1) == 0) ed->column++;
+            }
+            return 1;
+    }
+
+    // Vertical moves keep the column where the new line allows
+    length = editor_line_length(ed, ed->line);
+    if (ed->column > length) ed->column = length;
+    return 1;
+}
+
+void noirtext(const char *filename) {
+    Editor *ed = (Editor *)malloc(sizeof(Editor));
+    if (ed == NULL) {
+        print_colored("Error: Out of memory\n", make_color(LIGHT_RED, BLACK));
+        return;
+    }
+    memset(ed, 0, sizeof(Editor));
+    text_init(&ed->text);
+    ed->filename = filename;
+
+    // The file is read as it is shown
+    if (editor_open(ed) != 0) {
+        text_free(&ed->text);
+        free(ed);
+        print_colored("Error: Out of memory\n", make_color(LIGHT_RED, BLACK));
+        return;
+    }
+
+    // The frame starts out different from any rendered row, so the first
+    // render paints every row
+    clear_screen();
+    memset(ed->frame, 0xFF, sizeof(ed->frame));
+    ed->message = ed->readonly ? "Read-only. ESC: q quit, N go to line" : NULL;
+    editor_render(ed, NULL);
+    while (1) {
+        // Index the rest of the file while no key is waiting
+        while (!key_pending() && text_index_step(&ed->text)) {
+        }
+        int key = get_key();
+        ed->message = NULL;
+        if (!editor_key(ed, key)) break;
+        editor_render(ed, NULL);
+    }
+
+    text_free(&ed->text);
+    free(ed);
+    clear_screen();
+}
+
+void noirtext_command(int argc, char **argv) {
+    noirtext(argc > 1 ? argv[1] : NULL);
+}
+COMMAND_ARGS(noirtext, noirtext_command, 0, 1, "noirtext [filename]", "Edit file");
+
+#define MAX_TODO 100
+
+typedef struct {
+    char task[256];
+} TodoItem;
+
+TodoItem todo_list[MAX_TODO];
+int todo_count = 0;
+
+void add_todo(const char *task) {
+    if (todo_count < MAX_TODO) {
+        strncpy(todo_list[todo_count].task, task, 256);
+        todo_count++;
+        print("Task added.\n");
+    } else {
+        print("Error: To-do list is full.\n");
+    }
+}
+
+void list_todos() {
+    if (todo_count == 0) {
+        print("No tasks in the to-do list.\n");
+        return;
+    }
+
+    print("To-do list:\n");
+    for (int i = 0; i < todo_count; i++) {
+        print("  ");
+        print(todo_list[i].task);
+        print("\n");
+    }
+}
+
+void remove_todo(int index) {
+    if (index < 0 || index >= todo_count) {
+        print("Error: Invalid task number.\n");
+        return;
+    }
 
-    *(uint32_t *)(&vendor[0]) = ebx;
-    *(uint32_t *)(&vendor[4]) = edx;
-    *(uint32_t *)(&vendor[8]) = ecx;
-    vendor[12] = '\0';
+    for (int i = index; i < todo_count - 1; i++) {
+        todo_list[i] = todo_list[i + 1];
+    }
+    todo_count--;
+    print("Task removed.\n");
+}
 
-    print("CPU Vendor: ");
-    print(vendor);
+void todo(int argc, char **argv) {
+    if (strcmp(argv[1], "add") == 0 && argc > 2) {
+        char task[sizeof(todo_list[0].task)];
+        join_args(argc, argv, 2, task, sizeof(task));
+        add_todo(task);
+    } else if (strcmp(argv[1], "list") == 0 && argc == 2) {
+        list_todos();
+    } else if (strcmp(argv[1], "remove") == 0 && argc == 3) {
+        remove_todo(atoi(argv[2]) - 1);  // Convert to zero-based index
+    } else {
+        print("Usage: todo [add, list, remove] [task]\n");
+    }
+}
+COMMAND_ARGS(todo, todo, 1, COMMAND_ANY_ARGS, "todo [add, list, remove] [task]", "ToDo app");
+
+// Function declarations
+int is_space(char c);
+char *strchr(const char *str, int c);
+void execute_command(char *line);
+
+// VA args macros
+typedef __builtin_va_list va_list;
+#define va_start(v, l) __builtin_va_start(v, l)
+#define va_end(v) __builtin_va_end(v)
+#define va_arg(v, l) __builtin_va_arg(v, l)
+
+// Helper function implementations
+
+char *strchr(const char *str, int c) {
+    while (*str) {
+        if (*str == (char)c) return (char *)str;
+        str++;
+    }
+    return NULL;
+}
+
+void pwd() {
+    print(fs.current_dir->name);
     print("\n");
+}
+COMMAND(pwd, pwd, "Print working dir");
+
+// Command registry
+
+// Commands are found through a perfect hash of their names, built at boot
+// from the records in the .commands section: the seed and table size are
+// searched until every name lands in a slot of its own, so a lookup hashes
+// the first word once and makes a single string comparison.
+#define COMMAND_TABLE_MAX 1024
+#define COMMAND_MAX_ARGS 32
+#define COMMAND_SEED_TRIES 1024
+
+extern const Command __commands_start[];
+extern const Command __commands_end[];
+
+const Command *command_table[COMMAND_TABLE_MAX];
+uint32_t command_mask;
+uint32_t command_seed;
+const Command **command_sorted;  // By name, for help
+uint32_t command_count;
+TrieNode *command_trie;  // Names, for completion
+
+uint32_t command_hash(uint32_t seed, const char *name, uint32_t length) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    // FNV alone leaves nearby seeds correlated in the low bits
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    return hash;
+}
 
-    // Get CPU features
-    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+// Try to place every command with seed in a table of mask + 1 slots
+int command_place(uint32_t seed, uint32_t mask) {
+    memset(command_table, 0, sizeof(command_table));
+    for (uint32_t i = 0; i < command_count; i++) {
+        const Command *cmd = command_sorted[i];
+        uint32_t slot = command_hash(seed, cmd->name, strlen(cmd->name)) & mask;
+        if (command_table[slot] != NULL) return -1;
+        command_table[slot] = cmd;
+    }
+    return 0;
+}
 
-    print("CPU Features:\n");
-    if (edx & (1 << 0)) print("- FPU\n");
-    if (edx & (1 << 4)) print("- TSC\n");
-    if (edx & (1 << 5)) print("- MSR\n");
-    if (edx & (1 << 23)) print("- MMX\n");
-    if (edx & (1 << 25)) print("- SSE\n");
-    if (edx & (1 << 26)) print("- SSE2\n");
-    if (ecx & (1 << 0)) print("- SSE3\n");
+void command_init() {
+    uint32_t total = __commands_end - __commands_start;
+    command_sorted = (const Command **)malloc(total * sizeof(Command *));
+    if (command_sorted == NULL) {
+        print("Error: Out of memory for the command table\n");
+        return;
+    }
+
+    // Insertion sort by name; a name registered twice keeps its first record
+    command_count = 0;
+    for (const Command *cmd = __commands_start; cmd < __commands_end; cmd++) {
+        uint32_t i = command_count;
+        while (i > 0 && strcmp(command_sorted[i - 1]->name, cmd->name) > 0) i--;
+        if (i > 0 && strcmp(command_sorted[i - 1]->name, cmd->name) == 0) {
+            print("Error: Command registered twice: ");
+            print(cmd->name);
+            print("\n");
+            continue;
+        }
+        for (uint32_t j = command_count; j > i; j--) command_sorted[j] = command_sorted[j - 1];
+        command_sorted[i] = cmd;
+        command_count++;
+    }
+    command_trie = trie_node("", 0);
+    for (uint32_t i = 0; command_trie != NULL && i < command_count; i++) {
+        trie_insert(command_trie, command_sorted[i]->name);
+    }
+
+    uint32_t size = 1;
+    while (size < command_count * 2) size <<= 1;
+    for (; size <= COMMAND_TABLE_MAX; size <<= 1) {
+        for (uint32_t seed = 0; seed < COMMAND_SEED_TRIES; seed++) {
+            if (command_place(seed, size - 1) == 0) {
+                command_seed = seed;
+                command_mask = size - 1;
+                return;
+            }
+        }
+    }
+
+    // Not reachable with a sane number of commands
+    memset(command_table, 0, sizeof(command_table));
+    command_mask = 0;
+    print("Error: No perfect hash for the command table\n");
 }
 
-// Modified time function
-void time() {
-    uint8_t second, minute, hour;
+const Command *command_find(const char *name, uint32_t length) {
+    const Command *cmd =
+        command_table[command_hash(command_seed, name, length) & command_mask];
+    if (cmd == NULL || strncmp(cmd->name, name, length) != 0 || cmd->name[length] != '\0') {
+        return NULL;
+    }
+    return cmd;
+}
 
-    // Disable NMI
-    outb(0x70, 0x80);
+void print_padded(const char *str, int width) {
+    print(str);
+    for (int i = strlen(str); i < width; i++) print(" ");
+}
 
-    // Read CMOS registers
-    outb(0x70, 0x00);
-    second = inb(0x71);
-    outb(0x70, 0x02);
-    minute = inb(0x71);
-    outb(0x70, 0x04);
-    hour = inb(0x71);
+#define HELP_COLUMN 34       // Width of the left column, including its margin
+#define HELP_RIGHT_WIDTH 41  // Keeps the line short of the last screen column
 
-    // Re-enable NMI
-    outb(0x70, 0x00);
+// Width of a help entry: its usage, padded to 8, then " - " and the help
+int help_entry_width(const Command *cmd) {
+    int usage = strlen(cmd->usage);
+    return (usage > 8 ? usage : 8) + 3 + strlen(cmd->help);
+}
 
-    // Convert BCD to binary
-    second = ((second & 0xF0) >> 4) * 10 + (second & 0x0F);
-    minute = ((minute & 0xF0) >> 4) * 10 + (minute & 0x0F);
-    hour = ((hour & 0xF0) >> 4) * 10 + (hour & 0x0F);
+void print_help_entry(const Command *cmd) {
+    print_padded(cmd->usage, 8);
+    print(" - ");
+    print(cmd->help);
+}
 
-    // Print time
-    print("Current time: ");
-    if (hour < 10) putchar('0');
-    char buffer[3];
-    int i = 0;
+// Two entries to a line where they fit, in the layout of the old help text
+void help() {
+    print_colored("Available commands:\n", make_color(LIGHT_CYAN, BLACK));
+    uint32_t i = 0;
+    while (i < command_count) {
+        const Command *left = command_sorted[i++];
+        print("  ");
+        if (help_entry_width(left) < HELP_COLUMN && i < command_count &&
+            help_entry_width(command_sorted[i]) <= HELP_RIGHT_WIDTH) {
+            const Command *right = command_sorted[i++];
+            print_help_entry(left);
+            for (int w = help_entry_width(left); w < HELP_COLUMN; w++) print(" ");
+            print("| ");
+            print_help_entry(right);
+        } else {
+            print_help_entry(left);
+        }
+        print("\n");
+    }
+}
+COMMAND(help, help, "Show this help message");
 
-    // Convert hour
-    do {
-        buffer[i++] = (hour % 10) + '0';
-        hour /= 10;
-    } while (hour > 0);
-    while (i > 0) putchar(buffer[--i]);
+// End of Command registry
 
-    print(":");
+// Command statistics
 
-    // Convert minute
-    if (minute < 10) putchar('0');
-    i = 0;
-    do {
-        buffer[i++] = (minute % 10) + '0';
-        minute /= 10;
-    } while (minute > 0);
-    while (i > 0) putchar(buffer[--i]);
+// Every command that runs is timed with the time stamp counter. Each command
+// keeps its number of calls, total and maximum cycles, and a histogram of its
+// latencies laid out like HdrHistogram: values below 32 cycles have a bucket
+// each, and every power of two above is split into 16 buckets, so a bucket
+// is within 1/16 of the values it counts. A command's histogram is allocated
+// when it first runs. The counter is calibrated against the PIT at boot to
+// turn cycles into time.
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_BIT 47  // Latencies with higher bits, hours long, share the last bucket
+#define STATS_BUCKETS ((STATS_MAX_BIT - STATS_SUB_BITS + 2) * STATS_SUB_BUCKETS)
+#define PIT_HZ 1193182
 
-    print(":");
+typedef struct {
+    uint32_t calls;
+    uint64_t total;
+    uint64_t max;
+    uint32_t *buckets;  // STATS_BUCKETS counts, NULL until the first call
+} CommandStats;
+
+CommandStats *stats_table;  // One for each record in the .commands section
+uint32_t tsc_khz;           // Counter ticks per millisecond, 0 if unknown
+
+static inline uint64_t rdtsc() {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return (uint64_t)high << 32 | low;
+}
 
-    // Convert second
-    if (second < 10) putchar('0');
-    i = 0;
-    do {
-        buffer[i++] = (second % 10) + '0';
-        second /= 10;
-    } while (second > 0);
-    while (i > 0) putchar(buffer[--i]);
+// Count the ticks of the time stamp counter while PIT channel 2 counts down
+// 10 ms; 0 if the PIT never gets there
+uint32_t tsc_calibrate() {
+    uint32_t count = PIT_HZ / 100;
+    uint8_t speaker = inb(0x61);
+    outb(0x61, (speaker & ~0x02) | 0x01);  // Gate channel 2 on, speaker off
+    outb(0x43, 0xB0);                      // Channel 2, both bytes, count once
+    outb(0x42, count & 0xFF);
+    outb(0x42, count >> 8);
+
+    uint64_t start = rdtsc();
+    uint64_t end = start;
+    int done = 0;
+    while (!done && end - start < 0x40000000) {
+        done = inb(0x61) & 0x20;  // Channel 2 output, set at the end of the count
+        end = rdtsc();
+    }
+    outb(0x61, speaker);
+    return done ? (uint32_t)(end - start) / 10 : 0;
+}
 
-    print("\n");
+void stats_init() {
+    tsc_khz = tsc_calibrate();
+    uint32_t total = __commands_end - __commands_start;
+    stats_table = (CommandStats *)malloc(total * sizeof(CommandStats));
+    if (stats_table == NULL) {
+        print("Error: Out of memory for command statistics\n");
+        return;
+    }
+    memset(stats_table, 0, total * sizeof(CommandStats));
 }
 
-void reboot() {
-    print("Rebooting NeoNoir...\n");
-    print("Please wait while the system restarts...\n");
+uint32_t stats_bucket(uint64_t cycles) {
+    if (cycles < 2 * STATS_SUB_BUCKETS) return cycles;
+    uint32_t high = cycles >> 32;
+    int bit = high ? 63 - __builtin_clz(high) : 31 - __builtin_clz((uint32_t)cycles);
+    if (bit > STATS_MAX_BIT) return STATS_BUCKETS - 1;
+    int shift = bit - STATS_SUB_BITS;
+    return shift * STATS_SUB_BUCKETS + (uint32_t)(cycles >> shift);
+}
 
-    // Wait for keyboard buffer to empty
-    uint8_t temp;
-    do {
-        temp = inb(KEYBOARD_STATUS);
-        if (temp & 1) {
-            inb(KEYBOARD_PORT);
+// Highest value counted by a bucket
+uint64_t stats_bucket_top(uint32_t bucket) {
+    if (bucket < 2 * STATS_SUB_BUCKETS) return bucket;
+    int shift = bucket / STATS_SUB_BUCKETS - 1;
+    uint64_t sub = bucket % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void stats_record(const Command *cmd, uint64_t cycles) {
+    if (stats_table == NULL) return;
+    CommandStats *stats = &stats_table[cmd - __commands_start];
+    if (stats->buckets == NULL) {
+        stats->buckets = (uint32_t *)malloc(STATS_BUCKETS * sizeof(uint32_t));
+        if (stats->buckets == NULL) return;
+        memset(stats->buckets, 0, STATS_BUCKETS * sizeof(uint32_t));
+    }
+    stats->calls++;
+    stats->total += cycles;
+    if (cycles > stats->max) stats->max = cycles;
+    stats->buckets[stats_bucket(cycles)]++;
+}
+
+// Latency that per_mille thousandths of the calls did not exceed, to within
+// the bucket it falls in
+uint64_t stats_percentile(const CommandStats *stats, uint32_t per_mille) {
+    uint32_t rank = div64((uint64_t)stats->calls * per_mille + 999, 1000);
+    uint32_t seen = 0;
+    for (uint32_t i = 0; i < STATS_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen >= rank) {
+            uint64_t top = stats_bucket_top(i);
+            return top < stats->max ? top : stats->max;
         }
-    } while (temp & 2);
+    }
+    return stats->max;
+}
 
-    // Send reset command
-    outb(KEYBOARD_STATUS, 0xFE);
+// Microseconds, or cycles if the counter could not be calibrated
+uint64_t stats_time(uint64_t cycles) {
+    return tsc_khz ? div64(cycles * 1000, tsc_khz) : cycles;
+}
 
-    // If that didn't work, try alternative method
-    while (1) {
-        asm volatile("hlt");
+// Report the cycles a command line took, as time keeps to show the clock
+// without one
+void time_report(uint64_t cycles) {
+    print("real ");
+    if (tsc_khz) {
+        uint64_t us = div64(cycles * 1000, tsc_khz);
+        uint64_t ms = div64(us, 1000);
+        uint32_t fraction = us - ms * 1000;
+        print_uint64(ms);
+        print(fraction < 10 ? ".00" : fraction < 100 ? ".0" : ".");
+        print_uint(fraction);
+        print(" ms, ");
     }
+    print_uint64(cycles);
+    print(" cycles\n");
 }
 
-void echo(const char *str) {
-    print(str);
+// One line for each command run: name, calls, total cycles and the
+// percentiles, then one line for each bucket with its top value and count
+void stats_dump() {
+    print("stats tsc_khz ");
+    print_uint(tsc_khz);
     print("\n");
+    for (uint32_t i = 0; i < command_count; i++) {
+        const CommandStats *stats = &stats_table[command_sorted[i] - __commands_start];
+        if (stats->calls == 0) continue;
+        const char *name = command_sorted[i]->name;
+        print("command ");
+        print(name);
+        print(" calls ");
+        print_uint(stats->calls);
+        print(" total ");
+        print_uint64(stats->total);
+        print(" p50 ");
+        print_uint64(stats_percentile(stats, 500));
+        print(" p99 ");
+        print_uint64(stats_percentile(stats, 990));
+        print(" max ");
+        print_uint64(stats->max);
+        print("\n");
+        for (uint32_t b = 0; b < STATS_BUCKETS; b++) {
+            if (stats->buckets[b] == 0) continue;
+            print("bucket ");
+            print(name);
+            print(" ");
+            print_uint64(stats_bucket_top(b));
+            print(" ");
+            print_uint(stats->buckets[b]);
+            print("\n");
+        }
+    }
+    print("end\n");
 }
 
-void print_system_info() {
-    print("NeoNoir v1.0\n");
-    print("Architecture: x86, 32 Bit\n");
-    print("Memory: 640KB Base Memory\n");
-    print("Display: VGA Text Mode 80x26\n");
+int serial_stream_write(Stream *stream, const void *data, uint32_t size) {
+    serial_write(data, size);
+    return size;
 }
 
-void whoami() {
-    print("root\n");
+void stats(int argc, char **argv) {
+    if (stats_table == NULL) {
+        print("Error: No command statistics\n");
+        return;
+    }
+    if (argc > 1 && strcmp(argv[1], "serial") == 0) {
+        // Machine-readable, for comparing builds
+        Stream serial = {NULL, serial_stream_write, NULL, NULL, -1};
+        Stream *output = current_output;
+        current_output = &serial;
+        stats_dump();
+        current_output = output;
+        print("Statistics sent to COM1\n");
+        return;
+    }
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        for (uint32_t i = 0; i < command_count; i++) {
+            CommandStats *stats = &stats_table[command_sorted[i] - __commands_start];
+            if (stats->buckets) memset(stats->buckets, 0, STATS_BUCKETS * sizeof(uint32_t));
+            stats->calls = 0;
+            stats->total = 0;
+            stats->max = 0;
+        }
+        return;
+    }
+    if (argc > 1) {
+        print("Usage: stats [serial|reset]\n");
+        return;
+    }
+
+    print_padded("Command", 10);
+    print(tsc_khz ? "   Calls     p50 us     p99 us     max us\n"
+                  : "   Calls p50 cycles p99 cycles max cycles\n");
+    for (uint32_t i = 0; i < command_count; i++) {
+        const CommandStats *stats = &stats_table[command_sorted[i] - __commands_start];
+        if (stats->calls == 0) continue;
+        print_padded(command_sorted[i]->name, 10);
+        print_uint_padded(stats->calls, 8);
+        print_uint64_padded(stats_time(stats_percentile(stats, 500)), 11);
+        print_uint64_padded(stats_time(stats_percentile(stats, 990)), 11);
+        print_uint64_padded(stats_time(stats->max), 11);
+        print("\n");
+    }
+}
+COMMAND_ARGS(stats, stats, 0, 1, "stats [serial|reset]", "Command latencies");
+
+// End of Command statistics
+
+// Tasks
+
+// Pipeline stages run as tasks, each on a stack of its own. Switching is
+// cooperative: a task runs until it waits on a pipe, and the shell waits for
+// its tasks by yielding to them. The shell itself is the first task and runs
+// on the boot stack.
+#define TASK_STACK_SIZE 8192
+
+typedef struct Task {
+    uint32_t esp;  // Saved stack pointer while switched out
+    uint8_t *stack;
+    Stream *input;
+    Stream *output;
+    const Command *cmd;
+    int argc;
+    char **argv;
+    int close_input;  // Streams set up for the task rather than inherited
+    int close_output;
+    struct Job *job;  // Background job the task belongs to, if any
+    int killed;
+    int done;
+    int script_depth;  // Scripts the task is running inside one another
+    struct Task *next;  // Ring of all tasks
+} Task;
+
+Task shell_task = {0, NULL, &console, &console, NULL, 0, NULL, 0, 0, NULL, 0, 0, 0, &shell_task};
+Task *current_task = &shell_task;
+struct Job *foreground_job = NULL;  // Job given the keyboard by fg
+
+int task_killed() {
+    return current_task->killed;
 }
 
-void hostname() {
-    print("NeoNoir\n");
+int task_has_keyboard() {
+    return current_task->job == foreground_job;
 }
 
-#define SNAKE_MAX_LENGTH 100
-#define BOARD_WIDTH 20
-#define BOARD_HEIGHT 20
+// Save the callee-saved registers on the current stack, store its pointer in
+// *save and resume the stack at next, which was saved the same way
+void task_switch(uint32_t *save, uint32_t next);
+asm(".pushsection .text\n"
+    ".global task_switch\n"
+    "task_switch:\n"
+    "    push %ebp\n"
+    "    push %ebx\n"
+    "    push %esi\n"
+    "    push %edi\n"
+    "    mov 20(%esp), %eax\n"
+    "    mov %esp, (%eax)\n"
+    "    mov 24(%esp), %esp\n"
+    "    pop %edi\n"
+    "    pop %esi\n"
+    "    pop %ebx\n"
+    "    pop %ebp\n"
+    "    ret\n"
+    ".popsection\n");
+
+// Let the next task that has not finished run
+void task_yield() {
+    Task *prev = current_task;
+    Task *next = prev->next;
+    while (next->done && next != prev) next = next->next;
+    if (next == prev) return;
+
+    prev->input = current_input;
+    prev->output = current_output;
+    current_task = next;
+    current_input = next->input;
+    current_output = next->output;
+    task_switch(&prev->esp, next->esp);
+}
 
-struct Point {
-    int x;
-    int y;
-};
+void run_command(const Command *cmd, int argc, char **argv) {
+    uint64_t start = rdtsc();
+    if (cmd->run) {
+        cmd->run();
+    } else {
+        cmd->run_args(argc, argv);
+    }
+    stats_record(cmd, rdtsc() - start);
+}
 
-struct Snake {
-    struct Point body[SNAKE_MAX_LENGTH];
-    int length;
-    enum { UP, DOWN, LEFT, RIGHT } direction;
-};
+// First code run by a new task. Closing its streams tells the tasks on the
+// other ends of its pipes that it is gone.
+void task_start() {
+    Task *task = current_task;
+    run_command(task->cmd, task->argc, task->argv);
+    if (task->close_input && current_input->close) current_input->close(current_input);
+    if (task->close_output && current_output->close) current_output->close(current_output);
+    task->done = 1;
+    task_yield();  // Finished tasks are never switched back to
+}
 
-struct Game {
-    struct Snake snake;
-    struct Point food;
-    int score;
-    int game_over;
-};
+Task *task_create(const Command *cmd, int argc, char **argv, Stream *input, Stream *output) {
+    Task *task = (Task *)malloc(sizeof(Task));
+    uint8_t *stack = (uint8_t *)malloc(TASK_STACK_SIZE);
+    if (task == NULL || stack == NULL) {
+        free(task);
+        free(stack);
+        return NULL;
+    }
+    memset(task, 0, sizeof(Task));
+    task->stack = stack;
+    task->input = input;
+    task->output = output;
+    task->cmd = cmd;
+    task->argc = argc;
+    task->argv = argv;
+    task->job = current_task->job;  // Pipelines run by a job are part of it
+    task->killed = current_task->killed;
+
+    // A frame for task_switch to pop: four registers, then task_start as
+    // the return address
+    uint32_t *sp = (uint32_t *)(stack + TASK_STACK_SIZE);
+    *--sp = 0;  // Return address of task_start, which never returns
+    *--sp = (uint32_t)task_start;
+    for (int i = 0; i < 4; i++) *--sp = 0;
+    task->esp = (uint32_t)sp;
+
+    task->next = current_task->next;
+    current_task->next = task;
+    return task;
+}
 
-void init_game(struct Game *game) {
-    // Initialize snake in the middle
-    game->snake.body[0].x = BOARD_WIDTH / 2;
-    game->snake.body[0].y = BOARD_HEIGHT / 2;
-    game->snake.length = 1;
-    game->snake.direction = RIGHT;
-    game->score = 0;
-    game->game_over = 0;
+// Unlink a finished task and free it
+void task_free(Task *task) {
+    Task *prev = task;
+    while (prev->next != task) prev = prev->next;
+    prev->next = task->next;
+    free(task->stack);
+    free(task);
+}
+
+// End of Tasks
+
+// Pipelines
+
+// The shell runs a command line as a pipeline of up to PIPELINE_MAX_STAGES
+// commands joined by |, each with optional < file, > file or >> file. Stages
+// are joined by pipes: ring buffers of PIPE_SIZE bytes that block the writer
+// while full and the reader while empty, so data streams through them
+// instead of piling up. A single command runs directly in the shell, and a
+// line ending in & runs as a background job.
+#define PIPE_SIZE 512
+#define PIPELINE_MAX_STAGES 8
+
+// Operators in the ops array of parse_args
+#define SHELL_PIPE '|'
+#define SHELL_INPUT '<'
+#define SHELL_OUTPUT '>'
+#define SHELL_APPEND 'a'
+#define SHELL_BACKGROUND '&'
+
+typedef struct Pipe {
+    char data[PIPE_SIZE];
+    uint32_t head;  // Next byte to read
+    uint32_t count;
+    int reader_open;
+    int writer_open;
+} Pipe;
+
+int pipe_read(Stream *stream, void *buffer, uint32_t size) {
+    Pipe *pipe = stream->pipe;
+    while (pipe->count == 0 && pipe->writer_open && !task_killed()) task_yield();
+    if (task_killed()) return 0;
+
+    uint32_t n = size < pipe->count ? size : pipe->count;
+    for (uint32_t i = 0; i < n; i++) {
+        ((char *)buffer)[i] = pipe->data[pipe->head];
+        pipe->head = (pipe->head + 1) % PIPE_SIZE;
+    }
+    pipe->count -= n;
+    return n;
+}
+
+// Output nobody reads any more is an error, which commands may ignore
+int pipe_write(Stream *stream, const void *data, uint32_t size) {
+    Pipe *pipe = stream->pipe;
+    uint32_t done = 0;
+    while (done < size) {
+        if (!pipe->reader_open || task_killed()) return -1;
+        if (pipe->count == PIPE_SIZE) {
+            task_yield();
+            continue;
+        }
+        uint32_t tail = (pipe->head + pipe->count) % PIPE_SIZE;
+        pipe->data[tail] = ((const char *)data)[done++];
+        pipe->count++;
+    }
+    return done;
+}
+
+void pipe_close_reader(Stream *stream) {
+    stream->pipe->reader_open = 0;
+}
+
+void pipe_close_writer(Stream *stream) {
+    stream->pipe->writer_open = 0;
+}
+
+int file_stream_read(Stream *stream, void *buffer, uint32_t size) {
+    return read(stream->fd, buffer, size);
+}
+
+int file_stream_write(Stream *stream, const void *data, uint32_t size) {
+    return write(stream->fd, data, size);
+}
+
+typedef struct {
+    const Command *cmd;
+    int argc;
+    char **argv;
+    Stream input;  // Redirections
+    Stream output;
+    Pipe *pipe;  // To the next stage, with its two ends
+    Stream reader;
+    Stream writer;
+    Task *task;
+} Stage;
+
+const char *shell_operator_name(char op) {
+    switch (op) {
+        case SHELL_PIPE:
+            return "|";
+        case SHELL_INPUT:
+            return "<";
+        case SHELL_OUTPUT:
+            return ">";
+        case SHELL_BACKGROUND:
+            return "&";
+        default:
+            return ">>";
+    }
+}
+
+// Split line into words in place and point argv at them. Words are separated
+// by spaces or tabs. A backslash takes the next character as it is, single
+// quotes take everything up to the closing quote as it is, and double quotes
+// do the same except that \" and \\ are still escapes. Quotes and escapes are
+// dropped by moving the rest of the word down over them, so every word stays
+// inside line. If ops is given, unquoted | < > >> and & are operators: their
+// entry in ops is set to the operator, and to 0 for words. Returns the word
+// count, or -1 after printing an error.
+int parse_args(char *line, char **argv, char *ops, int max_args) {
+    char *in = line;
+    char *out = line;
+    char *end = NULL;  // End of the last word, terminated once in is past it
+    int argc = 0;
+    while (1) {
+        while (*in == ' ' || *in == '\t') in++;
+        char op = 0;
+        if (ops && (*in == '|' || *in == '<' || *in == '>' || *in == '&')) {
+            op = *in++;
+            if (op == '>' && *in == '>') {
+                op = SHELL_APPEND;
+                in++;
+            }
+        }
+        if (end) {
+            *end = '\0';
+            out = end + 1;
+            end = NULL;
+        }
+        if (!op && *in == '\0') return argc;
+        if (argc == max_args) {
+            print("Error: Too many arguments\n");
+            return -1;
+        }
+        if (ops) ops[argc] = op;
+        if (op) {
+            argv[argc++] = (char *)shell_operator_name(op);
+            continue;
+        }
+        argv[argc++] = out;
+
+        char quote = 0;
+        while (*in && (quote || (*in != ' ' && *in != '\t' &&
+                                 !(ops && (*in == '|' || *in == '<' || *in == '>' ||
+                                           *in == '&'))))) {
+            char c = *in++;
+            if (!quote && (c == '\'' || c == '"')) {
+                quote = c;
+                continue;
+            }
+            if (c == quote) {
+                quote = 0;
+                continue;
+            }
+            if (c == '\\' && *in && (!quote || (quote == '"' && (*in == '"' || *in == '\\')))) {
+                c = *in++;
+            }
+            *out++ = c;
+        }
+        if (quote) {
+            print("Error: Unterminated quote\n");
+            return -1;
+        }
+        end = out;
+    }
+}
 
-    // Place initial food
-    game->food.x = rand_range(0, BOARD_WIDTH - 1);
-    game->food.y = rand_range(0, BOARD_HEIGHT - 1);
+// Open the file named by a redirection for stream; -1 if it cannot be opened
+int redirect(Stream *stream, const char *path, char op) {
+    int flags = op == SHELL_INPUT    ? O_RDONLY
+                : op == SHELL_OUTPUT ? O_WRONLY | O_CREAT | O_TRUNC
+                                     : O_WRONLY | O_CREAT | O_APPEND;
+    if (stream->fd >= 0) close(stream->fd);  // A later redirection wins
+    stream->fd = open(path, flags);
+    if (stream->fd < 0) {
+        print("Error: Cannot open ");
+        print(path);
+        print("\n");
+        return -1;
+    }
+    stream->read = op == SHELL_INPUT ? file_stream_read : NULL;
+    stream->write = op == SHELL_INPUT ? NULL : file_stream_write;
+    return 0;
 }
 
-void draw_board(struct Game *game) {
-    clear_screen();
+// Check the words and operators of a command line and split them into
+// stages, opening redirections as they come. *count is the number of stages
+// set up, whose files must be closed even if -1 is returned after an error.
+int pipeline_parse(int argc, char **argv, const char *ops, Stage *stages, int *count) {
+    int i = 0;
+    *count = 0;
+    while (i < argc) {
+        if (*count == PIPELINE_MAX_STAGES) {
+            print("Error: Too many commands in the pipeline\n");
+            return -1;
+        }
+        Stage *stage = &stages[(*count)++];
+        memset(stage, 0, sizeof(Stage));
+        stage->input.fd = -1;
+        stage->output.fd = -1;
+        stage->argv = &argv[i];
+
+        // Words are compacted to the front of the stage as redirections are
+        // taken out
+        for (; i < argc && ops[i] != SHELL_PIPE; i++) {
+            if (ops[i] == 0) {
+                stage->argv[stage->argc++] = argv[i];
+                continue;
+            }
+            if (ops[i] == SHELL_BACKGROUND) {
+                print("Error: & must end the command line\n");
+                return -1;
+            }
+            if (i + 1 == argc || ops[i + 1] != 0) {
+                print("Error: Missing file name after ");
+                print(argv[i]);
+                print("\n");
+                return -1;
+            }
+            Stream *stream = ops[i] == SHELL_INPUT ? &stage->input : &stage->output;
+            if (redirect(stream, argv[i + 1], ops[i]) != 0) return -1;
+            i++;
+        }
+        if (stage->argc == 0) {
+            print("Error: Missing command\n");
+            return -1;
+        }
+        if (i < argc) {
+            // Step over the |, which must have a command after it
+            argv[i++] = NULL;
+            if (i == argc) {
+                print("Error: Missing command after |\n");
+                return -1;
+            }
+        }
 
-    // Draw border
-    for (int i = 0; i < BOARD_WIDTH + 2; i++) {
-        print_colored("#", make_color(LIGHT_BLUE, BLACK));
+        stage->cmd = command_find(stage->argv[0], strlen(stage->argv[0]));
+        if (stage->cmd == NULL) {
+            print("Unknown command: ");
+            print(stage->argv[0]);
+            print("\n");
+            return -1;
+        }
+        if (stage->argc - 1 < stage->cmd->min_args || stage->argc - 1 > stage->cmd->max_args) {
+            print("Usage: ");
+            print(stage->cmd->usage);
+            print("\n");
+            return -1;
+        }
     }
-    print("\n");
-
-    // Draw game area
-    for (int y = 0; y < BOARD_HEIGHT; y++) {
-        print_colored("#", make_color(LIGHT_BLUE, BLACK));
+    return 0;
+}
 
-        for (int x = 0; x < BOARD_WIDTH; x++) {
-            int is_snake = 0;
-            for (int i = 0; i < game->snake.length; i++) {
-                if (game->snake.body[i].x == x && game->snake.body[i].y == y) {
-                    print_colored("O", make_color(LIGHT_GREEN, BLACK));
-                    is_snake = 1;
-                    break;
-                }
-            }
+// Close the files of the first count stages
+void pipeline_close(Stage *stages, int count) {
+    for (int i = 0; i < count; i++) {
+        if (stages[i].input.fd >= 0) close(stages[i].input.fd);
+        if (stages[i].output.fd >= 0) close(stages[i].output.fd);
+    }
+}
 
-            if (!is_snake) {
-                if (game->food.x == x && game->food.y == y) {
-                    print_colored("*", make_color(LIGHT_RED, BLACK));
+// Start stages as tasks joined by pipes, with input and output at the ends of
+// the pipeline. Returns how many were started, fewer after running out of
+// memory; those see their pipes end and finish by themselves.
+int pipeline_start(Stage *stages, int count, Stream *input, Stream *output) {
+    for (int i = 0; i < count; i++) {
+        Stage *stage = &stages[i];
+        Stage *prev = i > 0 ? &stages[i - 1] : NULL;
+
+        // A redirection takes precedence over the pipe on the same side
+        Stream *in = input;
+        Stream *out = output;
+        if (stage->input.fd >= 0) {
+            in = &stage->input;
+            if (prev) prev->pipe->reader_open = 0;  // The stage before writes to nobody
+        } else if (prev) {
+            in = &prev->reader;
+        }
+        if (i + 1 < count) {
+            // On the heap, as scripts also run pipelines on the small stacks of tasks
+            Pipe *pipe = (Pipe *)malloc(sizeof(Pipe));
+            stage->pipe = pipe;
+            if (pipe != NULL) {
+                memset(pipe, 0, sizeof(Pipe));
+                pipe->reader_open = 1;
+                pipe->writer_open = 1;
+                Stream reader = {pipe_read, NULL, pipe_close_reader, pipe, -1};
+                Stream writer = {NULL, pipe_write, pipe_close_writer, pipe, -1};
+                stage->reader = reader;
+                stage->writer = writer;
+                if (stage->output.fd >= 0) {
+                    pipe->writer_open = 0;  // The next stage reads nothing
                 } else {
-                    print(" ");
+                    out = &stage->writer;
                 }
             }
         }
+        if (stage->output.fd >= 0) out = &stage->output;
 
-        print_colored("#\n", make_color(LIGHT_BLUE, BLACK));
+        if (i + 1 == count || stage->pipe != NULL) {
+            stage->task = task_create(stage->cmd, stage->argc, stage->argv, in, out);
+        }
+        if (stage->task == NULL) {
+            print("Error: Out of memory for the pipeline\n");
+            free(stage->pipe);
+            stage->pipe = NULL;
+            if (prev && in == &prev->reader) prev->reader.close(&prev->reader);
+            return i;
+        }
+        stage->task->close_input = in != input;
+        stage->task->close_output = out != output;
     }
+    return count;
+}
 
-    // Draw border
-    for (int i = 0; i < BOARD_WIDTH + 2; i++) {
-        print_colored("#", make_color(LIGHT_BLUE, BLACK));
+int pipeline_done(Stage *stages, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!stages[i].task->done) return 0;
     }
-    print("\n");
+    return 1;
+}
 
-    // Draw score
-    print("Score: ");
-    char score_str[10];
-    int i = 0;
-    int temp = game->score;
-    do {
-        score_str[i++] = (temp % 10) + '0';
-        temp /= 10;
-    } while (temp > 0);
-    while (i > 0) putchar(score_str[--i]);
-    print("\n");
+// Free the tasks and pipes of the first count stages once they are done
+void pipeline_free(Stage *stages, int count) {
+    for (int i = 0; i < count; i++) {
+        task_free(stages[i].task);
+        free(stages[i].pipe);
+    }
 }
 
-void update_snake(struct Game *game) {
-    // Save current head position
-    struct Point new_head = game->snake.body[0];
+// Run stages with the streams of whoever runs them, and wait for all of them
+void pipeline_run(Stage *stages, int count) {
+    count = pipeline_start(stages, count, current_input, current_output);
+    while (!pipeline_done(stages, count)) task_yield();
+    pipeline_free(stages, count);
+}
 
-    // Update head position based on direction
-    switch (game->snake.direction) {
-        case UP:
-            new_head.y--;
-            break;
-        case DOWN:
-            new_head.y++;
-            break;
-        case LEFT:
-            new_head.x--;
-            break;
-        case RIGHT:
-            new_head.x++;
-            break;
-    }
+void job_start(int argc, char **argv, const char *ops);
 
-    // Check for collisions with walls
-    if (new_head.x < 0 || new_head.x >= BOARD_WIDTH || new_head.y < 0 ||
-        new_head.y >= BOARD_HEIGHT) {
-        game->game_over = 1;
+// Run the words and operators of a command line
+void execute_args(int argc, char **argv, char *ops) {
+    if (ops[argc - 1] == SHELL_BACKGROUND) {
+        job_start(argc - 1, argv, ops);
         return;
     }
 
-    // Check for collisions with self
-    for (int i = 0; i < game->snake.length; i++) {
-        if (new_head.x == game->snake.body[i].x && new_head.y == game->snake.body[i].y) {
-            game->game_over = 1;
-            return;
-        }
+    Stage stages[PIPELINE_MAX_STAGES];
+    int count;
+    if (pipeline_parse(argc, argv, ops, stages, &count) != 0) {
+        pipeline_close(stages, count);
+        return;
     }
-
-    // Move body
-    for (int i = game->snake.length - 1; i > 0; i--) {
-        game->snake.body[i] = game->snake.body[i - 1];
+    for (int i = 0; i < count; i++) stages[i].argv[stages[i].argc] = NULL;
+
+    if (count == 1) {
+        Stage *stage = &stages[0];
+        Stream *input = current_input;
+        Stream *output = current_output;
+        if (stage->input.fd >= 0) current_input = &stage->input;
+        if (stage->output.fd >= 0) current_output = &stage->output;
+        run_command(stage->cmd, stage->argc, stage->argv);
+        current_input = input;
+        current_output = output;
+    } else {
+        pipeline_run(stages, count);
     }
-    game->snake.body[0] = new_head;
-
-    // Check for food
-    if (new_head.x == game->food.x && new_head.y == game->food.y) {
-        game->score += 10;
-        game->snake.length++;
+    pipeline_close(stages, count);
+}
 
-        // Place new food
-        game->food.x = rand_range(0, BOARD_WIDTH - 1);
-        game->food.y = rand_range(0, BOARD_HEIGHT - 1);
+void execute_command(char *line) {
+    char *argv[COMMAND_MAX_ARGS + 1];
+    char ops[COMMAND_MAX_ARGS];
+    int argc = parse_args(line, argv, ops, COMMAND_MAX_ARGS);
+    if (argc <= 0) return;
+
+    // time before a command line reports how long the rest of it takes
+    if (argc > 1 && ops[0] == 0 && strcmp(argv[0], "time") == 0) {
+        uint64_t start = rdtsc();
+        execute_args(argc - 1, argv + 1, ops + 1);
+        time_report(rdtsc() - start);
+        return;
     }
+    execute_args(argc, argv, ops);
 }
 
-void snake_game() {
-    struct Game game;
-    init_game(&game);
-
-    print_colored("Snake Game! Use WASD to move, Q to quit\n", make_color(LIGHT_CYAN, BLACK));
-    print("Press any key to start...\n");
-    get_keyboard_char();
-
-    while (!game.game_over) {
-        draw_board(&game);
-
-        // Handle input
-        char input = get_keyboard_char();
-        switch (input) {
-            case 'w':
-                if (game.snake.direction != DOWN) game.snake.direction = UP;
-                break;
-            case 's':
-                if (game.snake.direction != UP) game.snake.direction = DOWN;
-                break;
-            case 'a':
-                if (game.snake.direction != RIGHT) game.snake.direction = LEFT;
-                break;
-            case 'd':
-                if (game.snake.direction != LEFT) game.snake.direction = RIGHT;
-                break;
-            case 'q':
-                return;
-        }
-
-        update_snake(&game);
-
-        // Add a small delay
-        for (volatile int i = 0; i < 1000000; i++) {
-        }
+// End of Pipelines
+
+// Jobs
+
+// A command line ending in & runs as a job: its stages are tasks like those of
+// any pipeline, but the shell goes on instead of waiting for them. What a job
+// prints collects in a buffer of its own, which the shell shows while it
+// waits for keys, so several jobs can print at once without holding up the
+// prompt. A job that fills its buffer waits until it is shown. Jobs get no
+// input, and one that waits for a key waits until fg gives it the keyboard.
+// Tasks only switch when they wait, so killing a job is a request: its reads
+// end, its writes fail, and sleeping and key reads return at once.
+typedef struct Job {
+    int id;
+    int argc;  // Words of the command line, for jobs to show
+    char *argv[COMMAND_MAX_ARGS + 1];
+    Stage stages[PIPELINE_MAX_STAGES];
+    int count;    // Stages set up
+    int started;  // Stages running as tasks
+    Pipe output;  // Printed but not yet shown
+    Stream writer;
+    int killed;
+    struct Job *next;  // By id
+    char words[];      // Copy of the words, which argv points into
+} Job;
+
+Job *jobs = NULL;
+
+// The words of the command line, without quotes
+void job_print_command(Job *job) {
+    const char *word = job->words;
+    for (int i = 0; i < job->argc; i++) {
+        if (i > 0) print(" ");
+        print(word);
+        word += strlen(word) + 1;
     }
-
-    print_colored("\nGame Over!\n", make_color(LIGHT_RED, BLACK));
-    print_colored("Final Score: ", make_color(LIGHT_GREEN, BLACK));
-    char score_str[10];
-    int i = 0;
-    int temp = game.score;
-    do {
-        score_str[i++] = (temp % 10) + '0';
-        temp /= 10;
-    } while (temp > 0);
-    while (i > 0) putchar(score_str[--i]);
     print("\n");
-    print("Press any key to continue...\n");
-    get_keyboard_char();
-    clear_screen();
 }
 
-static uint32_t next = 1;  // Seed for the random number generator
+// Run a command line that ended in & as a job. Its words are copied, as the
+// line they are in is reused for the next one.
+void job_start(int argc, char **argv, const char *ops) {
+    if (argc == 0) {
+        print("Error: Missing command\n");
+        return;
+    }
+    uint32_t size = 0;
+    for (int i = 0; i < argc; i++) size += strlen(argv[i]) + 1;
+    Job *job = (Job *)malloc(sizeof(Job) + size);
+    if (job == NULL) {
+        print("Error: Out of memory for the job\n");
+        return;
+    }
+    memset(job, 0, sizeof(Job));
+    char *word = job->words;
+    for (int i = 0; i < argc; i++) {
+        uint32_t len = strlen(argv[i]) + 1;
+        memcpy(word, argv[i], len);
+        job->argv[i] = word;
+        word += len;
+    }
+    job->argc = argc;
 
-// Simple pseudo-random number generator
-static uint32_t z1 = 12345, z2 = 67890, z3 = 11111, z4 = 22222;
+    if (pipeline_parse(argc, job->argv, ops, job->stages, &job->count) != 0) {
+        pipeline_close(job->stages, job->count);
+        free(job);
+        return;
+    }
+    for (int i = 0; i < job->count; i++) job->stages[i].argv[job->stages[i].argc] = NULL;
+
+    // The lowest free id, keeping the list in order
+    Job **link = &jobs;
+    job->id = 1;
+    while (*link != NULL && (*link)->id == job->id) {
+        link = &(*link)->next;
+        job->id++;
+    }
+    job->next = *link;
+    *link = job;
+
+    job->output.reader_open = 1;
+    job->output.writer_open = 1;
+    Stream writer = {NULL, pipe_write, pipe_close_writer, &job->output, -1};
+    job->writer = writer;
+    job->started = pipeline_start(job->stages, job->count, &console, &job->writer);
+    for (int i = 0; i < job->started; i++) job->stages[i].task->job = job;
+
+    print("[");
+    print_uint(job->id);
+    print("] ");
+    job_print_command(job);
+}
 
-// Xorshift algorithm combined with Linear Congruential Generator
-uint32_t rand() {
-    // Get some system entropy from timer and other sources
-    uint8_t timer_low = inb(0x40);        // Timer counter low byte
-    uint8_t timer_high = inb(0x40);       // Timer counter high byte
-    uint8_t keyboard_status = inb(0x64);  // Keyboard controller status
-    uint32_t timer_value = (timer_high << 8) | timer_low;
+int job_done(Job *job) {
+    return pipeline_done(job->stages, job->started);
+}
 
-    // Xorshift algorithm
-    z1 ^= (z1 << 11);
-    z1 ^= (z1 >> 8);
-    z2 ^= (z2 << 13);
-    z2 ^= (z2 >> 17);
-    z3 ^= (z3 << 9);
-    z3 ^= (z3 >> 7);
-    z4 = z4 ^ (z4 << 15);
+// Write out what the job printed so far
+void job_show(Job *job, Stream *stream) {
+    Pipe *pipe = &job->output;
+    while (pipe->count > 0) {
+        uint32_t n = PIPE_SIZE - pipe->head;
+        if (n > pipe->count) n = pipe->count;
+        stream->write(stream, pipe->data + pipe->head, n);
+        pipe->head = (pipe->head + n) % PIPE_SIZE;
+        pipe->count -= n;
+    }
+}
 
-    // Combine multiple sources of randomness
-    uint32_t result = (z1 ^ z2 ^ z3 ^ z4) + timer_value + keyboard_status;
+// Unlink a finished job and free it
+void job_free(Job *job) {
+    Job **link = &jobs;
+    while (*link != job) link = &(*link)->next;
+    *link = job->next;
+    pipeline_free(job->stages, job->started);
+    pipeline_close(job->stages, job->count);
+    free(job);
+}
 
-    // Linear congruential generator
-    next = next * 1664525 + 1013904223;
+void job_print_status(Job *job) {
+    print("[");
+    print_uint(job->id);
+    print("] ");
+    print_padded(job->killed ? "Killed" : job_done(job) ? "Done" : "Running", 9);
+    job_print_command(job);
+}
 
-    // Mix everything together
-    result ^= next;
-    result ^= (result << 13);
-    result ^= (result >> 17);
-    result ^= (result << 5);
+// Job numbered by arg, with or without a leading %, or the newest job if
+// there is no arg; NULL after printing an error
+Job *job_find(const char *arg) {
+    if (jobs == NULL) {
+        print("Error: No jobs\n");
+        return NULL;
+    }
+    Job *job = jobs;
+    if (arg == NULL) {
+        while (job->next != NULL) job = job->next;
+        return job;
+    }
+    int id = atoi(arg[0] == '%' ? arg + 1 : arg);
+    while (job != NULL && job->id != id) job = job->next;
+    if (job == NULL) print("Error: No such job\n");
+    return job;
+}
 
-    return result;
+// Show what running jobs printed
+void jobs_show() {
+    for (Job *job = jobs; job != NULL; job = job->next) job_show(job, &console);
 }
 
-void srand(uint32_t seed) {
-    // Initialize all state variables with different transformations of the seed
-    next = seed;
-    z1 = seed ^ 0x12345678;
-    z2 = seed ^ 0x87654321;
-    z3 = seed ^ 0xFEDCBA98;
-    z4 = seed ^ 0x11223344;
+// Report and free the jobs that finished, before the shell's next prompt
+void jobs_reap() {
+    Job *job = jobs;
+    while (job != NULL) {
+        Job *next = job->next;
+        if (job_done(job)) {
+            job_show(job, &console);
+            job_print_status(job);
+            job_free(job);
+        }
+        job = next;
+    }
+}
 
-    // Additional mixing
-    for (int i = 0; i < 10; i++) {
-        rand();  // Discard first few values to improve distribution
+// Wait in get_key: the other tasks run meanwhile, and the shell shows what
+// jobs print
+void key_wait() {
+    if (current_task == &shell_task) jobs_show();
+    task_yield();
+
+    // Small delay to prevent overwhelming the CPU
+    for (volatile int i = 0; i < 10000; i++) {
     }
 }
 
-// Helper function to get random number in a specific range
-uint32_t rand_range(uint32_t min, uint32_t max) {
-    uint32_t range = max - min + 1;
-    return min + (rand() % range);
+void jobs_command() {
+    if (jobs == NULL) {
+        print("No jobs\n");
+        return;
+    }
+    // Finished jobs are reported here instead of at the next prompt
+    Job *job = jobs;
+    while (job != NULL) {
+        Job *next = job->next;
+        job_print_status(job);
+        if (job_done(job)) job_free(job);
+        job = next;
+    }
 }
+COMMAND(jobs, jobs_command, "List background jobs");
+
+// Give the job the keyboard and wait for it, showing what it prints
+void fg(int argc, char **argv) {
+    Job *job = job_find(argc > 1 ? argv[1] : NULL);
+    if (job == NULL) return;
+    if (current_task->job == job) {
+        print("Error: A job cannot wait for itself\n");
+        return;
+    }
+    job_print_command(job);
 
-void fortune() {
-    const char *fortunes[] = {"The best way to predict the future is to invent it.",
-                              "Stay hungry, stay foolish.",
-                              "The only way to do great work is to love what you do.",
-                              "Innovation distinguishes between a leader and a follower.",
-                              "The journey of a thousand miles begins with one step.",
-                              "Life is 10% what happens to us and 90% how we react to it.",
-                              "Your time is limited, don't waste it living someone else's life.",
-                              "You only live once, but if you do it right, once is enough."};
-    int fortune_count = sizeof(fortunes) / sizeof(fortunes[0]);
-    int random_index = rand() % fortune_count;  // Get a random index
+    struct Job *previous = foreground_job;
+    foreground_job = job;
+    while (!job_done(job)) {
+        job_show(job, current_output);
+        task_yield();
+    }
+    foreground_job = previous;
+    job_show(job, current_output);
+    job_free(job);
+}
+COMMAND_ARGS(fg, fg, 0, 1, "fg [job]", "Wait for a job");
+
+void kill(int argc, char **argv) {
+    Job *job = job_find(argv[1]);
+    if (job == NULL || job_done(job)) return;
+    job->killed = 1;
+    for (Task *task = shell_task.next; task != &shell_task; task = task->next) {
+        if (task->job == job) task->killed = 1;
+    }
+}
+COMMAND_ARGS(kill, kill, 1, 1, "kill [job]", "Stop a background job");
+
+// End of Jobs
+
+// Scripts
+
+// run compiles a script file once into bytecode for a small stack machine,
+// then runs the bytecode. Each line of a script is one statement, and lines
+// starting with # are comments:
+//
+//   set NAME = EXPR          Assign to a variable
+//   if EXPR ... [else ...] end
+//   while EXPR ... end       With break and continue inside
+//   anything else            A shell command line, in which $NAME and ${NAME}
+//                            outside single quotes become the value of NAME
+//
+// Values are 32-bit integers and variables start at 0. Expressions have
+// numbers, variables with or without $, parentheses, unary - and !, and the
+// binary operators * / % + - < <= > >= == != && || with the precedence they
+// have in C; && and || skip their right side the same way. Variables are
+// numbered while compiling, so running a script never looks up a name.
+// Holding Esc stops a script stuck in a loop.
+#define SCRIPT_MAX_VARS 64
+#define SCRIPT_MAX_BLOCKS 16
+#define SCRIPT_STACK_SIZE 32   // Values on the stack, and operands nested
+#define SCRIPT_MAX_DEPTH 4     // Scripts running scripts
+#define SCRIPT_ESC_PERIOD 256  // Loop iterations between checks for Esc and yields
+
+// Opcodes. Numbers and jump targets follow their opcode as 4 bytes, variable
+// slots as 1 byte. SCRIPT_RUN is followed by a command line ending in a NUL,
+// with each variable in it as SCRIPT_VAR_MARK and the slot.
+#define SCRIPT_END 0
+#define SCRIPT_PUSH 1
+#define SCRIPT_LOAD 2
+#define SCRIPT_STORE 3
+#define SCRIPT_ADD 4
+#define SCRIPT_SUB 5
+#define SCRIPT_MUL 6
+#define SCRIPT_DIV 7
+#define SCRIPT_MOD 8
+#define SCRIPT_LT 9
+#define SCRIPT_LE 10
+#define SCRIPT_GT 11
+#define SCRIPT_GE 12
+#define SCRIPT_EQ 13
+#define SCRIPT_NE 14
+#define SCRIPT_NEG 15
+#define SCRIPT_NOT 16
+#define SCRIPT_BOOL 17        // Turn the value into 0 or 1
+#define SCRIPT_AND 18         // Jump, keeping the value, if it is 0; else pop it
+#define SCRIPT_OR 19          // Jump with 1 if the value is not 0; else pop it
+#define SCRIPT_JUMP 20
+#define SCRIPT_JUMP_FALSE 21  // Pop the value and jump if it is 0
+#define SCRIPT_LOOP 22        // Jump back to the start of a loop
+#define SCRIPT_RUN 23
+#define SCRIPT_VAR_MARK 1
 
-    print_colored("Your fortune: \n", make_color(LIGHT_CYAN, BLACK));
-    print_colored(fortunes[random_index], make_color(LIGHT_GREEN, BLACK));  // Display the fortune
-    print("\n");
+typedef struct {
+    char type;  // 'i' for if, 'e' for else, 'w' for while
+    int line;
+    uint32_t start;   // Where a while loop tests its condition
+    uint32_t jump;    // Operand of the jump past the block, set at its end
+    uint32_t breaks;  // Operands of break jumps, chained through each other
+} ScriptBlock;
+
+typedef struct {
+    const char *path;
+    int line;
+    const char *p;  // Next character of the line
+    const char *names[SCRIPT_MAX_VARS];  // Point into the source
+    int name_lengths[SCRIPT_MAX_VARS];
+    int var_count;
+    uint8_t *code;
+    uint32_t size;
+    uint32_t capacity;
+    int stack;    // Values the code so far leaves on the stack
+    int nesting;  // Operands being compiled inside each other
+    ScriptBlock blocks[SCRIPT_MAX_BLOCKS];
+    int block_count;
+    int failed;
+} ScriptCompiler;
+
+// Report the first error only; the rest of the compile is skipped
+void script_error(ScriptCompiler *c, const char *message) {
+    if (c->failed) return;
+    c->failed = 1;
+    print("Error: ");
+    print(c->path);
+    print(" line ");
+    print_uint(c->line);
+    print(": ");
+    print(message);
     print("\n");
 }
 
-// Function prototypes for the adventure game
-void adventure_north(void);
-void adventure_south(void);
-void adventure_east(void);
-void adventure_west(void);
-void textadventure(void);
+void script_emit(ScriptCompiler *c, uint8_t byte) {
+    if (c->failed) return;
+    if (c->size == c->capacity) {
+        uint32_t capacity = c->capacity ? c->capacity * 2 : 256;
+        uint8_t *code = (uint8_t *)malloc(capacity);
+        if (code == NULL) {
+            script_error(c, "Out of memory");
+            return;
+        }
+        memcpy(code, c->code, c->size);
+        free(c->code);
+        c->code = code;
+        c->capacity = capacity;
+    }
+    c->code[c->size++] = byte;
+}
 
-void print_banner() {
-    print(" /$$   /$$                     /$$   /$$           /$$          \n");
-    print("| $$$ | $$                    | $$$ | $$          |__/          \n");
-    print("| $$$$| $$  /$$$$$$   /$$$$$$ | $$$$| $$  /$$$$$$  /$$  /$$$$$$ \n");
-    print("| $$ $$ $$ /$$__  $$ /$$__  $$| $$ $$ $$ /$$__  $$| $$ /$$__  $$\n");
-    print("| $$  $$$$| $$$$$$$$| $$  \ $$| $$  $$$$| $$  \ $$| $$| $$  \__/\n");
-    print("| $$\  $$$| $$_____/| $$  | $$| $$\  $$$| $$  | $$| $$| $$      \n");
-    print("| $$ \  $$|  $$$$$$$|  $$$$$$/| $$ \  $$|  $$$$$$/| $$| $$      \n");
-    print("|__/  \__/ \_______/ \______/ |__/  \__/ \______/ |__/|__/      \n");
-    print_colored("\nWelcome to NeoNoir!\n", make_color(LIGHT_CYAN, BLACK));
+void script_emit_word(ScriptCompiler *c, uint32_t value) {
+    for (int i = 0; i < 4; i++) script_emit(c, value >> (i * 8));
 }
 
-#define MAX_LINES 100
-#define MAX_LINE_LENGTH 80
+uint32_t script_word(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
 
-char text_buffer[MAX_LINES][MAX_LINE_LENGTH];
-int current_line = 0;
-int num_lines = 0;
+void script_patch(ScriptCompiler *c, uint32_t at, uint32_t value) {
+    if (c->failed) return;
+    for (int i = 0; i < 4; i++) c->code[at + i] = value >> (i * 8);
+}
 
-void noirtext(const char *filename) {
-    clear_screen();
-    print_colored("Welcome to NoirText!\n", make_color(LIGHT_CYAN, BLACK));
-    print_colored("Commands: :w to save, :q to quit\n\n", make_color(LIGHT_GREEN, BLACK));
-
-    // Load file content if it exists
-    FileEntry *file = NULL;
-    if (filename) {
-        for (int i = 0; i < fs.current_dir->num_files; i++) {
-            if (strcmp(fs.current_dir->files[i].filename, filename) == 0) {
-                file = &fs.current_dir->files[i];
-                break;
-            }
-        }
+// Emit a jump and return where its target is, for patching
+uint32_t script_jump(ScriptCompiler *c, uint8_t op, uint32_t target) {
+    script_emit(c, op);
+    uint32_t at = c->size;
+    script_emit_word(c, target);
+    return at;
+}
 
-        if (file) {
-            char *content = (char *)file->start_block;
-            int line = 0;
-            int col = 0;
-            for (size_t i = 0; i < file->size && line < MAX_LINES; i++) {
-                if (content[i] == '\n' || col == MAX_LINE_LENGTH - 1) {
-                    text_buffer[line][col] = '\0';
-                    line++;
-                    col = 0;
-                } else {
-                    text_buffer[line][col] = content[i];
-                    col++;
-                }
-            }
-            if (col > 0) {
-                text_buffer[line][col] = '\0';
-                line++;
-            }
-            num_lines = line;
-        }
-    }
+// Track the values left on the stack, which must fit in SCRIPT_STACK_SIZE
+void script_push(ScriptCompiler *c, int values) {
+    c->stack += values;
+    if (c->stack > SCRIPT_STACK_SIZE) script_error(c, "Expression too complex");
+}
 
-    while (1) {
-        // Display current content
-        for (int i = 0; i < num_lines; i++) {
-            print(text_buffer[i]);
-            print("\n");
-        }
+int script_is_name_char(char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') ||
+           ch == '_';
+}
 
-        // Get user input
-        char input[MAX_LINE_LENGTH];
-        print("> ");
-        read_line(input, MAX_LINE_LENGTH);
+// End of the variable name at p, which is p itself if there is none
+const char *script_name(const char *p) {
+    if (*p >= '0' && *p <= '9') return p;
+    while (script_is_name_char(*p)) p++;
+    return p;
+}
 
-        // Check for commands
-        if (strcmp(input, ":w") == 0) {
-            // Save file
-            if (filename) {
-                if (file == NULL) {
-                    if (fs.current_dir->num_files >= MAX_FILES) {
-                        print_colored("Error: Directory is full\n", make_color(LIGHT_RED, BLACK));
-                        continue;
-                    }
-                    file = &fs.current_dir->files[fs.current_dir->num_files];
-                    strncpy(file->filename, filename, MAX_FILENAME);
-                    fs.current_dir->num_files++;
-                }
+// Slot of the variable whose name is the len characters at name, giving it
+// the next slot the first time it is seen
+int script_slot(ScriptCompiler *c, const char *name, int len) {
+    for (int i = 0; i < c->var_count; i++) {
+        if (c->name_lengths[i] == len && strncmp(c->names[i], name, len) == 0) return i;
+    }
+    if (c->var_count == SCRIPT_MAX_VARS) {
+        script_error(c, "Too many variables");
+        return 0;
+    }
+    c->names[c->var_count] = name;
+    c->name_lengths[c->var_count] = len;
+    return c->var_count++;
+}
 
-                // Calculate total content size
-                size_t total_size = 0;
-                for (int i = 0; i < num_lines; i++) {
-                    total_size += strlen(text_buffer[i]) + 1;  // +1 for newline
-                }
+void script_skip_spaces(ScriptCompiler *c) {
+    while (*c->p == ' ' || *c->p == '\t') c->p++;
+}
 
-                // Allocate memory for file content
-                char *content = (char *)malloc(total_size + 1);  // +1 for null terminator
-                if (content == NULL) {
-                    print_colored("Error: Failed to allocate memory for file content\n",
-                                  make_color(LIGHT_RED, BLACK));
-                    continue;
-                }
+// Binary operator at p: its opcode in *op and length in *len. Returns its
+// precedence, higher binding tighter, or 0 if there is no operator.
+int script_binary_op(const char *p, uint8_t *op, int *len) {
+    static const struct {
+        const char *text;
+        uint8_t op;
+        uint8_t level;
+    } ops[] = {{"||", SCRIPT_OR, 1},  {"&&", SCRIPT_AND, 2}, {"==", SCRIPT_EQ, 3},
+               {"!=", SCRIPT_NE, 3},  {"<=", SCRIPT_LE, 4},  {">=", SCRIPT_GE, 4},
+               {"<", SCRIPT_LT, 4},   {">", SCRIPT_GT, 4},   {"+", SCRIPT_ADD, 5},
+               {"-", SCRIPT_SUB, 5},  {"*", SCRIPT_MUL, 6},  {"/", SCRIPT_DIV, 6},
+               {"%", SCRIPT_MOD, 6}};
+    for (uint32_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        int n = strlen(ops[i].text);
+        if (strncmp(p, ops[i].text, n) == 0) {
+            *op = ops[i].op;
+            *len = n;
+            return ops[i].level;
+        }
+    }
+    return 0;
+}
 
-                // Copy content to file
-                char *ptr = content;
-                for (int i = 0; i < num_lines; i++) {
-                    size_t line_len = strlen(text_buffer[i]);
-                    memcpy(ptr, text_buffer[i], line_len);
-                    ptr += line_len;
-                    *ptr++ = '\n';
-                }
-                *ptr = '\0';  // Null terminate the content
+void script_expression(ScriptCompiler *c, int min_level);
 
-                // Update file entry
-                if (file->start_block != 0) {
-                    free((void *)file->start_block);
-                }
-                file->start_block = (uint32_t)content;
-                file->size = total_size;
+// A number, variable or parenthesized expression, after any unary operators
+void script_operand(ScriptCompiler *c) {
+    script_skip_spaces(c);
+    if (++c->nesting > SCRIPT_STACK_SIZE) {
+        script_error(c, "Expression too complex");
+        return;
+    }
 
-                print_colored("File saved.\n", make_color(LIGHT_GREEN, BLACK));
-            } else {
-                print_colored("No filename specified.\n", make_color(LIGHT_RED, BLACK));
+    char ch = *c->p;
+    if (ch == '-' || ch == '!') {
+        c->p++;
+        script_operand(c);
+        script_emit(c, ch == '-' ? SCRIPT_NEG : SCRIPT_NOT);
+    } else if (ch == '(') {
+        c->p++;
+        script_expression(c, 1);
+        script_skip_spaces(c);
+        if (*c->p == ')') {
+            c->p++;
+        } else {
+            script_error(c, "Missing )");
+        }
+    } else if (ch >= '0' && ch <= '9') {
+        uint32_t value = 0;
+        while (*c->p >= '0' && *c->p <= '9') {
+            uint32_t digit = *c->p++ - '0';
+            if (value > (0x7FFFFFFF - digit) / 10) {
+                script_error(c, "Number too large");
+                return;
             }
-            continue;
-        } else if (strcmp(input, ":q") == 0) {
-            // Quit
-            break;
+            value = value * 10 + digit;
         }
+        script_emit(c, SCRIPT_PUSH);
+        script_emit_word(c, value);
+        script_push(c, 1);
+    } else {
+        if (ch == '$') c->p++;
+        const char *end = script_name(c->p);
+        if (end == c->p) {
+            script_error(c, *c->p ? "Bad expression" : "Missing value");
+            return;
+        }
+        script_emit(c, SCRIPT_LOAD);
+        script_emit(c, script_slot(c, c->p, end - c->p));
+        script_push(c, 1);
+        c->p = end;
+    }
+    c->nesting--;
+}
 
-        // Add new line to buffer
-        if (num_lines < MAX_LINES) {
-            strncpy(text_buffer[num_lines], input, MAX_LINE_LENGTH);
-            num_lines++;
+// Operands joined by operators of at least min_level, by precedence climbing
+void script_expression(ScriptCompiler *c, int min_level) {
+    script_operand(c);
+    while (!c->failed) {
+        uint8_t op;
+        int len;
+        script_skip_spaces(c);
+        int level = script_binary_op(c->p, &op, &len);
+        if (level < min_level || level == 0) return;
+        c->p += len;
+
+        if (op == SCRIPT_AND || op == SCRIPT_OR) {
+            uint32_t skip = script_jump(c, op, 0);
+            script_push(c, -1);
+            script_expression(c, level + 1);
+            script_emit(c, SCRIPT_BOOL);
+            script_patch(c, skip, c->size);
         } else {
-            print_colored("Buffer full!\n", make_color(LIGHT_RED, BLACK));
+            script_expression(c, level + 1);
+            script_emit(c, op);
+            script_push(c, -1);
         }
-
-        clear_screen();
     }
-
-    clear_screen();
 }
 
-// Add these to your existing definitions
-#define MAX_SCRIPT_SIZE 1024
-#define MAX_VARS 32
-
-// Structure for variables
-struct Variable {
-    char name[32];
-    char value[256];
-};
-
-// Add these global variables
-struct Variable variables[MAX_VARS];
-int var_count = 0;
-
-// Add these new functions
-void set_variable(const char *name, const char *value) {
-    for (int i = 0; i < var_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            strncpy(variables[i].value, value, 255);
+// The rest of the line as a command line, with its variables marked
+void script_command(ScriptCompiler *c) {
+    script_emit(c, SCRIPT_RUN);
+    char quote = 0;
+    const char *p = c->p;
+    while (*p) {
+        char ch = *p++;
+        if ((uint8_t)ch < ' ' && ch != '\t') {
+            script_error(c, "Bad character");
             return;
         }
+        if (!quote && (ch == '\'' || ch == '"')) {
+            quote = ch;
+        } else if (ch == quote) {
+            quote = 0;
+        } else if (ch == '\\' && quote != '\'' && *p) {
+            script_emit(c, ch);  // Keep the escape for the shell, and the $ after it
+            ch = *p++;
+        } else if (ch == '$' && quote != '\'') {
+            int braces = *p == '{';
+            const char *name = p + braces;
+            const char *end = script_name(name);
+            if (end > name && (!braces || *end == '}')) {
+                script_emit(c, SCRIPT_VAR_MARK);
+                script_emit(c, script_slot(c, name, end - name));
+                p = end + braces;
+                continue;
+            }
+        }
+        script_emit(c, ch);
     }
-    if (var_count < MAX_VARS) {
-        strncpy(variables[var_count].name, name, 31);
-        strncpy(variables[var_count].value, value, 255);
-        var_count++;
+    script_emit(c, '\0');
+}
+
+// True if the line goes on with keyword as a whole word, which is skipped
+int script_keyword(ScriptCompiler *c, const char *keyword) {
+    int n = strlen(keyword);
+    if (strncmp(c->p, keyword, n) != 0 || script_is_name_char(c->p[n])) return 0;
+    c->p += n;
+    script_skip_spaces(c);
+    return 1;
+}
+
+ScriptBlock *script_open(ScriptCompiler *c, char type) {
+    if (c->block_count == SCRIPT_MAX_BLOCKS) {
+        script_error(c, "Blocks nested too deeply");
+        return NULL;
     }
+    ScriptBlock *block = &c->blocks[c->block_count++];
+    block->type = type;
+    block->line = c->line;
+    block->start = c->size;
+    block->jump = 0;
+    block->breaks = 0;
+    return block;
 }
 
-char *get_variable(const char *name) {
-    for (int i = 0; i < var_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            return variables[i].value;
-        }
+// Innermost while loop, or NULL outside loops
+ScriptBlock *script_loop(ScriptCompiler *c) {
+    for (int i = c->block_count - 1; i >= 0; i--) {
+        if (c->blocks[i].type == 'w') return &c->blocks[i];
     }
     return NULL;
 }
 
-int evaluate_condition(const char *condition) {
-    char left[256], op[3], right[256];
-    int parsed = parse_condition(condition, left, op, right);
+void script_statement(ScriptCompiler *c) {
+    script_skip_spaces(c);
+    if (*c->p == '\0' || *c->p == '#') return;
 
-    // Get variable values if they exist
-    char *left_val = get_variable(left);
-    char *right_val = get_variable(right);
+    ScriptBlock *block;
+    char type = 0;
+    if (script_keyword(c, "if")) {
+        type = 'i';
+    } else if (script_keyword(c, "while")) {
+        type = 'w';
+    }
 
-    if (left_val) strncpy(left, left_val, 255);
-    if (right_val) strncpy(right, right_val, 255);
+    if (type) {
+        block = script_open(c, type);
+        if (block == NULL) return;
+        script_expression(c, 1);
+        block->jump = script_jump(c, SCRIPT_JUMP_FALSE, 0);
+    } else if (script_keyword(c, "set")) {
+        const char *end = script_name(c->p);
+        if (end == c->p) {
+            script_error(c, "Missing variable name");
+            return;
+        }
+        int slot = script_slot(c, c->p, end - c->p);
+        c->p = end;
+        script_skip_spaces(c);
+        if (*c->p != '=') {
+            script_error(c, "Missing =");
+            return;
+        }
+        c->p++;
+        script_expression(c, 1);
+        script_emit(c, SCRIPT_STORE);
+        script_emit(c, slot);
+    } else if (script_keyword(c, "else")) {
+        block = c->block_count ? &c->blocks[c->block_count - 1] : NULL;
+        if (block == NULL || block->type != 'i') {
+            script_error(c, "else without if");
+            return;
+        }
+        uint32_t skip = script_jump(c, SCRIPT_JUMP, 0);
+        script_patch(c, block->jump, c->size);
+        block->jump = skip;
+        block->type = 'e';
+    } else if (script_keyword(c, "end")) {
+        if (c->block_count == 0) {
+            script_error(c, "end without if or while");
+            return;
+        }
+        block = &c->blocks[--c->block_count];
+        if (block->type == 'w') {
+            script_jump(c, SCRIPT_LOOP, block->start);
+            for (uint32_t at = block->breaks; at != 0 && !c->failed;) {
+                uint32_t next = script_word(c->code + at);
+                script_patch(c, at, c->size);
+                at = next;
+            }
+        }
+        script_patch(c, block->jump, c->size);
+    } else if (script_keyword(c, "break")) {
+        block = script_loop(c);
+        if (block == NULL) {
+            script_error(c, "break outside while");
+            return;
+        }
+        block->breaks = script_jump(c, SCRIPT_JUMP, block->breaks);
+    } else if (script_keyword(c, "continue")) {
+        block = script_loop(c);
+        if (block == NULL) {
+            script_error(c, "continue outside while");
+            return;
+        }
+        script_jump(c, SCRIPT_LOOP, block->start);
+    } else {
+        script_command(c);
+        return;
+    }
 
-    if (strcmp(op, "==") == 0) return strcmp(left, right) == 0;
-    if (strcmp(op, "!=") == 0) return strcmp(left, right) != 0;
-    return 0;
+    script_skip_spaces(c);
+    if (*c->p != '\0') script_error(c, "Unexpected text at the end of the line");
 }
 
-#define MAX_TODO 100
-
-typedef struct {
-    char task[256];
-} TodoItem;
-
-TodoItem todo_list[MAX_TODO];
-int todo_count = 0;
+// Compile the script in file path. Returns its code, which the caller frees,
+// or NULL after printing an error.
+uint8_t *script_compile(const char *path, int *var_count) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        print("Error: Cannot open ");
+        print(path);
+        print("\n");
+        return NULL;
+    }
+    int size = lseek(fd, 0, SEEK_END);
+    lseek(fd, 0, SEEK_SET);
+    char *source = (char *)malloc(size + 1);
+    ScriptCompiler *c = (ScriptCompiler *)malloc(sizeof(ScriptCompiler));
+    int n = source && c ? read(fd, source, size) : -1;
+    close(fd);
+    if (n != size) {
+        print(n < 0 ? "Error: Out of memory\n" : "Error: Cannot read the script\n");
+        free(source);
+        free(c);
+        return NULL;
+    }
+    source[size] = '\0';
+    memset(c, 0, sizeof(ScriptCompiler));
+    c->path = path;
+
+    // Lines are cut in place, which keeps variable names in the source valid
+    char *line = source;
+    while (line < source + size && !c->failed) {
+        char *end = line;
+        while (*end && *end != '\n') end++;
+        char *next = end + (*end == '\n');
+        if (end > line && end[-1] == '\r') end--;
+        *end = '\0';
+        c->line++;
+        c->p = line;
+        c->stack = 0;
+        script_statement(c);
+        line = next;
+        if (next == end) break;  // A NUL inside the file ends it
+    }
+    if (c->block_count > 0) {
+        c->line = c->blocks[c->block_count - 1].line;
+        script_error(c, "Missing end");
+    }
+    script_emit(c, SCRIPT_END);
+
+    uint8_t *code = c->failed ? NULL : c->code;
+    if (c->failed) free(c->code);
+    *var_count = c->var_count;
+    free(c);
+    free(source);
+    return code;
+}
 
-void add_todo(const char *task) {
-    if (todo_count < MAX_TODO) {
-        strncpy(todo_list[todo_count].task, task, 256);
-        todo_count++;
-        print("Task added.\n");
-    } else {
-        print("Error: To-do list is full.\n");
+// Copy the command line of a SCRIPT_RUN at code into line with the values of
+// its variables. Returns the code after it, or NULL if the line is too long.
+const uint8_t *script_expand(const uint8_t *code, const int32_t *values, char *line) {
+    uint32_t n = 0;
+    while (*code) {
+        char digits[11];
+        const char *text = (const char *)code;
+        uint32_t len = 1;
+        if (*code == SCRIPT_VAR_MARK) {
+            int32_t value = values[code[1]];
+            uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+            len = 0;
+            do {
+                digits[sizeof(digits) - ++len] = '0' + magnitude % 10;
+                magnitude /= 10;
+            } while (magnitude > 0);
+            if (value < 0) digits[sizeof(digits) - ++len] = '-';
+            text = digits + sizeof(digits) - len;
+            code += 2;
+        } else {
+            code++;
+        }
+        if (n + len >= COMMAND_LINE_MAX) return NULL;
+        memcpy(line + n, text, len);
+        n += len;
     }
+    line[n] = '\0';
+    return code + 1;
 }
 
-void list_todos() {
-    if (todo_count == 0) {
-        print("No tasks in the to-do list.\n");
-        return;
+// Esc pressed since the last check, or the script's job killed. Other keys
+// are dropped, as the script has the keyboard while it runs.
+int script_interrupted() {
+    if (task_killed()) return 1;
+    if (!task_has_keyboard()) return 0;
+    int esc = 0;
+    while (key_pending()) {
+        if (inb(0x60) == 0x01) esc = 1;
     }
+    return esc;
+}
 
-    print("To-do list:\n");
-    for (int i = 0; i < todo_count; i++) {
-        print("  ");
-        print(todo_list[i].task);
-        print("\n");
+// Run compiled code. Returns 0, or -1 if the script stopped early.
+int script_exec(const uint8_t *code, int var_count) {
+    int32_t *values = (int32_t *)malloc(sizeof(int32_t) * var_count + 1);
+    if (values == NULL) {
+        print("Error: Out of memory\n");
+        return -1;
+    }
+    memset(values, 0, sizeof(int32_t) * var_count);
+
+    int32_t stack[SCRIPT_STACK_SIZE];
+    char line[COMMAND_LINE_MAX];
+    int sp = 0;
+    uint32_t loops = 0;
+    const uint8_t *pc = code;
+    int result = 1;  // Until the script ends
+    while (result > 0) {
+        uint8_t op = *pc++;
+        int32_t a = sp >= 2 ? stack[sp - 2] : 0;
+        int32_t b = sp >= 1 ? stack[sp - 1] : 0;
+        switch (op) {
+            case SCRIPT_END:
+                result = 0;
+                break;
+            case SCRIPT_PUSH:
+                stack[sp++] = script_word(pc);
+                pc += 4;
+                break;
+            case SCRIPT_LOAD:
+                stack[sp++] = values[*pc++];
+                break;
+            case SCRIPT_STORE:
+                values[*pc++] = stack[--sp];
+                break;
+            case SCRIPT_NEG:
+                stack[sp - 1] = -(uint32_t)b;
+                break;
+            case SCRIPT_NOT:
+                stack[sp - 1] = !b;
+                break;
+            case SCRIPT_BOOL:
+                stack[sp - 1] = b != 0;
+                break;
+            case SCRIPT_AND:
+            case SCRIPT_OR:
+                if ((op == SCRIPT_AND) == (b == 0)) {
+                    stack[sp - 1] = b != 0;
+                    pc = code + script_word(pc);
+                } else {
+                    sp--;
+                    pc += 4;
+                }
+                break;
+            case SCRIPT_JUMP:
+                pc = code + script_word(pc);
+                break;
+            case SCRIPT_JUMP_FALSE:
+                pc = stack[--sp] ? pc + 4 : code + script_word(pc);
+                break;
+            case SCRIPT_LOOP:
+                // Scripts in the background let the other tasks run too
+                if (++loops % SCRIPT_ESC_PERIOD == 0) {
+                    if (script_interrupted()) {
+                        print("Script stopped\n");
+                        result = -1;
+                    }
+                    task_yield();
+                }
+                pc = code + script_word(pc);
+                break;
+            case SCRIPT_RUN:
+                if (task_killed()) {
+                    result = -1;
+                    break;
+                }
+                pc = script_expand(pc, values, line);
+                if (pc == NULL) {
+                    print("Error: Command line too long\n");
+                    result = -1;
+                    break;
+                }
+                execute_command(line);
+                break;
+            default:
+                // Binary operators, computed on unsigned values so that
+                // overflow wraps around
+                sp--;
+                if ((op == SCRIPT_DIV || op == SCRIPT_MOD) && b == 0) {
+                    print("Error: Division by zero\n");
+                    result = -1;
+                    break;
+                }
+                stack[sp - 1] = op == SCRIPT_ADD   ? (int32_t)((uint32_t)a + (uint32_t)b)
+                                : op == SCRIPT_SUB ? (int32_t)((uint32_t)a - (uint32_t)b)
+                                : op == SCRIPT_MUL ? (int32_t)((uint32_t)a * (uint32_t)b)
+                                : op == SCRIPT_DIV ? (b == -1 ? (int32_t)-(uint32_t)a : a / b)
+                                : op == SCRIPT_MOD ? (b == -1 ? 0 : a % b)
+                                : op == SCRIPT_LT  ? a < b
+                                : op == SCRIPT_LE  ? a <= b
+                                : op == SCRIPT_GT  ? a > b
+                                : op == SCRIPT_GE  ? a >= b
+                                : op == SCRIPT_EQ  ? a == b
+                                                   : a != b;
+                break;
+        }
     }
+    free(values);
+    return result;
 }
 
-void remove_todo(int index) {
-    if (index < 0 || index >= todo_count) {
-        print("Error: Invalid task number.\n");
+void run_script(int argc, char **argv) {
+    if (current_task->script_depth == SCRIPT_MAX_DEPTH) {
+        print("Error: Scripts nested too deeply\n");
         return;
     }
+    int var_count;
+    uint8_t *code = script_compile(argv[1], &var_count);
+    if (code == NULL) return;
+    current_task->script_depth++;
+    script_exec(code, var_count);
+    current_task->script_depth--;
+    free(code);
+}
+COMMAND_ARGS(run, run_script, 1, 1, "run [script]", "Run a script");
+
+// End of Scripts
+
+// Batch mode
+//
+// Options on the kernel command line run the system unattended:
+//   batch=FILE    run the script FILE, e.g. batch=initrd/tests.sh
+//   serial-shell  run command lines read from COM1, until an EOT (Ctrl-D)
+// There is no prompt; the console is mirrored on COM1 as always. Once the
+// input is done and the jobs it started have finished, the kernel leaves QEMU
+// through its isa-debug-exit device (-device isa-debug-exit,iobase=0xf4).
+// QEMU then exits with (code << 1) | 1, where code is 0 if the batch ran to
+// its end.
+
+#define DEBUG_EXIT_PORT 0xF4
+#define SERIAL_EOT 0x04
+
+int batch_mode = 0;  // Set while running batch= or serial-shell, for exit
+
+// Look for option in the kernel command line, as a word of its own or with a
+// value after '='. Returns 1 if found, with the value copied into value.
+int boot_option(const char *cmdline, const char *option, char *value, uint32_t size) {
+    uint32_t len = strlen(option);
+    while (*cmdline) {
+        while (*cmdline == ' ') cmdline++;
+        const char *word = cmdline;
+        while (*cmdline && *cmdline != ' ') cmdline++;
+        if ((uint32_t)(cmdline - word) < len || strncmp(word, option, len) != 0) continue;
+        if (word + len != cmdline && word[len] != '=') continue;
+        if (size > 0) {
+            uint32_t n = 0;
+            for (const char *p = word + len + 1; p < cmdline && n < size - 1; p++) {
+                value[n++] = *p;
+            }
+            value[n] = '\0';
+        }
+        return 1;
+    }
+    return 0;
+}
 
-    for (int i = index; i < todo_count - 1; i++) {
-        todo_list[i] = todo_list[i + 1];
+// Exit QEMU with code, or halt where there is no isa-debug-exit device
+void batch_exit(int code) {
+    bcache_sync();
+    serial_flush();
+    outb(DEBUG_EXIT_PORT, code);
+    print("System halted\n");
+    asm volatile("cli");
+    while (1) {
+        asm volatile("hlt");
     }
-    todo_count--;
-    print("Task removed.\n");
 }
 
-// Function declarations
-int is_space(char c);
-char *strtok(char *str, const char *delim);
-char *strchr(const char *str, int c);
-int sscanf(const char *str, const char *format, ...);
-void execute_command(const char *command);
-int evaluate_condition(const char *condition);
+void batch_wait_jobs() {
+    while (jobs != NULL) {
+        key_wait();
+        jobs_reap();
+    }
+}
 
-// VA args macros
-typedef __builtin_va_list va_list;
-#define va_start(v, l) __builtin_va_start(v, l)
-#define va_end(v) __builtin_va_end(v)
-#define va_arg(v, l) __builtin_va_arg(v, l)
+void batch_run(const char *path) {
+    int var_count;
+    int code = 1;
+    batch_mode = 1;
+    uint8_t *script = script_compile(path, &var_count);
+    if (script != NULL) {
+        current_task->script_depth++;
+        code = script_exec(script, var_count) == 0 ? 0 : 1;
+        current_task->script_depth--;
+        free(script);
+    }
+    batch_wait_jobs();
+    batch_exit(code);
+}
 
-// Helper function implementations
+void serial_shell() {
+    char line[COMMAND_LINE_MAX];
+    int length = 0;
+    int too_long = 0;
+    batch_mode = 1;
+    while (1) {
+        int c = serial_read_byte();
+        if (c < 0) {
+            key_wait();
+            continue;
+        }
+        if (c == SERIAL_EOT) break;
+        if (c != '\n' && c != '\r') {
+            if (length < COMMAND_LINE_MAX - 1) {
+                line[length++] = c;
+            } else {
+                too_long = 1;
+            }
+            continue;
+        }
+        line[length] = '\0';
+        if (too_long) {
+            print("Error: Command line too long\n");
+        } else if (length > 0) {
+            execute_command(line);
+            bcache_tick();
+        }
+        jobs_reap();
+        length = 0;
+        too_long = 0;
+    }
+    batch_wait_jobs();
+    batch_exit(0);
+}
 
-char *strchr(const char *str, int c) {
-    while (*str) {
-        if (*str == (char)c) return (char *)str;
-        str++;
+// Only batch runs may end this way; at the keyboard it would halt the machine
+void exit_command(int argc, char **argv) {
+    if (!batch_mode) {
+        print("Error: exit only works in batch mode\n");
+        return;
     }
-    return NULL;
+    batch_exit(argc > 1 ? atoi(argv[1]) : 0);
 }
+COMMAND_ARGS(exit, exit_command, 0, 1, "exit [code]", "End a batch run with a status code");
 
-char *strtok(char *str, const char *delim) {
-    static char *last_str = NULL;
-    if (str) last_str = str;
-    if (!last_str) return NULL;
+// End of Batch mode
 
-    // Skip leading delimiters
-    while (*last_str && *last_str == *delim) last_str++;
-    if (!*last_str) return NULL;
+void shell_prompt() {
+    print_colored("root", make_color(LIGHT_GREEN, BLACK));
+    print_colored("@", make_color(WHITE, BLACK));
+    print_colored("NeoNoir", make_color(LIGHT_CYAN, BLACK));
 
-    char *token_start = last_str;
-    // Find end of token
-    while (*last_str && *last_str != *delim) last_str++;
+    // Show the current directory in the prompt
+    print_colored(" ", make_color(WHITE, BLACK));
+    print(fs.current_dir->name);
+    print_colored(" # ", make_color(LIGHT_RED, BLACK));
+}
 
-    if (*last_str) {
-        *last_str = '\0';
-        last_str++;
+// Completion
+//
+// Tab completes the word at the end of the command line: a command name where
+// a command goes, else a path. The word is extended as far as all the names
+// starting with it agree. A name completed in full gets the '/' of a
+// directory or the space that ends the word; if nothing can be added and
+// several names match, they are listed. Names come from the command trie and
+// the trie of the directory (see Tries).
+
+// The word being typed at the end of line, without its quotes and escapes.
+// Sets *quote to the quote left open, if any, and *command if the word is
+// where a command name goes.
+void complete_scan(const char *line, char *word, uint32_t size, char *quote, int *command) {
+    uint32_t length = 0;
+    int in_word = 0;
+    int at_command = 1;  // The next word starts a command
+    *quote = 0;
+    for (const char *p = line; *p; p++) {
+        char c = *p;
+        if (!*quote && (c == ' ' || c == '\t' || c == '|' || c == '<' || c == '>' || c == '&')) {
+            if (in_word) at_command = 0;
+            if (c == '|') at_command = 1;
+            in_word = 0;
+            continue;
+        }
+        if (!in_word) {
+            in_word = 1;
+            length = 0;
+            *command = at_command;
+        }
+        if (!*quote && (c == '\'' || c == '"')) {
+            *quote = c;
+            continue;
+        }
+        if (c == *quote) {
+            *quote = 0;
+            continue;
+        }
+        if (c == '\\' && p[1] && (!*quote || (*quote == '"' && (p[1] == '"' || p[1] == '\\')))) {
+            c = *++p;
+        }
+        if (length < size - 1) word[length++] = c;
     }
-
-    return token_start;
+    if (!in_word) {
+        length = 0;
+        *command = at_command;
+    }
+    word[length] = '\0';
 }
 
-void pwd() {
-    print(fs.current_dir->name);
-    print("\n");
+int complete_put(char *line, int length, int max_length, char c) {
+    if (length >= max_length - 1) return length;
+    line[length++] = c;
+    line[length] = '\0';
+    putchar(c);
+    return length;
 }
 
-int sscanf(const char *str, const char *format, ...) {
-    va_list args;
-    va_start(args, format);
-
-    int chars_matched = 0;
-    const char *str_ptr = str;
+// Append text to the line with the escapes it needs inside quote
+int complete_append(char *line, int length, int max_length, const char *text, char quote) {
+    for (; *text; text++) {
+        int escape = quote == 0 ? strchr(" \t'\"\\|<>&", *text) != NULL
+                                : quote == '"' && (*text == '"' || *text == '\\');
+        if (length + escape >= max_length - 1) break;
+        if (escape) length = complete_put(line, length, max_length, '\\');
+        length = complete_put(line, length, max_length, *text);
+    }
+    return length;
+}
 
-    while (*format && *str_ptr) {
-        if (*format == '%') {
-            format++;
-            if (*format == 's') {
-                char *s = va_arg(args, char *);
-                while (*str_ptr && !is_space(*str_ptr)) {
-                    *s++ = *str_ptr++;
-                }
-                *s = '\0';
-                chars_matched++;
-            }
-            format++;
-        } else if (is_space(*format)) {
-            // Skip whitespace in both strings
-            while (is_space(*str_ptr)) str_ptr++;
-            while (is_space(*format)) format++;
-        } else {
-            if (*format++ != *str_ptr++) {
-                break;
-            }
+int shell_complete(char *line, int length, int max_length) {
+    char word[COMMAND_LINE_MAX];
+    char quote;
+    int command;
+    complete_scan(line, word, sizeof(word), &quote, &command);
+
+    // A path is completed in the directory its leading part names
+    TrieNode *trie = command_trie;
+    Directory *dir = NULL;
+    char *name = word;
+    if (!command) {
+        dir = fs.current_dir;
+        for (char *p = word; *p; p++) {
+            if (*p == '/') name = p + 1;
+        }
+        if (name != word) {
+            char first = *name;
+            FileEntry *entry;
+            *name = '\0';
+            int found = resolve_path(word, &dir, &entry) == 0 && entry == NULL;
+            *name = first;
+            if (!found) return length;
         }
+        trie = name_trie(dir);
     }
-
-    va_end(args);
-    return chars_matched;
-}
-
-void execute_command(const char *command) {
-    if (strcmp(command, "clear") == 0) {
-        clear_screen();
-    } else if (strcmp(command, "help") == 0) {
-        print_colored("Available commands:\n", make_color(LIGHT_CYAN, BLACK));
-        print("  clear    - Clear the screen       | help     - Show this help message\n");
-        print("  shutdown - Power off the system   | reboot   - Restart the system\n");
-        print("  echo [text] - Display the text    | whoami   - Display current user\n");
-        print("  hostname - Display system hostname| uname    - Display system information\n");
-        print("  banner   - Display NeoNoir banner  | cpuinfo  - Display CPU information\n");
-        print("  time     - Display current time   | calc [expression] - Basic calculator\n");
-        print("  textgame - Start a game           | play     - Play a silly tune\n");
-        print("  fortune  - Display a fortune.     | touch    - Create a file.\n");
-        print("  cat      - Show contents of file  | mkdir    - Create a directory\n");
-        print("  ls       - List files and dirs    | cd       - Change directory \n");
-        print("  noirtext [filename] - Edit file   | snake    - Play the snake game\n");
-        print("  pwd      - Print working dir      | todo [add, list, remove] [task] - ToDo app \n");
-        print("  rm       - Remove file or dir     | search [filename] - Search files\n");
-    } else if (strcmp(command, "shutdown") == 0) {
-        shutdown();
-    } else if (strcmp(command, "reboot") == 0) {
-        reboot();
-    } else if (strncmp(command, "echo ", 5) == 0) {
-        echo(command + 5);
-    } else if (strcmp(command, "whoami") == 0) {
-        whoami();
-    } else if (strcmp(command, "hostname") == 0) {
-        hostname();
-    } else if (strcmp(command, "uname") == 0) {
-        print_system_info();
-    } else if (strcmp(command, "banner") == 0) {
-        print_banner();
-    } else if (strcmp(command, "cpuinfo") == 0) {
-        cpuinfo();
-    } else if (strcmp(command, "time") == 0) {
-        time();
-    } else if (strncmp(command, "calc ", 5) == 0) {
-        calc(command + 5);
-    } else if (strncmp(command, "textgame", 5) == 0) {
-        textadventure();
-    } else if (strcmp(command, "play") == 0) {
-        play_silly_tune();
-    } else if (strcmp(command, "fortune") == 0) {
-        fortune();
-    } else if (strncmp(command, "touch ", 6) == 0) {
-        touch(command + 6);
-    } else if (strncmp(command, "cat ", 4) == 0) {
-        cat(command + 4);
-    } else if (strncmp(command, "mkdir ", 6) == 0) {
-        mkdir(command + 6);
-    } else if (strcmp(command, "ls") == 0) {
-        ls();
-    } else if (strncmp(command, "cd ", 3) == 0) {
-        cd(command + 3);
-    } else if (strncmp(command, "noirtext ", 9) == 0) {
-        noirtext(command + 9);
-    } else if (strcmp(command, "noirtext") == 0) {
-        noirtext(NULL);
-    } else if (strcmp(command, "snake") == 0) {
-        snake_game();
-    } else if (strcmp(command, "pwd") == 0) {
-        pwd();
-    } else if (strncmp(command, "todo add ", 9) == 0) {
-        add_todo(command + 9);
-    } else if (strcmp(command, "todo list") == 0) {
-        list_todos();
-    } else if (strncmp(command, "todo remove ", 12) == 0) {
-        int task_number = atoi(command + 12) - 1; // Convert to zero-based index
-        remove_todo(task_number);
-    } else if (strncmp(command, "rm ", 3) == 0) {
-        // Get the filename from the command
-        const char *filename = command + 3; // Skip "rm " to get the filename
-        remove_file(filename); // Call the remove_file function
-        return;
-    } else if (strncmp(command, "search ", 7) == 0) {
-        const char *search_term = command + 7; // Skip "search " to get the search term
-        search_files(search_term); // Call the search_files function
-        return;
-    } else {
-        print("Unknown command: ");
-        print(command);
+    if (trie == NULL) return length;
+
+    char extra[COMMAND_LINE_MAX];
+    uint32_t matches = trie_complete(trie, name, extra, sizeof(extra));
+    if (matches == 0) return length;
+    length = complete_append(line, length, max_length, extra, quote);
+
+    if (matches == 1) {
+        char full[COMMAND_LINE_MAX];
+        strncpy(full, name, sizeof(full) - 1);
+        full[sizeof(full) - 1] = '\0';
+        strncpy(full + strlen(full), extra, sizeof(full) - 1 - strlen(full));
+        FileEntry *entry = dir ? find_entry(dir, full) : NULL;
+        if (entry != NULL && entry->is_directory) {
+            return complete_put(line, length, max_length, '/');
+        }
+        if (quote) length = complete_put(line, length, max_length, quote);
+        return complete_put(line, length, max_length, ' ');
+    }
+    if (extra[0] == '\0') {
         print("\n");
+        trie_list(trie, name);
+        shell_prompt();
+        print(line);
     }
+    return length;
 }
 
+// End of Completion
+
 void shell() {
-    char command[256];
+    char command[COMMAND_LINE_MAX];
     while (1) {
-        print_colored("root", make_color(LIGHT_GREEN, BLACK));
-        print_colored("@", make_color(WHITE, BLACK));
-        print_colored("NeoNoir", make_color(LIGHT_CYAN, BLACK));
-
-        // Show the current directory in the prompt
-        print_colored(" ", make_color(WHITE, BLACK));
-        print(fs.current_dir->name);
-        print_colored(" # ", make_color(LIGHT_RED, BLACK));
-
-        read_line(command, sizeof(command));
+        jobs_reap();
+        shell_prompt();
+        edit_line(command, sizeof(command), shell_complete);
         execute_command(command);
+        bcache_tick();
     }
 }
 
-int kernel_main() {
+int kernel_main(uint32_t magic, MultibootInfo *mbi) {
     clear_screen();
     print_banner();
+    sse_init();
+    interrupts_init();
+    serial_init();
+    command_init();
+    stats_init();
     init_fs();
+    bcache_init();
+    ata_init();
     mkdir("Home");
     mkdir("My Files");
     mkdir("Temporary Files");
-    mkdir("Text Files");    
+    mkdir("Text Files");
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC && (mbi->flags & MULTIBOOT_INFO_MODS)) {
+        mount_modules(mbi);
+    }
+
+    const char *cmdline = "";
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC && (mbi->flags & MULTIBOOT_INFO_CMDLINE)) {
+        cmdline = (const char *)mbi->cmdline;
+    }
+    char batch_file[COMMAND_LINE_MAX];
+    if (boot_option(cmdline, "batch", batch_file, sizeof(batch_file))) batch_run(batch_file);
+    if (boot_option(cmdline, "serial-shell", NULL, 0)) serial_shell();
+
     print_colored("Type 'help' for a list of commands.\n\n", make_color(LIGHT_MAGENTA, BLACK));
     shell();
     return 0;